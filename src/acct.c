@@ -0,0 +1,773 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Finished jobs from the server's accounting logs, for offline use. Only
+ * the job end (E) records are of interest. Their "key=value" messages are
+ * split in place into the attribute lists the server would return, so the
+ * jobs are parsed by parse_job_status() just like the live ones.
+ *
+ * Each log gets a sidecar index in the cache directory. It splits the log
+ * into blocks of whole lines, recording for each the range of job IDs and
+ * end times, and (Bloom filter) sets of users and queues, so that only the
+ * blocks possibly holding the wanted jobs are parsed. The index is
+ * extended, and the log is read further, as it grows.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+
+#include <pbs_ifl.h>
+
+#include <ncurses.h>
+
+#include "qtop.h"
+
+/* more than enough for an E record */
+#define ACCT_MAXATTRS   256
+
+#define ACCT_INDEX_MAGIC    "QTOPAIDX"
+#define ACCT_INDEX_VERSION  1
+#define ACCT_BLOCK_SIZE     (64*1024)
+#define ACCT_BLOOM_BITS     512
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t ino;
+    int64_t indexed;
+    uint32_t nblocks;
+    uint32_t pad;
+} acct_index_header_t;
+
+typedef struct {
+    int64_t offset;
+    uint32_t len;
+    uint32_t nrecords;
+    uint32_t id_min;
+    uint32_t id_max;
+    int64_t end_min;
+    int64_t end_max;
+    uint64_t users[ACCT_BLOOM_BITS/64];
+    uint64_t queues[ACCT_BLOOM_BITS/64];
+} acct_block_t;
+
+typedef struct {
+    acct_block_t *blocks;
+    int nblocks;
+    int size;
+    long indexed;
+} acct_index_t;
+
+/* accounting keys of interest and the job attributes they stand for */
+#define ACCT_KEY(key, name) {key, sizeof(key) - 1, name}
+static const struct {
+    const char *key;
+    size_t len;
+    const char *name;
+} acct_keys[] = {
+    ACCT_KEY("user",           ATTR_euser),
+    ACCT_KEY("jobname",        ATTR_name),
+    ACCT_KEY("queue",          ATTR_queue),
+    ACCT_KEY("exec_host",      ATTR_exechost),
+    ACCT_KEY("Exit_status",    ATTR_exit_status),
+    ACCT_KEY("qtime",          ATTR_qtime),
+    ACCT_KEY("start",          ATTR_stime),
+    ACCT_KEY("end",            ATTR_history_timestamp),
+    ACCT_KEY("Resource_List",  ATTR_l),
+    ACCT_KEY("resources_used", ATTR_used),
+    {NULL, 0, NULL}
+};
+
+static const char *acct_attr_name(const char *key, size_t len)
+{
+    int i;
+
+    for (i = 0; acct_keys[i].key; i++) {
+        if (acct_keys[i].len == len && !memcmp(key, acct_keys[i].key, len)) {
+            return acct_keys[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Split a message of space-separated key=value pairs (values possibly
+ * quoted) in place, keeping only the known keys.
+ */
+static int acct_split(char *s, struct attrl *attribs, int maxattribs)
+{
+    int n = 0;
+
+    while (s && *s && n < maxattribs) {
+        char *key, *value, *dot;
+
+        while (*s == ' ') {
+            s++;
+        }
+        key = s;
+        if (!(s = strchr(s, '='))) {
+            break;
+        }
+        *s++ = '\0';
+        size_t keylen = s - key - 1;
+
+        if (*s == '"') {
+            value = ++s;
+            s = strchr(s, '"');
+        } else {
+            value = s;
+            s = strchr(s, ' ');
+        }
+        if (s) {
+            *s++ = '\0';
+        }
+
+        if ((dot = memchr(key, '.', keylen))) {
+            keylen = dot - key;
+            *dot++ = '\0';
+        }
+        const char *name = acct_attr_name(key, keylen);
+        if (!name) {
+            continue;
+        }
+        // resources, and only they, come as "list.resource"
+        bool is_resource = !strcmp(name, ATTR_l) || !strcmp(name, ATTR_used);
+        if (is_resource != (dot != NULL)) {
+            continue;
+        }
+
+        memset(attribs + n, 0, sizeof(struct attrl));
+        attribs[n].name     = (char *) name;
+        attribs[n].resource = dot;
+        attribs[n].value    = value;
+        if (n > 0) {
+            attribs[n - 1].next = attribs + n;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+static bool acct_filtered_out(const qtop_t *q, const job_t *job, long cutoff)
+{
+    if ((q->username && (!job->user || strcmp(job->user, q->username))) ||
+        (q->queue && (!job->queue || strcmp(job->queue, q->queue))) ||
+        (q->failed && job->exit_status == 0) ||
+        (!q->subjobs && job->aid > 0) ||
+        job->history_ts < cutoff) {
+        return true;
+    } else {
+        return job_filtered_out(q, job);
+    }
+}
+
+/* Cheap rejection by user and queue, before parsing the whole record */
+static bool acct_prefiltered_out(const qtop_t *q, const struct attrl *attribs)
+{
+    const struct attrl *qattr;
+
+    for (qattr = attribs; qattr; qattr = qattr->next) {
+        if (q->username && !strcmp(qattr->name, ATTR_euser) &&
+            strcmp(qattr->value, q->username)) {
+            return true;
+        }
+        if (q->queue && !strcmp(qattr->name, ATTR_queue) &&
+            strcmp(qattr->value, q->queue)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* The sink of qtop_acct_update(), keeping the jobs in the history */
+static bool acct_add(job_t *job, void *data)
+{
+    qtop_t *q = data;
+
+    if (q->nhistory == q->history_size) {
+        int size = q->history_size ? 2*q->history_size:4096;
+        job_t *history = realloc(q->history, size*sizeof(job_t));
+        if (!history) {
+            job_free_data(job);
+            return false;
+        }
+        q->history = history;
+        q->history_size = size;
+    }
+    q->history[q->nhistory++] = *job;
+
+    return true;
+}
+
+/*
+ * A record is "MM/DD/YYYY HH:MM:SS;type;id;message". An E one is copied
+ * into buf, since the map is read-only, and split into the job ID and the
+ * attributes. Returns the number of the latter, or -1 for other records.
+ */
+static int acct_split_record(const char *p, size_t len, char **buf,
+    size_t *bufsize, char **id, struct attrl *attribs)
+{
+    const char *type, *msg, *end = p + len;
+
+    if (!(type = memchr(p, ';', len)) || type + 2 >= end ||
+        type[1] != 'E' || type[2] != ';') {
+        return -1;
+    }
+    p = type + 3;
+    if (!(msg = memchr(p, ';', end - p))) {
+        return -1;
+    }
+    msg++;
+
+    if (len + 1 > *bufsize) {
+        size_t size = 2*(len + 1);
+        char *b = realloc(*buf, size);
+        if (!b) {
+            return -1;
+        }
+        *buf = b;
+        *bufsize = size;
+    }
+    memcpy(*buf, p, end - p);
+    (*buf)[msg - p - 1] = '\0';
+    (*buf)[end - p] = '\0';
+
+    *id = *buf;
+    return acct_split(*buf + (msg - p), attribs, ACCT_MAXATTRS);
+}
+
+static bool acct_parse_record(qtop_t *q, const char *p, size_t len,
+    char **buf, size_t *bufsize, long cutoff, acct_sink_t sink, void *data)
+{
+    struct attrl attribs[ACCT_MAXATTRS];
+    struct batch_status bs;
+    char *id;
+    job_t job;
+
+    int n = acct_split_record(p, len, buf, bufsize, &id, attribs);
+    if (n < 0 || (n > 0 && acct_prefiltered_out(q, attribs))) {
+        return true;
+    }
+
+    if (!q->servername[0]) {
+        const char *server = strchr(id, '.');
+        if (server) {
+            free(q->servername);
+            q->servername = strdup(server + 1);
+        }
+    }
+
+    memset(&bs, 0, sizeof(bs));
+    bs.name    = id;
+    bs.attribs = n > 0 ? attribs:NULL;
+
+    memset(&job, 0, sizeof(job));
+    parse_job_status(&job, &bs);
+    job.state = 'F';
+
+    if (acct_filtered_out(q, &job, cutoff)) {
+        job_free_data(&job);
+        return true;
+    }
+
+    return sink(&job, data);
+}
+
+static void bloom_add(uint64_t *bloom, const char *str)
+{
+    unsigned int h = str_hash(str);
+    unsigned int h1 = h % ACCT_BLOOM_BITS, h2 = (h >> 16) % ACCT_BLOOM_BITS;
+
+    bloom[h1/64] |= 1ULL << (h1 % 64);
+    bloom[h2/64] |= 1ULL << (h2 % 64);
+}
+
+static bool bloom_has(const uint64_t *bloom, const char *str)
+{
+    unsigned int h = str_hash(str);
+    unsigned int h1 = h % ACCT_BLOOM_BITS, h2 = (h >> 16) % ACCT_BLOOM_BITS;
+
+    return (bloom[h1/64] & (1ULL << (h1 % 64))) &&
+        (bloom[h2/64] & (1ULL << (h2 % 64)));
+}
+
+/* <cache dir>/acct/<the log's absolute path, with '/' replaced by '_'> */
+static bool acct_index_path(const char *fname, char *buf, size_t bufsize)
+{
+    char dir[1024], *p;
+
+    if (!qtop_cache_dir(dir, 1024)) {
+        return false;
+    }
+    char *real = realpath(fname, NULL);
+    if (!real) {
+        return false;
+    }
+    for (p = real; *p; p++) {
+        if (*p == '/') {
+            *p = '_';
+        }
+    }
+
+    bool ok = snprintf(buf, bufsize, "%s/acct", dir) < (int) bufsize;
+    if (ok) {
+        mkdir(buf, 0700);
+        ok = snprintf(buf, bufsize, "%s/acct/%s.idx", dir, real) <
+            (int) bufsize;
+    }
+    free(real);
+
+    return ok;
+}
+
+/* An index of another (e.g., rotated) file, or a damaged one, is ignored */
+static void acct_index_load(const char *fname, const struct stat *sb,
+    acct_index_t *idx)
+{
+    char path[1024];
+    acct_index_header_t hdr;
+
+    memset(idx, 0, sizeof(acct_index_t));
+    if (!acct_index_path(fname, path, 1024)) {
+        return;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, ACCT_INDEX_MAGIC, 8) ||
+        hdr.version != ACCT_INDEX_VERSION ||
+        hdr.block_size != ACCT_BLOCK_SIZE ||
+        hdr.ino != (uint64_t) sb->st_ino ||
+        hdr.indexed > sb->st_size) {
+        fclose(fp);
+        return;
+    }
+
+    idx->blocks = malloc((hdr.nblocks + 1)*sizeof(acct_block_t));
+    if (idx->blocks &&
+        fread(idx->blocks, sizeof(acct_block_t), hdr.nblocks, fp) ==
+        hdr.nblocks) {
+        idx->nblocks = hdr.nblocks;
+        idx->size    = hdr.nblocks + 1;
+        idx->indexed = hdr.indexed;
+    } else {
+        free(idx->blocks);
+        idx->blocks = NULL;
+    }
+    fclose(fp);
+}
+
+static bool acct_index_save(const char *fname, const struct stat *sb,
+    const acct_index_t *idx)
+{
+    char path[1024], tmppath[1100];
+    acct_index_header_t hdr;
+
+    if (!acct_index_path(fname, path, 1024)) {
+        return false;
+    }
+    snprintf(tmppath, 1100, "%s.%d", path, (int) getpid());
+
+    FILE *fp = fopen(tmppath, "wb");
+    if (!fp) {
+        return false;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ACCT_INDEX_MAGIC, 8);
+    hdr.version    = ACCT_INDEX_VERSION;
+    hdr.block_size = ACCT_BLOCK_SIZE;
+    hdr.ino        = sb->st_ino;
+    hdr.indexed    = idx->indexed;
+    hdr.nblocks    = idx->nblocks;
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+        fwrite(idx->blocks, sizeof(acct_block_t), idx->nblocks, fp) ==
+        (size_t) idx->nblocks;
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (ok) {
+        ok = rename(tmppath, path) == 0;
+    }
+    if (!ok) {
+        unlink(tmppath);
+    }
+
+    return ok;
+}
+
+static acct_block_t *acct_index_new_block(acct_index_t *idx, long offset)
+{
+    if (idx->nblocks == idx->size) {
+        int size = idx->size ? 2*idx->size:256;
+        acct_block_t *blocks = realloc(idx->blocks,
+            size*sizeof(acct_block_t));
+        if (!blocks) {
+            return NULL;
+        }
+        idx->blocks = blocks;
+        idx->size = size;
+    }
+
+    acct_block_t *block = idx->blocks + idx->nblocks++;
+    memset(block, 0, sizeof(acct_block_t));
+    block->offset  = offset;
+    block->id_min  = UINT32_MAX;
+    block->end_min = INT64_MAX;
+
+    return block;
+}
+
+/* Index the complete lines past the indexed part; a partial block is redone */
+static bool acct_index_extend(acct_index_t *idx, const char *map, long size,
+    char **buf, size_t *bufsize)
+{
+    struct attrl attribs[ACCT_MAXATTRS];
+    acct_block_t *block = NULL;
+    long offset = idx->indexed;
+    char *id;
+    int i;
+
+    if (idx->nblocks > 0 &&
+        idx->blocks[idx->nblocks - 1].len < ACCT_BLOCK_SIZE) {
+        offset = idx->blocks[--idx->nblocks].offset;
+    }
+
+    const char *p = map + offset, *end = map + size;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            break;
+        }
+        if (!block && !(block = acct_index_new_block(idx, p - map))) {
+            return false;
+        }
+
+        int n = acct_split_record(p, eol - p, buf, bufsize, &id, attribs);
+        if (n >= 0) {
+            unsigned int jid = strtoul(id, NULL, 10);
+            long jend = 0;
+
+            for (i = 0; i < n; i++) {
+                const char *name = attribs[i].name;
+                if (!strcmp(name, ATTR_euser)) {
+                    bloom_add(block->users, attribs[i].value);
+                } else
+                if (!strcmp(name, ATTR_queue)) {
+                    bloom_add(block->queues, attribs[i].value);
+                } else
+                if (!strcmp(name, ATTR_history_timestamp)) {
+                    jend = atol(attribs[i].value);
+                }
+            }
+
+            if (jid < block->id_min) {
+                block->id_min = jid;
+            }
+            if (jid > block->id_max) {
+                block->id_max = jid;
+            }
+            if (jend < block->end_min) {
+                block->end_min = jend;
+            }
+            if (jend > block->end_max) {
+                block->end_max = jend;
+            }
+            block->nrecords++;
+        }
+
+        p = eol + 1;
+        block->len = p - (map + block->offset);
+        if (block->len >= ACCT_BLOCK_SIZE) {
+            block = NULL;
+        }
+    }
+    idx->indexed = p - map;
+
+    return true;
+}
+
+static bool acct_block_wanted(const qtop_t *q, const acct_block_t *block,
+    long cutoff)
+{
+    return block->nrecords > 0 && block->end_max >= cutoff &&
+        (!q->job_id ||
+         (q->job_id >= block->id_min && q->job_id <= block->id_max)) &&
+        (!q->username || bloom_has(block->users, q->username)) &&
+        (!q->queue || bloom_has(block->queues, q->queue));
+}
+
+/* Read the log further, through the relevant blocks only */
+static bool acct_read_file(qtop_t *q, acct_file_t *af, long cutoff,
+    acct_sink_t sink, void *data)
+{
+    struct stat sb;
+    acct_index_t idx;
+    char *buf = NULL;
+    size_t bufsize = 0;
+    bool ok = true;
+    int i;
+
+    int fd = open(af->fname, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        return false;
+    }
+    // rotated (another file by the name now) or truncated: read it afresh
+    bool rescan = af->offset > 0 &&
+        ((unsigned long) sb.st_ino != af->ino || sb.st_size < af->size);
+    if (rescan) {
+        af->offset = 0;
+    }
+    af->ino  = sb.st_ino;
+    af->size = sb.st_size;
+    if (sb.st_size <= af->offset) {
+        close(fd);
+        return true;
+    }
+
+    const char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    if (!rescan) {
+        acct_index_load(af->fname, &sb, &idx);
+    } else {
+        memset(&idx, 0, sizeof(acct_index_t));
+    }
+    // a file rewritten past the old end since indexed
+    if (idx.indexed > 0 && map[idx.indexed - 1] != '\n') {
+        free(idx.blocks);
+        memset(&idx, 0, sizeof(acct_index_t));
+    }
+    long indexed = idx.indexed;
+    if (!acct_index_extend(&idx, map, sb.st_size, &buf, &bufsize)) {
+        ok = false;
+    } else
+    if (idx.indexed != indexed) {
+        // not being able to save it is not fatal
+        acct_index_save(af->fname, &sb, &idx);
+    }
+
+    for (i = 0; ok && i < idx.nblocks; i++) {
+        const acct_block_t *block = idx.blocks + i;
+        long bend = block->offset + block->len;
+
+        if (bend <= af->offset || !acct_block_wanted(q, block, cutoff)) {
+            continue;
+        }
+
+        const char *p = map + (block->offset > af->offset ?
+            block->offset:af->offset);
+        while (ok && p < map + bend) {
+            const char *eol = memchr(p, '\n', map + bend - p);
+            if (!eol) {
+                break;
+            }
+            ok = acct_parse_record(q, p, eol - p, &buf, &bufsize, cutoff,
+                sink, data);
+            p = eol + 1;
+        }
+    }
+    if (ok) {
+        af->offset = idx.indexed;
+    }
+
+    munmap((void *) map, sb.st_size);
+    free(idx.blocks);
+    free(buf);
+
+    return ok;
+}
+
+static acct_file_t *acct_file(qtop_t *q, const char *fname)
+{
+    int i;
+
+    for (i = 0; i < q->nacct_files; i++) {
+        if (!strcmp(q->acct_files[i].fname, fname)) {
+            return q->acct_files + i;
+        }
+    }
+
+    acct_file_t *files = realloc(q->acct_files,
+        (q->nacct_files + 1)*sizeof(acct_file_t));
+    if (!files) {
+        return NULL;
+    }
+    q->acct_files = files;
+
+    acct_file_t *af = files + q->nacct_files++;
+    af->fname  = strdup(fname);
+    af->offset = 0;
+    af->ino    = 0;
+    af->size   = 0;
+
+    return af;
+}
+
+static int acct_name_comp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Daily files (named YYYYMMDD) of a directory, starting with that of since */
+static bool acct_read_dir(qtop_t *q, const char *dname, long cutoff,
+    acct_sink_t sink, void *data)
+{
+    char first[16], fname[1024];
+    char **names = NULL;
+    int nnames = 0, size = 0, i;
+    struct dirent *de;
+    bool ok = true;
+
+    time_t since = cutoff;
+    strftime(first, 16, "%Y%m%d", localtime(&since));
+
+    DIR *dir = opendir(dname);
+    if (!dir) {
+        return false;
+    }
+    while ((de = readdir(dir))) {
+        if (strlen(de->d_name) != 8 ||
+            strspn(de->d_name, "0123456789") != 8 ||
+            strcmp(de->d_name, first) < 0) {
+            continue;
+        }
+        if (nnames == size) {
+            size = size ? 2*size:64;
+            char **p = realloc(names, size*sizeof(char *));
+            if (!p) {
+                ok = false;
+                break;
+            }
+            names = p;
+        }
+        names[nnames++] = strdup(de->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, nnames, sizeof(char *), acct_name_comp);
+
+    for (i = 0; i < nnames; i++) {
+        snprintf(fname, 1024, "%s/%s", dname, names[i]);
+        acct_file_t *af = acct_file(q, fname);
+        if (ok) {
+            ok = af && acct_read_file(q, af, cutoff, sink, data);
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    return ok;
+}
+
+/*
+ * Pass the jobs finished since the last call (subject to the filters) to
+ * sink, which takes them over. Files are read whole; of directories, only
+ * the days within the history span, including any new ones.
+ */
+bool qtop_acct_foreach(qtop_t *q, acct_sink_t sink, void *data)
+{
+    struct stat sb;
+    int i;
+
+    long cutoff = time(NULL) - 3600L*q->history_span;
+
+    for (i = 0; i < q->nacct_paths; i++) {
+        const char *path = q->acct_paths[i];
+        bool ok;
+
+        if (stat(path, &sb) != 0) {
+            return false;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            ok = acct_read_dir(q, path, cutoff, sink, data);
+        } else {
+            acct_file_t *af = acct_file(q, path);
+            ok = af && acct_read_file(q, af, 0, sink, data);
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Read the newly finished jobs into q->history */
+bool qtop_acct_update(qtop_t *q)
+{
+    return qtop_acct_foreach(q, acct_add, q);
+}
+
+void qtop_acct_init(qtop_t *q, char * const *paths, int npaths)
+{
+    q->acct         = true;
+    q->acct_paths   = paths;
+    q->nacct_paths  = npaths;
+}
+
+bool qtop_acct_load(qtop_t *q, char * const *paths, int npaths)
+{
+    qtop_acct_init(q, paths, npaths);
+
+    return qtop_acct_update(q);
+}
+
+void qtop_acct_free(qtop_t *q)
+{
+    int i;
+
+    for (i = 0; i < q->nacct_files; i++) {
+        free(q->acct_files[i].fname);
+    }
+    free(q->acct_files);
+    q->acct_files = NULL;
+    q->nacct_files = 0;
+}
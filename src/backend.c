@@ -0,0 +1,1877 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The PBS calls qtop makes, made either directly, or directly while being
+ * recorded, or served from a recording instead. A recording is a gzip'ed
+ * stream of calls in the order made, each with its result (the raw batch
+ * status list, or the return code), pbs_errno, and how long it took. On
+ * replay, every call takes the next recorded one, provided it's of the same
+ * kind, after as long as the original did; i.e., the replay must make the
+ * same calls, which it does when run with the same options and keys.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <stdbool.h>
+
+#include <pbs_error.h>
+#include <pbs_ifl.h>
+
+#include <ncurses.h>
+#include <zlib.h>
+
+#include "qtop.h"
+
+#define TAPE_MAGIC      "QTOPPBS1"
+#define TAPE_NOSTRING   0xffffffff
+/* the longest string and most attributes a recording or a reply may have */
+#define TAPE_STRING_MAX     (64*1024*1024)
+#define TAPE_NATTRIBS_MAX   65536
+
+typedef enum {
+    CALL_DEFAULT = 1,
+    CALL_CONNECT,
+    CALL_DISCONNECT,
+    CALL_STATSERVER,
+    CALL_STATVNODE,
+    CALL_STATJOB,
+    CALL_SELSTAT,
+    CALL_DELJOB,
+    CALL_HOLDJOB,
+    CALL_RLSJOB,
+    CALL_ALTERJOB
+} call_t;
+
+typedef struct {
+    uint32_t call;
+    int32_t rc;
+    int32_t err;            /* pbs_errno */
+    uint32_t nstatus;       /* length of the batch status list */
+    int64_t duration;       /* ns */
+} call_header_t;
+
+static gzFile tape;
+static pthread_mutex_t tape_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* on replay, a call of another kind leaves the recorded one for later */
+static call_header_t pending;
+static bool has_pending;
+
+/* The direct calls; pbs_connect() is declared differently across versions */
+static int direct_connect(const char *server)
+{
+    return pbs_connect((char *) server);
+}
+
+static const pbs_backend_t direct_backend = {
+    "direct",
+    pbs_default,
+    direct_connect,
+    pbs_disconnect,
+    pbs_statserver,
+    pbs_statvnode,
+    pbs_statjob,
+    pbs_selstat,
+    pbs_statfree,
+    pbs_deljob,
+    pbs_holdjob,
+    pbs_rlsjob,
+    pbs_alterjob
+};
+
+const pbs_backend_t *backend = &direct_backend;
+
+static int64_t elapsed_ns(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return (int64_t) (t1.tv_sec - t0->tv_sec)*1000000000 +
+        (t1.tv_nsec - t0->tv_nsec);
+}
+
+static bool tape_write_string(gzFile gz, const char *str)
+{
+    uint32_t len = str ? strlen(str):TAPE_NOSTRING;
+
+    return gzwrite(gz, &len, sizeof(len)) == sizeof(len) &&
+        (!str || len == 0 || gzwrite(gz, str, len) == (int) len);
+}
+
+static bool tape_read_string(gzFile gz, char **str, uint32_t maxlen)
+{
+    uint32_t len;
+
+    *str = NULL;
+    if (gzread(gz, &len, sizeof(len)) != sizeof(len)) {
+        return false;
+    }
+    if (len == TAPE_NOSTRING) {
+        return true;
+    }
+    if (len > maxlen) {
+        return false;
+    }
+
+    *str = malloc(len + 1);
+    if (!*str) {
+        return false;
+    }
+    if (len > 0 && gzread(gz, *str, len) != (int) len) {
+        free(*str);
+        *str = NULL;
+        return false;
+    }
+    (*str)[len] = '\0';
+
+    return true;
+}
+
+/* Whether the attribute is among those asked for (all, if none are) */
+static bool attr_wanted(const struct attrl *wanted, const char *name)
+{
+    if (!wanted) {
+        return true;
+    }
+    for (; wanted; wanted = wanted->next) {
+        if (!strcmp(wanted->name, name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Whether the attribute is among the hidden ones (if any) */
+static bool attr_hidden(const char *const *hidden, const char *name)
+{
+    for (; hidden && *hidden; hidden++) {
+        if (!strcmp(*hidden, name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Write a status, only with the attributes wanted and not hidden */
+static bool tape_write_status(gzFile gz, const struct batch_status *bs,
+    const struct attrl *wanted, const char *const *hidden)
+{
+    const struct attrl *a;
+    uint32_t nattribs = 0;
+
+    for (a = bs->attribs; a; a = a->next) {
+        if (attr_wanted(wanted, a->name) && !attr_hidden(hidden, a->name)) {
+            nattribs++;
+        }
+    }
+    if (!tape_write_string(gz, bs->name) ||
+        !tape_write_string(gz, bs->text) ||
+        gzwrite(gz, &nattribs, sizeof(nattribs)) != sizeof(nattribs)) {
+        return false;
+    }
+    for (a = bs->attribs; a; a = a->next) {
+        int32_t op = a->op;
+        if (!attr_wanted(wanted, a->name) || attr_hidden(hidden, a->name)) {
+            continue;
+        }
+        if (!tape_write_string(gz, a->name) ||
+            !tape_write_string(gz, a->resource) ||
+            !tape_write_string(gz, a->value) ||
+            gzwrite(gz, &op, sizeof(op)) != sizeof(op)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void tape_record(call_t call, int rc, int err,
+    const struct batch_status *bs, const struct timespec *t0)
+{
+    const struct batch_status *s;
+    call_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.call     = call;
+    hdr.rc       = rc;
+    hdr.err      = err;
+    hdr.duration = elapsed_ns(t0);
+    for (s = bs; s; s = s->next) {
+        hdr.nstatus++;
+    }
+
+    pthread_mutex_lock(&tape_lock);
+    bool ok = gzwrite(tape, &hdr, sizeof(hdr)) == sizeof(hdr);
+    for (s = bs; ok && s; s = s->next) {
+        ok = tape_write_status(tape, s, NULL, NULL);
+    }
+    // keep what's recorded so far readable, should qtop be killed
+    gzflush(tape, Z_SYNC_FLUSH);
+    pthread_mutex_unlock(&tape_lock);
+}
+
+static void replay_statfree(struct batch_status *bs)
+{
+    while (bs) {
+        struct batch_status *next = bs->next;
+        struct attrl *a = bs->attribs;
+        while (a) {
+            struct attrl *anext = a->next;
+            free(a->name);
+            free(a->resource);
+            free(a->value);
+            free(a);
+            a = anext;
+        }
+        free(bs->name);
+        free(bs->text);
+        free(bs);
+        bs = next;
+    }
+}
+
+/*
+ * Read a batch status list of nstatus entries, none with a string longer
+ * than maxlen or more than maxattribs attributes; NULL if it isn't such
+ */
+static struct batch_status *tape_read_status(gzFile gz, uint32_t nstatus,
+    uint32_t maxlen, uint32_t maxattribs)
+{
+    struct batch_status *head = NULL, **tail = &head;
+    uint32_t i, j;
+
+    for (i = 0; i < nstatus; i++) {
+        struct batch_status *bs = calloc(1, sizeof(struct batch_status));
+        struct attrl **atail;
+        uint32_t nattribs;
+
+        if (!bs) {
+            break;
+        }
+        *tail = bs;
+        tail = &bs->next;
+
+        if (!tape_read_string(gz, &bs->name, maxlen) ||
+            !tape_read_string(gz, &bs->text, maxlen) ||
+            gzread(gz, &nattribs, sizeof(nattribs)) != sizeof(nattribs) ||
+            nattribs > maxattribs) {
+            break;
+        }
+        atail = &bs->attribs;
+        for (j = 0; j < nattribs; j++) {
+            struct attrl *a = calloc(1, sizeof(struct attrl));
+            int32_t op;
+            if (!a) {
+                break;
+            }
+            *atail = a;
+            atail = &a->next;
+            if (!tape_read_string(gz, &a->name, maxlen) ||
+                !tape_read_string(gz, &a->resource, maxlen) ||
+                !tape_read_string(gz, &a->value, maxlen) ||
+                gzread(gz, &op, sizeof(op)) != sizeof(op)) {
+                break;
+            }
+            a->op = op;
+        }
+        if (j < nattribs) {
+            break;
+        }
+    }
+
+    if (i < nstatus) {
+        replay_statfree(head);
+        return NULL;
+    }
+
+    return head;
+}
+
+/*
+ * Take the next recorded call, if it's of this kind, together with its
+ * batch status list (if asked for), and wait as long as it originally took.
+ */
+static bool tape_replay(call_t call, call_header_t *hdr,
+    struct batch_status **bs)
+{
+    pthread_mutex_lock(&tape_lock);
+    if (!has_pending) {
+        has_pending = gzread(tape, &pending, sizeof(pending)) ==
+            sizeof(pending);
+    }
+    if (!has_pending || pending.call != (uint32_t) call) {
+        pthread_mutex_unlock(&tape_lock);
+        pbs_errno = PBSE_PROTOCOL;
+        return false;
+    }
+    *hdr = pending;
+    has_pending = false;
+
+    struct batch_status *status = tape_read_status(tape, hdr->nstatus,
+        TAPE_STRING_MAX, TAPE_NATTRIBS_MAX);
+    pthread_mutex_unlock(&tape_lock);
+
+    if (bs) {
+        *bs = status;
+    } else {
+        replay_statfree(status);
+    }
+
+    struct timespec delay;
+    delay.tv_sec  = hdr->duration/1000000000;
+    delay.tv_nsec = hdr->duration % 1000000000;
+    nanosleep(&delay, NULL);
+
+    pbs_errno = hdr->err;
+
+    return true;
+}
+
+/* The recording backend */
+
+static char *record_default(void)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    char *server = pbs_default();
+    struct batch_status bs;
+
+    // the name goes as a (fake) status
+    memset(&bs, 0, sizeof(bs));
+    bs.name = server;
+    tape_record(CALL_DEFAULT, 0, 0, server ? &bs:NULL, &t0);
+
+    return server;
+}
+
+static int record_connect(const char *server)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int conn = direct_connect(server);
+    tape_record(CALL_CONNECT, conn, pbs_errno, NULL, &t0);
+    return conn;
+}
+
+static int record_disconnect(int conn)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = pbs_disconnect(conn);
+    tape_record(CALL_DISCONNECT, rc, pbs_errno, NULL, &t0);
+    return rc;
+}
+
+static struct batch_status *record_statserver(int conn, struct attrl *attribs,
+    char *extend)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    struct batch_status *bs = pbs_statserver(conn, attribs, extend);
+    tape_record(CALL_STATSERVER, 0, pbs_errno, bs, &t0);
+    return bs;
+}
+
+static struct batch_status *record_statvnode(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    struct batch_status *bs = pbs_statvnode(conn, id, attribs, extend);
+    tape_record(CALL_STATVNODE, 0, pbs_errno, bs, &t0);
+    return bs;
+}
+
+static struct batch_status *record_statjob(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    struct batch_status *bs = pbs_statjob(conn, id, attribs, extend);
+    tape_record(CALL_STATJOB, 0, pbs_errno, bs, &t0);
+    return bs;
+}
+
+static struct batch_status *record_selstat(int conn,
+    struct attropl *criteria, struct attrl *attribs, char *extend)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    struct batch_status *bs = pbs_selstat(conn, criteria, attribs, extend);
+    tape_record(CALL_SELSTAT, 0, pbs_errno, bs, &t0);
+    return bs;
+}
+
+static int record_deljob(int conn, char *id, char *extend)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = pbs_deljob(conn, id, extend);
+    tape_record(CALL_DELJOB, rc, pbs_errno, NULL, &t0);
+    return rc;
+}
+
+static int record_holdjob(int conn, char *id, char *type, char *extend)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = pbs_holdjob(conn, id, type, extend);
+    tape_record(CALL_HOLDJOB, rc, pbs_errno, NULL, &t0);
+    return rc;
+}
+
+static int record_rlsjob(int conn, char *id, char *type, char *extend)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = pbs_rlsjob(conn, id, type, extend);
+    tape_record(CALL_RLSJOB, rc, pbs_errno, NULL, &t0);
+    return rc;
+}
+
+static int record_alterjob(int conn, char *id, struct attrl *attribs,
+    char *extend)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = pbs_alterjob(conn, id, attribs, extend);
+    tape_record(CALL_ALTERJOB, rc, pbs_errno, NULL, &t0);
+    return rc;
+}
+
+static const pbs_backend_t record_backend = {
+    "record",
+    record_default,
+    record_connect,
+    record_disconnect,
+    record_statserver,
+    record_statvnode,
+    record_statjob,
+    record_selstat,
+    pbs_statfree,
+    record_deljob,
+    record_holdjob,
+    record_rlsjob,
+    record_alterjob
+};
+
+/* The replaying backend */
+
+static char *replay_default(void)
+{
+    static char server[256];
+    struct batch_status *bs;
+    call_header_t hdr;
+
+    if (!tape_replay(CALL_DEFAULT, &hdr, &bs) || !bs) {
+        return NULL;
+    }
+    snprintf(server, 256, "%s", bs->name ? bs->name:"");
+    replay_statfree(bs);
+
+    return server;
+}
+
+static int replay_rc(call_t call)
+{
+    call_header_t hdr;
+
+    if (!tape_replay(call, &hdr, NULL)) {
+        return -1;
+    }
+
+    return hdr.rc;
+}
+
+static struct batch_status *replay_status(call_t call)
+{
+    struct batch_status *bs;
+    call_header_t hdr;
+
+    if (!tape_replay(call, &hdr, &bs)) {
+        return NULL;
+    }
+
+    return bs;
+}
+
+static int replay_connect(const char *server)
+{
+    (void) server;
+    return replay_rc(CALL_CONNECT);
+}
+
+static int replay_disconnect(int conn)
+{
+    (void) conn;
+    return replay_rc(CALL_DISCONNECT);
+}
+
+static struct batch_status *replay_statserver(int conn, struct attrl *attribs,
+    char *extend)
+{
+    (void) conn; (void) attribs; (void) extend;
+    return replay_status(CALL_STATSERVER);
+}
+
+static struct batch_status *replay_statvnode(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    (void) conn; (void) id; (void) attribs; (void) extend;
+    return replay_status(CALL_STATVNODE);
+}
+
+static struct batch_status *replay_statjob(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    (void) conn; (void) id; (void) attribs; (void) extend;
+    return replay_status(CALL_STATJOB);
+}
+
+static struct batch_status *replay_selstat(int conn,
+    struct attropl *criteria, struct attrl *attribs, char *extend)
+{
+    (void) conn; (void) criteria; (void) attribs; (void) extend;
+    return replay_status(CALL_SELSTAT);
+}
+
+static int replay_deljob(int conn, char *id, char *extend)
+{
+    (void) conn; (void) id; (void) extend;
+    return replay_rc(CALL_DELJOB);
+}
+
+static int replay_holdjob(int conn, char *id, char *type, char *extend)
+{
+    (void) conn; (void) id; (void) type; (void) extend;
+    return replay_rc(CALL_HOLDJOB);
+}
+
+static int replay_rlsjob(int conn, char *id, char *type, char *extend)
+{
+    (void) conn; (void) id; (void) type; (void) extend;
+    return replay_rc(CALL_RLSJOB);
+}
+
+static int replay_alterjob(int conn, char *id, struct attrl *attribs,
+    char *extend)
+{
+    (void) conn; (void) id; (void) attribs; (void) extend;
+    return replay_rc(CALL_ALTERJOB);
+}
+
+static const pbs_backend_t replay_backend = {
+    "replay",
+    replay_default,
+    replay_connect,
+    replay_disconnect,
+    replay_statserver,
+    replay_statvnode,
+    replay_statjob,
+    replay_selstat,
+    replay_statfree,
+    replay_deljob,
+    replay_holdjob,
+    replay_rlsjob,
+    replay_alterjob
+};
+
+/*
+ * The daemon backend: the server status and the selections of active jobs
+ * are served by qtopd from its snapshot, the rest are passed to the backend
+ * that was in effect, connecting to the server only when first needed. Each
+ * call is a connection to the daemon's unix socket, with a request (the call
+ * header and, as batch statuses, the arguments) and a reply in the format of
+ * a recording. Should the daemon not answer, the call is passed on, too.
+ */
+
+#define DAEMON_NCONNS       64
+/* how long (in s) to wait for the daemon, which may be busy refreshing */
+#define DAEMON_TIMEOUT      10
+/* the longest string and most attributes (criteria) a request may have */
+#define DAEMON_STRING_MAX   4096
+#define DAEMON_NATTRIBS_MAX 256
+
+/* not in the headers of all PBS versions */
+#ifndef ATTR_query_other_jobs
+#define ATTR_query_other_jobs "query_other_jobs"
+#endif
+
+typedef struct {
+    bool used;
+    char *server;
+    int conn;           /* to the server, once needed */
+} daemon_conn_t;
+
+static const pbs_backend_t *upstream;
+static char *daemon_path;
+static daemon_conn_t daemon_conns[DAEMON_NCONNS];
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the daemon's snapshot */
+static struct batch_status *daemon_server;
+static struct batch_status *daemon_jobs;
+static int daemon_njobs;
+
+static int daemon_dial(const char *path)
+{
+    struct sockaddr_un sun;
+    struct timeval tv = {DAEMON_TIMEOUT, 0};
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Make a call to the daemon with the arguments in req (nreq of them); false
+ * if it couldn't be made, or the daemon can't answer it
+ */
+static bool daemon_call(call_t call, const struct batch_status *req,
+    int nreq, call_header_t *hdr, struct batch_status **bs)
+{
+    int fd, i;
+
+    *bs = NULL;
+    fd = daemon_dial(daemon_path);
+    if (fd < 0) {
+        return false;
+    }
+
+    gzFile gz = gzdopen(dup(fd), "wT");
+    if (!gz) {
+        close(fd);
+        return false;
+    }
+    memset(hdr, 0, sizeof(call_header_t));
+    hdr->call = call;
+    hdr->nstatus = nreq;
+    bool ok = gzwrite(gz, hdr, sizeof(call_header_t)) == sizeof(call_header_t);
+    for (i = 0; ok && i < nreq; i++) {
+        ok = tape_write_status(gz, req + i, NULL, NULL);
+    }
+    ok = gzclose(gz) == Z_OK && ok;
+    // the end of the request
+    shutdown(fd, SHUT_WR);
+
+    gz = ok ? gzdopen(fd, "rb"):NULL;
+    if (!gz) {
+        close(fd);
+        return false;
+    }
+    ok = gzread(gz, hdr, sizeof(call_header_t)) == sizeof(call_header_t) &&
+        hdr->call == (uint32_t) call && hdr->err != PBSE_PROTOCOL;
+    if (ok && hdr->nstatus > 0) {
+        *bs = tape_read_status(gz, hdr->nstatus, TAPE_STRING_MAX,
+            TAPE_NATTRIBS_MAX);
+        ok = *bs != NULL;
+    }
+    gzclose(gz);
+
+    if (ok) {
+        pbs_errno = hdr->err;
+    }
+
+    return ok;
+}
+
+/* The server connection behind the daemon one */
+static int daemon_upstream(int conn)
+{
+    daemon_conn_t *dc;
+    int upconn;
+
+    if (conn < 1 || conn > DAEMON_NCONNS) {
+        return -1;
+    }
+    dc = daemon_conns + conn - 1;
+
+    pthread_mutex_lock(&daemon_lock);
+    upconn = dc->conn;
+    pthread_mutex_unlock(&daemon_lock);
+    if (upconn < 0) {
+        upconn = upstream->connect(dc->server);
+        pthread_mutex_lock(&daemon_lock);
+        dc->conn = upconn;
+        pthread_mutex_unlock(&daemon_lock);
+    }
+
+    return upconn;
+}
+
+/* A copy of the upstream batch status list, so that all are freed alike */
+static struct batch_status *daemon_copy(struct batch_status *bs)
+{
+    struct batch_status *head = NULL, **tail = &head, *s;
+    const struct attrl *a;
+
+    for (s = bs; s; s = s->next) {
+        struct batch_status *c = calloc(1, sizeof(struct batch_status));
+        struct attrl **atail;
+        if (!c) {
+            break;
+        }
+        *tail = c;
+        tail = &c->next;
+        c->name = s->name ? strdup(s->name):NULL;
+        c->text = s->text ? strdup(s->text):NULL;
+        atail = &c->attribs;
+        for (a = s->attribs; a; a = a->next) {
+            struct attrl *ca = calloc(1, sizeof(struct attrl));
+            if (!ca) {
+                break;
+            }
+            *atail = ca;
+            atail = &ca->next;
+            ca->name = a->name ? strdup(a->name):NULL;
+            ca->resource = a->resource ? strdup(a->resource):NULL;
+            ca->value = a->value ? strdup(a->value):NULL;
+            ca->op = a->op;
+        }
+    }
+    if (bs) {
+        int err = pbs_errno;
+        upstream->statfree(bs);
+        pbs_errno = err;
+    }
+
+    return head;
+}
+
+static char *daemon_default(void)
+{
+    static char server[256];
+    struct batch_status *bs;
+    call_header_t hdr;
+
+    if (!daemon_call(CALL_DEFAULT, NULL, 0, &hdr, &bs) || !bs) {
+        return upstream->default_server();
+    }
+    snprintf(server, 256, "%s", bs->name ? bs->name:"");
+    replay_statfree(bs);
+
+    return server;
+}
+
+static int daemon_connect(const char *server)
+{
+    int i;
+
+    pthread_mutex_lock(&daemon_lock);
+    for (i = 0; i < DAEMON_NCONNS; i++) {
+        daemon_conn_t *dc = daemon_conns + i;
+        if (!dc->used) {
+            dc->used = true;
+            dc->server = server ? strdup(server):NULL;
+            dc->conn = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&daemon_lock);
+
+    if (i == DAEMON_NCONNS) {
+        pbs_errno = PBSE_PROTOCOL;
+        return -1;
+    }
+
+    return i + 1;
+}
+
+static int daemon_disconnect(int conn)
+{
+    daemon_conn_t *dc;
+    int rc = 0;
+
+    if (conn < 1 || conn > DAEMON_NCONNS) {
+        return -1;
+    }
+    dc = daemon_conns + conn - 1;
+    if (dc->conn >= 0) {
+        rc = upstream->disconnect(dc->conn);
+    }
+
+    pthread_mutex_lock(&daemon_lock);
+    free(dc->server);
+    memset(dc, 0, sizeof(daemon_conn_t));
+    pthread_mutex_unlock(&daemon_lock);
+
+    return rc;
+}
+
+/* The attributes asked for, as a status */
+static void daemon_attribs_req(struct batch_status *req, struct attrl *attribs)
+{
+    memset(req, 0, sizeof(struct batch_status));
+    // NULL for all attributes
+    req->name = attribs ? "":NULL;
+    req->attribs = attribs;
+}
+
+static struct batch_status *daemon_statserver(int conn, struct attrl *attribs,
+    char *extend)
+{
+    struct batch_status req, *bs;
+    call_header_t hdr;
+
+    daemon_attribs_req(&req, attribs);
+    if (!extend && daemon_call(CALL_STATSERVER, &req, 1, &hdr, &bs)) {
+        return bs;
+    }
+
+    return daemon_copy(upstream->statserver(daemon_upstream(conn), attribs,
+        extend));
+}
+
+static struct batch_status *daemon_statvnode(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    return daemon_copy(upstream->statvnode(daemon_upstream(conn), id,
+        attribs, extend));
+}
+
+static struct batch_status *daemon_statjob(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    return daemon_copy(upstream->statjob(daemon_upstream(conn), id,
+        attribs, extend));
+}
+
+static struct batch_status *daemon_selstat(int conn,
+    struct attropl *criteria, struct attrl *attribs, char *extend)
+{
+    struct batch_status req[2], *bs;
+    const struct attropl *c;
+    call_header_t hdr;
+    int n = 0;
+
+    // finished jobs aren't in the snapshot
+    if (!extend || !strchr(extend, 'x')) {
+        for (c = criteria; c; c = c->next) {
+            n++;
+        }
+        struct attrl *crit = calloc(n + 1, sizeof(struct attrl));
+        if (crit) {
+            for (c = criteria, n = 0; c; c = c->next, n++) {
+                crit[n].name = c->name;
+                crit[n].resource = c->resource;
+                crit[n].value = c->value;
+                crit[n].op = c->op;
+                crit[n].next = c->next ? crit + n + 1:NULL;
+            }
+            memset(req, 0, sizeof(struct batch_status));
+            req[0].name = extend ? extend:"";
+            req[0].attribs = criteria ? crit:NULL;
+            daemon_attribs_req(req + 1, attribs);
+            bool ok = daemon_call(CALL_SELSTAT, req, 2, &hdr, &bs);
+            free(crit);
+            if (ok) {
+                return bs;
+            }
+        }
+    }
+
+    return daemon_copy(upstream->selstat(daemon_upstream(conn), criteria,
+        attribs, extend));
+}
+
+static int daemon_deljob(int conn, char *id, char *extend)
+{
+    return upstream->deljob(daemon_upstream(conn), id, extend);
+}
+
+static int daemon_holdjob(int conn, char *id, char *type, char *extend)
+{
+    return upstream->holdjob(daemon_upstream(conn), id, type, extend);
+}
+
+static int daemon_rlsjob(int conn, char *id, char *type, char *extend)
+{
+    return upstream->rlsjob(daemon_upstream(conn), id, type, extend);
+}
+
+static int daemon_alterjob(int conn, char *id, struct attrl *attribs,
+    char *extend)
+{
+    return upstream->alterjob(daemon_upstream(conn), id, attribs, extend);
+}
+
+static const pbs_backend_t daemon_backend = {
+    "daemon",
+    daemon_default,
+    daemon_connect,
+    daemon_disconnect,
+    daemon_statserver,
+    daemon_statvnode,
+    daemon_statjob,
+    daemon_selstat,
+    replay_statfree,
+    daemon_deljob,
+    daemon_holdjob,
+    daemon_rlsjob,
+    daemon_alterjob
+};
+
+/* The daemon's side */
+
+/* Whether the job matches the selection, as far as the snapshot can tell */
+static bool daemon_match(const struct batch_status *job,
+    const struct attrl *criteria, bool subjobs, bool *known)
+{
+    const struct attrl *c, *a;
+    const char *p;
+
+    // a subjob, e.g., 123[4].server
+    p = job->name ? strchr(job->name, '['):NULL;
+    if (!subjobs && p && p[1] >= '0' && p[1] <= '9') {
+        return false;
+    }
+
+    for (c = criteria; c; c = c->next) {
+        // the user is that of the owner, user@host
+        bool by_user = !strcmp(c->name, ATTR_u);
+        const char *name = by_user ? ATTR_owner:c->name, *value = NULL;
+        if (!strcmp(c->name, ATTR_q)) {
+            name = ATTR_queue;
+        }
+        char user[256];
+
+        if (c->op != EQ) {
+            *known = false;
+            return false;
+        }
+        for (a = job->attribs; a; a = a->next) {
+            if (!strcmp(a->name, name) && !a->resource) {
+                value = a->value;
+                break;
+            }
+        }
+        if (by_user && value) {
+            snprintf(user, sizeof(user), "%s", value);
+            user[strcspn(user, "@")] = '\0';
+            value = user;
+        }
+
+        if (!strcmp(c->name, ATTR_state)) {
+            if (!value || !strchr(c->value, value[0])) {
+                return false;
+            }
+        } else
+        if (!strcmp(c->name, ATTR_u) || !strcmp(c->name, ATTR_q)) {
+            if (!value || strcmp(c->value, value)) {
+                return false;
+            }
+        } else {
+            *known = false;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* the attributes that may tell secrets (e.g., the environment) */
+static const char *const daemon_private[] = {
+    ATTR_v,
+    ATTR_submit_arguments,
+    ATTR_Arglist,
+    NULL
+};
+
+/*
+ * The user a client runs as, NULL if root or the daemon's own (they see
+ * everything anyway), or "" if not known
+ */
+static const char *daemon_peer(int fd, char *buf, size_t bufsize)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    struct passwd pw, *res = NULL;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        return "";
+    }
+    if (cred.uid == 0 || cred.uid == geteuid()) {
+        return NULL;
+    }
+    if (getpwuid_r(cred.uid, &pw, buf, bufsize, &res) != 0 || !res) {
+        return "";
+    }
+
+    return res->pw_name;
+}
+
+/* Whether the job is of the user (user@host) */
+static bool daemon_owned(const struct batch_status *job, const char *user)
+{
+    const struct attrl *a;
+    size_t len = strlen(user);
+
+    for (a = job->attribs; a; a = a->next) {
+        if (!strcmp(a->name, ATTR_owner) && !a->resource) {
+            return len > 0 && !strncmp(a->value, user, len) &&
+                (a->value[len] == '@' || a->value[len] == '\0');
+        }
+    }
+
+    return false;
+}
+
+/* Whether the server lets users see the jobs of others */
+static bool daemon_others_shown(void)
+{
+    const struct attrl *a;
+
+    for (a = daemon_server ? daemon_server->attribs:NULL; a; a = a->next) {
+        if (!strcmp(a->name, ATTR_query_other_jobs) && !a->resource) {
+            return a->value && !strcasecmp(a->value, "true");
+        }
+    }
+
+    return false;
+}
+
+/* The statuses are sent without the private attributes, but to their owner */
+static void daemon_reply(gzFile gz, call_t call, int err,
+    const struct batch_status **list, int n, const struct attrl *wanted,
+    const char *peer)
+{
+    call_header_t hdr;
+    int i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.call    = call;
+    hdr.err     = err;
+    hdr.nstatus = n;
+    bool ok = gzwrite(gz, &hdr, sizeof(hdr)) == sizeof(hdr);
+    for (i = 0; ok && i < n; i++) {
+        bool shown = !peer || daemon_owned(list[i], peer);
+        ok = tape_write_status(gz, list[i], wanted,
+            shown ? NULL:daemon_private);
+    }
+}
+
+/*
+ * Answer a request of a client on fd from the snapshot; a request out of
+ * bounds drops the client
+ */
+void daemon_answer(int fd, void *data)
+{
+    struct batch_status *req = NULL;
+    const struct batch_status **list = NULL;
+    call_header_t hdr;
+    char pwbuf[1024];
+    int n = 0;
+
+    (void) data;
+
+    const char *peer = daemon_peer(fd, pwbuf, sizeof(pwbuf));
+
+    gzFile gz = gzdopen(dup(fd), "rb");
+    if (!gz) {
+        return;
+    }
+    bool ok = gzread(gz, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        hdr.nstatus <= 2;
+    if (ok && hdr.nstatus > 0) {
+        req = tape_read_status(gz, hdr.nstatus, DAEMON_STRING_MAX,
+            DAEMON_NATTRIBS_MAX);
+        ok = req != NULL;
+    }
+    gzclose(gz);
+    if (!ok) {
+        replay_statfree(req);
+        return;
+    }
+
+    gz = gzdopen(dup(fd), "wT");
+    if (!gz) {
+        replay_statfree(req);
+        return;
+    }
+    if (!daemon_server) {
+        // no snapshot yet
+        daemon_reply(gz, hdr.call, PBSE_PROTOCOL, NULL, 0, NULL, NULL);
+    } else
+    if (hdr.call == CALL_DEFAULT) {
+        list = (const struct batch_status **) &daemon_server;
+        daemon_reply(gz, hdr.call, PBSE_NONE, list, 1, NULL, peer);
+    } else
+    if (hdr.call == CALL_STATSERVER && req) {
+        list = (const struct batch_status **) &daemon_server;
+        daemon_reply(gz, hdr.call, PBSE_NONE, list, 1,
+            req->name ? req->attribs:NULL, peer);
+    } else
+    if (hdr.call == CALL_SELSTAT && req && req->next) {
+        const struct batch_status *job;
+        bool subjobs = strchr(req->name, 't') != NULL, known = true;
+
+        // the snapshot is the daemon's; a user sees no more than the server
+        // would show them
+        bool own = peer && !daemon_others_shown();
+
+        list = malloc((daemon_njobs + 1)*sizeof(struct batch_status *));
+        for (job = daemon_jobs; list && job && known; job = job->next) {
+            if (daemon_match(job, req->attribs, subjobs, &known) &&
+                (!own || daemon_owned(job, peer))) {
+                list[n++] = job;
+            }
+        }
+        if (list && known) {
+            daemon_reply(gz, hdr.call, PBSE_NONE, list, n,
+                req->next->name ? req->next->attribs:NULL, peer);
+        } else {
+            daemon_reply(gz, hdr.call, PBSE_PROTOCOL, NULL, 0, NULL, NULL);
+        }
+        free(list);
+    } else {
+        daemon_reply(gz, hdr.call, PBSE_PROTOCOL, NULL, 0, NULL, NULL);
+    }
+    gzclose(gz);
+
+    replay_statfree(req);
+}
+
+/*
+ * Take a new snapshot: the server status and all active jobs, subjobs
+ * included, with all their attributes
+ */
+bool daemon_refresh(int conn)
+{
+    struct batch_status *server, *jobs, *bs;
+
+    server = backend->statserver(conn, NULL, NULL);
+    if (!server) {
+        return false;
+    }
+    jobs = backend->selstat(conn, NULL, NULL, "t");
+    if (!jobs && pbs_errno != PBSE_NONE) {
+        backend->statfree(server);
+        return false;
+    }
+
+    if (daemon_server) {
+        backend->statfree(daemon_server);
+    }
+    if (daemon_jobs) {
+        backend->statfree(daemon_jobs);
+    }
+    daemon_server = server;
+    daemon_jobs = jobs;
+    daemon_njobs = 0;
+    for (bs = jobs; bs; bs = bs->next) {
+        daemon_njobs++;
+    }
+
+    return true;
+}
+
+/*
+ * Bounded calls, wrapping the backend in effect: each call is made on a
+ * thread of its own and waited for up to a timeout, checking in between
+ * whether the user gave up waiting. A call not back in time is left to
+ * finish (its result is then thrown away) and its connection is given up:
+ * further calls on it fail at once with PBSE_EXPIRED, for the caller to
+ * reconnect, and it's disconnected once the stuck call is back.
+ */
+
+#define GUARD_NCONNS        64
+/* how often (in ms) a wait checks whether the user gave up */
+#define GUARD_POLL          100
+
+typedef struct {
+    bool used;
+    int conn;
+    int ncalls;         /* in progress, given up on or not */
+    bool dead;
+    bool closing;       /* to be disconnected when they're back */
+} guard_conn_t;
+
+typedef struct {
+    call_t call;
+
+    /* the arguments, copied: the caller may be gone when they're used */
+    int conn;
+    char *server;
+    char *id;
+    char *type;
+    char *extend;
+    struct attrl *attribs;
+    struct attropl *criteria;
+
+    int rc;
+    int err;
+    struct batch_status *bs;
+
+    bool done;
+    bool abandoned;
+} guard_call_t;
+
+static const pbs_backend_t *guarded;
+static int guard_connect_ms, guard_call_ms;
+static bool (*guard_cancelled)(void);
+static pthread_t guard_cancel_thread;
+static guard_conn_t guard_conns[GUARD_NCONNS];
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t guard_cond = PTHREAD_COND_INITIALIZER;
+
+static char *guard_strdup(const char *s)
+{
+    return s ? strdup(s):NULL;
+}
+
+static struct attrl *guard_attrl_copy(const struct attrl *a)
+{
+    struct attrl *head = NULL, **tail = &head;
+
+    for (; a; a = a->next) {
+        struct attrl *c = calloc(1, sizeof(struct attrl));
+        if (!c) {
+            break;
+        }
+        c->name     = guard_strdup(a->name);
+        c->resource = guard_strdup(a->resource);
+        c->value    = guard_strdup(a->value);
+        c->op       = a->op;
+        *tail = c;
+        tail = &c->next;
+    }
+
+    return head;
+}
+
+static struct attropl *guard_attropl_copy(const struct attropl *a)
+{
+    struct attropl *head = NULL, **tail = &head;
+
+    for (; a; a = a->next) {
+        struct attropl *c = calloc(1, sizeof(struct attropl));
+        if (!c) {
+            break;
+        }
+        c->name     = guard_strdup(a->name);
+        c->resource = guard_strdup(a->resource);
+        c->value    = guard_strdup(a->value);
+        c->op       = a->op;
+        *tail = c;
+        tail = &c->next;
+    }
+
+    return head;
+}
+
+static guard_call_t *guard_call_new(call_t call, int conn)
+{
+    guard_call_t *c = calloc(1, sizeof(guard_call_t));
+    if (c) {
+        c->call = call;
+        c->conn = conn;
+    }
+
+    return c;
+}
+
+static void guard_call_free(guard_call_t *c)
+{
+    while (c->attribs) {
+        struct attrl *next = c->attribs->next;
+        free(c->attribs->name);
+        free(c->attribs->resource);
+        free(c->attribs->value);
+        free(c->attribs);
+        c->attribs = next;
+    }
+    while (c->criteria) {
+        struct attropl *next = c->criteria->next;
+        free(c->criteria->name);
+        free(c->criteria->resource);
+        free(c->criteria->value);
+        free(c->criteria);
+        c->criteria = next;
+    }
+    free(c->server);
+    free(c->id);
+    free(c->type);
+    free(c->extend);
+    free(c);
+}
+
+/* The state of conn, NULL if not followed; called locked */
+static guard_conn_t *guard_conn(int conn)
+{
+    int i;
+
+    for (i = 0; i < GUARD_NCONNS; i++) {
+        if (guard_conns[i].used && guard_conns[i].conn == conn) {
+            return guard_conns + i;
+        }
+    }
+
+    return NULL;
+}
+
+static void *guard_thread(void *arg)
+{
+    guard_call_t *c = arg;
+
+    switch (c->call) {
+    case CALL_CONNECT:
+        c->rc = guarded->connect(c->server);
+        break;
+    case CALL_DISCONNECT:
+        c->rc = guarded->disconnect(c->conn);
+        break;
+    case CALL_STATSERVER:
+        c->bs = guarded->statserver(c->conn, c->attribs, c->extend);
+        break;
+    case CALL_STATVNODE:
+        c->bs = guarded->statvnode(c->conn, c->id, c->attribs, c->extend);
+        break;
+    case CALL_STATJOB:
+        c->bs = guarded->statjob(c->conn, c->id, c->attribs, c->extend);
+        break;
+    case CALL_SELSTAT:
+        c->bs = guarded->selstat(c->conn, c->criteria, c->attribs, c->extend);
+        break;
+    case CALL_DELJOB:
+        c->rc = guarded->deljob(c->conn, c->id, c->extend);
+        break;
+    case CALL_HOLDJOB:
+        c->rc = guarded->holdjob(c->conn, c->id, c->type, c->extend);
+        break;
+    case CALL_RLSJOB:
+        c->rc = guarded->rlsjob(c->conn, c->id, c->type, c->extend);
+        break;
+    case CALL_ALTERJOB:
+        c->rc = guarded->alterjob(c->conn, c->id, c->attribs, c->extend);
+        break;
+    default:
+        break;
+    }
+    c->err = pbs_errno;
+
+    pthread_mutex_lock(&guard_lock);
+    guard_conn_t *gc = c->call != CALL_CONNECT ? guard_conn(c->conn):NULL;
+    bool closing = false;
+    if (gc) {
+        gc->ncalls--;
+        if (c->call == CALL_DISCONNECT || (gc->closing && gc->ncalls == 0)) {
+            closing = gc->closing;
+            memset(gc, 0, sizeof(guard_conn_t));
+        }
+    }
+    // once done, c is the caller's to free, unless abandoned
+    call_t call = c->call;
+    int conn = c->conn;
+    c->done = true;
+    bool abandoned = c->abandoned;
+    pthread_cond_broadcast(&guard_cond);
+    pthread_mutex_unlock(&guard_lock);
+
+    if (abandoned) {
+        if (c->bs) {
+            guarded->statfree(c->bs);
+        }
+        if (call == CALL_CONNECT && c->rc > 0) {
+            guarded->disconnect(c->rc);
+        }
+        guard_call_free(c);
+    }
+    if (closing && call != CALL_DISCONNECT) {
+        guarded->disconnect(conn);
+    }
+
+    return NULL;
+}
+
+/*
+ * Make the call, waiting for it up to timeout_ms; false if it wasn't made
+ * or not waited for, in which case it's not the caller's to free anymore
+ */
+static bool guard_run(guard_call_t *c, int timeout_ms)
+{
+    struct timespec now, end;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (!c) {
+        pbs_errno = PBSE_PROTOCOL;
+        return false;
+    }
+
+    pthread_mutex_lock(&guard_lock);
+    guard_conn_t *gc = c->call != CALL_CONNECT ? guard_conn(c->conn):NULL;
+    if (gc && gc->dead) {
+        pthread_mutex_unlock(&guard_lock);
+        guard_call_free(c);
+        pbs_errno = PBSE_EXPIRED;
+        return false;
+    }
+    if (gc) {
+        gc->ncalls++;
+    }
+    pthread_mutex_unlock(&guard_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, guard_thread, c) != 0) {
+        // made here, then, unbounded
+        pthread_attr_destroy(&attr);
+        c->abandoned = false;
+        guard_thread(c);
+        pbs_errno = c->err;
+        return true;
+    }
+    pthread_attr_destroy(&attr);
+
+    clock_gettime(CLOCK_REALTIME, &end);
+    end.tv_sec  += timeout_ms/1000;
+    end.tv_nsec += (timeout_ms % 1000)*1000000L;
+    if (end.tv_nsec >= 1000000000) {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&guard_lock);
+    while (!c->done) {
+        struct timespec poll_end;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec > end.tv_sec ||
+            (now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec)) {
+            break;
+        }
+        poll_end = now;
+        poll_end.tv_nsec += GUARD_POLL*1000000L;
+        if (poll_end.tv_nsec >= 1000000000) {
+            poll_end.tv_sec++;
+            poll_end.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&guard_cond, &guard_lock, &poll_end);
+        if (!c->done && guard_cancelled &&
+            pthread_equal(pthread_self(), guard_cancel_thread)) {
+            pthread_mutex_unlock(&guard_lock);
+            bool cancelled = guard_cancelled();
+            pthread_mutex_lock(&guard_lock);
+            if (cancelled) {
+                break;
+            }
+        }
+    }
+    if (!c->done) {
+        // given up on, with its connection
+        c->abandoned = true;
+        gc = c->call != CALL_CONNECT ? guard_conn(c->conn):NULL;
+        if (gc) {
+            gc->dead = true;
+        }
+        pthread_mutex_unlock(&guard_lock);
+        pbs_errno = PBSE_EXPIRED;
+        return false;
+    }
+    pthread_mutex_unlock(&guard_lock);
+
+    pbs_errno = c->err;
+
+    return true;
+}
+
+static char *guard_default(void)
+{
+    return guarded->default_server();
+}
+
+static int guard_connect(const char *server)
+{
+    guard_call_t *c = guard_call_new(CALL_CONNECT, -1);
+    int conn, i;
+
+    if (c) {
+        c->server = guard_strdup(server);
+    }
+    if (!guard_run(c, guard_connect_ms)) {
+        return -1;
+    }
+    conn = c->rc;
+    guard_call_free(c);
+
+    if (conn > 0) {
+        pthread_mutex_lock(&guard_lock);
+        guard_conn_t *old = guard_conn(conn);
+        if (old) {
+            // the handle reissued; a call still stuck on it just returns
+            old->dead = false;
+            old->closing = false;
+        }
+        for (i = 0; i < GUARD_NCONNS && !old; i++) {
+            guard_conn_t *gc = guard_conns + i;
+            if (!gc->used) {
+                memset(gc, 0, sizeof(guard_conn_t));
+                gc->used = true;
+                gc->conn = conn;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&guard_lock);
+    }
+
+    return conn;
+}
+
+/* A connection with a call stuck is disconnected when the call is back */
+static int guard_disconnect(int conn)
+{
+    pthread_mutex_lock(&guard_lock);
+    guard_conn_t *gc = guard_conn(conn);
+    if (gc && gc->ncalls > 0) {
+        gc->closing = true;
+        pthread_mutex_unlock(&guard_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&guard_lock);
+
+    guard_call_t *c = guard_call_new(CALL_DISCONNECT, conn);
+    if (!guard_run(c, guard_connect_ms)) {
+        return -1;
+    }
+    int rc = c->rc;
+    guard_call_free(c);
+
+    return rc;
+}
+
+static struct batch_status *guard_status(guard_call_t *c)
+{
+    struct batch_status *bs;
+
+    if (!guard_run(c, guard_call_ms)) {
+        return NULL;
+    }
+    bs = c->bs;
+    guard_call_free(c);
+
+    return bs;
+}
+
+static int guard_rc(guard_call_t *c)
+{
+    int rc;
+
+    if (!guard_run(c, guard_call_ms)) {
+        return pbs_errno;
+    }
+    rc = c->rc;
+    guard_call_free(c);
+
+    return rc;
+}
+
+static struct batch_status *guard_statserver(int conn, struct attrl *attribs,
+    char *extend)
+{
+    guard_call_t *c = guard_call_new(CALL_STATSERVER, conn);
+    if (c) {
+        c->attribs = guard_attrl_copy(attribs);
+        c->extend  = guard_strdup(extend);
+    }
+
+    return guard_status(c);
+}
+
+static struct batch_status *guard_statvnode(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    guard_call_t *c = guard_call_new(CALL_STATVNODE, conn);
+    if (c) {
+        c->id      = guard_strdup(id);
+        c->attribs = guard_attrl_copy(attribs);
+        c->extend  = guard_strdup(extend);
+    }
+
+    return guard_status(c);
+}
+
+static struct batch_status *guard_statjob(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    guard_call_t *c = guard_call_new(CALL_STATJOB, conn);
+    if (c) {
+        c->id      = guard_strdup(id);
+        c->attribs = guard_attrl_copy(attribs);
+        c->extend  = guard_strdup(extend);
+    }
+
+    return guard_status(c);
+}
+
+static struct batch_status *guard_selstat(int conn,
+    struct attropl *criteria, struct attrl *attribs, char *extend)
+{
+    guard_call_t *c = guard_call_new(CALL_SELSTAT, conn);
+    if (c) {
+        c->criteria = guard_attropl_copy(criteria);
+        c->attribs  = guard_attrl_copy(attribs);
+        c->extend   = guard_strdup(extend);
+    }
+
+    return guard_status(c);
+}
+
+static void guard_statfree(struct batch_status *bs)
+{
+    guarded->statfree(bs);
+}
+
+static int guard_deljob(int conn, char *id, char *extend)
+{
+    guard_call_t *c = guard_call_new(CALL_DELJOB, conn);
+    if (c) {
+        c->id     = guard_strdup(id);
+        c->extend = guard_strdup(extend);
+    }
+
+    return guard_rc(c);
+}
+
+static int guard_holdjob(int conn, char *id, char *type, char *extend)
+{
+    guard_call_t *c = guard_call_new(CALL_HOLDJOB, conn);
+    if (c) {
+        c->id     = guard_strdup(id);
+        c->type   = guard_strdup(type);
+        c->extend = guard_strdup(extend);
+    }
+
+    return guard_rc(c);
+}
+
+static int guard_rlsjob(int conn, char *id, char *type, char *extend)
+{
+    guard_call_t *c = guard_call_new(CALL_RLSJOB, conn);
+    if (c) {
+        c->id     = guard_strdup(id);
+        c->type   = guard_strdup(type);
+        c->extend = guard_strdup(extend);
+    }
+
+    return guard_rc(c);
+}
+
+static int guard_alterjob(int conn, char *id, struct attrl *attribs,
+    char *extend)
+{
+    guard_call_t *c = guard_call_new(CALL_ALTERJOB, conn);
+    if (c) {
+        c->id      = guard_strdup(id);
+        c->attribs = guard_attrl_copy(attribs);
+        c->extend  = guard_strdup(extend);
+    }
+
+    return guard_rc(c);
+}
+
+static const pbs_backend_t guard_backend = {
+    "guarded",
+    guard_default,
+    guard_connect,
+    guard_disconnect,
+    guard_statserver,
+    guard_statvnode,
+    guard_statjob,
+    guard_selstat,
+    guard_statfree,
+    guard_deljob,
+    guard_holdjob,
+    guard_rlsjob,
+    guard_alterjob
+};
+
+/* Record all PBS calls to fname */
+bool backend_record(const char *fname)
+{
+    tape = gzopen(fname, "wb6");
+    if (!tape) {
+        return false;
+    }
+    if (gzwrite(tape, TAPE_MAGIC, 8) != 8) {
+        backend_close();
+        return false;
+    }
+
+    backend = &record_backend;
+
+    return true;
+}
+
+/* Serve all PBS calls from a recording */
+bool backend_replay(const char *fname)
+{
+    char magic[8];
+
+    tape = gzopen(fname, "rb");
+    if (!tape) {
+        return false;
+    }
+    gzbuffer(tape, 1 << 17);
+    if (gzread(tape, magic, 8) != 8 || memcmp(magic, TAPE_MAGIC, 8)) {
+        backend_close();
+        return false;
+    }
+
+    backend = &replay_backend;
+
+    return true;
+}
+
+/*
+ * Serve the PBS calls through the daemon listening on path, if it's there
+ * and has a snapshot to serve
+ */
+bool backend_daemon(const char *path)
+{
+    struct batch_status *bs;
+    call_header_t hdr;
+
+    daemon_path = strdup(path);
+    if (!daemon_path) {
+        return false;
+    }
+    if (!daemon_call(CALL_DEFAULT, NULL, 0, &hdr, &bs) || !bs) {
+        free(daemon_path);
+        daemon_path = NULL;
+        return false;
+    }
+    replay_statfree(bs);
+
+    upstream = backend;
+    backend = &daemon_backend;
+
+    return true;
+}
+
+/*
+ * Bound the calls of the backend in effect: connecting to connect_ms, the
+ * rest to call_ms
+ */
+bool backend_guard(int connect_ms, int call_ms)
+{
+    if (backend == &guard_backend || backend == &replay_backend) {
+        // a replay takes as long as the original calls did
+        return false;
+    }
+
+    guard_connect_ms = connect_ms;
+    guard_call_ms = call_ms;
+    guarded = backend;
+    backend = &guard_backend;
+
+    return true;
+}
+
+/*
+ * While waiting for a call made by this thread (not by the workers),
+ * cancelled() is asked whether to give up
+ */
+void backend_guard_cancel(bool (*cancelled)(void))
+{
+    guard_cancel_thread = pthread_self();
+    guard_cancelled = cancelled;
+}
+
+/*
+ * The secondary server of a failover pair, from the PBS configuration (the
+ * environment, or $PBS_CONF_FILE, /etc/pbs.conf by default); NULL if none
+ */
+char *backend_secondary(void)
+{
+    const char *fname = getenv("PBS_CONF_FILE");
+    char line[512], *secondary = getenv("PBS_SECONDARY");
+    FILE *fp;
+
+    if (secondary) {
+        return *secondary ? strdup(secondary):NULL;
+    }
+
+    fp = fopen(fname ? fname:"/etc/pbs.conf", "r");
+    if (!fp) {
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, "PBS_SECONDARY=", 14)) {
+            char *value = line + 14;
+            value[strcspn(value, " \t\r\n")] = '\0';
+            if (*value) {
+                secondary = strdup(value);
+            }
+            break;
+        }
+    }
+    fclose(fp);
+
+    return secondary;
+}
+
+void backend_close(void)
+{
+    if (tape) {
+        gzclose(tape);
+        tape = NULL;
+    }
+    backend = &direct_backend;
+}
+
+/* The jobs of the last refresh, and the server status with them */
+const struct batch_status *daemon_cached(const struct batch_status **server)
+{
+    *server = daemon_server;
+
+    return daemon_jobs;
+}
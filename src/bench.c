@@ -0,0 +1,608 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * qtop-bench: times the stages of a refresh on synthetic job lists of
+ * given sizes (see synth.c) -- parsing the batch status list into jobs,
+ * sorting them, aggregating the summary, publishing them as a snapshot and
+ * opening that as a reader would -- and the memory they take.
+ * Each size is run a number of times, the best time of each stage kept,
+ * and reported as a JSON line.
+ *
+ * With -d, it instead renders the job list as qtop would, on a terminal
+ * whose output goes to a temporary file, following a script of keys
+ * (scrolling, paging, the job details, resizes, ...). Every key makes a
+ * frame, timed and with the bytes sent to the terminal counted; these are
+ * reported per key, again as JSON lines.
+ */
+
+#define _GNU_SOURCE
+
+#include <malloc.h>
+
+/* qtop itself, minus main(); not all of it is used here */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define QTOP_NO_MAIN
+#include "qtop.c"
+
+static struct batch_status *bench_status;
+
+/* pbs_selstat() returns the list made in advance, which is freed here */
+static struct batch_status *bench_selstat(int conn,
+    struct attropl *criteria, struct attrl *attribs, char *extend)
+{
+    (void) conn; (void) criteria; (void) attribs; (void) extend;
+    return bench_status;
+}
+
+static void bench_statfree(struct batch_status *bs)
+{
+    (void) bs;
+}
+
+static double bench_ms(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return 1000.0*(t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec)/1.0e6;
+}
+
+static size_t bench_heap(void)
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+typedef struct {
+    double generate;
+    double parse;
+    double sort;
+    double summary;
+    double snap_write;
+    double snap_open;
+    size_t snap_bytes;
+    size_t status_bytes;
+    size_t job_bytes;
+    int nrows;
+} bench_result_t;
+
+static bool bench_run(qtop_t *q, int n, bool all_attribs, bench_result_t *r)
+{
+    struct attrl *qattribs = all_attribs ? NULL:job_attrl_new();
+    struct timespec t0;
+    size_t heap0;
+    int i, njobs;
+
+    heap0 = bench_heap();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    bench_status = synth_jobs(n, NULL, qattribs);
+    r->generate = bench_ms(&t0);
+    r->status_bytes = bench_heap() - heap0;
+    xfree(qattribs);
+    if (!bench_status && n > 0) {
+        return false;
+    }
+
+    heap0 = bench_heap();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    job_t *jobs = qtop_server_jobs(q, &njobs, 0);
+    r->parse = bench_ms(&t0);
+    r->job_bytes = bench_heap() - heap0;
+
+    synth_statfree(bench_status);
+    bench_status = NULL;
+    if (!jobs) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    qsort(jobs, njobs, sizeof(job_t), job_comp);
+    r->sort = bench_ms(&t0);
+
+    summary_row_t *rows = malloc((njobs + 1)*sizeof(summary_row_t));
+    if (!rows) {
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r->nrows = jobs_summary(jobs, njobs, rows, njobs);
+    r->summary = bench_ms(&t0);
+    xfree(rows);
+
+    char fname[256];
+    const char *tmpdir = getenv("TMPDIR");
+    server_t pbs;
+    struct stat sb;
+    memset(&pbs, 0, sizeof(pbs));
+    snprintf(fname, sizeof(fname), "%s/qtop-bench.%d.snap",
+        tmpdir ? tmpdir:"/tmp", (int) getpid());
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    bool ok = snapshot_publish(fname, 1, &pbs, jobs, njobs);
+    r->snap_write = bench_ms(&t0);
+    ok = ok && stat(fname, &sb) == 0;
+    if (ok) {
+        r->snap_bytes = sb.st_size;
+        // up to the first value of a column
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        snapshot_t *snap = snapshot_open(fname);
+        if (snap) {
+            const uint32_t *ids = snapshot_column(snap, SNAP_ID);
+            volatile uint32_t id = njobs > 0 ? ids[njobs - 1]:0;
+            (void) id;
+        }
+        r->snap_open = bench_ms(&t0);
+        ok = snap != NULL;
+        snapshot_close(snap);
+    }
+    unlink(fname);
+    if (!ok) {
+        return false;
+    }
+
+    for (i = 0; i < njobs; i++) {
+        job_free_data(jobs + i);
+    }
+    xfree(jobs);
+
+    return true;
+}
+
+/*
+ * The keys of a render script: d/u - line down/up (in details, scroll them),
+ * D/U - page down/up, h/e - home/end, x/X - shift right/left, i - toggle
+ * the job details, s - toggle the summary, r - toggle the terminal between
+ * the given size and 80x24, c - clear and redraw everything.
+ */
+#define RENDER_SCRIPT \
+    "ddddddddddDDDDDDDDDDuuuuuUUUUUeh" \
+    "iddddduuuuuxxxxxi" "xxxxxXXXXX" "sDDs" "rDDDr" "cc"
+
+typedef struct {
+    int nframes;
+    double ms;
+    size_t bytes;
+} render_stats_t;
+
+typedef struct {
+    qtop_mode_t mode;
+    int jid_start;
+    int selpos;
+    int nsummaries;
+    unsigned int xshift;
+    unsigned int yshift;
+    unsigned int joblist_xshift;
+} render_state_t;
+
+static int render_fd = -1;
+static off_t render_offset;
+
+/*
+ * Bytes the terminal received since the last call. A file, unlike a pipe,
+ * never fills up, so there is nothing to drain while a frame is written.
+ */
+static size_t render_drain(void)
+{
+    off_t offset = lseek(render_fd, 0, SEEK_CUR);
+    size_t n = offset > render_offset ? offset - render_offset:0;
+
+    if (offset >= 0) {
+        render_offset = offset;
+    }
+
+    return n;
+}
+
+/* Act on a key of the script, as qtop would */
+static void render_key(render_state_t *rs, char key, int njobs,
+    int cols, int lines)
+{
+    int page_lines = LINES - HEADER_NROWS;
+
+    switch (key) {
+    case 'd':
+        if (rs->mode == QTOP_MODE_DETAIL) {
+            rs->yshift++;
+        } else {
+            rs->selpos++;
+        }
+        break;
+    case 'u':
+        if (rs->mode == QTOP_MODE_DETAIL) {
+            if (rs->yshift > 0) {
+                rs->yshift--;
+            }
+        } else {
+            rs->selpos--;
+        }
+        break;
+    case 'D':
+        rs->jid_start += page_lines;
+        break;
+    case 'U':
+        rs->jid_start -= page_lines;
+        break;
+    case 'h':
+        rs->jid_start = 0;
+        rs->selpos = 0;
+        break;
+    case 'e':
+        rs->jid_start = njobs - page_lines;
+        rs->selpos = page_lines - 1;
+        break;
+    case 'x':
+        if (rs->mode == QTOP_MODE_DETAIL) {
+            rs->xshift++;
+        } else {
+            rs->joblist_xshift++;
+        }
+        break;
+    case 'X':
+        if (rs->mode == QTOP_MODE_DETAIL) {
+            if (rs->xshift > 0) {
+                rs->xshift--;
+            }
+        } else
+        if (rs->joblist_xshift > 0) {
+            rs->joblist_xshift--;
+        }
+        break;
+    case 'i':
+        if (rs->mode == QTOP_MODE_JOBS) {
+            rs->mode = QTOP_MODE_DETAIL;
+        } else
+        if (rs->mode == QTOP_MODE_DETAIL) {
+            rs->mode = QTOP_MODE_JOBS;
+        }
+        break;
+    case 's':
+        if (rs->mode == QTOP_MODE_JOBS) {
+            rs->mode = QTOP_MODE_SUMMARY;
+        } else
+        if (rs->mode == QTOP_MODE_SUMMARY) {
+            rs->mode = QTOP_MODE_JOBS;
+        }
+        break;
+    case 'r':
+        if (COLS == cols && LINES == lines) {
+            resize_term(24, 80);
+        } else {
+            resize_term(lines, cols);
+        }
+        break;
+    case 'c':
+        clearok(curscr, TRUE);
+        break;
+    }
+
+    page_lines = LINES - HEADER_NROWS;
+    if (rs->selpos < 0) {
+        rs->selpos++;
+        rs->jid_start--;
+    } else
+    if (rs->selpos >= page_lines) {
+        rs->selpos--;
+        rs->jid_start++;
+    }
+    if (rs->jid_start + page_lines > njobs) {
+        rs->jid_start = njobs - page_lines;
+    }
+    if (rs->jid_start < 0) {
+        rs->jid_start = 0;
+    }
+    if (rs->selpos >= njobs - rs->jid_start) {
+        rs->selpos = njobs - rs->jid_start - 1;
+    }
+    if (rs->selpos < 0) {
+        rs->selpos = 0;
+    }
+}
+
+static void render_frame(qtop_t *q, const server_t *pbs, job_t *jobs,
+    int njobs, render_state_t *rs, bool resized)
+{
+    if (resized) {
+        delwin(q->jwin);
+        q->jwin = newwin(LINES - HEADER_NROWS, COLS, HEADER_NROWS, 0);
+    }
+
+    print_server_stats(q, pbs, stdscr, false);
+
+    switch (rs->mode) {
+    case QTOP_MODE_DETAIL:
+        print_job_details(q, get_job(jobs, njobs, rs->jid_start + rs->selpos),
+            rs->xshift, rs->yshift);
+        break;
+    case QTOP_MODE_SUMMARY:
+        if (rs->nsummaries > 0 && rs->selpos >= rs->nsummaries) {
+            rs->selpos = rs->nsummaries - 1;
+        }
+        rs->nsummaries = print_jobs_summary(jobs, njobs, stdscr, rs->selpos);
+        break;
+    default:
+        rs->xshift = 0;
+        rs->yshift = 0;
+        print_jobs(jobs + rs->jid_start, njobs - rs->jid_start, stdscr,
+            rs->selpos, rs->joblist_xshift);
+        break;
+    }
+}
+
+static bool render_run(int n, const char *script, const char *term,
+    int cols, int lines, render_stats_t *stats)
+{
+    int i, njobs;
+
+    FILE *out = tmpfile();
+    FILE *in = fopen("/dev/null", "r");
+    SCREEN *scr = out && in ? newterm(term, out, in):NULL;
+    if (!scr) {
+        return false;
+    }
+    render_fd = fileno(out);
+    render_offset = 0;
+    set_term(scr);
+    noecho();
+    curs_set(0);
+    resize_term(lines, cols);
+    if (has_colors()) {
+        init_colors();
+    }
+
+    backend_synthetic(n);
+    qtop_t *q = qtop_new(NULL);
+    server_t *pbs = pbs_server_new();
+    job_t *jobs = NULL;
+    if (q && pbs) {
+        qtop_server_update(q, pbs);
+        jobs = qtop_server_jobs(q, &njobs, 0);
+    }
+    if (!jobs) {
+        return false;
+    }
+    qsort(jobs, njobs, sizeof(job_t), job_comp);
+
+    q->jwin = newwin(LINES - HEADER_NROWS, COLS, HEADER_NROWS, 0);
+
+    render_state_t rs;
+    memset(&rs, 0, sizeof(rs));
+    rs.mode = QTOP_MODE_JOBS;
+
+    // the initial frame, a full redraw, is timed as "c"
+    const char *s = script;
+    char key = 'c';
+    while (key) {
+        struct timespec t0;
+        render_stats_t *st = stats + (unsigned char) key;
+
+        render_drain();
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        render_key(&rs, key, njobs, cols, lines);
+        render_frame(q, pbs, jobs, njobs, &rs, key == 'r');
+        st->ms += bench_ms(&t0);
+        st->bytes += render_drain();
+        st->nframes++;
+
+        key = *s++;
+    }
+
+    delwin(q->jwin);
+    q->jwin = NULL;
+    endwin();
+    delscreen(scr);
+    fclose(out);
+    fclose(in);
+    render_fd = -1;
+
+    for (i = 0; i < njobs; i++) {
+        job_free_data(jobs + i);
+    }
+    xfree(jobs);
+    pbs_server_free(pbs);
+    qtop_free(q);
+
+    return true;
+}
+
+static void bench_usage(const char *arg0, FILE *out)
+{
+    fprintf(out, "Usage: %s [options]\n", arg0);
+    fprintf(out, "Available options:\n");
+    fprintf(out, "  -n <sizes>    comma-separated numbers of jobs [1000,10000,100000,500000]\n");
+    fprintf(out, "  -r <repeats>  runs per size, the best of which is reported (with -d,\n");
+    fprintf(out, "                the average) [3]\n");
+    fprintf(out, "  -a            return all job attributes, not only those asked for\n");
+    fprintf(out, "  -d            benchmark rendering instead\n");
+    fprintf(out, "  -k <keys>     with -d, the script of keys to render frames for [%s]\n",
+        RENDER_SCRIPT);
+    fprintf(out, "  -g <COLSxLINES> with -d, the terminal size [200x60]\n");
+    fprintf(out, "  -T <term>     with -d, the terminal type [xterm-256color]\n");
+    fprintf(out, "  -h            print this help\n");
+}
+
+int main(int argc, char * const argv[])
+{
+    char *sizes = "1000,10000,100000,500000";
+    char *script = RENDER_SCRIPT, *term = "xterm-256color";
+    bool all_attribs = false, render = false;
+    int opt, repeats = 3, cols = 200, lines = 60;
+
+    while ((opt = getopt(argc, argv, "n:r:adk:g:T:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            sizes = optarg;
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            if (repeats < 1) {
+                bench_usage(argv[0], stderr);
+                exit(1);
+            }
+            break;
+        case 'a':
+            all_attribs = true;
+            break;
+        case 'd':
+            render = true;
+            break;
+        case 'k':
+            script = optarg;
+            break;
+        case 'g':
+            if (sscanf(optarg, "%dx%d", &cols, &lines) != 2 ||
+                cols < 20 || lines < HEADER_NROWS + 1) {
+                bench_usage(argv[0], stderr);
+                exit(1);
+            }
+            break;
+        case 'T':
+            term = optarg;
+            break;
+        case 'h':
+            bench_usage(argv[0], stdout);
+            exit(0);
+            break;
+        default:
+            bench_usage(argv[0], stderr);
+            exit(1);
+            break;
+        }
+    }
+
+    if (render) {
+        char *s = sizes;
+        while (*s) {
+            static render_stats_t stats[256];
+            char *end;
+            long n = strtol(s, &end, 10);
+            int i;
+
+            if (end == s || n < 0 || n > INT32_MAX) {
+                bench_usage(argv[0], stderr);
+                exit(1);
+            }
+            s = *end == ',' ? end + 1:end;
+
+            memset(stats, 0, sizeof(stats));
+            for (i = 0; i < repeats; i++) {
+                if (!render_run(n, script, term, cols, lines, stats)) {
+                    fprintf(stderr, "Failed rendering %ld jobs on %s\n",
+                        n, term);
+                    exit(1);
+                }
+            }
+
+            render_stats_t all;
+            memset(&all, 0, sizeof(all));
+            for (i = 0; i < 256; i++) {
+                const render_stats_t *st = stats + i;
+                if (st->nframes == 0) {
+                    continue;
+                }
+                printf("{\"njobs\":%ld,\"size\":\"%dx%d\",\"key\":\"%c\","
+                    "\"frames\":%d,\"ms_per_frame\":%.3f,"
+                    "\"bytes_per_frame\":%.0f}\n", n, cols, lines, i,
+                    st->nframes, st->ms/st->nframes,
+                    (double) st->bytes/st->nframes);
+                all.nframes += st->nframes;
+                all.ms      += st->ms;
+                all.bytes   += st->bytes;
+            }
+            printf("{\"njobs\":%ld,\"size\":\"%dx%d\",\"key\":\"all\","
+                "\"frames\":%d,\"ms_per_frame\":%.3f,"
+                "\"bytes_per_frame\":%.0f}\n", n, cols, lines,
+                all.nframes, all.ms/all.nframes,
+                (double) all.bytes/all.nframes);
+            fflush(stdout);
+        }
+
+        backend_close();
+        exit(0);
+    }
+
+    static pbs_backend_t bench_backend;
+    backend_synthetic(0);
+    bench_backend = *backend;
+    bench_backend.name     = "bench";
+    bench_backend.selstat  = bench_selstat;
+    bench_backend.statfree = bench_statfree;
+    backend = &bench_backend;
+
+    qtop_t *q = qtop_new(NULL);
+    if (!q) {
+        fprintf(stderr, "Failed setting up the session\n");
+        exit(1);
+    }
+
+    char *s = sizes;
+    while (*s) {
+        char *end;
+        long n = strtol(s, &end, 10);
+        bench_result_t best, r;
+        int i;
+
+        if (end == s || n < 0 || n > INT32_MAX) {
+            bench_usage(argv[0], stderr);
+            exit(1);
+        }
+        s = *end == ',' ? end + 1:end;
+
+        memset(&best, 0, sizeof(best));
+        for (i = 0; i < repeats; i++) {
+            if (!bench_run(q, n, all_attribs, &r)) {
+                fprintf(stderr, "Failed running %ld jobs\n", n);
+                exit(1);
+            }
+            if (i == 0) {
+                best = r;
+            } else {
+                best.generate = fmin(best.generate, r.generate);
+                best.parse    = fmin(best.parse, r.parse);
+                best.sort     = fmin(best.sort, r.sort);
+                best.summary  = fmin(best.summary, r.summary);
+                best.snap_write = fmin(best.snap_write, r.snap_write);
+                best.snap_open  = fmin(best.snap_open, r.snap_open);
+            }
+        }
+
+        double per_job = n > 0 ? 1.0/n:0;
+        printf("{\"njobs\":%ld,\"repeats\":%d,\"all_attribs\":%s,"
+            "\"generate_ms\":%.3f,\"parse_ms\":%.3f,\"sort_ms\":%.3f,"
+            "\"summary_ms\":%.3f,\"summary_rows\":%d,"
+            "\"parse_ns_per_job\":%.1f,\"status_bytes_per_job\":%.0f,"
+            "\"job_bytes_per_job\":%.0f,\"snap_write_ms\":%.3f,"
+            "\"snap_open_us\":%.1f,\"snap_bytes_per_job\":%.0f}\n",
+            n, repeats, all_attribs ? "true":"false",
+            best.generate, best.parse, best.sort, best.summary, best.nrows,
+            1.0e6*best.parse*per_job, best.status_bytes*per_job,
+            best.job_bytes*per_job, best.snap_write, 1000*best.snap_open,
+            best.snap_bytes*per_job);
+        fflush(stdout);
+    }
+
+    qtop_free(q);
+
+    exit(0);
+}
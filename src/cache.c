@@ -0,0 +1,364 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Per-user cache of finished jobs, one file per server. It is a gzip'ed
+ * stream of a header, followed by fixed-layout records, each trailed by
+ * its strings. The layout is native; a version or size mismatch simply
+ * invalidates the cache.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+
+#include <pbs_ifl.h>
+
+#include <ncurses.h>
+#include <zlib.h>
+
+#include "qtop.h"
+
+#define CACHE_MAGIC     "QTOPHIST"
+#define CACHE_VERSION   2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t nrecords;
+    uint32_t filter_len;
+    int64_t watermark;
+    int64_t since;
+} cache_header_t;
+
+#define CACHE_NOSTRING  0xffff
+
+void job_to_record(const job_t *job, job_record_t *rec)
+{
+    memset(rec, 0, sizeof(job_record_t));
+    rec->id          = job->id;
+    rec->aid         = job->aid;
+    rec->state       = job->state;
+    rec->is_array    = job->is_array;
+    rec->exit_status = job->exit_status;
+    rec->ncpus_r     = job->ncpus_r;
+    rec->nodect_r    = job->nodect_r;
+    rec->ncpus_u     = job->ncpus_u;
+    rec->mem_r       = job->mem_r;
+    rec->vmem_r      = job->vmem_r;
+    rec->cput_r      = job->cput_r;
+    rec->walltime_r  = job->walltime_r;
+    rec->mem_u       = job->mem_u;
+    rec->vmem_u      = job->vmem_u;
+    rec->cput_u      = job->cput_u;
+    rec->walltime_u  = job->walltime_u;
+    rec->history_ts  = job->history_ts;
+    rec->qtime       = job->qtime;
+    rec->stime       = job->stime;
+    rec->io_r        = job->io_r;
+    rec->cpupercent  = job->cpupercent;
+}
+
+void job_from_record(job_t *job, const job_record_t *rec)
+{
+    job->id          = rec->id;
+    job->aid         = rec->aid;
+    job->state       = rec->state;
+    job->is_array    = rec->is_array;
+    job->exit_status = rec->exit_status;
+    job->ncpus_r     = rec->ncpus_r;
+    job->nodect_r    = rec->nodect_r;
+    job->ncpus_u     = rec->ncpus_u;
+    job->mem_r       = rec->mem_r;
+    job->vmem_r      = rec->vmem_r;
+    job->cput_r      = rec->cput_r;
+    job->walltime_r  = rec->walltime_r;
+    job->mem_u       = rec->mem_u;
+    job->vmem_u      = rec->vmem_u;
+    job->cput_u      = rec->cput_u;
+    job->walltime_u  = rec->walltime_u;
+    job->history_ts  = rec->history_ts;
+    job->qtime       = rec->qtime;
+    job->stime       = rec->stime;
+    job->io_r        = rec->io_r;
+    job->cpupercent  = rec->cpupercent;
+}
+
+/* $XDG_CACHE_HOME/qtop or ~/.cache/qtop, created if needed */
+bool qtop_cache_dir(char *buf, size_t bufsize)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+
+    if (base && base[0] == '/') {
+        mkdir(base, 0700);
+        snprintf(buf, bufsize, "%s/qtop", base);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home) {
+            return false;
+        }
+        snprintf(buf, bufsize, "%s/.cache", home);
+        mkdir(buf, 0700);
+        snprintf(buf, bufsize, "%s/.cache/qtop", home);
+    }
+    mkdir(buf, 0700);
+
+    return true;
+}
+
+static bool cache_path(const qtop_t *q, char *buf, size_t bufsize)
+{
+    char dir[1024];
+
+    if (!qtop_cache_dir(dir, 1024)) {
+        return false;
+    }
+
+    if (snprintf(buf, bufsize, "%s/%s.hist", dir, q->servername) >=
+        (int) bufsize) {
+        return false;
+    }
+
+    return true;
+}
+
+/* The filters the history was collected with */
+static void cache_filter(const qtop_t *q, char *buf, size_t bufsize)
+{
+    snprintf(buf, bufsize, "u=%s q=%s s=%s e=%s F=%d S=%d",
+        q->username ? q->username:"",
+        q->queue ? q->queue:"",
+        q->state ? q->state:"",
+        q->exec_host ? q->exec_host:"",
+        q->failed, q->subjobs);
+}
+
+static bool write_string(gzFile gz, const char *str)
+{
+    size_t len = str ? strlen(str):CACHE_NOSTRING;
+    uint16_t len16;
+
+    if (len >= CACHE_NOSTRING && str) {
+        len = CACHE_NOSTRING - 1;
+    }
+    len16 = len;
+    if (gzwrite(gz, &len16, sizeof(len16)) != sizeof(len16)) {
+        return false;
+    }
+    if (str && len > 0 && gzwrite(gz, str, len) != (int) len) {
+        return false;
+    }
+
+    return true;
+}
+
+static bool read_string(gzFile gz, char **str)
+{
+    uint16_t len16;
+
+    *str = NULL;
+    if (gzread(gz, &len16, sizeof(len16)) != sizeof(len16)) {
+        return false;
+    }
+    if (len16 == CACHE_NOSTRING) {
+        return true;
+    }
+
+    *str = malloc(len16 + 1);
+    if (!*str) {
+        return false;
+    }
+    if (len16 > 0 && gzread(gz, *str, len16) != len16) {
+        free(*str);
+        *str = NULL;
+        return false;
+    }
+    (*str)[len16] = '\0';
+
+    return true;
+}
+
+bool qtop_history_save(const qtop_t *q)
+{
+    char path[1024], tmppath[1100], filter[1024];
+    cache_header_t hdr;
+    int i;
+
+    if (!cache_path(q, path, 1024)) {
+        return false;
+    }
+    snprintf(tmppath, 1100, "%s.%d", path, (int) getpid());
+
+    gzFile gz = gzopen(tmppath, "wb1");
+    if (!gz) {
+        return false;
+    }
+
+    cache_filter(q, filter, 1024);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CACHE_MAGIC, 8);
+    hdr.version     = CACHE_VERSION;
+    hdr.record_size = sizeof(job_record_t);
+    hdr.nrecords    = q->nhistory;
+    hdr.filter_len  = strlen(filter);
+    hdr.watermark   = q->history_watermark;
+    hdr.since       = q->history_since;
+
+    bool ok = gzwrite(gz, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        gzwrite(gz, filter, hdr.filter_len) == (int) hdr.filter_len;
+
+    for (i = 0; ok && i < q->nhistory; i++) {
+        const job_t *job = q->history + i;
+        job_record_t rec;
+
+        job_to_record(job, &rec);
+
+        ok = gzwrite(gz, &rec, sizeof(rec)) == sizeof(rec) &&
+            write_string(gz, job->name) &&
+            write_string(gz, job->queue) &&
+            write_string(gz, job->user) &&
+            write_string(gz, job->exec_host) &&
+            write_string(gz, job->depend);
+    }
+
+    if (gzclose(gz) != Z_OK) {
+        ok = false;
+    }
+
+    if (ok) {
+        ok = rename(tmppath, path) == 0;
+    }
+    if (!ok) {
+        unlink(tmppath);
+    }
+
+    return ok;
+}
+
+/*
+ * Load the cached history, unless it was collected with other filters or
+ * doesn't cover the whole history span.
+ */
+bool qtop_history_load(qtop_t *q)
+{
+    char path[1024], filter[1024], cfilter[1024];
+    cache_header_t hdr;
+    unsigned int i;
+
+    if (!cache_path(q, path, 1024)) {
+        return false;
+    }
+
+    gzFile gz = gzopen(path, "rb");
+    if (!gz) {
+        return false;
+    }
+    gzbuffer(gz, 1 << 17);
+
+    cache_filter(q, filter, 1024);
+    long cutoff = time(NULL) - 3600*q->history_span;
+
+    if (gzread(gz, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, CACHE_MAGIC, 8) ||
+        hdr.version != CACHE_VERSION ||
+        hdr.record_size != sizeof(job_record_t) ||
+        hdr.filter_len >= 1024 ||
+        gzread(gz, cfilter, hdr.filter_len) != (int) hdr.filter_len ||
+        hdr.since > cutoff) {
+        gzclose(gz);
+        return false;
+    }
+    cfilter[hdr.filter_len] = '\0';
+    if (strcmp(filter, cfilter)) {
+        gzclose(gz);
+        return false;
+    }
+
+    job_t *history = calloc(hdr.nrecords + 1, sizeof(job_t));
+    if (!history) {
+        gzclose(gz);
+        return false;
+    }
+
+    int n = 0;
+    bool ok = true;
+    for (i = 0; ok && i < hdr.nrecords; i++) {
+        job_t *job = history + n;
+        job_record_t rec;
+
+        if (gzread(gz, &rec, sizeof(rec)) != sizeof(rec)) {
+            ok = false;
+            break;
+        }
+
+        job_from_record(job, &rec);
+
+        ok = read_string(gz, &job->name) &&
+            read_string(gz, &job->queue) &&
+            read_string(gz, &job->user) &&
+            read_string(gz, &job->exec_host) &&
+            read_string(gz, &job->depend);
+
+        // skip what has already expired, but keep the order
+        if (ok && job->history_ts < cutoff) {
+            free(job->name);
+            free(job->queue);
+            free(job->user);
+            free(job->exec_host);
+            free(job->depend);
+            memset(job, 0, sizeof(job_t));
+        } else {
+            n++;
+        }
+    }
+
+    gzclose(gz);
+
+    if (!ok) {
+        // the last, partially read record included
+        for (i = 0; i <= (unsigned int) n && i < hdr.nrecords; i++) {
+            free(history[i].name);
+            free(history[i].queue);
+            free(history[i].user);
+            free(history[i].exec_host);
+            free(history[i].depend);
+        }
+        free(history);
+        return false;
+    }
+
+    q->history           = history;
+    q->nhistory          = n;
+    q->history_size      = hdr.nrecords + 1;
+    q->history_watermark = hdr.watermark;
+    q->history_since     = hdr.since;
+
+    return true;
+}
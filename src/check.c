@@ -0,0 +1,424 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * qtop-check: regression checks of qtop against a scripted synthetic
+ * server (see synth.c). Each check prints a line "ok" or "FAIL" and the
+ * exit status is that of them all; run by ctest.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+
+/* qtop itself, minus main(); not all of it is used here */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define QTOP_NO_MAIN
+#include "qtop.c"
+
+/* the jobs the next pbs_selstat() returns */
+static int check_njobs;
+
+/* while set, pbs_selstat() hangs */
+static bool check_stuck;
+/* the connections made so far, and the last one disconnected */
+static int check_nconns;
+static int check_disconnected;
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t check_cond = PTHREAD_COND_INITIALIZER;
+
+/* A new handle each time, as a server does */
+static int check_connect(const char *server)
+{
+    (void) server;
+
+    pthread_mutex_lock(&check_lock);
+    int conn = ++check_nconns;
+    pthread_mutex_unlock(&check_lock);
+
+    return conn;
+}
+
+static int check_disconnect(int conn)
+{
+    pthread_mutex_lock(&check_lock);
+    check_disconnected = conn;
+    pthread_mutex_unlock(&check_lock);
+
+    return 0;
+}
+
+static struct batch_status *check_selstat(int conn,
+    struct attropl *criteria, struct attrl *attribs, char *extend)
+{
+    (void) conn; (void) extend;
+
+    pthread_mutex_lock(&check_lock);
+    while (check_stuck) {
+        pthread_cond_wait(&check_cond, &check_lock);
+    }
+    pthread_mutex_unlock(&check_lock);
+
+    pbs_errno = PBSE_NONE;
+    if (check_njobs == 0) {
+        return NULL;
+    }
+    return synth_jobs(check_njobs, criteria, attribs);
+}
+
+static int check_ndeleted;
+
+static void check_sink(const event_t *e, void *data)
+{
+    (void) data;
+    if (e->kind == EVENT_DELETED) {
+        check_ndeleted++;
+    }
+}
+
+/* The watch mode reports the last job leaving as it does any other */
+static bool check_watch_last_gone(qtop_t *q, server_t *pbs)
+{
+    events_t ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.mem_high = EVENTS_MEM_HIGH;
+    ev.sink = check_sink;
+    check_ndeleted = 0;
+
+    check_njobs = 1;
+    qtop_watch_refresh(q, pbs, &ev, NULL);
+    check_njobs = 0;
+    qtop_watch_refresh(q, pbs, &ev, NULL);
+
+    bool ok = check_ndeleted == 1 && ev.ntraces == 0;
+    events_free(&ev);
+    return ok;
+}
+
+/* The metrics have a series per label set, subjobs and all */
+static bool check_metrics_unique(qtop_t *q, server_t *pbs)
+{
+    // the subjobs of an array go by index, whatever the state
+    job_t jobs[] = {
+        {.id = 10, .user = "alice", .queue = "workq", .is_array = true,
+            .aid = 1, .state = JOB_RUNNING},
+        {.id = 10, .user = "alice", .queue = "workq", .is_array = true,
+            .aid = 2, .state = JOB_QUEUED},
+        {.id = 10, .user = "alice", .queue = "workq", .is_array = true,
+            .aid = 3, .state = JOB_RUNNING},
+        {.id = 11, .user = "alice", .queue = "workq", .state = JOB_RUNNING},
+        {.id = 12, .user = "bob", .queue = "workq", .is_array = true,
+            .aid = 1, .state = JOB_QUEUED},
+        {.id = 12, .user = "bob", .queue = "workq", .is_array = true,
+            .aid = 2, .state = JOB_RUNNING}
+    };
+    int njobs = sizeof(jobs)/sizeof(job_t), nseries = 0, total = 0;
+    char *series[16];
+    size_t len;
+    bool ok = true;
+
+    qsort(jobs, njobs, sizeof(job_t), job_comp);
+    char *body = qtop_metrics(q, pbs, jobs, njobs, 0, &len);
+    if (!body) {
+        return false;
+    }
+
+    char *line, *save = NULL;
+    for (line = strtok_r(body, "\n", &save); line;
+        line = strtok_r(NULL, "\n", &save)) {
+        int i;
+        if (strncmp(line, "qtop_jobs{", 10)) {
+            continue;
+        }
+        char *value = strchr(line, '}');
+        *value++ = '\0';
+        for (i = 0; i < nseries; i++) {
+            if (!strcmp(series[i], line)) {
+                ok = false;
+            }
+        }
+        if (nseries < 16) {
+            series[nseries++] = line;
+        }
+        total += atoi(value);
+    }
+    free(body);
+
+    // alice's R and Q, bob's Q and R
+    return ok && nseries == 4 && total == njobs;
+}
+
+/*
+ * The bytes qtopd answers a request with, of the header and, if len > 0, a
+ * status of a name len long
+ */
+static ssize_t check_daemon_reply(uint32_t call, uint32_t len)
+{
+    // as call_header_t of backend.c
+    struct {
+        uint32_t call;
+        int32_t rc;
+        int32_t err;
+        uint32_t nstatus;
+        int64_t duration;
+    } hdr;
+    uint32_t nostring = 0xffffffff, nattribs = 0;
+    char *name = calloc(1, len + 1), buf[256];
+    ssize_t n = -1;
+    int fds[2];
+
+    if (!name || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        free(name);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.call = call;
+    hdr.nstatus = len > 0;
+    memset(name, 'x', len);
+    if (write(fds[0], &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        (len == 0 || (write(fds[0], &len, sizeof(len)) == sizeof(len) &&
+        write(fds[0], name, len) == (ssize_t) len &&
+        write(fds[0], &nostring, sizeof(nostring)) == sizeof(nostring) &&
+        write(fds[0], &nattribs, sizeof(nattribs)) == sizeof(nattribs)))) {
+        shutdown(fds[0], SHUT_WR);
+        daemon_answer(fds[1], NULL);
+        close(fds[1]);
+        fds[1] = -1;
+        n = read(fds[0], buf, sizeof(buf));
+        // dropped, with some of the request unread
+        if (n < 0 && errno == ECONNRESET) {
+            n = 0;
+        }
+    }
+    close(fds[0]);
+    if (fds[1] >= 0) {
+        close(fds[1]);
+    }
+    free(name);
+
+    return n;
+}
+
+/* qtopd drops a client whose request is out of bounds, unanswered */
+static bool check_daemon_caps(qtop_t *q, server_t *pbs)
+{
+    (void) q; (void) pbs;
+
+    // CALL_STATSERVER is answered (with an error, there's no snapshot)...
+    if (check_daemon_reply(4, 16) <= 0) {
+        return false;
+    }
+    // ... unless its argument is too long
+    return check_daemon_reply(4, 8192) == 0;
+}
+
+/*
+ * A call timed out gives up its connection, which is disconnected when the
+ * call is back, after the session has reconnected
+ */
+static bool check_guard_stuck(qtop_t *q, server_t *pbs)
+{
+    const pbs_backend_t *unguarded = backend;
+    struct batch_status *bs;
+    int i;
+
+    (void) q; (void) pbs;
+
+    if (!backend_guard(1000, 100)) {
+        return false;
+    }
+    int conn = backend->connect("check");
+    check_stuck = true;
+    bs = backend->selstat(conn, NULL, NULL, NULL);
+    bool ok = !bs && pbs_errno == PBSE_EXPIRED;
+    backend->disconnect(conn);
+    int newconn = backend->connect("check");
+    ok = ok && newconn > 0 && newconn != conn && check_disconnected != conn;
+
+    pthread_mutex_lock(&check_lock);
+    check_stuck = false;
+    pthread_cond_broadcast(&check_cond);
+    pthread_mutex_unlock(&check_lock);
+    for (i = 0; i < 100; i++) {
+        pthread_mutex_lock(&check_lock);
+        bool back = check_disconnected == conn;
+        pthread_mutex_unlock(&check_lock);
+        if (back) {
+            break;
+        }
+        usleep(10000);
+    }
+    ok = ok && i < 100;
+
+    // the new connection is unaffected
+    check_njobs = 1;
+    bs = backend->selstat(newconn, NULL, NULL, NULL);
+    ok = ok && bs;
+    if (bs) {
+        backend->statfree(bs);
+    }
+    backend->disconnect(newconn);
+
+    backend = unguarded;
+    return ok;
+}
+
+/* A dependency declared at both ends is one edge */
+static bool check_depend_dedupe(qtop_t *q, server_t *pbs)
+{
+    job_t jobs[] = {
+        {.id = 1, .depend = "beforeok:2.srv:3.srv"},
+        {.id = 2, .depend = "afterok:1.srv"},
+        {.id = 3, .depend = "afterok:1.srv,afterany:1.srv"}
+    };
+    depindex_t di;
+
+    (void) q; (void) pbs;
+
+    memset(&di, 0, sizeof(di));
+    depindex_build(&di, jobs, 3);
+    bool ok = di.njobs == 3 &&
+        di.down_start[1] - di.down_start[0] == 2 &&
+        di.up_start[2] - di.up_start[1] == 1 &&
+        di.up_start[3] - di.up_start[2] == 1;
+    depindex_free(&di);
+
+    return ok;
+}
+
+/* A table written by snapshot_publish() reads back as it was */
+static bool check_snapshot_roundtrip(qtop_t *q, server_t *pbs)
+{
+    job_t jobs[] = {
+        {.id = 11, .state = 'R', .name = "a", .user = "alice",
+         .queue = "short", .exec_host = "n1/0*4", .ncpus_r = 4,
+         .mem_r = 1L << 32, .walltime_u = 90},
+        {.id = 12, .state = 'Q', .name = "b", .user = "alice",
+         .queue = "short", .exec_host = NULL, .ncpus_r = 1},
+        {.id = 13, .aid = 7, .state = 'H', .is_array = true, .name = "c",
+         .user = "bob", .queue = "long", .exec_host = NULL}
+    };
+    int njobs = sizeof(jobs)/sizeof(job_t);
+    char fname[64];
+    server_t spbs;
+    int i, n;
+
+    (void) q;
+
+    snprintf(fname, sizeof(fname), "/tmp/qtop-check-%d.snap", (int) getpid());
+    if (!snapshot_publish(fname, 1, pbs, jobs, njobs)) {
+        return false;
+    }
+
+    snapshot_t *snap = snapshot_open(fname);
+    if (!snap) {
+        unlink(fname);
+        return false;
+    }
+    // users and queues are stored once
+    const uint32_t *user = snapshot_column(snap, SNAP_USER);
+    const uint32_t *queue = snapshot_column(snap, SNAP_QUEUE);
+    bool ok = snapshot_header(snap)->njobs == (uint64_t) njobs &&
+        user[0] == user[1] && user[0] != user[2] &&
+        queue[0] == queue[1] && queue[0] != queue[2];
+
+    memset(&spbs, 0, sizeof(spbs));
+    job_t *rjobs = snapshot_jobs(snap, &spbs, &n);
+    ok = ok && rjobs && n == njobs;
+    for (i = 0; ok && i < n; i++) {
+        const job_t *a = jobs + i, *b = rjobs + i;
+        ok = a->id == b->id && a->aid == b->aid && a->state == b->state &&
+            a->is_array == b->is_array && a->ncpus_r == b->ncpus_r &&
+            a->mem_r == b->mem_r && a->walltime_u == b->walltime_u &&
+            !strcmp(a->name, b->name) && !strcmp(a->user, b->user) &&
+            !strcmp(a->queue, b->queue) &&
+            (a->exec_host ? b->exec_host && !strcmp(a->exec_host,
+                                                    b->exec_host):
+                            !b->exec_host);
+    }
+    if (rjobs) {
+        for (i = 0; i < n; i++) {
+            job_free_data(rjobs + i);
+        }
+        free(rjobs);
+    }
+    snapshot_close(snap);
+
+    // a short file is not a snapshot
+    struct stat sb;
+    ok = ok && stat(fname, &sb) == 0 && truncate(fname, sb.st_size - 8) == 0 &&
+        !(snap = snapshot_open(fname));
+    snapshot_close(snap);
+    unlink(fname);
+
+    return ok;
+}
+
+typedef struct {
+    const char *name;
+    bool (*run)(qtop_t *q, server_t *pbs);
+} check_t;
+
+static const check_t checks[] = {
+    {"watch_last_gone", check_watch_last_gone},
+    {"metrics_unique", check_metrics_unique},
+    {"daemon_caps", check_daemon_caps},
+    {"guard_stuck", check_guard_stuck},
+    {"depend_dedupe", check_depend_dedupe},
+    {"snapshot_roundtrip", check_snapshot_roundtrip}
+};
+
+int main(void)
+{
+    static pbs_backend_t check_backend;
+    unsigned int i;
+    int nfailed = 0;
+
+    backend_synthetic(0);
+    check_backend = *backend;
+    check_backend.name       = "check";
+    check_backend.connect    = check_connect;
+    check_backend.disconnect = check_disconnect;
+    check_backend.selstat    = check_selstat;
+    backend = &check_backend;
+
+    qtop_t *q = qtop_new(NULL);
+    server_t *pbs = pbs_server_new();
+    if (!q || !pbs) {
+        fprintf(stderr, "Failed setting up the session\n");
+        exit(1);
+    }
+    sched_t sched;
+    sched_init(&sched, 1, false, false);
+    q->sched = &sched;
+
+    for (i = 0; i < sizeof(checks)/sizeof(check_t); i++) {
+        bool ok = checks[i].run(q, pbs);
+        printf("%s %s\n", ok ? "ok":"FAIL", checks[i].name);
+        if (!ok) {
+            nfailed++;
+        }
+    }
+
+    qtop_free(q);
+    backend_close();
+    exit(nfailed ? 1:0);
+}
@@ -0,0 +1,274 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Formatting of the batch mode output into a fixed buffer, flushed to the
+ * stream as it fills up. Numbers are converted by hand, with no locale,
+ * format string parsing or allocations involved, so that dumping a large
+ * job list costs little more than copying its strings.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <stdbool.h>
+
+#include <pbs_ifl.h>
+
+#include <ncurses.h>
+
+#include "qtop.h"
+
+void outbuf_init(outbuf_t *ob, FILE *out)
+{
+    ob->out = out;
+    ob->len = 0;
+}
+
+void outbuf_flush(outbuf_t *ob)
+{
+    if (ob->len > 0) {
+        fwrite(ob->buf, 1, ob->len, ob->out);
+        ob->len = 0;
+    }
+    fflush(ob->out);
+}
+
+void out_mem(outbuf_t *ob, const char *s, size_t len)
+{
+    if (ob->len + len > OUTBUF_SIZE) {
+        fwrite(ob->buf, 1, ob->len, ob->out);
+        ob->len = 0;
+        if (len > OUTBUF_SIZE) {
+            fwrite(s, 1, len, ob->out);
+            return;
+        }
+    }
+    memcpy(ob->buf + ob->len, s, len);
+    ob->len += len;
+}
+
+void out_char(outbuf_t *ob, char c)
+{
+    if (ob->len == OUTBUF_SIZE) {
+        fwrite(ob->buf, 1, ob->len, ob->out);
+        ob->len = 0;
+    }
+    ob->buf[ob->len++] = c;
+}
+
+void out_str(outbuf_t *ob, const char *s)
+{
+    if (s) {
+        out_mem(ob, s, strlen(s));
+    }
+}
+
+void out_pad(outbuf_t *ob, int n)
+{
+    while (n-- > 0) {
+        out_char(ob, ' ');
+    }
+}
+
+/* s, right-aligned (or left, if width < 0) in a field of |width| */
+void out_field(outbuf_t *ob, const char *s, size_t len, int width)
+{
+    int pad = abs(width) - (int) len;
+
+    if (width > 0) {
+        out_pad(ob, pad);
+    }
+    out_mem(ob, s, len);
+    if (width < 0) {
+        out_pad(ob, pad);
+    }
+}
+
+/* Decimal digits of v into buf, returning their number */
+int fmt_long(char buf[24], long v)
+{
+    char tmp[24];
+    unsigned long u = v < 0 ? -(unsigned long) v:(unsigned long) v;
+    int n = 0, len = 0;
+
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    if (v < 0) {
+        buf[len++] = '-';
+    }
+    while (n > 0) {
+        buf[len++] = tmp[--n];
+    }
+
+    return len;
+}
+
+/* v with the given (up to 6) decimals, rounded; non-finite values as 0 */
+int fmt_fixed(char buf[32], double v, int decimals)
+{
+    static const long scales[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+    int len = 0, i;
+
+    if (!isfinite(v) || fabs(v) > 1e12) {
+        v = 0;
+    }
+    if (decimals < 0) {
+        decimals = 0;
+    } else
+    if (decimals > 6) {
+        decimals = 6;
+    }
+
+    long scaled = lround(fabs(v)*scales[decimals]);
+    if (v < 0 && scaled > 0) {
+        buf[len++] = '-';
+    }
+    len += fmt_long(buf + len, scaled/scales[decimals]);
+    if (decimals > 0) {
+        long frac = scaled % scales[decimals];
+        buf[len++] = '.';
+        for (i = decimals - 1; i >= 0; i--) {
+            buf[len + i] = '0' + frac % 10;
+            frac /= 10;
+        }
+        len += decimals;
+    }
+
+    return len;
+}
+
+/* HH:MM:SS, with as many hour digits as needed */
+int fmt_hms(char buf[32], long secs)
+{
+    int len;
+
+    if (secs < 0) {
+        secs = 0;
+    }
+    if (secs < 36000) {
+        buf[0] = '0';
+        len = 1 + fmt_long(buf + 1, secs/3600);
+    } else {
+        len = fmt_long(buf, secs/3600);
+    }
+    buf[len++] = ':';
+    buf[len++] = '0' + (secs/600) % 6;
+    buf[len++] = '0' + (secs/60) % 10;
+    buf[len++] = ':';
+    buf[len++] = '0' + (secs % 60)/10;
+    buf[len++] = '0' + secs % 10;
+
+    return len;
+}
+
+void out_long(outbuf_t *ob, long v, int width)
+{
+    char buf[24];
+    out_field(ob, buf, fmt_long(buf, v), width);
+}
+
+void out_fixed(outbuf_t *ob, double v, int decimals, int width)
+{
+    char buf[32];
+    out_field(ob, buf, fmt_fixed(buf, v, decimals), width);
+}
+
+void out_hms(outbuf_t *ob, long secs, int width)
+{
+    char buf[32];
+    out_field(ob, buf, fmt_hms(buf, secs), width);
+}
+
+/* A CSV field, quoted only if needed */
+void out_csv_str(outbuf_t *ob, const char *s)
+{
+    const char *p;
+
+    if (!s) {
+        return;
+    }
+    if (!strpbrk(s, ",\"\r\n")) {
+        out_str(ob, s);
+        return;
+    }
+
+    out_char(ob, '"');
+    for (p = s; *p; p++) {
+        if (*p == '"') {
+            out_char(ob, '"');
+        }
+        out_char(ob, *p);
+    }
+    out_char(ob, '"');
+}
+
+/* A JSON string, or null */
+void out_json_str(outbuf_t *ob, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p;
+
+    if (!s) {
+        out_mem(ob, "null", 4);
+        return;
+    }
+
+    out_char(ob, '"');
+    for (p = (const unsigned char *) s; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            out_char(ob, '\\');
+            out_char(ob, *p);
+        } else
+        if (*p < 0x20) {
+            out_mem(ob, "\\u00", 4);
+            out_char(ob, hex[*p >> 4]);
+            out_char(ob, hex[*p & 0xf]);
+        } else {
+            out_char(ob, *p);
+        }
+    }
+    out_char(ob, '"');
+}
+
+/* A Prometheus label value, quoted */
+void out_prom_label(outbuf_t *ob, const char *s)
+{
+    out_char(ob, '"');
+    for (; s && *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            out_char(ob, '\\');
+            out_char(ob, *s);
+        } else
+        if (*s == '\n') {
+            out_mem(ob, "\\n", 2);
+        } else {
+            out_char(ob, *s);
+        }
+    }
+    out_char(ob, '"');
+}
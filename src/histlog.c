@@ -0,0 +1,852 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Append-only log of job tables, one frame per refresh. A frame is either
+ * a keyframe, holding the whole table, or a delta against the previous
+ * frame, holding the keys of the removed jobs and the records of the new
+ * or changed ones. Each frame is deflated separately. Every frame's time
+ * and offset also go to a sidecar index (<log>.idx), so seeking costs a
+ * binary search, a keyframe, and at most HISTLOG_KEYFRAME_INTERVAL - 1
+ * deltas.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+
+#include <pbs_ifl.h>
+
+#include <ncurses.h>
+#include <zlib.h>
+
+#include "qtop.h"
+
+#define HISTLOG_MAGIC               "QTOPLOG2"
+#define HISTLOG_FRAME_MAGIC         0x52465451  /* "QTFR" */
+#define HISTLOG_KEYFRAME_INTERVAL   32
+
+#define FRAME_KEY   1
+#define FRAME_DELTA 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    int64_t stamp;
+    uint32_t zlen;
+    uint32_t rawlen;
+} frame_header_t;
+
+typedef struct {
+    int64_t stamp;
+    int64_t offset;
+    uint32_t type;
+    uint32_t pad;
+} index_entry_t;
+
+typedef struct {
+    uint32_t total_jobs;
+    uint32_t njobs_r;
+    uint32_t njobs_q;
+    uint32_t njobs_w;
+    uint32_t njobs_t;
+    uint32_t njobs_h;
+    uint32_t njobs_e;
+    uint32_t njobs_b;
+    uint32_t ncpus;
+    uint32_t mpiprocs;
+    uint32_t ncpus_avail;
+    uint32_t active;
+    int64_t mem;
+    int64_t vmem;
+    int64_t mem_avail;
+} server_record_t;
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} membuf_t;
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} memreader_t;
+
+struct histlog {
+    FILE *fp;
+    FILE *fidx;
+    char *fname;
+    bool writing;
+
+    index_entry_t *index;
+    int nframes;
+    int index_size;
+
+    /* the table of the last written or decoded frame, sorted by key */
+    job_t *jobs;
+    int njobs;
+    int frame;
+
+    /* the server of the decoded frame */
+    server_record_t server;
+    char *host;
+    char *version;
+
+    int since_keyframe;
+};
+
+static unsigned long long key_of(const job_t *job)
+{
+    return ((unsigned long long) job->id << 32) | job->aid;
+}
+
+static void free_job_strings(job_t *job)
+{
+    free(job->name);
+    free(job->queue);
+    free(job->user);
+    free(job->exec_host);
+    free(job->depend);
+}
+
+static void free_jobs(job_t *jobs, int njobs)
+{
+    int i;
+    for (i = 0; i < njobs; i++) {
+        free_job_strings(jobs + i);
+    }
+    free(jobs);
+}
+
+static char *dup_string(const char *s)
+{
+    return s ? strdup(s):NULL;
+}
+
+static void copy_job(job_t *dest, const job_t *src)
+{
+    job_record_t rec;
+
+    // only what is stored goes through
+    memset(dest, 0, sizeof(job_t));
+    job_to_record(src, &rec);
+    job_from_record(dest, &rec);
+    dest->name      = dup_string(src->name);
+    dest->queue     = dup_string(src->queue);
+    dest->user      = dup_string(src->user);
+    dest->exec_host = dup_string(src->exec_host);
+    dest->depend    = dup_string(src->depend);
+}
+
+static bool membuf_put(membuf_t *b, const void *data, size_t n)
+{
+    if (b->len + n > b->size) {
+        size_t size = b->size ? 2*b->size:65536;
+        while (size < b->len + n) {
+            size *= 2;
+        }
+        unsigned char *p = realloc(b->data, size);
+        if (!p) {
+            return false;
+        }
+        b->data = p;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+
+    return true;
+}
+
+static bool membuf_put_string(membuf_t *b, const char *s)
+{
+    uint16_t len = s ? strlen(s):0xffff;
+    if (s && strlen(s) >= 0xffff) {
+        len = 0xfffe;
+    }
+    return membuf_put(b, &len, sizeof(len)) &&
+        (!s || membuf_put(b, s, len));
+}
+
+static bool memreader_get(memreader_t *r, void *data, size_t n)
+{
+    if (r->p + n > r->end) {
+        return false;
+    }
+    memcpy(data, r->p, n);
+    r->p += n;
+
+    return true;
+}
+
+static bool memreader_get_string(memreader_t *r, char **s)
+{
+    uint16_t len;
+
+    *s = NULL;
+    if (!memreader_get(r, &len, sizeof(len))) {
+        return false;
+    }
+    if (len == 0xffff) {
+        return true;
+    }
+    if (r->p + len > r->end || !(*s = malloc(len + 1))) {
+        return false;
+    }
+    memcpy(*s, r->p, len);
+    (*s)[len] = '\0';
+    r->p += len;
+
+    return true;
+}
+
+static bool put_job(membuf_t *b, const job_t *job)
+{
+    job_record_t rec;
+
+    job_to_record(job, &rec);
+
+    return membuf_put(b, &rec, sizeof(rec)) &&
+        membuf_put_string(b, job->name) &&
+        membuf_put_string(b, job->queue) &&
+        membuf_put_string(b, job->user) &&
+        membuf_put_string(b, job->exec_host) &&
+        membuf_put_string(b, job->depend);
+}
+
+static bool get_job(memreader_t *r, job_t *job)
+{
+    job_record_t rec;
+
+    memset(job, 0, sizeof(job_t));
+    if (!memreader_get(r, &rec, sizeof(rec))) {
+        return false;
+    }
+    job_from_record(job, &rec);
+
+    return memreader_get_string(r, &job->name) &&
+        memreader_get_string(r, &job->queue) &&
+        memreader_get_string(r, &job->user) &&
+        memreader_get_string(r, &job->exec_host) &&
+        memreader_get_string(r, &job->depend);
+}
+
+static bool same_string(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL) {
+        return a == b;
+    } else {
+        return !strcmp(a, b);
+    }
+}
+
+static bool same_job(const job_t *a, const job_t *b)
+{
+    job_record_t ra, rb;
+
+    job_to_record(a, &ra);
+    job_to_record(b, &rb);
+
+    return !memcmp(&ra, &rb, sizeof(job_record_t)) &&
+        same_string(a->name, b->name) &&
+        same_string(a->queue, b->queue) &&
+        same_string(a->user, b->user) &&
+        same_string(a->exec_host, b->exec_host) &&
+        same_string(a->depend, b->depend);
+}
+
+static int job_key_comp(const void *a, const void *b)
+{
+    unsigned long long ka = key_of(a), kb = key_of(b);
+
+    if (ka < kb) {
+        return -1;
+    } else
+    if (ka > kb) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static bool index_add(histlog_t *log, const index_entry_t *entry)
+{
+    if (log->nframes == log->index_size) {
+        int size = log->index_size ? 2*log->index_size:1024;
+        index_entry_t *index = realloc(log->index,
+            size*sizeof(index_entry_t));
+        if (!index) {
+            return false;
+        }
+        log->index = index;
+        log->index_size = size;
+    }
+    log->index[log->nframes++] = *entry;
+
+    return true;
+}
+
+/* Rebuild the index from the frame headers, if it's missing or stale */
+static bool histlog_scan(histlog_t *log)
+{
+    struct stat sb;
+    frame_header_t fh;
+    index_entry_t entry;
+    int64_t offset = strlen(HISTLOG_MAGIC);
+
+    if (fstat(fileno(log->fp), &sb) != 0) {
+        return false;
+    }
+
+    if (log->nframes > 0) {
+        const index_entry_t *last = log->index + log->nframes - 1;
+        if (fseek(log->fp, last->offset, SEEK_SET) == 0 &&
+            fread(&fh, sizeof(fh), 1, log->fp) == 1 &&
+            fh.magic == HISTLOG_FRAME_MAGIC) {
+            offset = last->offset + sizeof(fh) + fh.zlen;
+        } else {
+            log->nframes = 0;
+            if (log->fidx && log->writing) {
+                log->fidx = freopen(NULL, "w+b", log->fidx);
+            }
+        }
+    }
+
+    while (offset + (int64_t) sizeof(fh) <= sb.st_size) {
+        if (fseek(log->fp, offset, SEEK_SET) != 0 ||
+            fread(&fh, sizeof(fh), 1, log->fp) != 1 ||
+            fh.magic != HISTLOG_FRAME_MAGIC ||
+            offset + (int64_t) sizeof(fh) + fh.zlen > sb.st_size) {
+            // a torn write at the end
+            break;
+        }
+        memset(&entry, 0, sizeof(entry));
+        entry.stamp  = fh.stamp;
+        entry.offset = offset;
+        entry.type   = fh.type;
+        if (!index_add(log, &entry)) {
+            return false;
+        }
+        if (log->fidx && log->writing) {
+            fwrite(&entry, sizeof(entry), 1, log->fidx);
+        }
+        offset += sizeof(fh) + fh.zlen;
+    }
+
+    return true;
+}
+
+static bool histlog_load_index(histlog_t *log)
+{
+    index_entry_t entry;
+
+    log->nframes = 0;
+
+    if (log->fidx) {
+        rewind(log->fidx);
+        while (fread(&entry, sizeof(entry), 1, log->fidx) == 1) {
+            if (!index_add(log, &entry)) {
+                return false;
+            }
+        }
+        fseek(log->fidx, 0, SEEK_END);
+    }
+
+    return histlog_scan(log);
+}
+
+void histlog_close(histlog_t *log)
+{
+    if (log) {
+        if (log->fp) {
+            fclose(log->fp);
+        }
+        if (log->fidx) {
+            fclose(log->fidx);
+        }
+        free(log->fname);
+        free(log->index);
+        free_jobs(log->jobs, log->njobs);
+        free(log->host);
+        free(log->version);
+        free(log);
+    }
+}
+
+static histlog_t *histlog_open(const char *fname, bool writing)
+{
+    char idxname[1024], magic[8];
+
+    histlog_t *log = calloc(1, sizeof(histlog_t));
+    if (!log) {
+        return NULL;
+    }
+    log->fname = strdup(fname);
+    log->writing = writing;
+    log->frame = -1;
+
+    log->fp = fopen(fname, writing ? "a+b":"rb");
+    if (!log->fp) {
+        histlog_close(log);
+        return NULL;
+    }
+
+    fseek(log->fp, 0, SEEK_END);
+    if (ftell(log->fp) == 0 && writing) {
+        fwrite(HISTLOG_MAGIC, strlen(HISTLOG_MAGIC), 1, log->fp);
+        fflush(log->fp);
+    }
+    rewind(log->fp);
+    if (fread(magic, 8, 1, log->fp) != 1 ||
+        memcmp(magic, HISTLOG_MAGIC, 8)) {
+        histlog_close(log);
+        return NULL;
+    }
+
+    snprintf(idxname, 1024, "%s.idx", fname);
+    log->fidx = fopen(idxname, writing ? "a+b":"rb");
+    if (writing && log->fidx) {
+        // an index shorter than the log is completed by histlog_scan()
+        struct stat sb;
+        if (fstat(fileno(log->fidx), &sb) == 0 &&
+            sb.st_size % sizeof(index_entry_t) != 0) {
+            fclose(log->fidx);
+            log->fidx = fopen(idxname, "w+b");
+        }
+    }
+
+    if (!histlog_load_index(log)) {
+        histlog_close(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+histlog_t *histlog_open_write(const char *fname)
+{
+    return histlog_open(fname, true);
+}
+
+histlog_t *histlog_open_read(const char *fname)
+{
+    return histlog_open(fname, false);
+}
+
+/* Pick up frames appended since (by a concurrent recorder) */
+int histlog_nframes(histlog_t *log)
+{
+    if (!log->writing) {
+        histlog_scan(log);
+    }
+
+    return log->nframes;
+}
+
+time_t histlog_stamp(const histlog_t *log, int frame)
+{
+    if (frame >= 0 && frame < log->nframes) {
+        return log->index[frame].stamp;
+    } else {
+        return 0;
+    }
+}
+
+/* The last frame not later than t, or the first one */
+int histlog_find(const histlog_t *log, time_t t)
+{
+    int lo = 0, hi = log->nframes;
+
+    while (lo < hi) {
+        int mid = (lo + hi)/2;
+        if (log->index[mid].stamp <= t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo > 0 ? lo - 1:0;
+}
+
+static void put_server(membuf_t *b, const server_t *pbs)
+{
+    server_record_t srec;
+
+    memset(&srec, 0, sizeof(srec));
+    srec.total_jobs  = pbs->total_jobs;
+    srec.njobs_r     = pbs->njobs_r;
+    srec.njobs_q     = pbs->njobs_q;
+    srec.njobs_w     = pbs->njobs_w;
+    srec.njobs_t     = pbs->njobs_t;
+    srec.njobs_h     = pbs->njobs_h;
+    srec.njobs_e     = pbs->njobs_e;
+    srec.njobs_b     = pbs->njobs_b;
+    srec.ncpus       = pbs->ncpus;
+    srec.mpiprocs    = pbs->mpiprocs;
+    srec.ncpus_avail = pbs->ncpus_avail;
+    srec.active      = pbs->active;
+    srec.mem         = pbs->mem;
+    srec.vmem        = pbs->vmem;
+    srec.mem_avail   = pbs->mem_avail;
+
+    membuf_put(b, &srec, sizeof(srec));
+    membuf_put_string(b, pbs->host);
+    membuf_put_string(b, pbs->version);
+}
+
+bool histlog_append(histlog_t *log, const server_t *pbs,
+    const job_t *jobs, int njobs)
+{
+    membuf_t raw;
+    frame_header_t fh;
+    index_entry_t entry;
+    int i, j;
+    uint32_t n;
+
+    memset(&raw, 0, sizeof(raw));
+
+    job_t *cur = malloc((njobs > 0 ? njobs:1)*sizeof(job_t));
+    if (!cur) {
+        return false;
+    }
+    for (i = 0; i < njobs; i++) {
+        copy_job(cur + i, jobs + i);
+    }
+    qsort(cur, njobs, sizeof(job_t), job_key_comp);
+
+    bool keyframe = log->frame < 0 ||
+        log->since_keyframe >= HISTLOG_KEYFRAME_INTERVAL - 1;
+
+    put_server(&raw, pbs);
+
+    if (!keyframe) {
+        membuf_t changed;
+        uint32_t nremoved = 0, nchanged = 0;
+        size_t nremoved_pos = raw.len;
+
+        memset(&changed, 0, sizeof(changed));
+        membuf_put(&raw, &nremoved, sizeof(nremoved));
+
+        // both tables are sorted by key
+        i = j = 0;
+        while (i < log->njobs || j < njobs) {
+            unsigned long long kold = i < log->njobs ?
+                key_of(log->jobs + i):~0ULL;
+            unsigned long long knew = j < njobs ? key_of(cur + j):~0ULL;
+            if (kold < knew) {
+                membuf_put(&raw, &kold, sizeof(kold));
+                nremoved++;
+                i++;
+            } else
+            if (kold > knew) {
+                put_job(&changed, cur + j);
+                nchanged++;
+                j++;
+            } else {
+                if (!same_job(log->jobs + i, cur + j)) {
+                    put_job(&changed, cur + j);
+                    nchanged++;
+                }
+                i++;
+                j++;
+            }
+        }
+        memcpy(raw.data + nremoved_pos, &nremoved, sizeof(nremoved));
+        membuf_put(&raw, &nchanged, sizeof(nchanged));
+        if (changed.len) {
+            membuf_put(&raw, changed.data, changed.len);
+        }
+        free(changed.data);
+
+        // a delta this large would only slow down seeking
+        if (2*nchanged > (uint32_t) njobs) {
+            keyframe = true;
+            raw.len = 0;
+            put_server(&raw, pbs);
+        }
+    }
+
+    if (keyframe) {
+        n = njobs;
+        membuf_put(&raw, &n, sizeof(n));
+        for (i = 0; i < njobs; i++) {
+            put_job(&raw, cur + i);
+        }
+    }
+
+    uLongf zlen = compressBound(raw.len);
+    unsigned char *zdata = malloc(zlen);
+    if (!zdata || !raw.data ||
+        compress2(zdata, &zlen, raw.data, raw.len, Z_BEST_SPEED) != Z_OK) {
+        free(zdata);
+        free(raw.data);
+        free_jobs(cur, njobs);
+        return false;
+    }
+
+    fseek(log->fp, 0, SEEK_END);
+
+    memset(&fh, 0, sizeof(fh));
+    fh.magic  = HISTLOG_FRAME_MAGIC;
+    fh.type   = keyframe ? FRAME_KEY:FRAME_DELTA;
+    fh.stamp  = time(NULL);
+    fh.zlen   = zlen;
+    fh.rawlen = raw.len;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.stamp  = fh.stamp;
+    entry.offset = ftell(log->fp);
+    entry.type   = fh.type;
+
+    bool ok = fwrite(&fh, sizeof(fh), 1, log->fp) == 1 &&
+        fwrite(zdata, zlen, 1, log->fp) == 1 &&
+        fflush(log->fp) == 0;
+
+    free(zdata);
+    free(raw.data);
+
+    if (!ok) {
+        free_jobs(cur, njobs);
+        return false;
+    }
+
+    index_add(log, &entry);
+    if (log->fidx) {
+        fwrite(&entry, sizeof(entry), 1, log->fidx);
+        fflush(log->fidx);
+    }
+
+    free_jobs(log->jobs, log->njobs);
+    log->jobs = cur;
+    log->njobs = njobs;
+    log->frame = log->nframes - 1;
+    log->since_keyframe = keyframe ? 0:log->since_keyframe + 1;
+
+    return true;
+}
+
+/* Inflate a frame and apply it to the current table */
+static bool histlog_apply(histlog_t *log, int frame)
+{
+    frame_header_t fh;
+    memreader_t r;
+    uint32_t n, i;
+    bool ok = true;
+
+    if (fseek(log->fp, log->index[frame].offset, SEEK_SET) != 0 ||
+        fread(&fh, sizeof(fh), 1, log->fp) != 1 ||
+        fh.magic != HISTLOG_FRAME_MAGIC) {
+        return false;
+    }
+
+    unsigned char *zdata = malloc(fh.zlen);
+    unsigned char *raw = malloc(fh.rawlen);
+    uLongf rawlen = fh.rawlen;
+    if (!zdata || !raw ||
+        fread(zdata, fh.zlen, 1, log->fp) != 1 ||
+        uncompress(raw, &rawlen, zdata, fh.zlen) != Z_OK) {
+        free(zdata);
+        free(raw);
+        return false;
+    }
+    free(zdata);
+
+    r.p = raw;
+    r.end = raw + rawlen;
+
+    // replaced only once read, the old ones being still referred to
+    char *host = NULL, *version = NULL;
+    ok = memreader_get(&r, &log->server, sizeof(server_record_t)) &&
+        memreader_get_string(&r, &host) &&
+        memreader_get_string(&r, &version);
+    if (ok) {
+        free(log->host);
+        free(log->version);
+        log->host = host;
+        log->version = version;
+    } else {
+        free(host);
+        free(version);
+    }
+
+    if (ok && fh.type == FRAME_KEY) {
+        free_jobs(log->jobs, log->njobs);
+        log->njobs = 0;
+        ok = memreader_get(&r, &n, sizeof(n));
+        log->jobs = malloc((ok && n > 0 ? n:1)*sizeof(job_t));
+        if (!log->jobs) {
+            ok = false;
+        }
+        for (i = 0; ok && i < n; i++) {
+            ok = get_job(&r, log->jobs + i);
+            if (ok) {
+                log->njobs++;
+            }
+        }
+    } else
+    if (ok) {
+        uint32_t nremoved, nchanged;
+        unsigned long long *removed = NULL;
+        job_t *changed = NULL;
+        int nch = 0;
+
+        ok = memreader_get(&r, &nremoved, sizeof(nremoved));
+        if (ok) {
+            removed = malloc((nremoved > 0 ? nremoved:1)*sizeof(*removed));
+            ok = removed &&
+                memreader_get(&r, removed, nremoved*sizeof(*removed)) &&
+                memreader_get(&r, &nchanged, sizeof(nchanged));
+        }
+        if (ok) {
+            changed = malloc((nchanged > 0 ? nchanged:1)*sizeof(job_t));
+            ok = changed != NULL;
+            for (i = 0; ok && i < nchanged; i++) {
+                ok = get_job(&r, changed + i);
+                if (ok) {
+                    nch++;
+                }
+            }
+        }
+
+        job_t *merged = NULL;
+        if (ok) {
+            merged = malloc((log->njobs + nch + 1)*sizeof(job_t));
+            ok = merged != NULL;
+        }
+        if (ok) {
+            // merge the three key-sorted lists
+            int io = 0, ic = 0, nm = 0;
+            uint32_t ir = 0;
+            while (io < log->njobs || ic < nch) {
+                unsigned long long kold = io < log->njobs ?
+                    key_of(log->jobs + io):~0ULL;
+                unsigned long long kch = ic < nch ?
+                    key_of(changed + ic):~0ULL;
+                while (ir < nremoved && removed[ir] < kold) {
+                    ir++;
+                }
+                if (kch <= kold) {
+                    merged[nm++] = changed[ic++];
+                    if (kch == kold) {
+                        free_job_strings(log->jobs + io);
+                        io++;
+                    }
+                } else
+                if (ir < nremoved && removed[ir] == kold) {
+                    free_job_strings(log->jobs + io);
+                    io++;
+                } else {
+                    merged[nm++] = log->jobs[io++];
+                }
+            }
+            free(log->jobs);
+            log->jobs = merged;
+            log->njobs = nm;
+            nch = 0;
+        }
+
+        free(removed);
+        free_jobs(changed, nch);
+        if (!ok) {
+            free(merged);
+        }
+    }
+
+    free(raw);
+
+    if (ok) {
+        log->frame = frame;
+    } else {
+        // the table is unreliable now
+        log->frame = -1;
+    }
+
+    return ok;
+}
+
+/*
+ * Decode the job table (as fresh copies) and the server counters of a
+ * frame. The server strings stay owned by the log.
+ */
+job_t *histlog_jobs(histlog_t *log, int frame, server_t *pbs, int *njobs)
+{
+    int i, start;
+
+    *njobs = 0;
+    if (frame < 0 || frame >= log->nframes || log->writing) {
+        return NULL;
+    }
+
+    start = frame;
+    while (start > 0 && log->index[start].type != FRAME_KEY) {
+        start--;
+    }
+    // stepping forward from the current frame is cheaper
+    if (log->frame >= start && log->frame <= frame) {
+        start = log->frame + 1;
+    }
+    for (i = start; i <= frame; i++) {
+        if (!histlog_apply(log, i)) {
+            // the strings of the frames applied so far are the valid ones
+            pbs->host    = log->host;
+            pbs->version = log->version;
+            return NULL;
+        }
+    }
+
+    pbs->total_jobs  = log->server.total_jobs;
+    pbs->njobs_r     = log->server.njobs_r;
+    pbs->njobs_q     = log->server.njobs_q;
+    pbs->njobs_w     = log->server.njobs_w;
+    pbs->njobs_t     = log->server.njobs_t;
+    pbs->njobs_h     = log->server.njobs_h;
+    pbs->njobs_e     = log->server.njobs_e;
+    pbs->njobs_b     = log->server.njobs_b;
+    pbs->ncpus       = log->server.ncpus;
+    pbs->mpiprocs    = log->server.mpiprocs;
+    pbs->ncpus_avail = log->server.ncpus_avail;
+    pbs->active      = log->server.active;
+    pbs->mem         = log->server.mem;
+    pbs->vmem        = log->server.vmem;
+    pbs->mem_avail   = log->server.mem_avail;
+    pbs->host        = log->host;
+    pbs->version     = log->version;
+
+    job_t *jobs = calloc(log->njobs + 1, sizeof(job_t));
+    if (!jobs) {
+        return NULL;
+    }
+    for (i = 0; i < log->njobs; i++) {
+        copy_job(jobs + i, log->jobs + i);
+    }
+    *njobs = log->njobs;
+
+    return jobs;
+}
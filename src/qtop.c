@@ -21,12 +21,18 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
 #include <time.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <pwd.h>
 #include <math.h>
+#include <pthread.h>
 
 #include <stdbool.h>
 
@@ -54,7 +60,7 @@ static long int parse_resource(const char *resource, const char *svalue, int *ty
         *type = RESOURCE_TYPE_CPLX;
     } else
     if (strstr(resource, "mem")) {
-        sscanf(svalue, "%ld", &value);
+        value = strtol(svalue, NULL, 10);
         if (strstr(svalue, "kb")) {
             ;
         } else
@@ -72,12 +78,15 @@ static long int parse_resource(const char *resource, const char *svalue, int *ty
         *type = RESOURCE_TYPE_MEM;
     } else
     if (!strcmp(resource, "walltime") || !strcmp(resource, "cput")) {
-        int h, m, s;
-        sscanf(svalue, "%d:%d:%d", &h, &m, &s);
-        value = s + 60*(m + 60*h);
+        // [[HH:]MM:]SS
+        char *p = (char *) svalue;
+        value = strtol(p, &p, 10);
+        while (*p == ':') {
+            value = 60*value + strtol(p + 1, &p, 10);
+        }
         *type = RESOURCE_TYPE_TIME;
     } else {
-        sscanf(svalue, "%ld", &value);
+        value = strtol(svalue, NULL, 10);
         *type = RESOURCE_TYPE_NONE;
     }
 
@@ -179,6 +188,9 @@ static void print_attribs(WINDOW *win, const struct attrl *attribs,
 static void parse_server_attribs(server_t *pbs)
 {
     const struct attrl *qattr = pbs->qstatus->attribs;
+
+    pbs->mem_avail = 0;
+    pbs->ncpus_avail = 0;
     while (qattr) {
         if (!strcmp(qattr->name, ATTR_SvrHost)) {
             pbs->host = qattr->value;
@@ -220,10 +232,131 @@ static void parse_server_attribs(server_t *pbs)
             if (!strcmp(qattr->resource, "mpiprocs")) {
                 pbs->mpiprocs = atoi(qattr->value);
             }
+        } else
+        if (!strcmp(qattr->name, ATTR_rescavail)) {
+            int type;
+            if (!strcmp(qattr->resource, "mem")) {
+                pbs->mem_avail =
+                    parse_resource(qattr->resource, qattr->value, &type);
+            } else
+            if (!strcmp(qattr->resource, "ncpus")) {
+                pbs->ncpus_avail = atoi(qattr->value);
+            }
         }
 
         qattr = qattr->next;
     }
+
+    // not set on the server; the vnode sums, if known
+    if (pbs->vnode_time) {
+        if (pbs->ncpus_avail == 0) {
+            pbs->ncpus_avail = pbs->vnode_ncpus;
+        }
+        if (pbs->mem_avail == 0) {
+            pbs->mem_avail = pbs->vnode_mem;
+        }
+    }
+}
+
+void job_free_data(job_t *job)
+{
+    if (job) {
+        xfree(job->name);
+        xfree(job->queue);
+        xfree(job->user);
+        xfree(job->exec_host);
+        xfree(job->depend);
+    }
+}
+
+static reconnect_t *reconnect_new(const char *server, const char *secondary)
+{
+    reconnect_t *r = calloc(1, sizeof(reconnect_t));
+    if (!r) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->servers[0] = strdup(server);
+    if (secondary && strcmp(secondary, server)) {
+        r->servers[1] = strdup(secondary);
+    }
+
+    return r;
+}
+
+static void reconnect_destroy(reconnect_t *r)
+{
+    if (r->done && r->conn > 0) {
+        backend->disconnect(r->conn);
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    xfree(r->servers[0]);
+    xfree(r->servers[1]);
+    xfree(r);
+}
+
+/* An attempt in progress is left to the thread to clean up after */
+static void reconnect_free(reconnect_t *r)
+{
+    if (!r) {
+        return;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    bool running = r->running;
+    r->orphaned = true;
+    pthread_mutex_unlock(&r->lock);
+
+    if (!running) {
+        reconnect_destroy(r);
+    }
+}
+
+/* One attempt: the server connected to last, then the other one */
+static void *reconnect_thread(void *arg)
+{
+    reconnect_t *r = arg;
+    int i, conn = -1, current = r->current;
+
+    for (i = 0; i < 2 && conn <= 0; i++) {
+        int k = (current + i) % 2;
+        if (r->servers[k]) {
+            conn = backend->connect(r->servers[k]);
+            if (conn > 0) {
+                current = k;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->running = false;
+    if (conn > 0) {
+        r->conn = conn;
+        r->current = current;
+        r->done = true;
+        r->nfailed = 0;
+        r->next_time = 0;
+    } else {
+        // 1, 2, 4, ... s
+        r->nfailed++;
+        int backoff = r->nfailed < 10 ? 1 << (r->nfailed - 1):512;
+        if (backoff > RECONNECT_MAX_BACKOFF) {
+            backoff = RECONNECT_MAX_BACKOFF;
+        }
+        r->next_time = time(NULL) + backoff;
+    }
+    bool orphaned = r->orphaned;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    if (orphaned) {
+        reconnect_destroy(r);
+    }
+
+    return NULL;
 }
 
 void qtop_free(qtop_t *q)
@@ -234,22 +367,40 @@ void qtop_free(qtop_t *q)
         xfree(q->queue);
         xfree(q->state);
         xfree(q->exec_host);
+        if (q->history) {
+            int i;
+            for (i = 0; i < q->nhistory; i++) {
+                job_free_data(q->history + i);
+            }
+            xfree(q->history);
+        }
         if (q->conn > 0) {
-            pbs_disconnect(q->conn);
+            backend->disconnect(q->conn);
         }
+        reconnect_free(q->reconnect);
+        qtop_acct_free(q);
+        histlog_close(q->recorder);
+        histlog_close(q->playback);
+        snapshot_close(q->snapshot);
         xfree(q);
     }
 }
 
+/*
+ * Connect to the server; if it's the default one and doesn't answer, to the
+ * secondary server of its failover pair, if configured
+ */
 qtop_t *qtop_new(char *servername)
 {
     qtop_t *q = calloc(1, sizeof(qtop_t));
+    char *secondary = NULL;
     if (!q) {
         return NULL;
     }
 
     if (!servername) {
-        servername = pbs_default();
+        servername = backend->default_server();
+        secondary = backend_secondary();
     }
     if (!servername) {
         qtop_free(q);
@@ -257,8 +408,18 @@ qtop_t *qtop_new(char *servername)
     }
 
     q->servername = strdup(servername);
+    q->reconnect = reconnect_new(servername, secondary);
+    xfree(secondary);
 
-    q->conn = pbs_connect(servername);
+    q->conn = backend->connect(servername);
+    if (q->conn <= 0 && q->reconnect && q->reconnect->servers[1]) {
+        q->conn = backend->connect(q->reconnect->servers[1]);
+        if (q->conn > 0) {
+            q->reconnect->current = 1;
+            xfree(q->servername);
+            q->servername = strdup(q->reconnect->servers[1]);
+        }
+    }
     if (q->conn <= 0) {
         qtop_free(q);
         return NULL;
@@ -267,21 +428,86 @@ qtop_t *qtop_new(char *servername)
     return q;
 }
 
+/* A session with no server connection, e.g. playing back a recording */
+qtop_t *qtop_new_offline(const char *name)
+{
+    qtop_t *q = calloc(1, sizeof(qtop_t));
+    if (!q) {
+        return NULL;
+    }
+
+    q->servername = strdup(name);
+
+    return q;
+}
+
+/*
+ * Reconnect to the server in the background, failing over to the other one
+ * of the pair, if any, and backing off between attempts; true once
+ * reconnected. The old connection is dropped (if a call on it is stuck,
+ * when that returns).
+ */
 bool qtop_reconnect(qtop_t *q)
 {
-    q->conn = pbs_connect(q->servername);
-    if (q->conn <= 0) {
+    reconnect_t *r = q->reconnect;
+    struct timespec end;
+    pthread_t thread;
+    int conn = -1;
+
+    if (!r) {
         return false;
-    } else {
-        return true;
     }
+
+    pthread_mutex_lock(&r->lock);
+    if (!r->running && !r->done && time(NULL) >= r->next_time) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        r->running = pthread_create(&thread, &attr, reconnect_thread, r) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    clock_gettime(CLOCK_REALTIME, &end);
+    end.tv_nsec += RECONNECT_GRACE*1000000L;
+    end.tv_sec += end.tv_nsec/1000000000;
+    end.tv_nsec %= 1000000000;
+    while (r->running &&
+        pthread_cond_timedwait(&r->cond, &r->lock, &end) == 0) {
+        ;
+    }
+    if (r->done) {
+        conn = r->conn;
+        r->done = false;
+    }
+    int current = r->current;
+    pthread_mutex_unlock(&r->lock);
+
+    if (conn <= 0) {
+        return false;
+    }
+
+    if (q->conn > 0 && q->conn != conn) {
+        backend->disconnect(q->conn);
+    }
+    q->conn = conn;
+    if (strcmp(q->servername, r->servers[current])) {
+        xfree(q->servername);
+        q->servername = strdup(r->servers[current]);
+    }
+
+    return true;
+}
+
+/* Whether the last call failed for the connection rather than the request */
+static bool conn_lost(void)
+{
+    return pbs_errno == PBSE_EXPIRED || pbs_errno == PBSE_PROTOCOL;
 }
 
 void pbs_server_free(server_t *p)
 {
     if (p) {
         if (p->qstatus != NULL) {
-            pbs_statfree(p->qstatus);
+            backend->statfree(p->qstatus);
         }
     }
 }
@@ -296,31 +522,204 @@ server_t *pbs_server_new(void)
     return p;
 }
 
+static const char *prof_names[PROF_NSTAGES] = {
+    "server",
+    "parse",
+    "sort",
+    "other",
+    "draw"
+};
+
+/* Monotonic time in ms */
+static double profile_now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return 1000.0*t.tv_sec + t.tv_nsec/1.0e6;
+}
+
+/* The start of a stage, if profiling; not even the clock is read otherwise */
+static double profile_start(const profile_t *p)
+{
+    return p ? profile_now():0;
+}
+
+/* Charge the time since t0 to a stage of the refresh in progress */
+static void profile_add(profile_t *p, prof_stage_t stage, double t0)
+{
+    if (p) {
+        p->cur.ms[stage] += profile_now() - t0;
+    }
+}
+
+/* Count the attributes and their bytes in a batch status list */
+static void profile_count(profile_t *p, const struct batch_status *bs)
+{
+    double t0 = profile_now();
+
+    for (; bs; bs = bs->next) {
+        const struct attrl *a;
+        for (a = bs->attribs; a; a = a->next) {
+            p->cur.nattribs++;
+            p->cur.nbytes += strlen(a->name) + strlen(a->value) +
+                (a->resource ? strlen(a->resource):0);
+        }
+        p->cur.nbytes += strlen(bs->name);
+    }
+
+    p->count_ms += profile_now() - t0;
+}
+
+/* The refresh in progress is complete */
+static void profile_commit(profile_t *p)
+{
+    int i;
+
+    p->last = p->cur;
+    for (i = 0; i < PROF_NSTAGES; i++) {
+        p->total.ms[i] += p->cur.ms[i];
+    }
+    p->total.njobs    += p->cur.njobs;
+    p->total.nattribs += p->cur.nattribs;
+    p->total.nbytes   += p->cur.nbytes;
+    p->nrefreshes++;
+
+    if (p->out) {
+        fprintf(p->out, "{\"time\":%ld", (long) time(NULL));
+        for (i = 0; i < PROF_NSTAGES; i++) {
+            fprintf(p->out, ",\"%s_ms\":%.3f", prof_names[i], p->cur.ms[i]);
+        }
+        fprintf(p->out, ",\"njobs\":%ld,\"nattribs\":%ld,\"bytes\":%ld}\n",
+            p->cur.njobs, p->cur.nattribs, p->cur.nbytes);
+        fflush(p->out);
+    }
+
+    memset(&p->cur, 0, sizeof(prof_record_t));
+    p->pending = false;
+}
+
 bool qtop_server_update(const qtop_t *q, server_t *pbs)
 {
     struct attrl *qattribs = NULL;
 
+    double t0 = profile_start(q->prof);
+    struct batch_status *qstatus =
+        backend->statserver(q->conn, qattribs, NULL);
+    profile_add(q->prof, PROF_SERVER, t0);
+    if (qstatus == NULL) {
+        // the last one is still shown
+        return false;
+    }
+
     if (pbs->qstatus != NULL) {
-        pbs_statfree(pbs->qstatus);
+        backend->statfree(pbs->qstatus);
+    }
+    pbs->qstatus = qstatus;
+
+    parse_server_attribs(pbs);
+
+    return true;
+}
+
+/*
+ * Sum up resources of all vnodes that are neither down nor offline, for
+ * those not set on the server; the sums are reused for CAPACITY_TTL
+ */
+bool qtop_server_capacity(const qtop_t *q, server_t *pbs)
+{
+    struct attrl qattribs[2];
+    struct batch_status *qstatus, *qtmp;
+    time_t now = time(NULL);
+
+    if (pbs->vnode_time && now - pbs->vnode_time < CAPACITY_TTL) {
+        if (pbs->ncpus_avail == 0) {
+            pbs->ncpus_avail = pbs->vnode_ncpus;
+        }
+        if (pbs->mem_avail == 0) {
+            pbs->mem_avail = pbs->vnode_mem;
+        }
+        return true;
     }
 
-    pbs->qstatus = pbs_statserver(q->conn, qattribs, NULL);
-    if (pbs->qstatus == NULL) {
+    memset(qattribs, 0, sizeof(qattribs));
+    qattribs[0].name = ATTR_NODE_state;
+    qattribs[0].value = "";
+    qattribs[0].next = qattribs + 1;
+    qattribs[1].name = ATTR_rescavail;
+    qattribs[1].value = "";
+    qattribs[1].next = NULL;
+
+    qstatus = backend->statvnode(q->conn, NULL, qattribs, NULL);
+    if (qstatus == NULL) {
         return false;
     }
 
-    parse_server_attribs(pbs);
+    pbs->vnode_ncpus = 0;
+    pbs->vnode_mem = 0;
+
+    qtmp = qstatus;
+    while (qtmp) {
+        const struct attrl *qattr = qtmp->attribs;
+        bool usable = true;
+        long mem = 0;
+        unsigned int ncpus = 0;
+        while (qattr) {
+            if (!strcmp(qattr->name, ATTR_NODE_state)) {
+                if (strstr(qattr->value, ND_down) ||
+                    strstr(qattr->value, ND_offline)) {
+                    usable = false;
+                }
+            } else
+            if (!strcmp(qattr->name, ATTR_rescavail)) {
+                int type;
+                if (!strcmp(qattr->resource, "mem")) {
+                    mem = parse_resource(qattr->resource, qattr->value, &type);
+                } else
+                if (!strcmp(qattr->resource, "ncpus")) {
+                    ncpus = atoi(qattr->value);
+                }
+            }
+            qattr = qattr->next;
+        }
+        if (usable) {
+            pbs->vnode_ncpus += ncpus;
+            pbs->vnode_mem += mem;
+        }
+        qtmp = qtmp->next;
+    }
+
+    backend->statfree(qstatus);
+
+    pbs->vnode_time = now;
+    if (pbs->ncpus_avail == 0) {
+        pbs->ncpus_avail = pbs->vnode_ncpus;
+    }
+    if (pbs->mem_avail == 0) {
+        pbs->mem_avail = pbs->vnode_mem;
+    }
 
     return true;
 }
 
-static void job_free_data(job_t *job)
+static void job_copy(job_t *dest, const job_t *src)
 {
-    if (job) {
-        xfree(job->name);
-        xfree(job->queue);
-        xfree(job->user);
-        xfree(job->exec_host);
+    *dest = *src;
+    if (src->name) {
+        dest->name = strdup(src->name);
+    }
+    if (src->queue) {
+        dest->queue = strdup(src->queue);
+    }
+    if (src->user) {
+        dest->user = strdup(src->user);
+    }
+    if (src->exec_host) {
+        dest->exec_host = strdup(src->exec_host);
+    }
+    if (src->depend) {
+        dest->depend = strdup(src->depend);
     }
 }
 
@@ -347,6 +746,21 @@ static void parse_job_attribs(job_t *job, const struct attrl *attribs)
         if (!strcmp(qattr->name, ATTR_exechost) && qattr->value) {
             job->exec_host = strdup(qattr->value);
         } else
+        if (!strcmp(qattr->name, ATTR_depend) && qattr->value) {
+            job->depend = strdup(qattr->value);
+        } else
+        if (!strcmp(qattr->name, ATTR_history_timestamp)) {
+            job->history_ts = atol(qattr->value);
+        } else
+        if (!strcmp(qattr->name, ATTR_exit_status)) {
+            job->exit_status = atoi(qattr->value);
+        } else
+        if (!strcmp(qattr->name, ATTR_qtime)) {
+            job->qtime = atol(qattr->value);
+        } else
+        if (!strcmp(qattr->name, ATTR_stime)) {
+            job->stime = atol(qattr->value);
+        } else
         if (!strcmp(qattr->name, ATTR_l)) {
             int type;
             if (!strcmp(qattr->resource, "mem")) {
@@ -431,22 +845,13 @@ static struct attropl *attropl_add(struct attropl *a,
     return new;
 }
 
-job_t *qtop_server_jobs(qtop_t *q, int *njobs, int ajob_id_expanded)
+static struct attrl *job_attrl_new(void)
 {
-    struct batch_status *qstatus, *qstatus_sub = NULL, *qtmp;
-    struct attrl *qattribs = NULL;
-    struct attropl *criteria_list = NULL;
-    char extend[3] = "";
-    int nsubjobs = 0, njobs_total;
-
-    if (q->subjobs) {
-        strcat(extend, "t");
-    }
-    if (q->finished) {
-        strcat(extend, "x");
+    struct attrl *qattribs = calloc(11, sizeof(struct attrl));
+    if (!qattribs) {
+        return NULL;
     }
 
-    qattribs = calloc(7, sizeof(struct attrl));
     qattribs[0].name = ATTR_name;
     qattribs[0].value = "";
     qattribs[0].next = qattribs + 1;
@@ -467,7 +872,26 @@ job_t *qtop_server_jobs(qtop_t *q, int *njobs, int ajob_id_expanded)
     qattribs[5].next = qattribs + 6;
     qattribs[6].name = ATTR_used;
     qattribs[6].value = "";
-    qattribs[6].next = NULL;
+    qattribs[6].next = qattribs + 7;
+    qattribs[7].name = ATTR_depend;
+    qattribs[7].value = "";
+    qattribs[7].next = qattribs + 8;
+    qattribs[8].name = ATTR_history_timestamp;
+    qattribs[8].value = "";
+    qattribs[8].next = qattribs + 9;
+    qattribs[9].name = ATTR_qtime;
+    qattribs[9].value = "";
+    qattribs[9].next = qattribs + 10;
+    qattribs[10].name = ATTR_stime;
+    qattribs[10].value = "";
+    qattribs[10].next = NULL;
+
+    return qattribs;
+}
+
+static struct attropl *job_criteria_new(const qtop_t *q)
+{
+    struct attropl *criteria_list = NULL;
 
     if (q->username != NULL) {
         criteria_list = attropl_add(criteria_list, ATTR_u, q->username, EQ);
@@ -478,89 +902,305 @@ job_t *qtop_server_jobs(qtop_t *q, int *njobs, int ajob_id_expanded)
     if (q->state) {
         criteria_list = attropl_add(criteria_list, ATTR_state, q->state, EQ);
     }
-
-    if (q->finished) {
-        char buf[16];
-        time_t now = time(NULL);
-        sprintf(buf, "%ld", now - 3600*q->history_span);
-        criteria_list = attropl_add(criteria_list,
-            ATTR_history_timestamp, buf, GE);
-    }
     if (q->failed) {
         criteria_list = attropl_add(criteria_list, ATTR_exit_status, "0", NE);
     }
 
-    qstatus = pbs_selstat(q->conn, criteria_list, qattribs, extend);
-    if (qstatus == NULL) {
-        xfree(qattribs);
-        attropl_free(criteria_list);
-        *njobs = 0;
-        return NULL;
-    }
+    return criteria_list;
+}
 
-    unsigned int jid = 0;
-    qtmp = qstatus;
-    while (qtmp) {
-        jid++;
-        qtmp = qtmp->next;
+void parse_job_status(job_t *job, struct batch_status *qtmp)
+{
+    char *idot, *isb1, *isb2;
+    if (qtmp->name && (idot = strchr(qtmp->name, '.')) > qtmp->name) {
+        *idot = '\0';
     }
-    *njobs = jid;
 
-    char idbuf[32];
-    if (ajob_id_expanded > 0) {
-        sprintf(idbuf, "%d[]", ajob_id_expanded);
-        qstatus_sub = pbs_statjob(q->conn, idbuf, qattribs, "xt");
-        if (qstatus_sub != NULL) {
-            jid = 0;
-            qtmp = qstatus_sub;
-            while (qtmp) {
-                jid++;
-                qtmp = qtmp->next;
-            }
-            // 1 is for the parent job
-            nsubjobs = jid - 1;
-            *njobs += nsubjobs;
+    if ((isb1 = strchr(qtmp->name, '[')) &&
+        (isb2 = strchr(qtmp->name, ']'))) {
+        if (isb1 + 1 == isb2) {
+            job->is_array = true;
+            sscanf(qtmp->name, "%u[]", &job->id);
+        } else {
+            sscanf(qtmp->name, "%u[%u]", &job->id, &job->aid);
         }
+    } else {
+        job->id = atoi(qtmp->name);
     }
 
-    njobs_total = *njobs;
+    parse_job_attribs(job, qtmp->attribs);
+}
 
-    job_t *jobs = calloc(*njobs, sizeof(job_t));
-    if (!jobs) {
-        *njobs = 0;
-        pbs_statfree(qstatus);
-        if (qstatus_sub) {
-            pbs_statfree(qstatus_sub);
-        }
-        return NULL;
+bool job_filtered_out(const qtop_t *q, const job_t *job)
+{
+    if (q->exec_host &&
+        (!job->exec_host || !strstr(job->exec_host, q->exec_host))) {
+        return true;
+    } else
+    if (q->job_id && job->id != q->job_id) {
+        return true;
+    } else {
+        return false;
     }
+}
 
-    qtmp = qstatus;
-    jid = 0;
-    bool in_subjobs = false;
-    while (qtmp) {
-        job_t *job = jobs + jid;
+static int history_ts_comp(const void *a, const void *b)
+{
+    const job_t *ja = a, *jb = b;
 
-        char *idot, *isb1, *isb2;
-        if (qtmp->name && (idot = strchr(qtmp->name, '.')) > qtmp->name) {
-            *idot = '\0';
-        }
+    if (ja->history_ts < jb->history_ts) {
+        return -1;
+    } else
+    if (ja->history_ts > jb->history_ts) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
 
-        if ((isb1 = strchr(qtmp->name, '[')) &&
-            (isb2 = strchr(qtmp->name, ']'))) {
-            if (isb1 + 1 == isb2) {
-                job->is_array = true;
-                sscanf(qtmp->name, "%u[]", &job->id);
-            } else {
-                sscanf(qtmp->name, "%u[%u]", &job->id, &job->aid);
-            }
-        } else {
-            job->id = atoi(qtmp->name);
+static bool history_has(const qtop_t *q, const job_t *job)
+{
+    int i;
+
+    for (i = q->nhistory - 1;
+         i >= 0 && q->history[i].history_ts >= job->history_ts; i--) {
+        if (q->history[i].id == job->id && q->history[i].aid == job->aid) {
+            return true;
         }
+    }
 
-        parse_job_attribs(job, qtmp->attribs);
-        qtmp = qtmp->next;
-        if (qtmp == NULL && !in_subjobs && qstatus_sub != NULL) {
+    return false;
+}
+
+/*
+ * Expire finished jobs that fell out of the history span and append the
+ * newly fetched ones (taking over their data), keeping the order by time.
+ */
+static void history_merge(qtop_t *q, job_t *fresh, int nfresh, long cutoff)
+{
+    int i, nexpired = 0;
+
+    while (nexpired < q->nhistory &&
+           q->history[nexpired].history_ts < cutoff) {
+        job_free_data(q->history + nexpired);
+        nexpired++;
+    }
+    if (nexpired > 0) {
+        q->nhistory -= nexpired;
+        memmove(q->history, q->history + nexpired,
+            q->nhistory*sizeof(job_t));
+    }
+
+    if (q->nhistory + nfresh > q->history_size) {
+        int size = 2*(q->nhistory + nfresh);
+        job_t *history = realloc(q->history, size*sizeof(job_t));
+        if (!history) {
+            for (i = 0; i < nfresh; i++) {
+                job_free_data(fresh + i);
+            }
+            return;
+        }
+        q->history = history;
+        q->history_size = size;
+    }
+
+    qsort(fresh, nfresh, sizeof(job_t), history_ts_comp);
+
+    for (i = 0; i < nfresh; i++) {
+        job_t *job = fresh + i;
+        // jobs at the watermark itself may have been seen already
+        if (job->history_ts <= q->history_watermark && history_has(q, job)) {
+            job_free_data(job);
+            continue;
+        }
+        q->history[q->nhistory++] = *job;
+        if (job->history_ts > q->history_watermark) {
+            q->history_watermark = job->history_ts;
+        }
+    }
+}
+
+/* Fetch only jobs finished since the last watermark */
+static bool qtop_update_history(qtop_t *q, struct attrl *qattribs)
+{
+    struct batch_status *qstatus, *qtmp;
+    struct attropl *criteria_list;
+    char extend[3] = "x", buf[32];
+    int n = 0, nfresh = 0;
+
+    if (q->subjobs) {
+        strcat(extend, "t");
+    }
+
+    long cutoff = time(NULL) - 3600*q->history_span;
+    long since = q->history_watermark > cutoff ? q->history_watermark:cutoff;
+    sprintf(buf, "%ld", since);
+    if (q->history_since == 0 || q->history_since > since) {
+        q->history_since = since;
+    }
+
+    criteria_list = job_criteria_new(q);
+    criteria_list = attropl_add(criteria_list,
+        ATTR_state, q->subjobs ? "FX":"F", EQ);
+    criteria_list = attropl_add(criteria_list,
+        ATTR_history_timestamp, buf, GE);
+
+    double t0 = profile_start(q->prof);
+    qstatus = backend->selstat(q->conn, criteria_list, qattribs, extend);
+    profile_add(q->prof, PROF_SERVER, t0);
+    attropl_free(criteria_list);
+    if (qstatus == NULL && pbs_errno != PBSE_NONE) {
+        return false;
+    }
+    if (q->prof) {
+        profile_count(q->prof, qstatus);
+    }
+
+    qtmp = qstatus;
+    while (qtmp) {
+        n++;
+        qtmp = qtmp->next;
+    }
+
+    job_t *fresh = calloc(n > 0 ? n:1, sizeof(job_t));
+    if (!fresh) {
+        if (qstatus) {
+            backend->statfree(qstatus);
+        }
+        return false;
+    }
+
+    qtmp = qstatus;
+    while (qtmp) {
+        job_t *job = fresh + nfresh;
+        parse_job_status(job, qtmp);
+        if (job_filtered_out(q, job)) {
+            job_free_data(job);
+            memset(job, 0, sizeof(job_t));
+        } else {
+            nfresh++;
+        }
+        qtmp = qtmp->next;
+    }
+    if (qstatus) {
+        backend->statfree(qstatus);
+    }
+
+    history_merge(q, fresh, nfresh, cutoff);
+    xfree(fresh);
+
+    return true;
+}
+
+job_t *qtop_server_jobs(qtop_t *q, int *njobs, int ajob_id_expanded)
+{
+    struct batch_status *qstatus, *qstatus_sub = NULL, *qtmp;
+    struct attrl *qattribs = NULL;
+    struct attropl *criteria_list = NULL;
+    char extend[3] = "";
+    int nsubjobs = 0, njobs_total;
+
+    // finished jobs are fetched incrementally; see qtop_update_history()
+    if (q->subjobs) {
+        strcat(extend, "t");
+    }
+
+    qattribs = job_attrl_new();
+    criteria_list = job_criteria_new(q);
+
+    // parsing takes the rest of the time
+    double tstart = profile_start(q->prof), t0 = tstart;
+    double server0 = q->prof ? q->prof->cur.ms[PROF_SERVER]:0;
+    if (q->prof) {
+        q->prof->count_ms = 0;
+    }
+
+    qstatus = backend->selstat(q->conn, criteria_list, qattribs, extend);
+    profile_add(q->prof, PROF_SERVER, t0);
+    if (qstatus == NULL && (!q->finished || pbs_errno != PBSE_NONE)) {
+        xfree(qattribs);
+        attropl_free(criteria_list);
+        *njobs = 0;
+        q->stale = pbs_errno != PBSE_NONE;
+        if (!q->stale) {
+            q->data_time = time(NULL);
+        }
+        return NULL;
+    }
+
+    if (q->finished && !qtop_update_history(q, qattribs)) {
+        q->stale = true;
+        xfree(qattribs);
+        attropl_free(criteria_list);
+        if (qstatus) {
+            backend->statfree(qstatus);
+        }
+        *njobs = 0;
+        return NULL;
+    }
+    // not to lose the whole session if killed
+    if (q->finished && time(NULL) - q->history_saved >= HISTORY_SAVE_PERIOD &&
+        qtop_history_save(q)) {
+        q->history_saved = time(NULL);
+    }
+
+    unsigned int jid = 0;
+    qtmp = qstatus;
+    while (qtmp) {
+        jid++;
+        qtmp = qtmp->next;
+    }
+    *njobs = jid;
+
+    char idbuf[32];
+    if (ajob_id_expanded > 0) {
+        sprintf(idbuf, "%d[]", ajob_id_expanded);
+        t0 = profile_start(q->prof);
+        qstatus_sub = backend->statjob(q->conn, idbuf, qattribs, "xt");
+        profile_add(q->prof, PROF_SERVER, t0);
+        if (qstatus_sub != NULL) {
+            jid = 0;
+            qtmp = qstatus_sub;
+            while (qtmp) {
+                jid++;
+                qtmp = qtmp->next;
+            }
+            // 1 is for the parent job
+            nsubjobs = jid - 1;
+            *njobs += nsubjobs;
+        }
+    }
+
+    njobs_total = *njobs;
+
+    if (q->prof) {
+        profile_count(q->prof, qstatus);
+        profile_count(q->prof, qstatus_sub);
+    }
+
+    job_t *jobs = calloc(*njobs + q->nhistory + 1, sizeof(job_t));
+    if (!jobs) {
+        *njobs = 0;
+        if (qstatus) {
+            backend->statfree(qstatus);
+        }
+        if (qstatus_sub) {
+            backend->statfree(qstatus_sub);
+        }
+        xfree(qattribs);
+        attropl_free(criteria_list);
+        return NULL;
+    }
+
+    qtmp = qstatus;
+    jid = 0;
+    bool in_subjobs = false;
+    while (qtmp) {
+        job_t *job = jobs + jid;
+
+        parse_job_status(job, qtmp);
+        qtmp = qtmp->next;
+        if (qtmp == NULL && !in_subjobs && qstatus_sub != NULL) {
             // Skip the parent array job itself; it's already in the list
             qtmp = qstatus_sub->next;
             in_subjobs = true;
@@ -569,8 +1209,7 @@ job_t *qtop_server_jobs(qtop_t *q, int *njobs, int ajob_id_expanded)
             job->is_last_subjob = true;
         }
         // Filter out undesired jobs
-        if (q->exec_host &&
-            (!job->exec_host || !strstr(job->exec_host, q->exec_host))) {
+        if (job_filtered_out(q, job)) {
             job_free_data(job);
             memset(job, 0, sizeof(job_t));
             (*njobs)--;
@@ -579,27 +1218,86 @@ job_t *qtop_server_jobs(qtop_t *q, int *njobs, int ajob_id_expanded)
         }
     }
 
+    /* append the cached finished jobs */
+    int ih;
+    for (ih = 0; ih < q->nhistory; ih++) {
+        job_copy(jobs + *njobs, q->history + ih);
+        (*njobs)++;
+    }
+    njobs_total += q->nhistory;
+
     /* free unused part of the array */
     if (*njobs < njobs_total) {
-        jobs = realloc(jobs, (*njobs)*sizeof(job_t));
+        jobs = realloc(jobs, (*njobs + 1)*sizeof(job_t));
     }
 
     /* free allocated data */
     xfree(qattribs);
     attropl_free(criteria_list);
-    pbs_statfree(qstatus);
+    if (qstatus) {
+        backend->statfree(qstatus);
+    }
     if (qstatus_sub) {
-        pbs_statfree(qstatus_sub);
+        backend->statfree(qstatus_sub);
+    }
+
+    if (q->prof) {
+        profile_t *p = q->prof;
+        p->cur.ms[PROF_PARSE] += profile_now() - tstart - p->count_ms -
+            (p->cur.ms[PROF_SERVER] - server0);
+        p->cur.njobs = *njobs;
     }
 
+    q->stale = false;
+    q->data_time = time(NULL);
+
     return jobs;
 }
 
-void print_server_stats(const server_t *pbs, WINDOW *win, bool paused)
+static const char *hist_titles[HIST_NKINDS] = {
+    "%CPU",
+    "%Mem",
+    "%Walltime"
+};
+
+static void format_hist_bin(char buf[16], int bin)
+{
+    if (bin == HIST_NBINS - 1) {
+        sprintf(buf, "%3d+   ", bin*HIST_BIN_WIDTH);
+    } else {
+        sprintf(buf, "%3d-%-3d", bin*HIST_BIN_WIDTH, (bin + 1)*HIST_BIN_WIDTH);
+    }
+}
+
+/* Whether all the running jobs, subjobs included, are among the selected */
+static bool qtop_selects_running(const qtop_t *q)
+{
+    return !q->username && !q->queue && !q->state && !q->exec_host &&
+        !q->failed && !q->job_id && q->subjobs && q->hist_kind < 0;
+}
+
+/* All running jobs, irrespective of the filters */
+static job_t *qtop_running_jobs(const qtop_t *q, int *njobs)
+{
+    qtop_t qall = *q;
+
+    qall.username  = NULL;
+    qall.queue     = NULL;
+    qall.state     = "RE";
+    qall.exec_host = NULL;
+    qall.finished  = false;
+    qall.failed    = false;
+    qall.subjobs   = true;
+
+    return qtop_server_jobs(&qall, njobs, 0);
+}
+
+void print_server_stats(const qtop_t *q, const server_t *pbs, WINDOW *win,
+    bool paused)
 {
     const double gb_scale = pow(2, 20);
 
-    time_t now = time(NULL);
+    time_t now = q->playback ? q->frame_time:time(NULL);
     struct tm *ptm = localtime(&now);
     char datebuf[32];
     strftime(datebuf, 32, "%T", ptm);
@@ -622,16 +1320,79 @@ void print_server_stats(const server_t *pbs, WINDOW *win, bool paused)
         x = COLS;
     }
 
+    if (q->hist_kind >= 0 && y == 0) {
+        char binbuf[16];
+        format_hist_bin(binbuf, q->hist_bin);
+        wprintw(win, " [%s %s]", hist_titles[q->hist_kind], binbuf);
+    }
+    if (q->nmarked > 0 && y == 0) {
+        wprintw(win, " [%d marked]", q->nmarked);
+    }
+    if (q->playback && y == 0) {
+        char daybuf[16];
+        strftime(daybuf, 16, "%F", ptm);
+        wprintw(win, " [replay %s %d/%d]", daybuf, q->frame + 1,
+            histlog_nframes(q->playback));
+    }
+    // what's shown is the last good snapshot, this old
+    if (q->stale && y == 0) {
+        long age = q->data_time ? (long) (time(NULL) - q->data_time):-1;
+        if (age < 0) {
+            wprintw(win, " [no data]");
+        } else
+        if (age < 60) {
+            wprintw(win, " [stale %lds]", age);
+        } else
+        if (age < 3600) {
+            wprintw(win, " [stale %ldm]", age/60);
+        } else {
+            wprintw(win, " [stale %ldh]", age/3600);
+        }
+    }
+
     mvwprintw(win, 1, 0,
         "Mem: %.1f GiB, VMem: %.1f GiB, Cores: %d (SP:%d + MP:%d)",
         pbs->mem/gb_scale, pbs->vmem/gb_scale, pbs->ncpus,
         pbs->ncpus - pbs->mpiprocs, pbs->mpiprocs);
-    mvwprintw(win, 1, x - 9, "%c%s", paused? 'P':' ', datebuf);
+    // the effective refresh period, "!" if backing off after errors
+    char periodbuf[16] = "";
+    if (q->sched && !q->playback) {
+        snprintf(periodbuf, sizeof(periodbuf), "%s%.0fs ",
+            q->sched->nerrors ? "!":"", q->sched->effective);
+    }
+    mvwprintw(win, 1, x - 9 - (int) strlen(periodbuf), "%s%c%s", periodbuf,
+        paused? 'P':' ', datebuf);
 
     wattroff(win, COLOR_PAIR(COLOR_PAIR_HEADER));
     wrefresh(win);
 }
 
+/* The overlay line with the last and average timing of refreshes */
+static void print_profile(const profile_t *p, WINDOW *win, int row)
+{
+    char linebuf[256];
+    int i, len;
+
+    if (p->nrefreshes == 0) {
+        len = snprintf(linebuf, 256, "Profiling, waiting for a refresh...");
+    } else {
+        len = 0;
+        for (i = 0; i < PROF_NSTAGES; i++) {
+            len += snprintf(linebuf + len, 256 - len, "%s %.1f/%.1f ",
+                prof_names[i], p->last.ms[i], p->total.ms[i]/p->nrefreshes);
+        }
+        snprintf(linebuf + len, 256 - len,
+            "ms | %ld jobs %ld attrs %.1f MB (last/avg)",
+            p->last.njobs, p->last.nattribs, p->last.nbytes/1048576.0);
+    }
+
+    wattron(win, COLOR_PAIR(COLOR_PAIR_HEADER) | A_REVERSE);
+    mvwprintw(win, row, 0, "%-*.*s", COLS, COLS, linebuf);
+    wattroff(win, COLOR_PAIR(COLOR_PAIR_HEADER) | A_REVERSE);
+    touchline(win, row, 1);
+    wrefresh(win);
+}
+
 static bool format_time(unsigned int secs, char buf[16])
 {
     int hh, mm, ss;
@@ -662,6 +1423,87 @@ static int get_idlen(unsigned int id)
     return len;
 }
 
+static void format_job_id(const job_t *job, char buf[32])
+{
+    if (job->is_array) {
+        sprintf(buf, "%d[]", job->id);
+    } else
+    if (job->aid) {
+        sprintf(buf, "%d[%d]", job->id, job->aid);
+    } else {
+        sprintf(buf, "%d", job->id);
+    }
+}
+
+static void get_job_stats(const job_t *job, job_stats_t *st)
+{
+    const double gb_scale = pow(2, 20);
+
+    memset(st, 0, sizeof(job_stats_t));
+
+    switch (job->state) {
+    case JOB_RUNNING:
+    case JOB_EXITING:
+    case JOB_FINISHED:
+    case JOB_SUSPENDED:
+    case JOB_SUB_COMPLETED:
+        st->mem      = job->mem_u;
+        st->vmem     = job->vmem_u;
+        st->cput     = job->cput_u;
+        st->walltime = job->walltime_u;
+        st->ncpus    = job->ncpus_u;
+        if (st->walltime > 0) {
+            st->cpuutil = (double) st->cput/(st->ncpus*st->walltime);
+        }
+        if (job->mem_r > 0) {
+            st->memutil = st->mem/job->mem_r;
+        }
+        break;
+    default:
+        st->mem      = job->mem_r;
+        st->vmem     = job->vmem_r;
+        st->cput     = job->cput_r;
+        st->walltime = job->walltime_r;
+        st->ncpus    = job->ncpus_r;
+        break;
+    }
+
+    if (job->walltime_r != 0) {
+        st->wallutil = (double) job->walltime_u/job->walltime_r;
+    }
+
+    // Test for "badness" only jobs that have run at last 2 min
+    if (job->walltime_u > 120) {
+        double cpuutil_min, cpuutil_max = 1.25;
+        unsigned int nodect = job->nodect_r;
+        if (st->ncpus == 1) {
+            cpuutil_min = 0.5;
+            if (job->io_r > 1.0) {
+                cpuutil_min = 0;
+            }
+        } else
+        if (st->ncpus == 2) {
+            cpuutil_min = 0.6;
+        } else
+        if (st->ncpus < 10) {
+            cpuutil_min = 1 - 1.0*nodect/st->ncpus;
+        } else {
+            cpuutil_min = 0.9;
+        }
+        double mem_unused = (job->mem_r - job->mem_u)/gb_scale;
+        int walltime_unused = job->walltime_r - job->walltime_u;
+        if (st->cpuutil < cpuutil_min || st->cpuutil > cpuutil_max ||
+            (job->has_rates && job->state == JOB_RUNNING &&
+             job->cpu_rate < cpuutil_min) ||
+            (st->memutil > 0 && mem_unused/nodect > 2.0 &&
+             st->memutil < 0.5) ||
+            (job->state == JOB_FINISHED && walltime_unused > 7200 &&
+             st->wallutil > 0 && st->wallutil < 0.5)) {
+            st->bad = true;
+        }
+    }
+}
+
 void print_jobs(const job_t *jobs, int njobs, WINDOW *win, int selpos,
     unsigned int xshift)
 {
@@ -671,7 +1513,7 @@ void print_jobs(const job_t *jobs, int njobs, WINDOW *win, int selpos,
 
     mvwprintw(win, HEADER_NROWS - 1, 0, "%s", "  Job ID ");
     const char *dheader =
-        "    User    Queue S    Mem %Mem   VMem  NC %CPU Walltime I/O Name";
+        "    User    Queue S    Mem %Mem   VMem  NC %CPU Walltime I/O iCPU   dMem Trend   Name";
 
     int x, __attribute__ ((unused)) y;
     getyx(win, y, x);
@@ -683,42 +1525,10 @@ void print_jobs(const job_t *jobs, int njobs, WINDOW *win, int selpos,
     const double gb_scale = pow(2, 20);
     const job_t *job = jobs;
     for (i = HEADER_NROWS; i < LINES && i < njobs + HEADER_NROWS; i++) {
-        double mem, vmem;
-        long cput, walltime;
-        int ncpus;
-        double cpuutil = 0, memutil = 0, wallutil = 0;
+        job_stats_t st;
         char linebuf[1024];
 
-        switch (job->state) {
-        case JOB_RUNNING:
-        case JOB_EXITING:
-        case JOB_FINISHED:
-        case JOB_SUSPENDED:
-        case JOB_SUB_COMPLETED:
-            mem         = job->mem_u;
-            vmem        = job->vmem_u;
-            cput        = job->cput_u;
-            walltime    = job->walltime_u;
-            ncpus       = job->ncpus_u;
-            if (walltime > 0) {
-                cpuutil = (double) cput/(ncpus*walltime);
-            }
-            if (job->mem_r > 0) {
-                memutil = mem/job->mem_r;
-            }
-            break;
-        default:
-            mem         = job->mem_r;
-            vmem        = job->vmem_r;
-            cput        = job->cput_r;
-            walltime    = job->walltime_r;
-            ncpus       = job->ncpus_r;
-            break;
-        }
-
-        if (job->walltime_r != 0) {
-            wallutil = (double) job->walltime_u/job->walltime_r;
-        }
+        get_job_stats(job, &st);
 
         int cpair = 0;
         switch (job->state) {
@@ -741,41 +1551,20 @@ void print_jobs(const job_t *jobs, int njobs, WINDOW *win, int selpos,
             cpair = COLOR_PAIR_JOB_OTHER;
             break;
         }
-        // Test for "badness" only jobs that have run at last 2 min
-        if (job->walltime_u > 120) {
-            double cpuutil_min, cpuutil_max = 1.25;
-            unsigned int nodect = job->nodect_r;
-            if (ncpus == 1) {
-                cpuutil_min = 0.5;
-                if (job->io_r > 1.0) {
-                    cpuutil_min = 0;
-                }
-            } else
-            if (ncpus == 2) {
-                cpuutil_min = 0.6;
-            } else
-            if (ncpus < 10) {
-                cpuutil_min = 1 - 1.0*nodect/ncpus;
-            } else {
-                cpuutil_min = 0.9;
-            }
-            double mem_unused = (job->mem_r - job->mem_u)/gb_scale;
-            int walltime_unused = job->walltime_r - job->walltime_u;
-            if (cpuutil < cpuutil_min || cpuutil > cpuutil_max ||
-                (memutil > 0 && mem_unused/nodect > 2.0 && memutil < 0.5) ||
-                (job->state == JOB_FINISHED && walltime_unused > 7200 &&
-                 wallutil > 0 && wallutil < 0.5)) {
-                cpair = COLOR_PAIR_JOB_BAD;
-            }
+        if (st.bad) {
+            cpair = COLOR_PAIR_JOB_BAD;
         }
 
         char timebuf[16];
-        format_time(walltime, timebuf);
+        format_time(st.walltime, timebuf);
 
         int cattrs = COLOR_PAIR(cpair);
         if (i == selpos + HEADER_NROWS) {
             cattrs |= A_REVERSE;
         }
+        if (job->marked) {
+            cattrs |= A_UNDERLINE;
+        }
 
         wattron(win, cattrs);
         if (job->is_array) {
@@ -805,12 +1594,12 @@ void print_jobs(const job_t *jobs, int njobs, WINDOW *win, int selpos,
         waddch(win, ' ');
 
         int memprec, vmemprec, ioprec;
-        if (mem/gb_scale >= 1000) {
+        if (st.mem/gb_scale >= 1000) {
             memprec = 0;
         } else {
             memprec = 2;
         }
-        if (vmem/gb_scale >= 1000) {
+        if (st.vmem/gb_scale >= 1000) {
             vmemprec = 0;
         } else {
             vmemprec = 2;
@@ -820,11 +1609,29 @@ void print_jobs(const job_t *jobs, int njobs, WINDOW *win, int selpos,
         } else {
             ioprec = 0;
         }
+        char icpubuf[16], dmembuf[16], trendbuf[TS_NSAMPLES];
+        if (job->has_rates) {
+            int k;
+            // in GB/h
+            snprintf(icpubuf, 16, "%3.0f", 100*job->cpu_rate);
+            snprintf(dmembuf, 16, "%+6.2f", 3600*job->mem_rate/gb_scale);
+            for (k = 0; k < job->ntrend; k++) {
+                trendbuf[k] = " .:-=+*#"[job->trend[k]];
+            }
+            trendbuf[k] = '\0';
+        } else {
+            strcpy(icpubuf, "-");
+            strcpy(dmembuf, "-");
+            trendbuf[0] = '\0';
+        }
+
         sprintf(linebuf,
-            "%8s %8s %c %6.*f  %3.0f %6.*f %3d  %3.0f %8s %3.*f %s",
+            "%8s %8s %c %6.*f  %3.0f %6.*f %3d  %3.0f %8s %3.*f %4s %6s %-7s %s",
             job->user, job->queue, job->state,
-            memprec, mem/gb_scale, 100*memutil, vmemprec, vmem/gb_scale, ncpus,
-            100*cpuutil, timebuf, ioprec, job->io_r, job->name);
+            memprec, st.mem/gb_scale, 100*st.memutil,
+            vmemprec, st.vmem/gb_scale, st.ncpus,
+            100*st.cpuutil, timebuf, ioprec, job->io_r,
+            icpubuf, dmembuf, trendbuf, job->name);
 
         getyx(win, y, x);
 
@@ -850,458 +1657,4112 @@ void print_jobs(const job_t *jobs, int njobs, WINDOW *win, int selpos,
     wrefresh(win);
 }
 
-static int print_jobs_summary(const job_t *jobs, int njobs,
-    WINDOW *win, int selpos)
+/* Whether the used (rather than requested) values of a job count */
+static bool state_started(job_state_t state)
 {
-    int i, nj;
-    const double gb_scale = pow(2, 20);
-
-    wattron(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
-
-    const char *header =
-        "    User     Queue    S    Jobs      Mem   %Mem      NC   %CPU   Walltime    I/O";
-
-    mvwprintw(win, HEADER_NROWS - 1, 0, "%-*s", COLS, header);
+    switch (state) {
+    case JOB_RUNNING:
+    case JOB_EXITING:
+    case JOB_FINISHED:
+    case JOB_SUSPENDED:
+    case JOB_SUB_COMPLETED:
+        return true;
+    default:
+        return false;
+    }
+}
 
-    wattroff(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+/* The utilizations of summary rows, from their sums */
+static void summary_utils(summary_row_t *rows, int nrows)
+{
+    int i;
 
-    const job_t *job = jobs;
-    const char *current_user = NULL;
-    job_state_t current_state;
-    const char *current_queue;
-
-    // stats to collect
-    double mem_sum = 0.0, mem_r_sum = 0.0, io_sum = 0.0;
-    long cput_sum = 0, walltime_sum = 0;
-    int ncpus_sum = 0, njobs_sum = 0;
-    long nwalltime_sum = 0;
-
-    i = HEADER_NROWS;
-    nj = 0;
-    while (nj <= njobs && i < LINES) {
-        double mem, mem_r, io;
+    for (i = 0; i < nrows; i++) {
+        summary_row_t *row = rows + i;
+        row->cpuutil = 0;
+        row->memutil = 0;
+        if (state_started(row->state)) {
+            if (row->nwalltime > 0) {
+                row->cpuutil = ((double) row->cput)/row->nwalltime;
+            }
+            if (row->mem_r > 0) {
+                row->memutil = row->mem/row->mem_r;
+            }
+        }
+    }
+}
+
+/*
+ * Sum up the runs of jobs of the same user, state, and queue (as the job
+ * list is sorted); returns the number of rows, up to maxrows.
+ */
+static int jobs_summary(const job_t *jobs, int njobs, summary_row_t *rows,
+    int maxrows)
+{
+    summary_row_t *row = NULL;
+    int i, n = 0;
+
+    for (i = 0; i < njobs; i++) {
+        const job_t *job = jobs + i;
+        double mem;
         long cput, walltime;
         int ncpus;
-        double cpuutil = 0, memutil = 0;
-        char linebuf[1024];
-        bool pre_state;
 
-        if (current_user == NULL) {
-            current_user  = job->user;
-            current_state = job->state;
-            current_queue = job->queue;
+        if (!row || strcmp(job->user, row->user) ||
+            job->state != row->state || strcmp(job->queue, row->queue)) {
+            if (n == maxrows) {
+                break;
+            }
+            row = rows + n++;
+            memset(row, 0, sizeof(summary_row_t));
+            row->user  = job->user;
+            row->state = job->state;
+            row->queue = job->queue;
         }
 
-        switch (job->state) {
-        case JOB_RUNNING:
-        case JOB_EXITING:
-        case JOB_FINISHED:
-        case JOB_SUSPENDED:
-        case JOB_SUB_COMPLETED:
+        if (state_started(job->state)) {
             mem         = job->mem_u;
             cput        = job->cput_u;
             walltime    = job->walltime_u;
             ncpus       = job->ncpus_u;
-            pre_state   = false;
-            break;
-        default:
+        } else {
             mem         = job->mem_r;
             cput        = job->cput_r;
             walltime    = job->walltime_r;
             ncpus       = job->ncpus_r;
-            pre_state   = true;
-            break;
         }
 
-        mem_r = job->mem_r;
-        io    = job->io_r;
+        row->mem_r     += job->mem_r;
+        row->mem       += mem;
+        row->cput      += cput;
+        row->walltime  += walltime;
+        row->ncpus     += ncpus;
+        row->io        += job->io_r;
+        row->nwalltime += ncpus*walltime;
+        row->njobs++;
+
+        job_stats_t st;
+        get_job_stats(job, &st);
+        if (st.bad) {
+            row->nbad++;
+        }
+    }
 
-        if (strcmp(job->user, current_user)   ||
-            job->state != current_state       ||
-            strcmp(job->queue, current_queue) ||
-            nj == njobs) {
-            // print the accumulated stats
-            if (!pre_state) {
-                if (walltime_sum > 0) {
-                    cpuutil = ((double) cput_sum)/nwalltime_sum;
-                }
-                if (mem_r_sum > 0) {
-                    memutil = mem_sum/mem_r_sum;
-                }
-            } else {
-                cpuutil = 0.0;
-                memutil = 0.0;
-            }
+    summary_utils(rows, n);
 
-            char timebuf[16];
-            format_time(walltime_sum, timebuf);
+    return n;
+}
 
-            int cpair = 0;
-            switch (current_state) {
-            case JOB_RUNNING:
-                cpair = COLOR_PAIR_JOB_R;
-                break;
-            case JOB_QUEUED:
-                cpair = COLOR_PAIR_JOB_Q;
-                break;
-            case JOB_WAITING:
-                cpair = COLOR_PAIR_JOB_W;
-                break;
-            case JOB_HELD:
-                cpair = COLOR_PAIR_JOB_H;
-                break;
-            case JOB_SUSPENDED:
-                cpair = COLOR_PAIR_JOB_S;
-                break;
-            default:
-                cpair = COLOR_PAIR_JOB_OTHER;
-                break;
-            }
+static int summary_row_comp(const void *a, const void *b)
+{
+    const summary_row_t *ra = a, *rb = b;
+    int c = strcmp(ra->user, rb->user);
+    if (!c) {
+        c = strcmp(ra->queue, rb->queue);
+    }
+    if (!c) {
+        c = (int) ra->state - (int) rb->state;
+    }
+    return c;
+}
 
-            if (!pre_state) {
-                double ncpus_avg = (double) ncpus_sum/njobs_sum;
-                double io_avg = (double) io_sum/njobs_sum;
-                double mem_avg = (double) mem_sum/njobs_sum;
+/*
+ * Merge the rows of the same user, queue, and state, which the job order
+ * needn't keep together (e.g., subjobs go by their array); returns the
+ * number of rows left.
+ */
+static int summary_merge(summary_row_t *rows, int nrows)
+{
+    int i, n = 0;
 
-                double cpuutil_min, cpuutil_max = 1.25;
-                if (io_avg >= 1.0) {
-                    cpuutil_min = 0.0;
-                } else
-                if (ncpus_avg >= 2.0) {
-                    cpuutil_min = 1 - 1/ncpus_avg;
-                } else {
-                    cpuutil_min = 0.9;
-                }
+    if (nrows < 2) {
+        return nrows;
+    }
 
-                // Test for "badness"
-                if (cpuutil < cpuutil_min || cpuutil > cpuutil_max ||
-                    (memutil > 0 && memutil < 0.5 && mem_avg > 2.0)) {
-                    cpair = COLOR_PAIR_JOB_BAD;
-                }
-            }
+    qsort(rows, nrows, sizeof(summary_row_t), summary_row_comp);
+    for (i = 0; i < nrows; i++) {
+        if (n == 0 || summary_row_comp(rows + n - 1, rows + i)) {
+            rows[n++] = rows[i];
+            continue;
+        }
+        summary_row_t *row = rows + n - 1;
+        row->njobs     += rows[i].njobs;
+        row->mem       += rows[i].mem;
+        row->mem_r     += rows[i].mem_r;
+        row->io        += rows[i].io;
+        row->cput      += rows[i].cput;
+        row->walltime  += rows[i].walltime;
+        row->nwalltime += rows[i].nwalltime;
+        row->ncpus     += rows[i].ncpus;
+        row->nbad      += rows[i].nbad;
+    }
 
-            int cattrs = COLOR_PAIR(cpair);
-            if (i == selpos + HEADER_NROWS) {
-                cattrs |= A_REVERSE;
-            }
+    summary_utils(rows, n);
+
+    return n;
+}
+
+static int print_jobs_summary(const job_t *jobs, int njobs,
+    WINDOW *win, int selpos)
+{
+    int i, nrows, maxrows = LINES - HEADER_NROWS;
+    const double gb_scale = pow(2, 20);
+
+    wattron(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
 
-            wattron(win, cattrs);
+    const char *header =
+        "    User     Queue    S    Jobs      Mem   %Mem      NC   %CPU   Walltime    I/O";
 
-            sprintf(linebuf,
-                "%8s %9s    %c  %6d %8.1f  %5.0f %7d  %5.0f   %8s %6.1f",
-                current_user, current_queue, current_state, njobs_sum,
-                mem_sum/gb_scale, 100*memutil, ncpus_sum,
-                100*cpuutil, timebuf, io_sum);
+    mvwprintw(win, HEADER_NROWS - 1, 0, "%-*s", COLS, header);
 
-            linebuf[1023] = '\0';
+    wattroff(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
 
-            mvwprintw(win, i, 0, "%s", linebuf);
+    summary_row_t *rows = malloc((maxrows > 0 ? maxrows:1)*sizeof(summary_row_t));
+    if (!rows) {
+        return 0;
+    }
+    nrows = jobs_summary(jobs, njobs, rows, maxrows);
 
-            wattroff(win, cattrs);
+    for (i = 0; i < nrows; i++) {
+        const summary_row_t *row = rows + i;
+        double cpuutil = row->cpuutil, memutil = row->memutil;
+        char linebuf[1024];
+        bool pre_state = !state_started(row->state);
 
-            // reset the stats
-            mem_r_sum     = 0.0;
-            mem_sum       = 0.0;
-            cput_sum      = 0;
-            walltime_sum  = 0;
-            ncpus_sum     = 0;
-            io_sum        = 0.0;
-            njobs_sum     = 0;
-            nwalltime_sum = 0;
-            current_user  = job->user;
-            current_state = job->state;
-            current_queue = job->queue;
+        char timebuf[16];
+        format_time(row->walltime, timebuf);
 
-            i++;
+        int cpair = 0;
+        switch (row->state) {
+        case JOB_RUNNING:
+            cpair = COLOR_PAIR_JOB_R;
+            break;
+        case JOB_QUEUED:
+            cpair = COLOR_PAIR_JOB_Q;
+            break;
+        case JOB_WAITING:
+            cpair = COLOR_PAIR_JOB_W;
+            break;
+        case JOB_HELD:
+            cpair = COLOR_PAIR_JOB_H;
+            break;
+        case JOB_SUSPENDED:
+            cpair = COLOR_PAIR_JOB_S;
+            break;
+        default:
+            cpair = COLOR_PAIR_JOB_OTHER;
+            break;
         }
 
-        mem_r_sum    += mem_r;
-        mem_sum      += mem;
-        cput_sum     += cput;
-        walltime_sum += walltime;
-        ncpus_sum    += ncpus;
-        io_sum       += io;
-        njobs_sum++;
+        if (!pre_state) {
+            double ncpus_avg = (double) row->ncpus/row->njobs;
+            double io_avg = (double) row->io/row->njobs;
+            double mem_avg = (double) row->mem/row->njobs;
+
+            double cpuutil_min, cpuutil_max = 1.25;
+            if (io_avg >= 1.0) {
+                cpuutil_min = 0.0;
+            } else
+            if (ncpus_avg >= 2.0) {
+                cpuutil_min = 1 - 1/ncpus_avg;
+            } else {
+                cpuutil_min = 0.9;
+            }
 
-        nwalltime_sum += ncpus*walltime;
+            // Test for "badness"
+            if (cpuutil < cpuutil_min || cpuutil > cpuutil_max ||
+                (memutil > 0 && memutil < 0.5 && mem_avg > 2.0)) {
+                cpair = COLOR_PAIR_JOB_BAD;
+            }
+        }
 
-        nj++;
-        if (nj < njobs) {
-            job++;
+        int cattrs = COLOR_PAIR(cpair);
+        if (i == selpos) {
+            cattrs |= A_REVERSE;
         }
+
+        wattron(win, cattrs);
+
+        sprintf(linebuf,
+            "%8s %9s    %c  %6d %8.1f  %5.0f %7d  %5.0f   %8s %6.1f",
+            row->user, row->queue, row->state, row->njobs,
+            row->mem/gb_scale, 100*memutil, row->ncpus,
+            100*cpuutil, timebuf, row->io);
+
+        linebuf[1023] = '\0';
+
+        mvwprintw(win, i + HEADER_NROWS, 0, "%s", linebuf);
+
+        wattroff(win, cattrs);
     }
 
+    xfree(rows);
+
     wclrtobot(win);
     wrefresh(win);
 
-    return i - HEADER_NROWS;
+    return nrows;
 }
 
-static void alert(const char *message)
+/* Bin of a running job in a histogram of given kind; -1 if not applicable */
+static int job_hist_bin(const job_t *job, const job_stats_t *st,
+    hist_kind_t kind)
 {
-    int msglen = strlen(message);
-    int width  = msglen + 6;
-    int height = 7;
+    double util;
 
-    if (width < 24) {
-        width = 24;
+    if (job->state != JOB_RUNNING) {
+        return -1;
     }
 
-    int starty = (LINES - height) / 2;
-    int startx = (COLS  - width)  / 2;
+    switch (kind) {
+    case HIST_CPU:
+        if (st->walltime <= 0) {
+            return -1;
+        }
+        util = st->cpuutil;
+        break;
+    case HIST_MEM:
+        if (job->mem_r <= 0) {
+            return -1;
+        }
+        util = st->memutil;
+        break;
+    case HIST_WALL:
+        if (job->walltime_r <= 0) {
+            return -1;
+        }
+        util = st->wallutil;
+        break;
+    default:
+        return -1;
+    }
 
-    WINDOW *win = newwin(height, width, starty, startx);
-    keypad(win, TRUE);
+    int bin = 100*util/HIST_BIN_WIDTH;
+    if (bin < 0) {
+        bin = 0;
+    } else
+    if (bin >= HIST_NBINS) {
+        bin = HIST_NBINS - 1;
+    }
 
-    bool in_loop = true;
-    while (in_loop) {
-        werase(win);
-        box(win, 0, 0);
+    return bin;
+}
 
-        mvwprintw(win, 2, (width - msglen)/2, "%s", message);
+/* Collect all the distributions in a single pass over the job table */
+static void jobs_histogram(const job_t *jobs, int njobs, histogram_t *h)
+{
+    int i, k;
 
-        int ok_x = width/2 - 3;
+    memset(h, 0, sizeof(histogram_t));
 
-        wattron(win, A_REVERSE);
-        mvwprintw(win, 4, ok_x, " OK ");
-        wattroff(win, A_REVERSE);
+    for (i = 0; i < njobs; i++) {
+        const job_t *job = jobs + i;
+        job_stats_t st;
 
-        wrefresh(win);
+        if (job->state != JOB_RUNNING) {
+            continue;
+        }
 
-        int ch = wgetch(win);
+        get_job_stats(job, &st);
+        h->nrunning++;
 
-        switch (ch) {
-        case '\n':
-        case '\r':
-        case KEY_ENTER:
-        case 27: /* Esc */
-            in_loop = false;
-            break;
+        for (k = 0; k < HIST_NKINDS; k++) {
+            int bin = job_hist_bin(job, &st, k);
+            if (bin >= 0) {
+                h->counts[k][bin]++;
+                h->total[k]++;
+                if (st.bad) {
+                    h->nbad[k][bin]++;
+                }
+            }
         }
     }
-
-    delwin(win);
-    touchwin(stdscr);
-    refresh();
 }
 
-static bool yes_no(const char *message)
+/* Drop jobs not falling in the histogram bin selected as a filter */
+static void jobs_filter_hist(const qtop_t *q, job_t *jobs, int *njobs)
 {
-    int msglen = strlen(message);
-    int width  = msglen + 6;
-    int height = 7;
+    int i, nkept = 0;
 
-    if (width < 24) {
-        width = 24;
+    if (q->hist_kind < 0) {
+        return;
     }
 
-    int starty = (LINES - height) / 2;
-    int startx = (COLS  - width)  / 2;
+    for (i = 0; i < *njobs; i++) {
+        job_t *job = jobs + i;
+        job_stats_t st;
 
-    WINDOW *win = newwin(height, width, starty, startx);
-    keypad(win, TRUE);
+        get_job_stats(job, &st);
+        if (job_hist_bin(job, &st, q->hist_kind) == q->hist_bin) {
+            if (nkept != i) {
+                jobs[nkept] = *job;
+            }
+            nkept++;
+        } else {
+            job_free_data(job);
+        }
+    }
 
-    int choice = 1;  /* 0 = Yes, 1 = No */
+    *njobs = nkept;
+}
 
-    bool in_loop = true;
-    while (in_loop) {
-        werase(win);
-        box(win, 0, 0);
+static void print_histogram(const histogram_t *h, WINDOW *win,
+    int selkind, int selbin, const qtop_t *q)
+{
+    int k, b;
 
-        mvwprintw(win, 2, (width - msglen)/2, "%s", message);
+    wattron(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+    mvwprintw(win, HEADER_NROWS - 1, 0, "%-*s", COLS,
+        "  Utilization of running jobs (bad jobs in red; Enter to filter)");
+    wattroff(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
 
-        int yes_x = width/2 - 8;
-        int no_x  = width/2 + 2;
+    wmove(win, HEADER_NROWS, 0);
+    wclrtobot(win);
 
-        if (choice == 0) {
-            wattron(win, A_REVERSE);
-        }
-        mvwprintw(win, 4, yes_x, " Yes ");
-        if (choice == 0) {
-            wattroff(win, A_REVERSE);
-        } else
-        if (choice == 1) {
-            wattron(win, A_REVERSE);
+    int chart_width = COLS/HIST_NKINDS;
+    /* label, space, bar, space, count */
+    int bar_width = chart_width - 7 - 1 - 1 - 6 - 2;
+    if (bar_width < 1) {
+        bar_width = 1;
+    }
+
+    unsigned int cmax = 0;
+    for (k = 0; k < HIST_NKINDS; k++) {
+        for (b = 0; b < HIST_NBINS; b++) {
+            if (h->counts[k][b] > cmax) {
+                cmax = h->counts[k][b];
+            }
         }
-        mvwprintw(win, 4, no_x, " No ");
-        if (choice == 1) {
-            wattroff(win, A_REVERSE);
+    }
+
+    for (k = 0; k < HIST_NKINDS; k++) {
+        int x0 = k*chart_width;
+        int y = HEADER_NROWS + 1;
+
+        if (y >= LINES) {
+            break;
         }
 
-        wrefresh(win);
+        wattron(win, A_BOLD);
+        mvwprintw(win, y, x0, "%s (%u jobs)", hist_titles[k], h->total[k]);
+        wattroff(win, A_BOLD);
+
+        for (b = 0; b < HIST_NBINS && y + 1 + b < LINES; b++) {
+            unsigned int count = h->counts[k][b];
+            unsigned int nbad = h->nbad[k][b];
+            int len = 0, len_bad = 0;
+            char lbuf[16];
+
+            if (cmax > 0) {
+                len = (long) bar_width*count/cmax;
+                len_bad = (long) bar_width*nbad/cmax;
+                if (count > 0 && len == 0) {
+                    len = 1;
+                }
+                if (nbad > 0 && len_bad == 0) {
+                    len_bad = 1;
+                }
+            }
 
-        int ch = wgetch(win);
+            format_hist_bin(lbuf, b);
 
-        switch (ch) {
-        case KEY_LEFT:
-            choice = 0;
-            break;
-        case KEY_RIGHT:
-            choice = 1;
-            break;
-        case '\n':
-        case '\r':
-        case KEY_ENTER:
-            in_loop = false;
-            break;
-        case 27: /* Esc */
-            in_loop = false;
-            choice = 1;
-            break;
+            int lattrs = 0;
+            if (k == selkind && b == selbin) {
+                lattrs |= A_REVERSE;
+            }
+            if (k == q->hist_kind && b == q->hist_bin) {
+                lattrs |= A_BOLD;
+            }
+
+            wattron(win, lattrs);
+            mvwprintw(win, y + 1 + b, x0, "%s", lbuf);
+            wattroff(win, lattrs);
+
+            waddch(win, ' ');
+            int i;
+            wattron(win, COLOR_PAIR(COLOR_PAIR_JOB_BAD) | A_REVERSE);
+            for (i = 0; i < len_bad; i++) {
+                waddch(win, ' ');
+            }
+            wattroff(win, COLOR_PAIR(COLOR_PAIR_JOB_BAD) | A_REVERSE);
+            wattron(win, COLOR_PAIR(COLOR_PAIR_JOB_R) | A_REVERSE);
+            for (; i < len; i++) {
+                waddch(win, ' ');
+            }
+            wattroff(win, COLOR_PAIR(COLOR_PAIR_JOB_R) | A_REVERSE);
+            wprintw(win, "%*s %6u", bar_width - len, "", count);
         }
     }
 
-    delwin(win);
-    touchwin(stdscr);
-    refresh();
-    return (choice == 0);
+    wrefresh(win);
+}
+
+/* Min-heap keeping the K largest values seen */
+static void topk_push(waste_entry_t *heap, int *n, double value, int index)
+{
+    int i;
+
+    if (value <= 0) {
+        return;
+    }
+
+    if (*n < LEADERBOARD_K) {
+        i = (*n)++;
+        while (i > 0 && heap[(i - 1)/2].value > value) {
+            heap[i] = heap[(i - 1)/2];
+            i = (i - 1)/2;
+        }
+    } else
+    if (value > heap[0].value) {
+        i = 0;
+        while (true) {
+            int c = 2*i + 1;
+            if (c >= *n) {
+                break;
+            }
+            if (c + 1 < *n && heap[c + 1].value < heap[c].value) {
+                c++;
+            }
+            if (heap[c].value >= value) {
+                break;
+            }
+            heap[i] = heap[c];
+            i = c;
+        }
+    } else {
+        return;
+    }
+
+    heap[i].value = value;
+    heap[i].index = index;
+}
+
+static int waste_comp(const void *a, const void *b)
+{
+    const waste_entry_t *wa = a, *wb = b;
+
+    if (wa->value < wb->value) {
+        return 1;
+    } else
+    if (wa->value > wb->value) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+unsigned int str_hash(const char *str)
+{
+    unsigned int h = 5381;
+    while (*str) {
+        h = 33*h + (unsigned char) *str++;
+    }
+    return h;
+}
+
+static user_waste_t *leaderboard_user(leaderboard_t *lb, const char *user)
+{
+    unsigned int i;
+
+    if (2*(lb->utable_used + 1) > lb->utable_size) {
+        unsigned int old_size = lb->utable_size;
+        user_waste_t *old = lb->utable;
+
+        lb->utable_size = old_size ? 2*old_size:256;
+        lb->utable = calloc(lb->utable_size, sizeof(user_waste_t));
+        if (!lb->utable) {
+            lb->utable = old;
+            lb->utable_size = old_size;
+            return NULL;
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old[i].user) {
+                unsigned int j = str_hash(old[i].user) & (lb->utable_size - 1);
+                while (lb->utable[j].user) {
+                    j = (j + 1) & (lb->utable_size - 1);
+                }
+                lb->utable[j] = old[i];
+            }
+        }
+        xfree(old);
+    }
+
+    i = str_hash(user) & (lb->utable_size - 1);
+    while (lb->utable[i].user) {
+        if (!strcmp(lb->utable[i].user, user)) {
+            return lb->utable + i;
+        }
+        i = (i + 1) & (lb->utable_size - 1);
+    }
+
+    lb->utable[i].user = user;
+    lb->utable_used++;
+
+    return lb->utable + i;
+}
+
+static void leaderboard_free(leaderboard_t *lb)
+{
+    if (lb) {
+        xfree(lb->utable);
+    }
+}
+
+/*
+ * Wasted core-hours are the allocated but unused CPU time; wasted GB-hours
+ * are the requested but unused memory times the walltime. For running jobs,
+ * the projection assumes the current rate of waste till walltime_r.
+ */
+static void jobs_leaderboard(const job_t *jobs, int njobs, leaderboard_t *lb)
+{
+    const double gb_scale = pow(2, 20);
+    int i, h, k;
+    unsigned int iu;
+
+    memset(lb->njobs, 0, sizeof(lb->njobs));
+    memset(lb->nusers, 0, sizeof(lb->nusers));
+    if (lb->utable) {
+        memset(lb->utable, 0, lb->utable_size*sizeof(user_waste_t));
+    }
+    lb->utable_used = 0;
+
+    for (i = 0; i < njobs; i++) {
+        const job_t *job = jobs + i;
+        double waste[WASTE_NHORIZONS][WASTE_NKINDS];
+        bool running;
+
+        switch (job->state) {
+        case JOB_RUNNING:
+        case JOB_EXITING:
+        case JOB_SUSPENDED:
+            running = true;
+            break;
+        case JOB_FINISHED:
+        case JOB_SUB_COMPLETED:
+            running = false;
+            break;
+        default:
+            continue;
+        }
+
+        if (job->walltime_u <= 0 || job->is_array) {
+            continue;
+        }
+
+        double core_secs = (double) job->ncpus_u*job->walltime_u - job->cput_u;
+        waste[WASTE_SO_FAR][WASTE_CPU] = core_secs > 0 ? core_secs/3600:0;
+        if (job->mem_r > job->mem_u) {
+            waste[WASTE_SO_FAR][WASTE_MEM] =
+                (job->mem_r - job->mem_u)/gb_scale*job->walltime_u/3600;
+        } else {
+            waste[WASTE_SO_FAR][WASTE_MEM] = 0;
+        }
+
+        for (k = 0; k < WASTE_NKINDS; k++) {
+            if (running && job->walltime_r > job->walltime_u) {
+                waste[WASTE_PROJECTED][k] = waste[WASTE_SO_FAR][k]*
+                    job->walltime_r/job->walltime_u;
+            } else {
+                waste[WASTE_PROJECTED][k] = waste[WASTE_SO_FAR][k];
+            }
+        }
+
+        user_waste_t *uw = job->user ? leaderboard_user(lb, job->user):NULL;
+        if (uw) {
+            uw->njobs++;
+        }
+
+        for (h = 0; h < WASTE_NHORIZONS; h++) {
+            for (k = 0; k < WASTE_NKINDS; k++) {
+                topk_push(lb->jobs[h][k], &lb->njobs[h][k], waste[h][k], i);
+                if (uw) {
+                    uw->waste[h][k] += waste[h][k];
+                }
+            }
+        }
+    }
+
+    for (iu = 0; iu < lb->utable_size; iu++) {
+        const user_waste_t *uw = lb->utable + iu;
+        if (!uw->user) {
+            continue;
+        }
+        for (h = 0; h < WASTE_NHORIZONS; h++) {
+            for (k = 0; k < WASTE_NKINDS; k++) {
+                topk_push(lb->users[h][k], &lb->nusers[h][k],
+                    uw->waste[h][k], iu);
+            }
+        }
+    }
+
+    // only the K winners get sorted
+    for (h = 0; h < WASTE_NHORIZONS; h++) {
+        for (k = 0; k < WASTE_NKINDS; k++) {
+            qsort(lb->jobs[h][k], lb->njobs[h][k],
+                sizeof(waste_entry_t), waste_comp);
+            qsort(lb->users[h][k], lb->nusers[h][k],
+                sizeof(waste_entry_t), waste_comp);
+        }
+    }
+}
+
+static void print_leaderboard(const leaderboard_t *lb,
+    const job_t *jobs, int njobs, WINDOW *win,
+    waste_kind_t kind, waste_horizon_t horizon)
+{
+    int i;
+    char header[128];
+
+    snprintf(header, 128, "  Top wasters by %s, %s",
+        kind == WASTE_CPU ? "core-hours":"GB-hours",
+        horizon == WASTE_SO_FAR ? "so far":"projected to walltime limit");
+
+    wattron(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+    mvwprintw(win, HEADER_NROWS - 1, 0, "%-*s", COLS, header);
+    wattroff(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+
+    wmove(win, HEADER_NROWS, 0);
+    wclrtobot(win);
+
+    int xu = COLS/2;
+    const char *unit = kind == WASTE_CPU ? "Core-h":"  GB-h";
+
+    wattron(win, A_BOLD);
+    mvwprintw(win, HEADER_NROWS, 0, "  Job ID     User  NC  Walltime   %s",
+        unit);
+    mvwprintw(win, HEADER_NROWS, xu, "    User  Jobs   %s", unit);
+    wattroff(win, A_BOLD);
+
+    for (i = 0; i < lb->njobs[horizon][kind] &&
+            HEADER_NROWS + 1 + i < LINES; i++) {
+        const waste_entry_t *we = &lb->jobs[horizon][kind][i];
+        const job_t *job;
+        char idbuf[32], timebuf[16];
+
+        if (we->index >= njobs) {
+            continue;
+        }
+        job = jobs + we->index;
+
+        format_job_id(job, idbuf);
+        format_time(job->walltime_u, timebuf);
+
+        mvwprintw(win, HEADER_NROWS + 1 + i, 0, "%8s %8s %3d  %8s %8.1f",
+            idbuf, job->user, job->ncpus_u, timebuf, we->value);
+    }
+
+    for (i = 0; i < lb->nusers[horizon][kind] &&
+            HEADER_NROWS + 1 + i < LINES; i++) {
+        const waste_entry_t *we = &lb->users[horizon][kind][i];
+        const user_waste_t *uw = lb->utable + we->index;
+
+        mvwprintw(win, HEADER_NROWS + 1 + i, xu, "%8s %5u %8.1f",
+            uw->user, uw->njobs, we->value);
+    }
+
+    wrefresh(win);
+}
+
+static int forecast_point_comp(const void *a, const void *b)
+{
+    const forecast_point_t *pa = a, *pb = b;
+
+    if (pa->when < pb->when) {
+        return -1;
+    } else
+    if (pa->when > pb->when) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static void forecast_free(forecast_t *fc)
+{
+    if (fc) {
+        xfree(fc->points);
+    }
+}
+
+/*
+ * Sweep the projected end times of running jobs (walltime_r - walltime_u
+ * from now) into a cumulative timeline of released cores and memory.
+ */
+static void forecast_update(forecast_t *fc, const server_t *pbs,
+    const job_t *jobs, int njobs)
+{
+    int i, n = 0;
+
+    fc->stamp       = time(NULL);
+    fc->ncpus_total = pbs->ncpus_avail;
+    fc->mem_total   = pbs->mem_avail;
+    // negative if oversubscribed
+    fc->ncpus_free  = (long) pbs->ncpus_avail - (long) pbs->ncpus;
+    // with no memory total known, memory isn't a constraint
+    fc->mem_free    = pbs->mem_avail > 0 ? pbs->mem_avail - pbs->mem:0;
+    fc->npoints     = 0;
+
+    if (njobs > fc->size) {
+        forecast_point_t *points = realloc(fc->points,
+            njobs*sizeof(forecast_point_t));
+        if (!points) {
+            return;
+        }
+        fc->points = points;
+        fc->size = njobs;
+    }
+
+    for (i = 0; i < njobs; i++) {
+        const job_t *job = jobs + i;
+        forecast_point_t *p = fc->points + n;
+
+        if (job->is_array ||
+            (job->state != JOB_RUNNING && job->state != JOB_EXITING)) {
+            continue;
+        }
+        // no walltime limit - never ends as far as we know
+        if (job->walltime_r <= 0) {
+            continue;
+        }
+
+        p->when = job->walltime_r - job->walltime_u;
+        if (p->when < 0 || job->state == JOB_EXITING) {
+            p->when = 0;
+        }
+        p->ncpus = job->ncpus_r;
+        p->mem   = job->mem_r;
+        n++;
+    }
+
+    qsort(fc->points, n, sizeof(forecast_point_t), forecast_point_comp);
+
+    // merge simultaneous events and turn them into prefix sums
+    for (i = 0; i < n; i++) {
+        const forecast_point_t *p = fc->points + i;
+        forecast_point_t *last = fc->npoints > 0 ?
+            fc->points + fc->npoints - 1:NULL;
+        if (last && last->when == p->when) {
+            last->ncpus += p->ncpus;
+            last->mem   += p->mem;
+        } else {
+            forecast_point_t point = *p;
+            if (last) {
+                point.ncpus += last->ncpus;
+                point.mem   += last->mem;
+            }
+            fc->points[fc->npoints++] = point;
+        }
+    }
+}
+
+/* Index of the last point not later than t; -1 if before the first one */
+static int forecast_find(const forecast_t *fc, long t)
+{
+    int lo = 0, hi = fc->npoints;
+
+    while (lo < hi) {
+        int mid = (lo + hi)/2;
+        if (fc->points[mid].when <= t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo - 1;
+}
+
+static void forecast_at(const forecast_t *fc, long t, long *ncpus, long *mem)
+{
+    int i = forecast_find(fc, t);
+
+    *ncpus = fc->ncpus_free;
+    *mem   = fc->mem_free;
+    if (i >= 0) {
+        *ncpus += fc->points[i].ncpus;
+        *mem   += fc->points[i].mem;
+    }
+}
+
+/*
+ * Earliest moment (seconds from now) a job of the given size could fit,
+ * ignoring other queued jobs; -1 if never. Free resources only grow, so
+ * this is a binary search over the prefix sums.
+ */
+static long forecast_fit(const forecast_t *fc, long ncpus, long mem)
+{
+    int lo = 0, hi = fc->npoints;
+
+    if (fc->mem_total <= 0) {
+        mem = 0;
+    }
+
+    if (ncpus > fc->ncpus_total || mem > fc->mem_total) {
+        return -1;
+    }
+    if (fc->ncpus_free >= ncpus && fc->mem_free >= mem) {
+        return 0;
+    }
+
+    while (lo < hi) {
+        int mid = (lo + hi)/2;
+        if (fc->ncpus_free + fc->points[mid].ncpus >= ncpus &&
+            fc->mem_free + fc->points[mid].mem >= mem) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    if (lo == fc->npoints) {
+        return -1;
+    } else {
+        return fc->points[lo].when;
+    }
+}
+
+static void print_forecast(const forecast_t *fc, WINDOW *win,
+    long ncpus, long mem)
+{
+    const double gb_scale = pow(2, 20);
+    char header[128];
+    int i;
+
+    if (fc->mem_total > 0) {
+        snprintf(header, 128,
+            "  Forecast of free resources (total: %ld cores, %.1f GiB)",
+            fc->ncpus_total, fc->mem_total/gb_scale);
+    } else {
+        snprintf(header, 128,
+            "  Forecast of free resources (total: %ld cores, memory unknown)",
+            fc->ncpus_total);
+    }
+
+    wattron(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+    mvwprintw(win, HEADER_NROWS - 1, 0, "%-*s", COLS, header);
+    wattroff(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+
+    wmove(win, HEADER_NROWS, 0);
+    wclrtobot(win);
+
+    if (fc->ncpus_total <= 0) {
+        mvwprintw(win, HEADER_NROWS, 0, "  Server capacity is unknown");
+        wrefresh(win);
+        return;
+    }
+
+    long fit = forecast_fit(fc, ncpus, mem);
+    wattron(win, A_BOLD);
+    if (fit < 0) {
+        mvwprintw(win, HEADER_NROWS, 0,
+            "  A job of %ld cores and %.1f GiB won't fit in running jobs' "
+            "lifetime", ncpus, mem/gb_scale);
+    } else {
+        char timebuf[16], datebuf[32];
+        time_t start = fc->stamp + fit;
+        format_time(fit, timebuf);
+        strftime(datebuf, 32, "%a %T", localtime(&start));
+        mvwprintw(win, HEADER_NROWS, 0,
+            "  A job of %ld cores and %.1f GiB could start in %s (%s)",
+            ncpus, mem/gb_scale, timebuf, datebuf);
+    }
+    wattroff(win, A_BOLD);
+
+    int nrows = LINES - HEADER_NROWS - 3;
+    if (nrows < 1) {
+        wrefresh(win);
+        return;
+    }
+
+    long horizon = fc->npoints > 0 ? fc->points[fc->npoints - 1].when:0;
+    if (horizon < 3600) {
+        horizon = 3600;
+    }
+    long step = (horizon + nrows - 1)/nrows;
+
+    wattron(win, A_BOLD);
+    mvwprintw(win, HEADER_NROWS + 2, 0, "%10s %8s %8s", "In", "Cores",
+        "Mem,GiB");
+    wattroff(win, A_BOLD);
+
+    int bar_width = COLS - 30;
+    for (i = 0; i < nrows; i++) {
+        long t = i*step, fcpus, fmem;
+        char timebuf[16];
+        int len = 0, j;
+
+        forecast_at(fc, t, &fcpus, &fmem);
+        format_time(t, timebuf);
+        if (bar_width > 0 && fcpus > 0) {
+            len = fcpus < fc->ncpus_total ?
+                bar_width*fcpus/fc->ncpus_total:bar_width;
+        }
+
+        int cpair = fcpus >= ncpus && (fmem >= mem || fc->mem_total <= 0) ?
+            COLOR_PAIR_JOB_R:COLOR_PAIR_JOB_Q;
+        mvwprintw(win, HEADER_NROWS + 3 + i, 0, "%10s %8ld %8.1f ",
+            timebuf, fcpus, fmem/gb_scale);
+        wattron(win, COLOR_PAIR(cpair) | A_REVERSE);
+        for (j = 0; j < len; j++) {
+            waddch(win, ' ');
+        }
+        wattroff(win, COLOR_PAIR(cpair) | A_REVERSE);
+    }
+
+    wrefresh(win);
+}
+
+static int sketch_bin(double x)
+{
+    int i = ceil(log(x)/log(SKETCH_GAMMA));
+
+    return i < SKETCH_NBINS ? i:SKETCH_NBINS - 1;
+}
+
+/* the midpoint (in relative terms) of a bin */
+static double sketch_bin_value(int i)
+{
+    return 2*pow(SKETCH_GAMMA, i)/(SKETCH_GAMMA + 1);
+}
+
+static void sketch_add(sketch_t *s, long wait)
+{
+    if (wait < 1) {
+        s->nzero++;
+    } else {
+        s->counts[sketch_bin(wait)]++;
+    }
+    s->n++;
+}
+
+static void sketch_merge(sketch_t *dst, const sketch_t *src)
+{
+    int i;
+
+    for (i = 0; i < SKETCH_NBINS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->nzero += src->nzero;
+    dst->n += src->n;
+}
+
+/* the value at quantile q (0 to 1) */
+static double sketch_quantile(const sketch_t *s, double q)
+{
+    double rank = q*(s->n - 1);
+    unsigned int c = s->nzero;
+    int i;
+
+    if (s->n == 0 || rank < c) {
+        return 0;
+    }
+    for (i = 0; i < SKETCH_NBINS; i++) {
+        c += s->counts[i];
+        if (rank < c) {
+            break;
+        }
+    }
+
+    return sketch_bin_value(i < SKETCH_NBINS ? i:SKETCH_NBINS - 1);
+}
+
+/* the fraction of values not exceeding x */
+static double sketch_cdf(const sketch_t *s, double x)
+{
+    unsigned int c = s->nzero;
+    int i, bin;
+
+    if (s->n == 0) {
+        return 0;
+    }
+    if (x < 1) {
+        return (double) c/s->n;
+    }
+    bin = sketch_bin(x);
+    for (i = 0; i <= bin; i++) {
+        c += s->counts[i];
+    }
+
+    return (double) c/s->n;
+}
+
+static const char *wait_size_names[WAIT_NSIZES] = {
+    "1", "2-4", "5-16", "17-64", "65-256", "257+"
+};
+
+static int wait_size(long ncpus)
+{
+    if (ncpus <= 1) {
+        return 0;
+    } else
+    if (ncpus <= 4) {
+        return 1;
+    } else
+    if (ncpus <= 16) {
+        return 2;
+    } else
+    if (ncpus <= 64) {
+        return 3;
+    } else
+    if (ncpus <= 256) {
+        return 4;
+    } else {
+        return 5;
+    }
+}
+
+/* The sketches of a queue, added (in order by name) if needed */
+static queue_waits_t *waits_queue(waits_t *w, const char *queue, bool add)
+{
+    int i;
+
+    for (i = 0; i < w->nqueues; i++) {
+        int cmp = strcmp(w->queues[i].queue, queue);
+        if (cmp == 0) {
+            return w->queues + i;
+        } else
+        if (cmp > 0) {
+            break;
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+
+    queue_waits_t *queues = realloc(w->queues,
+        (w->nqueues + 1)*sizeof(queue_waits_t));
+    if (!queues) {
+        return NULL;
+    }
+    w->queues = queues;
+    memmove(queues + i + 1, queues + i,
+        (w->nqueues - i)*sizeof(queue_waits_t));
+    memset(queues + i, 0, sizeof(queue_waits_t));
+    queues[i].queue = strdup(queue);
+    w->nqueues++;
+
+    return queues + i;
+}
+
+static unsigned long long job_key(const job_t *job)
+{
+    return ((unsigned long long) job->id << 32) | job->aid;
+}
+
+static void waits_add(waits_t *w, const job_t *job)
+{
+    queue_waits_t *qw;
+
+    if (job->is_array || !job->queue || job->qtime <= 0 ||
+        job->stime < job->qtime) {
+        return;
+    }
+    if ((qw = waits_queue(w, job->queue, true))) {
+        sketch_add(qw->sizes + wait_size(job->ncpus_r),
+            job->stime - job->qtime);
+    }
+}
+
+static void waits_free(waits_t *w)
+{
+    int i;
+
+    for (i = 0; i < w->nqueues; i++) {
+        xfree(w->queues[i].queue);
+    }
+    xfree(w->queues);
+    xfree(w->edge);
+    memset(w, 0, sizeof(waits_t));
+}
+
+static bool waits_edge_has(const waits_t *w, unsigned long long key)
+{
+    int i;
+
+    for (i = 0; i < w->nedge; i++) {
+        if (w->edge[i] == key) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void waits_edge_add(waits_t *w, unsigned long long key)
+{
+    if (w->nedge == w->edge_size) {
+        int size = w->edge_size ? 2*w->edge_size:64;
+        unsigned long long *edge = realloc(w->edge, size*sizeof(*edge));
+        if (!edge) {
+            return;
+        }
+        w->edge = edge;
+        w->edge_size = size;
+    }
+    w->edge[w->nedge++] = key;
+}
+
+/*
+ * Fold in the jobs started since the watermark, of all users and in any
+ * state, finished ones included. Each job's start crosses the watermark
+ * once, so it's counted once, however long it keeps running; those of the
+ * watermark's second are selected again and skipped by key. Accounting
+ * jobs are only appended to the history, so these are folded in by count.
+ */
+static void waits_update(const qtop_t *q, waits_t *w)
+{
+    struct batch_status *qstatus, *qtmp;
+    struct attropl *criteria_list;
+    struct attrl qattribs[4];
+    char buf[32];
+    int i;
+
+    if (q->acct) {
+        for (i = w->nacct; i < q->nhistory; i++) {
+            waits_add(w, q->history + i);
+        }
+        w->nacct = q->nhistory;
+        return;
+    }
+
+    if (w->watermark == 0) {
+        w->watermark = time(NULL) - 3600*q->history_span;
+    }
+    sprintf(buf, "%ld", w->watermark);
+
+    memset(qattribs, 0, sizeof(qattribs));
+    qattribs[0].name = ATTR_queue;
+    qattribs[0].value = "";
+    qattribs[0].next = qattribs + 1;
+    qattribs[1].name = ATTR_l;
+    qattribs[1].value = "";
+    qattribs[1].next = qattribs + 2;
+    qattribs[2].name = ATTR_qtime;
+    qattribs[2].value = "";
+    qattribs[2].next = qattribs + 3;
+    qattribs[3].name = ATTR_stime;
+    qattribs[3].value = "";
+
+    criteria_list = attropl_add(NULL, ATTR_stime, buf, GE);
+    qstatus = backend->selstat(q->conn, criteria_list, qattribs, "xt");
+    attropl_free(criteria_list);
+    if (!qstatus && pbs_errno != PBSE_NONE) {
+        // the same jobs are asked for the next time
+        w->error = pbs_errno;
+        return;
+    }
+    w->error = 0;
+
+    long watermark = w->watermark;
+    for (qtmp = qstatus; qtmp; qtmp = qtmp->next) {
+        job_t job;
+
+        memset(&job, 0, sizeof(job_t));
+        parse_job_status(&job, qtmp);
+        // those of the watermark's second are selected again
+        if (job.stime > w->watermark ||
+            (job.stime == w->watermark && !waits_edge_has(w, job_key(&job)))) {
+            waits_add(w, &job);
+        }
+        if (job.stime > watermark) {
+            watermark = job.stime;
+        }
+        job_free_data(&job);
+    }
+
+    // those of the new watermark's second, to skip the next time
+    if (watermark != w->watermark) {
+        w->nedge = 0;
+    }
+    for (qtmp = qstatus; qtmp; qtmp = qtmp->next) {
+        job_t job;
+
+        memset(&job, 0, sizeof(job_t));
+        parse_job_status(&job, qtmp);
+        if (job.stime == watermark && !waits_edge_has(w, job_key(&job))) {
+            waits_edge_add(w, job_key(&job));
+        }
+        job_free_data(&job);
+    }
+    w->watermark = watermark;
+
+    if (qstatus) {
+        backend->statfree(qstatus);
+    }
+}
+
+static void format_wait(double secs, char buf[16])
+{
+    if (secs < 60) {
+        sprintf(buf, "%.0fs", secs);
+    } else
+    if (secs < 3600) {
+        sprintf(buf, "%.1fm", secs/60);
+    } else
+    if (secs < 86400) {
+        sprintf(buf, "%.1fh", secs/3600);
+    } else {
+        sprintf(buf, "%.1fd", secs/86400);
+    }
+}
+
+/* A row of wait quantiles; returns the next row */
+static int print_wait_row(WINDOW *win, int row, const char *queue,
+    const char *size, const sketch_t *s)
+{
+    char p50[16], p90[16], p99[16];
+
+    if (row >= LINES) {
+        return row;
+    }
+
+    format_wait(sketch_quantile(s, 0.5), p50);
+    format_wait(sketch_quantile(s, 0.9), p90);
+    format_wait(sketch_quantile(s, 0.99), p99);
+    mvwprintw(win, row, 0, "%-16.16s %7s %8u %8s %8s %8s",
+        queue, size, s->n, p50, p90, p99);
+
+    return row + 1;
+}
+
+/*
+ * Predict the rest of the wait of a job queued since qtime from the waits
+ * of alike jobs that waited at least as long already. Too few of these
+ * (by size), and all of the queue is taken instead.
+ */
+static void print_wait_prediction(const waits_t *w, WINDOW *win,
+    const char *queue, long ncpus, long qtime)
+{
+    const queue_waits_t *qw = waits_queue((waits_t *) w, queue, false);
+    sketch_t s;
+    int i;
+
+    if (!qw) {
+        mvwprintw(win, HEADER_NROWS, 0,
+            "  No jobs have started from queue %s yet", queue);
+        return;
+    }
+
+    s = qw->sizes[wait_size(ncpus)];
+    if (s.n < 20) {
+        memset(&s, 0, sizeof(sketch_t));
+        for (i = 0; i < WAIT_NSIZES; i++) {
+            sketch_merge(&s, qw->sizes + i);
+        }
+    }
+
+    long waited = time(NULL) - qtime;
+    if (waited < 0) {
+        waited = 0;
+    }
+    double p0 = sketch_cdf(&s, waited);
+    char waitbuf[16], p50[16], p90[16];
+    format_wait(waited, waitbuf);
+
+    wattron(win, A_BOLD);
+    if (p0 >= 1) {
+        mvwprintw(win, HEADER_NROWS, 0,
+            "  A %ld-core job in %s has waited %s, longer than any started",
+            ncpus, queue, waitbuf);
+    } else {
+        double r50 = sketch_quantile(&s, p0 + 0.5*(1 - p0)) - waited;
+        double r90 = sketch_quantile(&s, p0 + 0.9*(1 - p0)) - waited;
+        format_wait(r50 > 0 ? r50:0, p50);
+        format_wait(r90 > 0 ? r90:0, p90);
+        mvwprintw(win, HEADER_NROWS, 0,
+            "  A %ld-core job in %s has waited %s; likely to start in %s "
+            "(90%%: %s)", ncpus, queue, waitbuf, p50, p90);
+    }
+    wattroff(win, A_BOLD);
+}
+
+static void print_waits(const waits_t *w, WINDOW *win,
+    const char *queue, long ncpus, long qtime)
+{
+    int i, j, row;
+
+    wattron(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+    mvwprintw(win, HEADER_NROWS - 1, 0, "%-*s", COLS,
+        "  Queue wait of started jobs");
+    wattroff(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+
+    wmove(win, HEADER_NROWS, 0);
+    wclrtobot(win);
+
+    if (queue) {
+        print_wait_prediction(w, win, queue, ncpus, qtime);
+    } else
+    if (w->error) {
+        mvwprintw(win, HEADER_NROWS, 0,
+            "  Failed fetching the started jobs, errno = %d", w->error);
+    }
+
+    wattron(win, A_BOLD);
+    mvwprintw(win, HEADER_NROWS + 2, 0, "%-16s %7s %8s %8s %8s %8s",
+        "Queue", "Cores", "Jobs", "p50", "p90", "p99");
+    wattroff(win, A_BOLD);
+
+    row = HEADER_NROWS + 3;
+    for (i = 0; i < w->nqueues; i++) {
+        const queue_waits_t *qw = w->queues + i;
+        sketch_t all;
+        int nsizes = 0;
+
+        memset(&all, 0, sizeof(sketch_t));
+        for (j = 0; j < WAIT_NSIZES; j++) {
+            const sketch_t *s = qw->sizes + j;
+            if (s->n > 0) {
+                row = print_wait_row(win, row, nsizes ? "":qw->queue,
+                    wait_size_names[j], s);
+                sketch_merge(&all, s);
+                nsizes++;
+            }
+        }
+        if (nsizes > 1) {
+            wattron(win, A_BOLD);
+            row = print_wait_row(win, row, "", "all", &all);
+            wattroff(win, A_BOLD);
+        }
+    }
+
+    wrefresh(win);
+}
+
+static void depindex_free(depindex_t *di)
+{
+    if (di) {
+        xfree(di->hids);
+        xfree(di->hidx);
+        xfree(di->up_start);
+        xfree(di->up);
+        xfree(di->down_start);
+        xfree(di->down);
+        xfree(di->edges);
+    }
+}
+
+static int depindex_lookup(const depindex_t *di, unsigned int id)
+{
+    unsigned int i;
+
+    if (!di->hsize || !id) {
+        return -1;
+    }
+
+    i = (id*2654435761u) & (di->hsize - 1);
+    while (di->hids[i]) {
+        if (di->hids[i] == id) {
+            return di->hidx[i];
+        }
+        i = (i + 1) & (di->hsize - 1);
+    }
+
+    return -1;
+}
+
+static bool depindex_add_edge(depindex_t *di, unsigned int up,
+    unsigned int down)
+{
+    if (2*(di->nedges + 1) > di->edges_size) {
+        int size = di->edges_size ? 2*di->edges_size:256;
+        unsigned int *edges = realloc(di->edges, size*sizeof(unsigned int));
+        if (!edges) {
+            return false;
+        }
+        di->edges = edges;
+        di->edges_size = size;
+    }
+
+    di->edges[2*di->nedges]     = up;
+    di->edges[2*di->nedges + 1] = down;
+    di->nedges++;
+
+    return true;
+}
+
+/*
+ * Parse a depend attribute, e.g. "afterok:123.srv:124.srv,beforeany:130.srv",
+ * into edges. For "after*" types, the listed jobs are upstream of this one;
+ * for "before*" ones, downstream.
+ */
+static void depindex_parse(depindex_t *di, unsigned int id, const char *depend)
+{
+    const char *p = depend;
+
+    while (p && *p) {
+        bool after = !strncmp(p, "after", 5);
+        bool before = !strncmp(p, "before", 6);
+        const char *end = strchr(p, ',');
+        const char *c = strchr(p, ':');
+
+        while ((after || before) && c && (!end || c < end)) {
+            unsigned int other = strtoul(c + 1, NULL, 10);
+            if (other) {
+                if (after) {
+                    depindex_add_edge(di, other, id);
+                } else {
+                    depindex_add_edge(di, id, other);
+                }
+            }
+            c = strchr(c + 1, ':');
+        }
+
+        p = end ? end + 1:NULL;
+    }
+}
+
+static bool depindex_csr(int **start, unsigned int **adj, int njobs,
+    int nedges)
+{
+    int *s = realloc(*start, (njobs + 1)*sizeof(int));
+    if (!s) {
+        return false;
+    }
+    *start = s;
+    memset(s, 0, (njobs + 1)*sizeof(int));
+
+    unsigned int *a = realloc(*adj,
+        (nedges > 0 ? nedges:1)*sizeof(unsigned int));
+    if (!a) {
+        return false;
+    }
+    *adj = a;
+
+    return true;
+}
+
+/*
+ * Drop the edges listed twice, e.g., declared at both ends, keeping the
+ * first of each; hashing the pairs, as the ids are sparse
+ */
+static void depindex_dedupe(depindex_t *di)
+{
+    unsigned int hsize = 64;
+    int e, n = 0;
+
+    while (hsize < 2*(unsigned int) di->nedges) {
+        hsize <<= 1;
+    }
+    // edge index + 1, 0 if free
+    int *slots = calloc(hsize, sizeof(int));
+    if (!slots) {
+        return;
+    }
+
+    for (e = 0; e < di->nedges; e++) {
+        unsigned int up = di->edges[2*e], down = di->edges[2*e + 1];
+        unsigned int h = (up*2654435761u ^ down*40503u) & (hsize - 1);
+        while (slots[h] && (di->edges[2*(slots[h] - 1)] != up ||
+            di->edges[2*(slots[h] - 1) + 1] != down)) {
+            h = (h + 1) & (hsize - 1);
+        }
+        if (slots[h]) {
+            continue;
+        }
+        di->edges[2*n]     = up;
+        di->edges[2*n + 1] = down;
+        slots[h] = ++n;
+    }
+    di->nedges = n;
+
+    xfree(slots);
+}
+
+/* Rebuild the index in a time linear in the number of jobs and edges */
+static void depindex_build(depindex_t *di, const job_t *jobs, int njobs)
+{
+    int i, e;
+    unsigned int hsize = 64;
+
+    di->njobs = 0;
+    di->nedges = 0;
+
+    while (hsize < 2*(unsigned int) njobs) {
+        hsize <<= 1;
+    }
+    if (hsize != di->hsize) {
+        xfree(di->hids);
+        xfree(di->hidx);
+        di->hids = malloc(hsize*sizeof(unsigned int));
+        di->hidx = malloc(hsize*sizeof(int));
+        if (!di->hids || !di->hidx) {
+            di->hsize = 0;
+            return;
+        }
+        di->hsize = hsize;
+    }
+    memset(di->hids, 0, hsize*sizeof(unsigned int));
+
+    for (i = 0; i < njobs; i++) {
+        const job_t *job = jobs + i;
+        if (job->aid) {
+            continue;
+        }
+        unsigned int h = (job->id*2654435761u) & (hsize - 1);
+        while (di->hids[h] && di->hids[h] != job->id) {
+            h = (h + 1) & (hsize - 1);
+        }
+        di->hids[h] = job->id;
+        di->hidx[h] = i;
+
+        if (job->depend) {
+            depindex_parse(di, job->id, job->depend);
+        }
+    }
+
+    // an edge may be declared at both ends
+    depindex_dedupe(di);
+
+    if (!depindex_csr(&di->up_start, &di->up, njobs, di->nedges) ||
+        !depindex_csr(&di->down_start, &di->down, njobs, di->nedges)) {
+        return;
+    }
+
+    for (e = 0; e < di->nedges; e++) {
+        int iup = depindex_lookup(di, di->edges[2*e]);
+        int idown = depindex_lookup(di, di->edges[2*e + 1]);
+        if (idown >= 0) {
+            di->up_start[idown + 1]++;
+        }
+        if (iup >= 0) {
+            di->down_start[iup + 1]++;
+        }
+    }
+    for (i = 0; i < njobs; i++) {
+        di->up_start[i + 1] += di->up_start[i];
+        di->down_start[i + 1] += di->down_start[i];
+    }
+    for (e = 0; e < di->nedges; e++) {
+        int iup = depindex_lookup(di, di->edges[2*e]);
+        int idown = depindex_lookup(di, di->edges[2*e + 1]);
+        if (idown >= 0) {
+            di->up[di->up_start[idown]++] = di->edges[2*e];
+        }
+        if (iup >= 0) {
+            di->down[di->down_start[iup]++] = di->edges[2*e + 1];
+        }
+    }
+    // restore the starts shifted by the fill
+    for (i = njobs; i > 0; i--) {
+        di->up_start[i] = di->up_start[i - 1];
+        di->down_start[i] = di->down_start[i - 1];
+    }
+    di->up_start[0] = 0;
+    di->down_start[0] = 0;
+
+    di->njobs = njobs;
+}
+
+#define DEPEND_MAXDEPTH 16
+
+static void print_depend_tree(const depindex_t *di, const job_t *jobs,
+    WINDOW *win, int ij, bool upstream, int depth, unsigned char *visited,
+    int *y)
+{
+    const int *start = upstream ? di->up_start:di->down_start;
+    const unsigned int *adj = upstream ? di->up:di->down;
+    int e;
+
+    for (e = start[ij]; e < start[ij + 1] && *y < LINES; e++) {
+        unsigned int id = adj[e];
+        int other = depindex_lookup(di, id);
+
+        wmove(win, *y, 2*depth + 2);
+        waddch(win, e == start[ij + 1] - 1 ? ACS_LLCORNER:ACS_LTEE);
+        waddch(win, ACS_HLINE);
+
+        if (other < 0) {
+            wprintw(win, " %u (not listed)", id);
+        } else {
+            const job_t *job = jobs + other;
+            int cpair;
+            switch (job->state) {
+            case JOB_RUNNING:
+                cpair = COLOR_PAIR_JOB_R;
+                break;
+            case JOB_QUEUED:
+                cpair = COLOR_PAIR_JOB_Q;
+                break;
+            case JOB_HELD:
+                cpair = COLOR_PAIR_JOB_H;
+                break;
+            default:
+                cpair = COLOR_PAIR_JOB_OTHER;
+                break;
+            }
+            wattron(win, COLOR_PAIR(cpair));
+            wprintw(win, " %u %c %s %s", id, job->state,
+                job->user ? job->user:"", job->name ? job->name:"");
+            wattroff(win, COLOR_PAIR(cpair));
+        }
+        (*y)++;
+
+        if (other >= 0 && !visited[other] && depth < DEPEND_MAXDEPTH) {
+            visited[other] = 1;
+            print_depend_tree(di, jobs, win, other, upstream, depth + 1,
+                visited, y);
+        }
+    }
+}
+
+static void print_depend(const depindex_t *di, const job_t *jobs, int njobs,
+    WINDOW *win, unsigned int id)
+{
+    char header[128];
+    int ij = depindex_lookup(di, id);
+
+    snprintf(header, 128, "  Dependencies of job %u", id);
+    wattron(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+    mvwprintw(win, HEADER_NROWS - 1, 0, "%-*s", COLS, header);
+    wattroff(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+
+    wmove(win, HEADER_NROWS, 0);
+    wclrtobot(win);
+
+    if (ij < 0 || di->njobs != njobs) {
+        mvwprintw(win, HEADER_NROWS, 0, "  Job %u is not listed", id);
+        wrefresh(win);
+        return;
+    }
+
+    unsigned char *visited = calloc(njobs, 1);
+    if (!visited) {
+        wrefresh(win);
+        return;
+    }
+
+    const job_t *job = jobs + ij;
+    int y = HEADER_NROWS;
+
+    wattron(win, A_BOLD);
+    mvwprintw(win, y++, 0, "  %u %c %s %s", job->id, job->state,
+        job->user ? job->user:"", job->name ? job->name:"");
+    wattroff(win, A_BOLD);
+
+    if (y < LINES) {
+        mvwprintw(win, y++, 0, "  Upstream (blockers):");
+    }
+    visited[ij] = 1;
+    print_depend_tree(di, jobs, win, ij, true, 0, visited, &y);
+
+    if (y < LINES) {
+        mvwprintw(win, y++, 0, "  Downstream (dependants):");
+    }
+    memset(visited, 0, njobs);
+    visited[ij] = 1;
+    print_depend_tree(di, jobs, win, ij, false, 0, visited, &y);
+
+    xfree(visited);
+
+    wrefresh(win);
+}
+
+static void alert(const char *message)
+{
+    int msglen = strlen(message);
+    int width  = msglen + 6;
+    int height = 7;
+
+    if (width < 24) {
+        width = 24;
+    }
+
+    int starty = (LINES - height) / 2;
+    int startx = (COLS  - width)  / 2;
+
+    WINDOW *win = newwin(height, width, starty, startx);
+    keypad(win, TRUE);
+
+    bool in_loop = true;
+    while (in_loop) {
+        werase(win);
+        box(win, 0, 0);
+
+        mvwprintw(win, 2, (width - msglen)/2, "%s", message);
+
+        int ok_x = width/2 - 3;
+
+        wattron(win, A_REVERSE);
+        mvwprintw(win, 4, ok_x, " OK ");
+        wattroff(win, A_REVERSE);
+
+        wrefresh(win);
+
+        int ch = wgetch(win);
+
+        switch (ch) {
+        case '\n':
+        case '\r':
+        case KEY_ENTER:
+        case 27: /* Esc */
+            in_loop = false;
+            break;
+        }
+    }
+
+    delwin(win);
+    touchwin(stdscr);
+    refresh();
+}
+
+static bool yes_no(const char *message)
+{
+    int msglen = strlen(message);
+    int width  = msglen + 6;
+    int height = 7;
+
+    if (width < 24) {
+        width = 24;
+    }
+
+    int starty = (LINES - height) / 2;
+    int startx = (COLS  - width)  / 2;
+
+    WINDOW *win = newwin(height, width, starty, startx);
+    keypad(win, TRUE);
+
+    int choice = 1;  /* 0 = Yes, 1 = No */
+
+    bool in_loop = true;
+    while (in_loop) {
+        werase(win);
+        box(win, 0, 0);
+
+        mvwprintw(win, 2, (width - msglen)/2, "%s", message);
+
+        int yes_x = width/2 - 8;
+        int no_x  = width/2 + 2;
+
+        if (choice == 0) {
+            wattron(win, A_REVERSE);
+        }
+        mvwprintw(win, 4, yes_x, " Yes ");
+        if (choice == 0) {
+            wattroff(win, A_REVERSE);
+        } else
+        if (choice == 1) {
+            wattron(win, A_REVERSE);
+        }
+        mvwprintw(win, 4, no_x, " No ");
+        if (choice == 1) {
+            wattroff(win, A_REVERSE);
+        }
+
+        wrefresh(win);
+
+        int ch = wgetch(win);
+
+        switch (ch) {
+        case KEY_LEFT:
+            choice = 0;
+            break;
+        case KEY_RIGHT:
+            choice = 1;
+            break;
+        case '\n':
+        case '\r':
+        case KEY_ENTER:
+            in_loop = false;
+            break;
+        case 27: /* Esc */
+            in_loop = false;
+            choice = 1;
+            break;
+        }
+    }
+
+    delwin(win);
+    touchwin(stdscr);
+    refresh();
+    return (choice == 0);
+}
+
+
+static bool prompt(const char *message, char *buf, int bufsize)
+{
+    int msglen = strlen(message);
+    int width  = msglen + 6;
+    int height = 7;
+
+    if (width < 48) {
+        width = 48;
+    }
+
+    int starty = (LINES - height) / 2;
+    int startx = (COLS  - width)  / 2;
+
+    WINDOW *win = newwin(height, width, starty, startx);
+    keypad(win, TRUE);
+
+    werase(win);
+    box(win, 0, 0);
+    mvwprintw(win, 2, (width - msglen)/2, "%s", message);
+    wmove(win, 4, 3);
+    wrefresh(win);
+
+    echo();
+    curs_set(1);
+    int rc = wgetnstr(win, buf, bufsize - 1);
+    curs_set(0);
+    noecho();
+
+    delwin(win);
+    touchwin(stdscr);
+    refresh();
+
+    return (rc == OK && buf[0] != '\0');
+}
+
+static int key_comp(const void *a, const void *b)
+{
+    unsigned long long ka = *(const unsigned long long *) a;
+    unsigned long long kb = *(const unsigned long long *) b;
+
+    if (ka < kb) {
+        return -1;
+    } else
+    if (ka > kb) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static bool marks_has(const marks_t *m, unsigned long long key)
+{
+    return m->n > 0 &&
+        bsearch(&key, m->keys, m->n, sizeof(key), key_comp) != NULL;
+}
+
+static void marks_clear(marks_t *m)
+{
+    m->n = 0;
+}
+
+static void marks_free(marks_t *m)
+{
+    if (m) {
+        xfree(m->keys);
+    }
+}
+
+static bool marks_toggle(marks_t *m, job_t *job)
+{
+    unsigned long long key = job_key(job);
+    int i = 0;
+
+    while (i < m->n && m->keys[i] < key) {
+        i++;
+    }
+
+    if (i < m->n && m->keys[i] == key) {
+        memmove(m->keys + i, m->keys + i + 1, (m->n - i - 1)*sizeof(key));
+        m->n--;
+        job->marked = false;
+    } else {
+        if (m->n == m->size) {
+            int size = m->size ? 2*m->size:64;
+            unsigned long long *keys = realloc(m->keys, size*sizeof(key));
+            if (!keys) {
+                return false;
+            }
+            m->keys = keys;
+            m->size = size;
+        }
+        memmove(m->keys + i + 1, m->keys + i, (m->n - i)*sizeof(key));
+        m->keys[i] = key;
+        m->n++;
+        job->marked = true;
+    }
+
+    return true;
+}
+
+/* Mark all jobs in the (filtered) list */
+static bool marks_set_all(marks_t *m, job_t *jobs, int njobs)
+{
+    int i;
+
+    if (njobs > m->size) {
+        unsigned long long *keys = realloc(m->keys,
+            njobs*sizeof(unsigned long long));
+        if (!keys) {
+            return false;
+        }
+        m->keys = keys;
+        m->size = njobs;
+    }
+
+    for (i = 0; i < njobs; i++) {
+        m->keys[i] = job_key(jobs + i);
+        jobs[i].marked = true;
+    }
+    m->n = njobs;
+    qsort(m->keys, m->n, sizeof(unsigned long long), key_comp);
+
+    return true;
+}
+
+/* Re-apply the marks to a freshly fetched job list */
+static int marks_apply(const marks_t *m, job_t *jobs, int njobs)
+{
+    int i, nmarked = 0;
+
+    for (i = 0; i < njobs; i++) {
+        jobs[i].marked = marks_has(m, job_key(jobs + i));
+        if (jobs[i].marked) {
+            nmarked++;
+        }
+    }
+
+    return nmarked;
+}
+
+static void timeseries_free(timeseries_t *ts)
+{
+    if (ts) {
+        xfree(ts->rings);
+    }
+}
+
+static ts_ring_t *timeseries_slot(const timeseries_t *ts,
+    unsigned long long key)
+{
+    unsigned int i;
+
+    if (!ts->size) {
+        return NULL;
+    }
+
+    i = (unsigned int) ((key*0x9E3779B97F4A7C15ULL) >> 32) & (ts->size - 1);
+    while (ts->rings[i].key && ts->rings[i].key != key) {
+        i = (i + 1) & (ts->size - 1);
+    }
+
+    return ts->rings + i;
+}
+
+/*
+ * Add a sample per running job and derive the interval CPU utilization
+ * and memory growth over the samples kept, as opposed to the lifetime
+ * averages reported by the server.
+ */
+static void timeseries_update(timeseries_t *ts, job_t *jobs, int njobs)
+{
+    timeseries_t nts;
+    int i, nrunning = 0;
+
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].state == JOB_RUNNING && !jobs[i].is_array) {
+            nrunning++;
+        }
+    }
+
+    nts.size = 64;
+    while (nts.size < 2*(unsigned int) nrunning) {
+        nts.size <<= 1;
+    }
+    nts.rings = calloc(nts.size, sizeof(ts_ring_t));
+    if (!nts.rings) {
+        return;
+    }
+
+    for (i = 0; i < njobs; i++) {
+        job_t *job = jobs + i;
+        unsigned long long key = job_key(job);
+        int k;
+
+        if (job->state != JOB_RUNNING || job->is_array) {
+            continue;
+        }
+
+        ts_ring_t *ring = timeseries_slot(&nts, key);
+        const ts_ring_t *old = timeseries_slot(ts, key);
+        if (old && old->key == key) {
+            *ring = *old;
+        } else {
+            memset(ring, 0, sizeof(ts_ring_t));
+            ring->key = key;
+        }
+
+        // the server updates resources_used only every now and then
+        const ts_sample_t *last = ring->samples + ring->head;
+        if (ring->n == 0 || last->walltime < job->walltime_u) {
+            if (ring->n > 0) {
+                ring->head = (ring->head + 1) % TS_NSAMPLES;
+            }
+            if (ring->n < TS_NSAMPLES) {
+                ring->n++;
+            }
+            ts_sample_t *sample = ring->samples + ring->head;
+            sample->cput     = job->cput_u;
+            sample->walltime = job->walltime_u;
+            sample->mem      = job->mem_u;
+        }
+
+        if (ring->n < 2 || job->ncpus_u == 0) {
+            continue;
+        }
+
+        int oldest = (ring->head + TS_NSAMPLES - ring->n + 1) % TS_NSAMPLES;
+        const ts_sample_t *s0 = ring->samples + oldest;
+        const ts_sample_t *s1 = ring->samples + ring->head;
+        double dt = (double) s1->walltime - s0->walltime;
+
+        job->has_rates = true;
+        job->cpu_rate  = ((double) s1->cput - s0->cput)/(job->ncpus_u*dt);
+        job->mem_rate  = ((double) s1->mem - s0->mem)/dt;
+
+        job->ntrend = ring->n - 1;
+        for (k = 0; k < job->ntrend; k++) {
+            const ts_sample_t *a = ring->samples +
+                (oldest + k) % TS_NSAMPLES;
+            const ts_sample_t *b = ring->samples +
+                (oldest + k + 1) % TS_NSAMPLES;
+            double util = ((double) b->cput - a->cput)/
+                (job->ncpus_u*((double) b->walltime - a->walltime));
+            int level = util*(TS_NLEVELS - 1) + 0.5;
+            if (level < 0) {
+                level = 0;
+            } else
+            if (level > TS_NLEVELS - 1) {
+                level = TS_NLEVELS - 1;
+            }
+            job->trend[k] = level;
+        }
+    }
+
+    timeseries_free(ts);
+    *ts = nts;
+}
+
+static void events_free(events_t *ev)
+{
+    xfree(ev->traces);
+    if (ev->journal) {
+        fclose(ev->journal);
+    }
+}
+
+static unsigned int events_home(const events_t *ev, unsigned long long key)
+{
+    return (unsigned int) ((key*0x9E3779B97F4A7C15ULL) >> 32) & (ev->size - 1);
+}
+
+static job_trace_t *events_slot(const events_t *ev, unsigned long long key)
+{
+    unsigned int i = events_home(ev, key);
+
+    while (ev->traces[i].key && ev->traces[i].key != key) {
+        i = (i + 1) & (ev->size - 1);
+    }
+
+    return ev->traces + i;
+}
+
+static bool events_grow(events_t *ev)
+{
+    job_trace_t *old = ev->traces;
+    unsigned int old_size = ev->size, i;
+
+    ev->size = old_size ? 2*old_size:1024;
+    ev->traces = calloc(ev->size, sizeof(job_trace_t));
+    if (!ev->traces) {
+        ev->traces = old;
+        ev->size = old_size;
+        return false;
+    }
+    for (i = 0; i < old_size; i++) {
+        if (old[i].key) {
+            *events_slot(ev, old[i].key) = old[i];
+        }
+    }
+    xfree(old);
+
+    return true;
+}
+
+/* Remove a slot, moving back the entries that probed past it */
+static void events_remove(events_t *ev, unsigned int i)
+{
+    unsigned int j = i, mask = ev->size - 1;
+
+    while (true) {
+        j = (j + 1) & mask;
+        if (!ev->traces[j].key) {
+            break;
+        }
+        unsigned int k = events_home(ev, ev->traces[j].key);
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            ev->traces[i] = ev->traces[j];
+            i = j;
+        }
+    }
+    ev->traces[i].key = 0;
+    ev->ntraces--;
+}
+
+static void format_event(const event_t *e, char buf[64])
+{
+    switch (e->kind) {
+    case EVENT_STATE:
+        if (e->old_state) {
+            sprintf(buf, "%c -> %c", e->old_state, e->new_state);
+        } else {
+            sprintf(buf, "new (%c)", e->new_state);
+        }
+        break;
+    case EVENT_BAD:
+        sprintf(buf, "became bad (%c)", e->new_state);
+        break;
+    case EVENT_MEM:
+        sprintf(buf, "%%Mem %d", e->memutil);
+        break;
+    case EVENT_DELETED:
+        sprintf(buf, "deleted (%c)", e->old_state);
+        break;
+    }
+}
+
+/* A line of the journal: date, time, job ID, user, queue, what happened */
+static void format_event_line(const event_t *e, char buf[192])
+{
+    char datebuf[32], descr[64];
+
+    strftime(datebuf, 32, "%F %T", localtime(&e->stamp));
+    format_event(e, descr);
+    snprintf(buf, 192, "%s %s %s %s %s\n", datebuf, e->jobid, e->user,
+        e->queue, descr);
+}
+
+static void events_emit(events_t *ev, event_kind_t kind,
+    const job_trace_t *t, char old_state, int memutil)
+{
+    event_t *e = ev->ring + ev->head;
+
+    e->stamp     = time(NULL);
+    e->kind      = kind;
+    e->old_state = old_state;
+    e->new_state = kind == EVENT_DELETED ? 0:t->state;
+    e->memutil   = memutil;
+    memcpy(e->jobid, t->jobid, sizeof(e->jobid));
+    memcpy(e->user, t->user, sizeof(e->user));
+    memcpy(e->queue, t->queue, sizeof(e->queue));
+
+    if (kind == EVENT_STATE || kind == EVENT_DELETED) {
+        ev->nchanged++;
+    }
+
+    ev->head = (ev->head + 1) % EVENTS_NKEEP;
+    if (ev->n < EVENTS_NKEEP) {
+        ev->n++;
+    }
+
+    if (ev->journal) {
+        char line[192];
+        format_event_line(e, line);
+        fputs(line, ev->journal);
+        fflush(ev->journal);
+    }
+    if (ev->sink) {
+        ev->sink(e, ev->sink_data);
+    }
+}
+
+/*
+ * Diff the job table against the jobs seen before, by job key: a job
+ * that hasn't changed costs a lookup, and the table is only scanned for
+ * the gone jobs if some weren't seen this time. The first table is taken
+ * as is. Subjobs are only followed if listed (-S); otherwise they come
+ * and go with expanding the arrays.
+ */
+static void events_update(events_t *ev, const job_t *jobs, int njobs,
+    bool subjobs)
+{
+    int i, nprev = ev->ntraces, nmatched = 0;
+    unsigned int j;
+
+    ev->gen++;
+    ev->nchanged = 0;
+
+    for (i = 0; i < njobs; i++) {
+        const job_t *job = jobs + i;
+        unsigned long long key = job_key(job);
+        job_stats_t st;
+
+        if (job->aid && !subjobs) {
+            continue;
+        }
+
+        if (2*(ev->ntraces + 1) > (int) ev->size && !events_grow(ev)) {
+            return;
+        }
+
+        job_trace_t *t = events_slot(ev, key);
+        if (t->key && t->gen == ev->gen) {
+            continue;
+        }
+
+        get_job_stats(job, &st);
+        int memutil = 100*st.memutil;
+        bool mem_high = memutil > ev->mem_high;
+
+        if (!t->key) {
+            t->key      = key;
+            t->state    = job->state;
+            t->bad      = st.bad;
+            t->mem_high = mem_high;
+            t->gen      = ev->gen;
+            format_job_id(job, t->jobid);
+            snprintf(t->user, sizeof(t->user), "%s",
+                job->user ? job->user:"");
+            snprintf(t->queue, sizeof(t->queue), "%s",
+                job->queue ? job->queue:"");
+            ev->ntraces++;
+            if (ev->primed) {
+                events_emit(ev, EVENT_STATE, t, 0, memutil);
+            }
+            continue;
+        }
+
+        char old_state = t->state;
+        bool was_bad = t->bad, was_mem_high = t->mem_high;
+
+        t->state    = job->state;
+        t->bad      = st.bad;
+        t->mem_high = mem_high;
+        t->gen      = ev->gen;
+        nmatched++;
+
+        if (old_state != t->state) {
+            events_emit(ev, EVENT_STATE, t, old_state, memutil);
+        }
+        if (t->bad && !was_bad) {
+            events_emit(ev, EVENT_BAD, t, old_state, memutil);
+        }
+        if (t->mem_high && !was_mem_high) {
+            events_emit(ev, EVENT_MEM, t, old_state, memutil);
+        }
+    }
+
+    if (nmatched < nprev) {
+        for (j = 0; j < ev->size; j++) {
+            // the removal may move another entry into the slot
+            while (ev->traces[j].key && ev->traces[j].gen != ev->gen) {
+                events_emit(ev, EVENT_DELETED, ev->traces + j,
+                    ev->traces[j].state, 0);
+                events_remove(ev, j);
+            }
+        }
+    }
+
+    ev->primed = true;
+}
+
+/* The latest events first, skipping the first scroll ones */
+static void print_events(const events_t *ev, WINDOW *win, int scroll)
+{
+    char header[128];
+    int i, row;
+
+    snprintf(header, 128, "  Job events (%d kept%s)", ev->n,
+        ev->journal ? ", journaled":"");
+
+    wattron(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+    mvwprintw(win, HEADER_NROWS - 1, 0, "%-*s", COLS, header);
+    wattroff(win, COLOR_PAIR(COLOR_PAIR_JHEADER) | A_REVERSE);
+
+    wmove(win, HEADER_NROWS, 0);
+    wclrtobot(win);
+
+    for (i = scroll, row = HEADER_NROWS; i < ev->n && row < LINES;
+         i++, row++) {
+        const event_t *e = ev->ring +
+            (ev->head + EVENTS_NKEEP - 1 - i) % EVENTS_NKEEP;
+        char datebuf[32], descr[64];
+        int cpair = 0;
+        if (e->kind == EVENT_BAD || e->kind == EVENT_MEM) {
+            cpair = COLOR_PAIR_JOB_BAD;
+        } else
+        if (e->kind == EVENT_DELETED) {
+            cpair = COLOR_PAIR_JOB_OTHER;
+        }
+
+        strftime(datebuf, 32, "%a %T", localtime(&e->stamp));
+        format_event(e, descr);
+        mvwprintw(win, row, 0, "%s %16s %-12s %-12s ", datebuf, e->jobid,
+            e->user, e->queue);
+        wattron(win, COLOR_PAIR(cpair));
+        wprintw(win, "%s", descr);
+        wattroff(win, COLOR_PAIR(cpair));
+    }
+
+    wrefresh(win);
+}
+
+static void *bulk_worker(void *arg)
+{
+    bulk_t *b = arg;
+    int conn = backend->connect(b->servername);
+    int err_conn = conn <= 0 ? (pbs_errno ? pbs_errno:PBSE_PROTOCOL):0;
+
+    while (true) {
+        int i, rc, err = 0;
+
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+
+        if (i >= b->nitems) {
+            break;
+        }
+
+        bulk_item_t *item = b->items + i;
+        if (err_conn) {
+            err = err_conn;
+        } else {
+            switch (b->op) {
+            case BULK_DELETE:
+                rc = backend->deljob(conn, item->id, NULL);
+                break;
+            case BULK_HOLD:
+                rc = backend->holdjob(conn, item->id, "u", NULL);
+                break;
+            case BULK_RELEASE:
+                rc = backend->rlsjob(conn, item->id, "u", NULL);
+                break;
+            case BULK_ALTER:
+                rc = backend->alterjob(conn, item->id, &b->attr, NULL);
+                break;
+            default:
+                rc = 0;
+                break;
+            }
+            if (rc != 0) {
+                err = pbs_errno ? pbs_errno:rc;
+            }
+        }
+
+        pthread_mutex_lock(&b->lock);
+        item->err = err;
+        b->ndone++;
+        if (err) {
+            b->nfailed++;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    if (conn > 0) {
+        backend->disconnect(conn);
+    }
+
+    return NULL;
+}
+
+static void bulk_free(bulk_t *b)
+{
+    if (b) {
+        int i;
+        for (i = 0; i < b->nthreads; i++) {
+            pthread_join(b->threads[i], NULL);
+        }
+        pthread_mutex_destroy(&b->lock);
+        xfree(b->servername);
+        xfree(b->items);
+        xfree(b->attr.name);
+        xfree(b->attr.resource);
+        xfree(b->attr.value);
+        xfree(b);
+    }
+}
+
+/*
+ * Start an operation on the marked jobs or, if there are none, on the
+ * selected one. For BULK_ALTER, spec is "attribute=value"; resources may
+ * be given as is (e.g., "walltime=1:00:00").
+ */
+static bulk_t *bulk_start(const qtop_t *q, bulk_op_t op, const char *spec,
+    const job_t *jobs, int njobs, const job_t *selected)
+{
+    int i;
+
+    bulk_t *b = calloc(1, sizeof(bulk_t));
+    if (!b) {
+        return NULL;
+    }
+    b->op = op;
+    pthread_mutex_init(&b->lock, NULL);
+    // a copy: the session's may change on a failover while workers run
+    b->servername = strdup(q->servername);
+    if (!b->servername) {
+        bulk_free(b);
+        return NULL;
+    }
+
+    if (op == BULK_ALTER) {
+        const char *resources[] = {
+            "walltime", "cput", "mem", "vmem", "ncpus", "nodect",
+            "select", "place", "io", NULL
+        };
+        const char *eq = strchr(spec, '=');
+        if (!eq || eq == spec) {
+            bulk_free(b);
+            return NULL;
+        }
+        char *name = strndup(spec, eq - spec);
+        char *dot = strchr(name, '.');
+        b->attr.value = strdup(eq + 1);
+        b->attr.op = SET;
+        if (dot) {
+            *dot = '\0';
+            b->attr.name = name;
+            b->attr.resource = strdup(dot + 1);
+        } else {
+            const char **r;
+            for (r = resources; *r && strcmp(*r, name); r++) {
+                ;
+            }
+            if (*r) {
+                b->attr.name = strdup(ATTR_l);
+                b->attr.resource = name;
+            } else {
+                b->attr.name = name;
+            }
+        }
+    }
+
+    b->items = calloc(njobs > 0 ? njobs:1, sizeof(bulk_item_t));
+    if (!b->items) {
+        bulk_free(b);
+        return NULL;
+    }
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].marked) {
+            format_job_id(jobs + i, b->items[b->nitems++].id);
+        }
+    }
+    if (b->nitems == 0 && selected) {
+        format_job_id(selected, b->items[b->nitems++].id);
+    }
+    if (b->nitems == 0) {
+        bulk_free(b);
+        return NULL;
+    }
+
+    for (i = 0; i < BULK_NWORKERS && i < b->nitems; i++) {
+        if (pthread_create(&b->threads[i], NULL, bulk_worker, b) == 0) {
+            b->nthreads++;
+        }
+    }
+    if (b->nthreads == 0) {
+        bulk_free(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+static bool bulk_done(bulk_t *b)
+{
+    bool done;
+
+    pthread_mutex_lock(&b->lock);
+    done = (b->ndone == b->nitems);
+    pthread_mutex_unlock(&b->lock);
+
+    return done;
+}
+
+static const char *bulk_op_names[] = {
+    "Delete",
+    "Hold",
+    "Release",
+    "Alter"
+};
+
+static void print_progress(const bulk_t *b)
+{
+    int width  = COLS/2 < 40 ? 40:COLS/2;
+    int height = 6;
+
+    if (width > COLS) {
+        width = COLS;
+    }
+
+    WINDOW *win = newwin(height, width, (LINES - height)/2,
+        (COLS - width)/2);
+
+    werase(win);
+    box(win, 0, 0);
+
+    pthread_mutex_t *lock = (pthread_mutex_t *) &b->lock;
+    pthread_mutex_lock(lock);
+    int ndone = b->ndone, nfailed = b->nfailed;
+    pthread_mutex_unlock(lock);
+
+    mvwprintw(win, 1, 2, "%s: %d of %d jobs done, %d failed",
+        bulk_op_names[b->op], ndone, b->nitems, nfailed);
+
+    int i, len = (long) (width - 4)*ndone/b->nitems;
+    wmove(win, 3, 2);
+    wattron(win, A_REVERSE);
+    for (i = 0; i < len; i++) {
+        waddch(win, ' ');
+    }
+    wattroff(win, A_REVERSE);
+
+    wrefresh(win);
+    delwin(win);
+}
+
+/* Per-job error summary of a finished operation */
+static void bulk_report(const bulk_t *b)
+{
+    int width  = COLS - 8;
+    int height = b->nfailed + 6;
+
+    if (height > LINES - 4) {
+        height = LINES - 4;
+    }
+    if (width < 24) {
+        width = 24;
+    }
+
+    WINDOW *win = newwin(height, width, (LINES - height)/2, (COLS - width)/2);
+    keypad(win, TRUE);
+
+    int i, y, nlisted = 0, yshift = 0;
+    bool in_loop = true;
+    while (in_loop) {
+        werase(win);
+        box(win, 0, 0);
+
+        mvwprintw(win, 1, 2, "%s: %d of %d jobs failed",
+            bulk_op_names[b->op], b->nfailed, b->nitems);
+
+        y = 2;
+        nlisted = 0;
+        for (i = 0; i < b->nitems && y < height - 3; i++) {
+            const bulk_item_t *item = b->items + i;
+            if (item->err == 0) {
+                continue;
+            }
+            if (nlisted++ < yshift) {
+                continue;
+            }
+            const char *errtxt = pbse_to_txt(item->err);
+            mvwprintw(win, y++, 2, "%-16s %.*s", item->id, width - 21,
+                errtxt ? errtxt:"Unknown error");
+        }
+
+        wattron(win, A_REVERSE);
+        mvwprintw(win, height - 2, width/2 - 3, " OK ");
+        wattroff(win, A_REVERSE);
+
+        wrefresh(win);
+
+        int ch = wgetch(win);
+
+        switch (ch) {
+        case KEY_UP:
+            if (yshift > 0) {
+                yshift--;
+            }
+            break;
+        case KEY_DOWN:
+            if (yshift < b->nfailed - 1) {
+                yshift++;
+            }
+            break;
+        case '\n':
+        case '\r':
+        case KEY_ENTER:
+        case 27: /* Esc */
+            in_loop = false;
+            break;
+        }
+    }
+
+    delwin(win);
+    touchwin(stdscr);
+    refresh();
 }
 
-
 static int state_rank(job_state_t s)
 {
-    int rank = 0;
-    switch (s) {
-    case JOB_EXITING:
-        rank = 1;
-        break;
-    case JOB_SUSPENDED:
-    case JOB_SUSPENDED_U:
-        rank = 2;
-        break;
-    case JOB_SUB_RUNNING:
-    case JOB_RUNNING:
-        rank = 3;
-        break;
-    case JOB_QUEUED:
-        rank = 4;
+    int rank = 0;
+    switch (s) {
+    case JOB_EXITING:
+        rank = 1;
+        break;
+    case JOB_SUSPENDED:
+    case JOB_SUSPENDED_U:
+        rank = 2;
+        break;
+    case JOB_SUB_RUNNING:
+    case JOB_RUNNING:
+        rank = 3;
+        break;
+    case JOB_QUEUED:
+        rank = 4;
+        break;
+    case JOB_WAITING:
+        rank = 5;
+        break;
+    case JOB_HELD:
+        rank = 6;
+        break;
+    case JOB_TRANSIT:
+        rank = 7;
+        break;
+    case JOB_SUB_COMPLETED:
+    case JOB_FINISHED:
+        rank = 8;
+        break;
+    case JOB_MOVED:
+        rank = 9;
+        break;
+    }
+
+    return rank;
+}
+
+static int job_comp(const void *a, const void *b)
+{
+    const job_t *ja = a, *jb = b;
+    int cmp = 0;
+
+    /* sort subjobs according to their sub-id irrespecitvely of the state */
+    if (jb->id == ja->id) {
+        return ja->aid - jb->aid;
+    }
+
+    cmp = state_rank(ja->state) - state_rank(jb->state);
+
+    if (cmp == 0) {
+        if (ja->user && jb->user) {
+            cmp = strcmp(ja->user, jb->user);
+        } else {
+            cmp = 0;
+        }
+    }
+
+    if (cmp == 0) {
+        if (ja->queue && jb->queue) {
+            cmp = strcmp(ja->queue, jb->queue);
+        } else {
+            cmp = 0;
+        }
+    }
+
+    if (cmp == 0) {
+        cmp = jb->id - ja->id;
+    }
+
+    return cmp;
+}
+
+static void print_job_details(const qtop_t *q, const job_t *job,
+    unsigned int xshift, unsigned int yshift)
+{
+    werase(q->jwin);
+
+    box(q->jwin, 0, 0);
+
+    if (job && job->id) {
+        char idbuf[32];
+        format_job_id(job, idbuf);
+        mvwprintw(q->jwin, 0, 1, "Job ID = %s", idbuf);
+        struct batch_status *qstatus = backend->statjob(q->conn, idbuf, NULL, "x");
+        if (qstatus) {
+            print_attribs(q->jwin, qstatus->attribs, xshift, yshift);
+            backend->statfree(qstatus);
+        }
+    }
+
+    wrefresh(q->jwin);
+}
+
+static job_t *get_job(job_t *jobs, int njobs, int jid)
+{
+    if (jobs && jid >= 0 && jid < njobs) {
+        return jobs + jid;
+    } else {
+        return NULL;
+    }
+}
+
+/* Step through the recording; the last frame follows a growing one */
+static void qtop_playback_seek(qtop_t *q, int frame)
+{
+    int nframes = histlog_nframes(q->playback);
+
+    if (frame >= nframes) {
+        frame = nframes - 1;
+    }
+    if (frame < 0) {
+        frame = 0;
+    }
+    q->frame = frame;
+    q->frame_follow = frame == nframes - 1;
+}
+
+static report_entry_t *report_entry(report_table_t *rt, const char *name)
+{
+    unsigned int i;
+
+    if (2*(rt->used + 1) > rt->size) {
+        unsigned int old_size = rt->size;
+        report_entry_t *old = rt->table;
+
+        rt->size = old_size ? 2*old_size:64;
+        rt->table = calloc(rt->size, sizeof(report_entry_t));
+        if (!rt->table) {
+            rt->table = old;
+            rt->size = old_size;
+            return NULL;
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old[i].name) {
+                unsigned int j = str_hash(old[i].name) & (rt->size - 1);
+                while (rt->table[j].name) {
+                    j = (j + 1) & (rt->size - 1);
+                }
+                rt->table[j] = old[i];
+            }
+        }
+        xfree(old);
+    }
+
+    i = str_hash(name) & (rt->size - 1);
+    while (rt->table[i].name) {
+        if (!strcmp(rt->table[i].name, name)) {
+            return rt->table + i;
+        }
+        i = (i + 1) & (rt->size - 1);
+    }
+
+    rt->table[i].name = strdup(name);
+    if (!rt->table[i].name) {
+        return NULL;
+    }
+    rt->used++;
+
+    return rt->table + i;
+}
+
+static void report_fold(report_entry_t *re, const job_t *job,
+    const job_stats_t *st)
+{
+    const double gb_scale = pow(2, 20);
+    double hours = job->walltime_u/3600.0;
+    unsigned int ncpus = job->ncpus_r > 0 ? job->ncpus_r:(unsigned int) st->ncpus;
+
+    re->njobs++;
+    if (st->bad) {
+        re->nbad++;
+    }
+    re->coreh_alloc += ncpus*hours;
+    re->coreh_used  += job->cput_u/3600.0;
+    re->gbh_req     += job->mem_r/gb_scale*hours;
+    re->gbh_used    += job->mem_u/gb_scale*hours;
+    re->wall_req    += job->walltime_r/3600.0;
+    re->wall_used   += hours;
+}
+
+/* The sink of finished jobs for the report; only the totals are kept */
+static bool report_add(job_t *job, void *data)
+{
+    report_t *report = data;
+    job_stats_t st;
+
+    get_job_stats(job, &st);
+
+    report_entry_t *ue = report_entry(&report->users,
+        job->user ? job->user:"?");
+    report_entry_t *qe = report_entry(&report->queues,
+        job->queue ? job->queue:"?");
+    if (ue) {
+        report_fold(ue, job, &st);
+    }
+    if (qe) {
+        report_fold(qe, job, &st);
+    }
+    report_fold(&report->total, job, &st);
+
+    job_free_data(job);
+
+    return ue && qe;
+}
+
+static void report_free(report_t *report)
+{
+    unsigned int i;
+
+    for (i = 0; i < report->users.size; i++) {
+        xfree(report->users.table[i].name);
+    }
+    xfree(report->users.table);
+    for (i = 0; i < report->queues.size; i++) {
+        xfree(report->queues.table[i].name);
+    }
+    xfree(report->queues.table);
+}
+
+/*
+ * Pass the finished jobs to sink, which takes them over. The server is
+ * asked for a day at a time, so that no more than a day worth of them is
+ * held in memory at once.
+ */
+static bool qtop_foreach_finished(qtop_t *q, acct_sink_t sink, void *data)
+{
+    char extend[3] = "x", since[32], until[32];
+    struct attrl *qattribs = job_attrl_new();
+    long t;
+
+    if (q->subjobs) {
+        strcat(extend, "t");
+    }
+
+    long now = time(NULL);
+    for (t = now - 3600L*q->history_span; t < now; t += 86400) {
+        struct batch_status *qstatus, *qtmp;
+        struct attropl *criteria_list;
+
+        sprintf(since, "%ld", t);
+        sprintf(until, "%ld", t + 86400);
+
+        criteria_list = job_criteria_new(q);
+        criteria_list = attropl_add(criteria_list,
+            ATTR_state, q->subjobs ? "FX":"F", EQ);
+        criteria_list = attropl_add(criteria_list,
+            ATTR_history_timestamp, since, GE);
+        criteria_list = attropl_add(criteria_list,
+            ATTR_history_timestamp, until, LT);
+
+        qstatus = backend->selstat(q->conn, criteria_list, qattribs, extend);
+        attropl_free(criteria_list);
+        if (qstatus == NULL && pbs_errno != PBSE_NONE) {
+            xfree(qattribs);
+            return false;
+        }
+
+        bool ok = true;
+        for (qtmp = qstatus; ok && qtmp; qtmp = qtmp->next) {
+            job_t job;
+            memset(&job, 0, sizeof(job_t));
+            parse_job_status(&job, qtmp);
+            if (job_filtered_out(q, &job)) {
+                job_free_data(&job);
+            } else {
+                ok = sink(&job, data);
+            }
+        }
+        if (qstatus) {
+            backend->statfree(qstatus);
+        }
+        if (!ok) {
+            xfree(qattribs);
+            return false;
+        }
+    }
+
+    xfree(qattribs);
+
+    return true;
+}
+
+static int report_entry_comp(const void *a, const void *b)
+{
+    const report_entry_t *ra = a, *rb = b;
+
+    if (ra->coreh_alloc > rb->coreh_alloc) {
+        return -1;
+    } else
+    if (ra->coreh_alloc < rb->coreh_alloc) {
+        return 1;
+    } else {
+        return strcmp(ra->name, rb->name);
+    }
+}
+
+static double report_ratio(double a, double b)
+{
+    return b > 0 ? 100*a/b:0;
+}
+
+static void print_report_entry(FILE *out, const char *kind,
+    const report_entry_t *re, report_format_t format)
+{
+    if (format == REPORT_CSV) {
+        fprintf(out, "%s,%s,%u,%u,%.2f,%.2f,%.1f,%.2f,%.2f,%.1f,%.2f,%.2f,%.1f\n",
+            kind, re->name, re->njobs, re->nbad,
+            re->coreh_alloc, re->coreh_used,
+            report_ratio(re->coreh_used, re->coreh_alloc),
+            re->gbh_req, re->gbh_used,
+            report_ratio(re->gbh_used, re->gbh_req),
+            re->wall_req, re->wall_used,
+            report_ratio(re->wall_used, re->wall_req));
+    } else {
+        fprintf(out, "%-12s %7u %6u %10.1f %10.1f %5.1f %10.1f %10.1f %5.1f"
+            " %9.1f %9.1f %5.1f\n",
+            re->name, re->njobs, re->nbad,
+            re->coreh_alloc, re->coreh_used,
+            report_ratio(re->coreh_used, re->coreh_alloc),
+            re->gbh_req, re->gbh_used,
+            report_ratio(re->gbh_used, re->gbh_req),
+            re->wall_req, re->wall_used,
+            report_ratio(re->wall_used, re->wall_req));
+    }
+}
+
+static void print_report_table(FILE *out, const char *kind,
+    const report_table_t *rt, report_format_t format)
+{
+    unsigned int i, n = 0;
+
+    report_entry_t *entries = malloc((rt->used + 1)*sizeof(report_entry_t));
+    if (!entries) {
+        return;
+    }
+    for (i = 0; i < rt->size; i++) {
+        if (rt->table[i].name) {
+            entries[n++] = rt->table[i];
+        }
+    }
+    qsort(entries, n, sizeof(report_entry_t), report_entry_comp);
+
+    if (format == REPORT_TABLE) {
+        fprintf(out, "\n%-12s %7s %6s %10s %10s %5s %10s %10s %5s"
+            " %9s %9s %5s\n",
+            kind, "Jobs", "Bad", "Core-h", "CPU-h", "%CPU",
+            "GB-h", "GB-h used", "%Mem", "Wall-h", "used", "%Wall");
+    }
+    for (i = 0; i < n; i++) {
+        print_report_entry(out, kind, entries + i, format);
+    }
+
+    xfree(entries);
+}
+
+/*
+ * Efficiency of the jobs finished within the history span, per user and
+ * per queue. The jobs are folded into the totals one by one, as they come.
+ */
+static bool qtop_report(qtop_t *q, report_format_t format, FILE *out)
+{
+    report_t report;
+    bool ok;
+
+    memset(&report, 0, sizeof(report_t));
+    report.total.name = "Total";
+
+    if (q->acct) {
+        ok = qtop_acct_foreach(q, report_add, &report);
+    } else {
+        ok = qtop_foreach_finished(q, report_add, &report);
+    }
+
+    if (ok) {
+        if (format == REPORT_CSV) {
+            fprintf(out, "kind,name,jobs,bad,coreh_alloc,cpuh_used,cpu_eff,"
+                "gbh_req,gbh_used,mem_eff,wallh_req,wallh_used,wall_eff\n");
+        } else {
+            fprintf(out, "Finished jobs over the last %d hours\n",
+                q->history_span);
+        }
+        print_report_table(out, "User", &report.users, format);
+        print_report_table(out, "Queue", &report.queues, format);
+        if (format == REPORT_TABLE) {
+            fprintf(out, "\n");
+        }
+        print_report_entry(out, "Total", &report.total, format);
+    }
+
+    report_free(&report);
+
+    return ok;
+}
+
+/*
+ * Copies of the jobs read from accounting logs, which may have grown; those
+ * that fell out of the history span are expired, as in the live mode
+ */
+static job_t *qtop_acct_jobs(qtop_t *q, server_t *pbs, int *njobs)
+{
+    long cutoff = time(NULL) - 3600L*q->history_span;
+    int i, n = 0;
+
+    qtop_acct_update(q);
+
+    // the logs are read in no particular order of the jobs' end
+    for (i = 0; i < q->nhistory; i++) {
+        if (q->history[i].history_ts < cutoff) {
+            job_free_data(q->history + i);
+        } else {
+            q->history[n++] = q->history[i];
+        }
+    }
+    q->nhistory = n;
+
+    job_t *jobs = calloc(q->nhistory + 1, sizeof(job_t));
+    if (!jobs) {
+        *njobs = 0;
+        return NULL;
+    }
+    for (i = 0; i < q->nhistory; i++) {
+        job_copy(jobs + i, q->history + i);
+    }
+    *njobs = q->nhistory;
+
+    pbs->host       = q->servername;
+    pbs->version    = "accounting";
+    pbs->total_jobs = q->nhistory;
+
+    return jobs;
+}
+
+/* The job table of the current playback frame */
+static job_t *qtop_playback_jobs(qtop_t *q, server_t *pbs, int *njobs)
+{
+    if (q->frame_follow) {
+        qtop_playback_seek(q, histlog_nframes(q->playback));
+    }
+    q->frame_time = histlog_stamp(q->playback, q->frame);
+
+    return histlog_jobs(q->playback, q->frame, pbs, njobs);
+}
+
+/*
+ * The job table of the latest snapshot published by another qtop, selected
+ * as the server would
+ */
+static job_t *qtop_snapshot_jobs(qtop_t *q, server_t *pbs, int *njobs)
+{
+    int i, n;
+
+    if (snapshot_changed(q->snapshot, q->snapshot_path)) {
+        snapshot_t *snap = snapshot_open(q->snapshot_path);
+        if (snap) {
+            snapshot_close(q->snapshot);
+            q->snapshot = snap;
+        }
+    }
+
+    job_t *jobs = snapshot_jobs(q->snapshot, pbs, njobs);
+    if (!jobs) {
+        return NULL;
+    }
+
+    for (i = 0, n = 0; i < *njobs; i++) {
+        job_t *job = jobs + i;
+        bool is_subjob = job->aid && !job->is_array;
+        if ((is_subjob && !q->subjobs) ||
+            (q->username && (!job->user || strcmp(job->user, q->username))) ||
+            (q->queue && (!job->queue || strcmp(job->queue, q->queue))) ||
+            (q->state && (!job->state || !strchr(q->state, job->state))) ||
+            (q->failed && !job->exit_status) ||
+            job_filtered_out(q, job)) {
+            job_free_data(job);
+        } else {
+            jobs[n++] = *job;
+        }
+    }
+    *njobs = n;
+
+    return jobs;
+}
+
+/* Publish the job table just fetched, if asked to */
+static void qtop_snapshot_publish(qtop_t *q, const server_t *pbs,
+    const job_t *jobs, int njobs)
+{
+    if (q->snapshot_file && (jobs || pbs_errno == PBSE_NONE)) {
+        double t0 = profile_start(q->prof);
+        snapshot_publish(q->snapshot_file, ++q->snapshot_gen, pbs,
+            jobs, jobs ? njobs:0);
+        profile_add(q->prof, PROF_OTHER, t0);
+    }
+}
+
+static int refresh_period = DEFAULT_REFRESH;
+static bool paused = false;
+
+/* Keys typed while waiting for the server, to be handled after it */
+static int waiting_keys[32];
+static int nwaiting_keys = 0;
+/* 'q' was among them: the rest of the refresh gives up too */
+static bool wait_quit = false;
+
+static bool wait_cancelled(void)
+{
+    int delay = wgetdelay(stdscr), ch;
+
+    wtimeout(stdscr, 0);
+    while ((ch = getch()) != ERR) {
+        if (nwaiting_keys < 32) {
+            waiting_keys[nwaiting_keys++] = ch;
+        }
+        if (ch == 'q') {
+            wait_quit = true;
+        }
+    }
+    wtimeout(stdscr, delay);
+
+    return wait_quit;
+}
+
+static void wait_keys_restore(void)
+{
+    while (nwaiting_keys > 0) {
+        ungetch(waiting_keys[--nwaiting_keys]);
+    }
+    wait_quit = false;
+}
+
+volatile sig_atomic_t need_update = false;
+void catch_alarm(int sig)
+{
+    if (sig != SIGALRM) {
+        return;
+    }
+
+    if (!paused) {
+        need_update = true;
+    } else
+    if (refresh_period) {
+        // to check again; the next period is set after the refresh
+        alarm(refresh_period);
+    }
+}
+
+static void sched_init(sched_t *s, int period, bool adaptive, bool jitter)
+{
+    memset(s, 0, sizeof(sched_t));
+    s->base      = period > 0 ? period:DEFAULT_REFRESH;
+    s->period    = s->base;
+    s->effective = s->base;
+    s->next      = s->base;
+    s->adaptive  = adaptive;
+    s->jitter    = jitter;
+    s->seed      = getpid() ^ time(NULL);
+}
+
+/*
+ * Account for a refresh, given how long fetching the jobs took and how many
+ * of them changed (negative if not known), and return the time till the
+ * next one, in s. The period is lengthened while nothing changes and
+ * shortened during rapid turnover, but is kept long enough for the server
+ * not to spend more than 1/SCHED_LOAD of the time on us. Failed refreshes
+ * double the wait, up to SCHED_MAX_BACKOFF.
+ */
+static double sched_update(sched_t *s, bool ok, double fetch_ms,
+    int nchanged, int njobs)
+{
+    double period = s->period;
+
+    if (!ok) {
+        s->nerrors++;
+        s->effective = fmin(period*pow(2, s->nerrors),
+            fmax(SCHED_MAX_BACKOFF, period));
+    } else {
+        s->nerrors = 0;
+        s->fetch_ms = s->nrefreshes ? 0.7*s->fetch_ms + 0.3*fetch_ms:fetch_ms;
+        if (s->adaptive) {
+            if (s->nrefreshes > 0 && nchanged >= 0) {
+                if (nchanged > SCHED_TURNOVER*njobs) {
+                    period *= 0.7;
+                } else
+                if (nchanged == 0) {
+                    period *= 1.25;
+                } else {
+                    period += (s->base - period)/2;
+                }
+            }
+            period = fmax(period, fmax(SCHED_MIN_SCALE*s->base, 1));
+            period = fmin(period, SCHED_MAX_SCALE*s->base);
+            // however long that makes it
+            period = fmax(period, SCHED_LOAD*s->fetch_ms/1000);
+        }
+        s->period = period;
+        s->effective = period;
+        s->nrefreshes++;
+    }
+
+    s->next = s->effective;
+    if (s->jitter) {
+        double r = (double) rand_r(&s->seed)/RAND_MAX;
+        s->next *= 1 + SCHED_JITTER*(2*r - 1);
+    }
+
+    return s->next;
+}
+
+/* Have SIGALRM delivered when the next refresh is due */
+static void sched_arm(const sched_t *s)
+{
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec  = (time_t) s->next;
+    it.it_value.tv_usec = 1.0e6*(s->next - (time_t) s->next);
+    if (it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0) {
+        it.it_value.tv_usec = 1;
+    }
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/* Sleep for secs, or until a signal */
+static void sched_sleep(double secs)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = (time_t) secs;
+    ts.tv_nsec = 1.0e9*(secs - (time_t) secs);
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * Parse a watch condition: "state" (any change) or "state=<states>" (one
+ * of these entered), "bad", "mem" or "mem=<%>", and "gone".
+ */
+static bool watch_add_rule(watch_t *w, const char *spec)
+{
+    watch_rule_t rule;
+
+    memset(&rule, 0, sizeof(watch_rule_t));
+    if (!strcmp(spec, "state")) {
+        rule.kind = EVENT_STATE;
+    } else
+    if (!strncmp(spec, "state=", 6) && strlen(spec + 6) < 16) {
+        rule.kind = EVENT_STATE;
+        strcpy(rule.states, spec + 6);
+    } else
+    if (!strcmp(spec, "bad")) {
+        rule.kind = EVENT_BAD;
+    } else
+    if (!strcmp(spec, "mem")) {
+        rule.kind = EVENT_MEM;
+    } else
+    if (!strncmp(spec, "mem=", 4) && atoi(spec + 4) > 0) {
+        rule.kind = EVENT_MEM;
+        // one threshold for all; the edge is crossed once per job
+        w->mem_high = atoi(spec + 4);
+    } else
+    if (!strcmp(spec, "gone")) {
+        rule.kind = EVENT_DELETED;
+    } else {
+        return false;
+    }
+
+    watch_rule_t *rules = realloc(w->rules,
+        (w->nrules + 1)*sizeof(watch_rule_t));
+    if (!rules) {
+        return false;
+    }
+    w->rules = rules;
+    w->rules[w->nrules++] = rule;
+
+    return true;
+}
+
+static bool watch_matches(const watch_t *w, const event_t *e)
+{
+    int i;
+
+    for (i = 0; i < w->nrules; i++) {
+        const watch_rule_t *rule = w->rules + i;
+        if (rule->kind == e->kind && (rule->kind != EVENT_STATE ||
+            rule->states[0] == '\0' || strchr(rule->states, e->new_state))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Fire a matching event: run the command, with the event described in the
+ * environment, and/or write a line to the FIFO, if anyone reads it.
+ */
+static void watch_event(const event_t *e, void *data)
+{
+    watch_t *w = data;
+    char line[192];
+
+    if (!watch_matches(w, e)) {
+        return;
+    }
+
+    format_event_line(e, line);
+
+    if (w->command) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            char descr[64], state[2] = {e->new_state, '\0'},
+                old_state[2] = {e->old_state, '\0'};
+            format_event(e, descr);
+            setenv("QTOP_JOBID", e->jobid, 1);
+            setenv("QTOP_USER", e->user, 1);
+            setenv("QTOP_QUEUE", e->queue, 1);
+            setenv("QTOP_STATE", state, 1);
+            setenv("QTOP_OLD_STATE", old_state, 1);
+            setenv("QTOP_EVENT", descr, 1);
+            execl("/bin/sh", "sh", "-c", w->command, (char *) NULL);
+            _exit(127);
+        }
+    }
+    if (w->fifo) {
+        // without a reader, the event is dropped
+        if (w->fifo_fd < 0) {
+            w->fifo_fd = open(w->fifo, O_WRONLY | O_NONBLOCK);
+        }
+        if (w->fifo_fd >= 0 && write(w->fifo_fd, line, strlen(line)) < 0) {
+            close(w->fifo_fd);
+            w->fifo_fd = -1;
+        }
+    }
+    if (!w->command && !w->fifo) {
+        fputs(line, stdout);
+        fflush(stdout);
+    }
+}
+
+typedef enum {
+    METRIC_JOBS,
+    METRIC_BAD,
+    METRIC_NCPUS,
+    METRIC_MEM,
+    METRIC_MEM_R,
+    METRIC_CPUT,
+    METRIC_WALLTIME,
+    METRIC_IO
+} metric_t;
+
+static void metric_head(outbuf_t *ob, const char *name, const char *type,
+    const char *help)
+{
+    out_str(ob, "# HELP ");
+    out_str(ob, name);
+    out_char(ob, ' ');
+    out_str(ob, help);
+    out_str(ob, "\n# TYPE ");
+    out_str(ob, name);
+    out_char(ob, ' ');
+    out_str(ob, type);
+    out_char(ob, '\n');
+}
+
+/* A sample of a server-wide gauge, optionally with the state label */
+static void metric_server(outbuf_t *ob, const qtop_t *q, const char *name,
+    const char *state, double v)
+{
+    out_str(ob, name);
+    out_str(ob, "{server=");
+    out_prom_label(ob, q->servername);
+    if (state) {
+        out_str(ob, ",state=");
+        out_prom_label(ob, state);
+    }
+    out_mem(ob, "} ", 2);
+    out_fixed(ob, v, v == floor(v) ? 0:3, 0);
+    out_char(ob, '\n');
+}
+
+static void metric_rows(outbuf_t *ob, const qtop_t *q, metric_t what,
+    const char *name, const char *help, const summary_row_t *rows, int nrows)
+{
+    const double kb = 1024;
+    int i;
+
+    metric_head(ob, name, "gauge", help);
+    for (i = 0; i < nrows; i++) {
+        const summary_row_t *row = rows + i;
+        char state[2] = {row->state, '\0'};
+        double v = 0;
+
+        switch (what) {
+        case METRIC_JOBS:
+            v = row->njobs;
+            break;
+        case METRIC_BAD:
+            v = row->nbad;
+            break;
+        case METRIC_NCPUS:
+            v = row->ncpus;
+            break;
+        case METRIC_MEM:
+            v = kb*row->mem;
+            break;
+        case METRIC_MEM_R:
+            v = kb*row->mem_r;
+            break;
+        case METRIC_CPUT:
+            v = row->cput;
+            break;
+        case METRIC_WALLTIME:
+            v = row->walltime;
+            break;
+        case METRIC_IO:
+            v = row->io;
+            break;
+        }
+
+        out_str(ob, name);
+        out_str(ob, "{server=");
+        out_prom_label(ob, q->servername);
+        out_str(ob, ",user=");
+        out_prom_label(ob, row->user);
+        out_str(ob, ",queue=");
+        out_prom_label(ob, row->queue);
+        out_str(ob, ",state=");
+        out_prom_label(ob, state);
+        out_mem(ob, "} ", 2);
+        out_fixed(ob, v, what == METRIC_IO ? 3:0, 0);
+        out_char(ob, '\n');
+    }
+}
+
+/*
+ * The Prometheus text exposition of the server counters and of the summary
+ * of jobs (sorted), into a malloc'ed buffer
+ */
+static char *qtop_metrics(const qtop_t *q, const server_t *pbs,
+    const job_t *jobs, int njobs, double fetch_ms, size_t *len)
+{
+    const double kb = 1024;
+    static outbuf_t ob;
+    char *body = NULL;
+    FILE *fp;
+
+    fp = open_memstream(&body, len);
+    if (!fp) {
+        return NULL;
+    }
+    outbuf_init(&ob, fp);
+
+    metric_head(&ob, "qtop_refresh_timestamp_seconds", "gauge",
+        "Time of the last successful refresh.");
+    metric_server(&ob, q, "qtop_refresh_timestamp_seconds", NULL, time(NULL));
+    metric_head(&ob, "qtop_refresh_duration_seconds", "gauge",
+        "Time the last refresh took.");
+    metric_server(&ob, q, "qtop_refresh_duration_seconds", NULL,
+        fetch_ms/1000);
+
+    metric_head(&ob, "qtop_server_active", "gauge",
+        "Whether the server is active.");
+    metric_server(&ob, q, "qtop_server_active", NULL, pbs->active);
+    metric_head(&ob, "qtop_server_jobs_total", "gauge",
+        "Jobs known to the server.");
+    metric_server(&ob, q, "qtop_server_jobs_total", NULL, pbs->total_jobs);
+    metric_head(&ob, "qtop_server_jobs", "gauge",
+        "Jobs known to the server, by state.");
+    metric_server(&ob, q, "qtop_server_jobs", "R", pbs->njobs_r);
+    metric_server(&ob, q, "qtop_server_jobs", "Q", pbs->njobs_q);
+    metric_server(&ob, q, "qtop_server_jobs", "W", pbs->njobs_w);
+    metric_server(&ob, q, "qtop_server_jobs", "T", pbs->njobs_t);
+    metric_server(&ob, q, "qtop_server_jobs", "H", pbs->njobs_h);
+    metric_server(&ob, q, "qtop_server_jobs", "E", pbs->njobs_e);
+    metric_server(&ob, q, "qtop_server_jobs", "B", pbs->njobs_b);
+    metric_head(&ob, "qtop_server_assigned_ncpus", "gauge",
+        "CPUs assigned to jobs.");
+    metric_server(&ob, q, "qtop_server_assigned_ncpus", NULL, pbs->ncpus);
+    metric_head(&ob, "qtop_server_assigned_mpiprocs", "gauge",
+        "MPI processes assigned to jobs.");
+    metric_server(&ob, q, "qtop_server_assigned_mpiprocs", NULL,
+        pbs->mpiprocs);
+    metric_head(&ob, "qtop_server_assigned_mem_bytes", "gauge",
+        "Memory assigned to jobs.");
+    metric_server(&ob, q, "qtop_server_assigned_mem_bytes", NULL,
+        kb*pbs->mem);
+    metric_head(&ob, "qtop_server_assigned_vmem_bytes", "gauge",
+        "Virtual memory assigned to jobs.");
+    metric_server(&ob, q, "qtop_server_assigned_vmem_bytes", NULL,
+        kb*pbs->vmem);
+    metric_head(&ob, "qtop_server_available_ncpus", "gauge",
+        "CPUs available on the server.");
+    metric_server(&ob, q, "qtop_server_available_ncpus", NULL,
+        pbs->ncpus_avail);
+    metric_head(&ob, "qtop_server_available_mem_bytes", "gauge",
+        "Memory available on the server.");
+    metric_server(&ob, q, "qtop_server_available_mem_bytes", NULL,
+        kb*pbs->mem_avail);
+
+    summary_row_t *rows = malloc((njobs + 1)*sizeof(summary_row_t));
+    int nrows = rows ? jobs_summary(jobs, njobs, rows, njobs):0;
+    // a series per label set
+    nrows = summary_merge(rows, nrows);
+    metric_rows(&ob, q, METRIC_JOBS, "qtop_jobs",
+        "Jobs by user, queue, and state.", rows, nrows);
+    metric_rows(&ob, q, METRIC_BAD, "qtop_jobs_bad",
+        "Misbehaving jobs by user, queue, and state.", rows, nrows);
+    metric_rows(&ob, q, METRIC_NCPUS, "qtop_jobs_ncpus",
+        "CPUs of the jobs (used, or requested if not started).", rows, nrows);
+    metric_rows(&ob, q, METRIC_MEM, "qtop_jobs_mem_bytes",
+        "Memory of the jobs (used, or requested if not started).", rows,
+        nrows);
+    metric_rows(&ob, q, METRIC_MEM_R, "qtop_jobs_mem_requested_bytes",
+        "Memory requested by the jobs.", rows, nrows);
+    metric_rows(&ob, q, METRIC_CPUT, "qtop_jobs_cput_seconds",
+        "CPU time of the jobs (used, or requested if not started).", rows,
+        nrows);
+    metric_rows(&ob, q, METRIC_WALLTIME, "qtop_jobs_walltime_seconds",
+        "Walltime of the jobs (used, or requested if not started).", rows,
+        nrows);
+    metric_rows(&ob, q, METRIC_IO, "qtop_jobs_io",
+        "I/O rate of the jobs.", rows, nrows);
+    xfree(rows);
+
+    outbuf_flush(&ob);
+    fclose(fp);
+
+    return body;
+}
+
+static volatile sig_atomic_t watch_stopped = false;
+static void catch_stop(int sig)
+{
+    (void) sig;
+    watch_stopped = true;
+}
+
+/* The session whose history is saved on exit, whichever way it comes */
+static const qtop_t *history_owner = NULL;
+static void history_save_at_exit(void)
+{
+    if (history_owner) {
+        qtop_history_save(history_owner);
+    }
+}
+
+/*
+ * A refresh of the headless modes: the events and, if serving, the metrics
+ * updated. Returns the time till the next one, in s.
+ */
+static double qtop_watch_refresh(qtop_t *q, server_t *pbs, events_t *ev,
+    serve_t *srv)
+{
+    int njobs, i;
+    double t0 = profile_now();
+    // the header counters are only needed for the metrics
+    bool ok = !srv || qtop_server_update(q, pbs);
+    job_t *jobs = ok ? qtop_server_jobs(q, &njobs, 0):NULL;
+    if (!jobs && conn_lost() && qtop_reconnect(q)) {
+        ok = !srv || qtop_server_update(q, pbs);
+        jobs = ok ? qtop_server_jobs(q, &njobs, 0):NULL;
+    }
+    double fetch_ms = profile_now() - t0;
+    // no jobs selected isn't a failure
+    ok = jobs || pbs_errno == PBSE_NONE;
+    if (!jobs) {
+        njobs = 0;
+    }
+    if (ok) {
+        t0 = profile_start(q->prof);
+        // an empty selection too, the last jobs being gone
+        events_update(ev, jobs, njobs, q->subjobs);
+        // likewise, no jobs left is published, as no series of them
+        if (srv) {
+            size_t len;
+            if (njobs > 0) {
+                qsort(jobs, njobs, sizeof(job_t), job_comp);
+            }
+            char *body = qtop_metrics(q, pbs, jobs, njobs, fetch_ms, &len);
+            if (body) {
+                serve_set(srv, body, len);
+            }
+        }
+        profile_add(q->prof, PROF_OTHER, t0);
+        if (q->prof) {
+            profile_commit(q->prof);
+        }
+    }
+    if (jobs) {
+        for (i = 0; i < njobs; i++) {
+            job_free_data(jobs + i);
+        }
+        xfree(jobs);
+    }
+
+    return sched_update(q->sched, ok, fetch_ms, ok ? ev->nchanged:0, njobs);
+}
+
+/*
+ * The headless watch mode: one fetch per refresh period, diffed into
+ * events, which are matched against the conditions. Runs until killed.
+ */
+static void qtop_watch(qtop_t *q, server_t *pbs, events_t *ev, watch_t *w,
+    serve_t *srv)
+{
+    ev->sink = watch_event;
+    ev->sink_data = w;
+    // the commands are not waited for
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    // to remove the unix socket
+    signal(SIGINT, catch_stop);
+    signal(SIGTERM, catch_stop);
+    signal(SIGHUP, catch_stop);
+
+    while (!watch_stopped) {
+        double delay = qtop_watch_refresh(q, pbs, ev, srv);
+
+        if (watch_stopped) {
+            break;
+        }
+        if (srv) {
+            serve_wait(srv, delay);
+        } else {
+            sched_sleep(delay);
+        }
+    }
+
+    serve_close(srv);
+    exit(0);
+}
+
+/* a column of the batch output; the time is left out of fixed columns */
+typedef struct {
+    const char *name;
+    int width;          /* negative for left-aligned */
+} batch_column_t;
+
+static const batch_column_t batch_job_columns[] = {
+    {"time",      0},
+    {"id",       12},
+    {"user",      8},
+    {"queue",     8},
+    {"state",    -5},
+    {"mem_gb",    8},
+    {"mem_pct",   7},
+    {"vmem_gb",   8},
+    {"ncpus",     6},
+    {"cpu_pct",   7},
+    {"walltime", 10},
+    {"io",        5},
+    {"bad",       5},
+    {"name",      0}
+};
+
+static const batch_column_t batch_summary_columns[] = {
+    {"time",      0},
+    {"user",      8},
+    {"queue",     8},
+    {"state",    -5},
+    {"jobs",      7},
+    {"mem_gb",    9},
+    {"mem_pct",   7},
+    {"ncpus",     7},
+    {"cpu_pct",   7},
+    {"walltime", 11},
+    {"io",        7},
+    {"bad",       5}
+};
+
+/* Start the i-th field of a row */
+static void batch_key(outbuf_t *ob, batch_format_t format,
+    const batch_column_t *cols, int i)
+{
+    switch (format) {
+    case BATCH_JSON:
+        out_char(ob, i == 0 ? '{':',');
+        out_char(ob, '"');
+        out_str(ob, cols[i].name);
+        out_mem(ob, "\":", 2);
         break;
-    case JOB_WAITING:
-        rank = 5;
+    case BATCH_CSV:
+        if (i > 0) {
+            out_char(ob, ',');
+        }
         break;
-    case JOB_HELD:
-        rank = 6;
+    default:
+        if (i > 1) {
+            out_char(ob, ' ');
+        }
         break;
-    case JOB_TRANSIT:
-        rank = 7;
+    }
+}
+
+static void batch_str(outbuf_t *ob, batch_format_t format,
+    const batch_column_t *cols, int i, const char *s, size_t len)
+{
+    batch_key(ob, format, cols, i);
+    switch (format) {
+    case BATCH_JSON:
+        out_json_str(ob, s);
         break;
-    case JOB_SUB_COMPLETED:
-    case JOB_FINISHED:
-        rank = 8;
+    case BATCH_CSV:
+        out_csv_str(ob, s);
         break;
-    case JOB_MOVED:
-        rank = 9;
+    default:
+        out_field(ob, s ? s:"-", s ? len:1, cols[i].width);
         break;
     }
-
-    return rank;
 }
 
-static int job_comp(const void *a, const void *b)
+static void batch_num(outbuf_t *ob, batch_format_t format,
+    const batch_column_t *cols, int i, double v, int decimals)
 {
-    const job_t *ja = a, *jb = b;
-    int cmp = 0;
+    batch_key(ob, format, cols, i);
+    out_fixed(ob, v, decimals, format == BATCH_COLUMNS ? cols[i].width:0);
+}
 
-    /* sort subjobs according to their sub-id irrespecitvely of the state */
-    if (jb->id == ja->id) {
-        return ja->aid - jb->aid;
+static void batch_end(outbuf_t *ob, batch_format_t format)
+{
+    if (format == BATCH_JSON) {
+        out_char(ob, '}');
     }
+    out_char(ob, '\n');
+}
 
-    cmp = state_rank(ja->state) - state_rank(jb->state);
+static void batch_header(outbuf_t *ob, batch_format_t format,
+    const batch_column_t *cols, int ncols)
+{
+    int i;
 
-    if (cmp == 0) {
-        if (ja->user && jb->user) {
-            cmp = strcmp(ja->user, jb->user);
+    for (i = format == BATCH_COLUMNS ? 1:0; i < ncols; i++) {
+        batch_key(ob, format, cols, i);
+        if (format == BATCH_COLUMNS) {
+            out_field(ob, cols[i].name, strlen(cols[i].name), cols[i].width);
         } else {
-            cmp = 0;
+            out_str(ob, cols[i].name);
         }
     }
+    batch_end(ob, BATCH_CSV);
+}
 
-    if (cmp == 0) {
-        if (ja->queue && jb->queue) {
-            cmp = strcmp(ja->queue, jb->queue);
-        } else {
-            cmp = 0;
-        }
+static void batch_job(outbuf_t *ob, batch_format_t format, const job_t *job,
+    long stamp)
+{
+    const batch_column_t *cols = batch_job_columns;
+    const double gb_scale = pow(2, 20);
+    char buf[64], state[2];
+    job_stats_t st;
+    int len;
+
+    get_job_stats(job, &st);
+
+    if (format != BATCH_COLUMNS) {
+        batch_num(ob, format, cols, 0, stamp, 0);
     }
 
-    if (cmp == 0) {
-        cmp = jb->id - ja->id;
+    len = fmt_long(buf, job->id);
+    if (job->is_array) {
+        buf[len++] = '[';
+        buf[len++] = ']';
+    } else
+    if (job->aid) {
+        buf[len++] = '[';
+        len += fmt_long(buf + len, job->aid);
+        buf[len++] = ']';
+    }
+    buf[len] = '\0';
+    batch_str(ob, format, cols, 1, buf, len);
+    batch_str(ob, format, cols, 2, job->user,
+        job->user ? strlen(job->user):0);
+    batch_str(ob, format, cols, 3, job->queue,
+        job->queue ? strlen(job->queue):0);
+    state[0] = job->state;
+    state[1] = '\0';
+    batch_str(ob, format, cols, 4, state, 1);
+
+    batch_num(ob, format, cols, 5, st.mem/gb_scale, 2);
+    batch_num(ob, format, cols, 6, 100*st.memutil, 0);
+    batch_num(ob, format, cols, 7, st.vmem/gb_scale, 2);
+    batch_num(ob, format, cols, 8, st.ncpus, 0);
+    batch_num(ob, format, cols, 9, 100*st.cpuutil, 0);
+    if (format == BATCH_COLUMNS) {
+        batch_key(ob, format, cols, 10);
+        out_hms(ob, st.walltime, cols[10].width);
+    } else {
+        batch_num(ob, format, cols, 10, st.walltime, 0);
+    }
+    batch_num(ob, format, cols, 11, job->io_r, 1);
+    batch_key(ob, format, cols, 12);
+    if (format == BATCH_JSON) {
+        out_str(ob, st.bad ? "true":"false");
+    } else {
+        out_field(ob, st.bad ? "1":"0", 1,
+            format == BATCH_COLUMNS ? cols[12].width:0);
     }
+    batch_str(ob, format, cols, 13, job->name,
+        job->name ? strlen(job->name):0);
+    batch_end(ob, format);
+}
 
-    return cmp;
+static void batch_summary(outbuf_t *ob, batch_format_t format,
+    const summary_row_t *row, long stamp)
+{
+    const batch_column_t *cols = batch_summary_columns;
+    const double gb_scale = pow(2, 20);
+    char state[2];
+
+    state[0] = row->state;
+    state[1] = '\0';
+
+    if (format != BATCH_COLUMNS) {
+        batch_num(ob, format, cols, 0, stamp, 0);
+    }
+    batch_str(ob, format, cols, 1, row->user,
+        row->user ? strlen(row->user):0);
+    batch_str(ob, format, cols, 2, row->queue,
+        row->queue ? strlen(row->queue):0);
+    batch_str(ob, format, cols, 3, state, 1);
+    batch_num(ob, format, cols, 4, row->njobs, 0);
+    batch_num(ob, format, cols, 5, row->mem/gb_scale, 2);
+    batch_num(ob, format, cols, 6, 100*row->memutil, 0);
+    batch_num(ob, format, cols, 7, row->ncpus, 0);
+    batch_num(ob, format, cols, 8, 100*row->cpuutil, 0);
+    if (format == BATCH_COLUMNS) {
+        batch_key(ob, format, cols, 9);
+        out_hms(ob, row->walltime, cols[9].width);
+    } else {
+        batch_num(ob, format, cols, 9, row->walltime, 0);
+    }
+    batch_num(ob, format, cols, 10, row->io, 1);
+    batch_num(ob, format, cols, 11, row->nbad, 0);
+    batch_end(ob, format);
 }
 
-static void print_job_details(const qtop_t *q, const job_t *job,
-    unsigned int xshift, unsigned int yshift)
+/*
+ * The batch mode: niter times (forever if 0), fetch the job list and write
+ * it, or its summary, to stdout.
+ */
+static bool qtop_batch(qtop_t *q, server_t *pbs, events_t *ev,
+    batch_format_t format, bool summary, int niter)
 {
-    werase(q->jwin);
+    const batch_column_t *cols;
+    double delay = 0;
+    static outbuf_t ob;
+    int iter, ncols;
+
+    if (summary) {
+        cols = batch_summary_columns;
+        ncols = sizeof(batch_summary_columns)/sizeof(batch_column_t);
+    } else {
+        cols = batch_job_columns;
+        ncols = sizeof(batch_job_columns)/sizeof(batch_column_t);
+    }
 
-    box(q->jwin, 0, 0);
+    outbuf_init(&ob, stdout);
+    if (format == BATCH_CSV) {
+        batch_header(&ob, format, cols, ncols);
+    }
 
-    if (job && job->id) {
-        char idbuf[32];
-        if (job->is_array) {
-            sprintf(idbuf, "%d[]", job->id);
+    for (iter = 0; niter == 0 || iter < niter; iter++) {
+        int njobs, i;
+        job_t *jobs;
+
+        if (iter > 0) {
+            sched_sleep(delay);
+        }
+
+        double t0 = profile_now();
+        if (q->acct) {
+            jobs = qtop_acct_jobs(q, pbs, &njobs);
         } else
-        if (job->aid) {
-            sprintf(idbuf, "%d[%d]", job->id, job->aid);
+        if (q->playback) {
+            jobs = qtop_playback_jobs(q, pbs, &njobs);
+        } else
+        if (q->snapshot) {
+            jobs = qtop_snapshot_jobs(q, pbs, &njobs);
         } else {
-            sprintf(idbuf, "%d", job->id);
+            qtop_server_update(q, pbs);
+            jobs = qtop_server_jobs(q, &njobs, 0);
+            if (!jobs && conn_lost() && qtop_reconnect(q)) {
+                qtop_server_update(q, pbs);
+                jobs = qtop_server_jobs(q, &njobs, 0);
+            }
+            if (q->recorder) {
+                histlog_append(q->recorder, pbs, jobs, njobs);
+            }
+            qtop_snapshot_publish(q, pbs, jobs, njobs);
+            // an empty selection too, the last jobs being gone
+            if (jobs || pbs_errno == PBSE_NONE) {
+                double t0 = profile_start(q->prof);
+                events_update(ev, jobs, njobs, q->subjobs);
+                profile_add(q->prof, PROF_OTHER, t0);
+            }
         }
-        mvwprintw(q->jwin, 0, 1, "Job ID = %s", idbuf);
-        struct batch_status *qstatus = pbs_statjob(q->conn, idbuf, NULL, "x");
-        if (qstatus) {
-            print_attribs(q->jwin, qstatus->attribs, xshift, yshift);
-            pbs_statfree(qstatus);
+        if (!jobs) {
+            // no jobs selected isn't a failure
+            if (q->acct || q->playback || q->snapshot ||
+                pbs_errno != PBSE_NONE) {
+                outbuf_flush(&ob);
+                return false;
+            }
+            njobs = 0;
+        }
+        delay = sched_update(q->sched, true, profile_now() - t0,
+            q->acct || q->playback || q->snapshot ? -1:ev->nchanged, njobs);
+
+        t0 = profile_start(q->prof);
+        if (njobs > 0) {
+            qsort(jobs, njobs, sizeof(job_t), job_comp);
+        }
+        profile_add(q->prof, PROF_SORT, t0);
+
+        t0 = profile_start(q->prof);
+        time_t stamp = q->playback ? q->frame_time:time(NULL);
+        if (format == BATCH_COLUMNS) {
+            if (iter > 0) {
+                out_char(&ob, '\n');
+            }
+            char datebuf[32];
+            strftime(datebuf, 32, "%F %T", localtime(&stamp));
+            out_str(&ob, q->servername);
+            out_char(&ob, ' ');
+            out_str(&ob, datebuf);
+            out_mem(&ob, ", ", 2);
+            out_long(&ob, njobs, 0);
+            out_str(&ob, " jobs\n");
+            batch_header(&ob, format, cols, ncols);
+        }
+        if (summary) {
+            summary_row_t *rows = malloc((njobs + 1)*sizeof(summary_row_t));
+            int nrows = rows ? jobs_summary(jobs, njobs, rows, njobs):0;
+            for (i = 0; i < nrows; i++) {
+                batch_summary(&ob, format, rows + i, stamp);
+            }
+            xfree(rows);
+        } else {
+            for (i = 0; i < njobs; i++) {
+                batch_job(&ob, format, jobs + i, stamp);
+            }
+        }
+        outbuf_flush(&ob);
+        profile_add(q->prof, PROF_DRAW, t0);
+        if (q->prof) {
+            profile_commit(q->prof);
+        }
+
+        for (i = 0; i < njobs; i++) {
+            job_free_data(jobs + i);
         }
+        xfree(jobs);
     }
 
-    wrefresh(q->jwin);
+    return true;
 }
 
-static job_t *get_job(job_t *jobs, int njobs, int jid)
+/* Publish the daemon's last refresh as a snapshot; it's left intact */
+static void qtop_daemon_publish(qtop_t *q, server_t *pbs)
 {
-    if (jobs && jid >= 0 && jid < njobs) {
-        return jobs + jid;
-    } else {
-        return NULL;
-    }
-}
+    const struct batch_status *server, *bs;
+    const struct batch_status *statuses = daemon_cached(&server);
+    int njobs = 0, i;
 
-static int refresh_period = DEFAULT_REFRESH;
-static bool paused = false;
+    if (!server) {
+        return;
+    }
+    pbs->qstatus = (struct batch_status *) server;
+    parse_server_attribs(pbs);
+    pbs->qstatus = NULL;
 
-volatile sig_atomic_t need_update = false;
-void catch_alarm(int sig)
-{
-    if (sig != SIGALRM) {
+    for (bs = statuses; bs; bs = bs->next) {
+        njobs++;
+    }
+    job_t *jobs = calloc(njobs + 1, sizeof(job_t));
+    if (!jobs) {
         return;
     }
+    for (bs = statuses, i = 0; bs; bs = bs->next, i++) {
+        // parsing cuts the server name off the ID
+        struct batch_status tmp = *bs;
+        char name[256];
+        snprintf(name, sizeof(name), "%s", bs->name ? bs->name:"");
+        tmp.name = name;
+        parse_job_status(jobs + i, &tmp);
+    }
 
-    if (!paused) {
-        need_update = true;
+    pbs_errno = PBSE_NONE;
+    qtop_snapshot_publish(q, pbs, jobs, njobs);
+
+    for (i = 0; i < njobs; i++) {
+        job_free_data(jobs + i);
     }
-    if (refresh_period) {
-        alarm(refresh_period);
+    xfree(jobs);
+}
+
+/*
+ * The daemon mode: one refresh of all active jobs per period, served to the
+ * qtop clients on srv in between
+ */
+static void qtop_daemon(qtop_t *q, server_t *pbs, serve_t *srv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, catch_stop);
+    signal(SIGTERM, catch_stop);
+
+    while (!watch_stopped) {
+        double t0 = profile_now();
+        bool ok = daemon_refresh(q->conn);
+        if (!ok && conn_lost() && qtop_reconnect(q)) {
+            ok = daemon_refresh(q->conn);
+        }
+        // the changes aren't followed here, only the load
+        double delay = sched_update(q->sched, ok, profile_now() - t0, -1, 0);
+        if (ok && q->snapshot_file) {
+            qtop_daemon_publish(q, pbs);
+        }
+        if (watch_stopped) {
+            break;
+        }
+        serve_wait(srv, delay);
     }
+
+    serve_close(srv);
+    exit(0);
 }
 
 static void usage(const char *arg0, FILE *out)
 {
     fprintf(out, "usage: %s [options]\n", arg0);
+    fprintf(out, "       %s [options] -A <accounting log(s)>\n", arg0);
     fprintf(out, "Available options:\n");
     fprintf(out, "  -u <username> show jobs for username\n");
     fprintf(out, "  -q <queue>    only show jobs in specific queue\n");
     fprintf(out, "  -s <state(s)> only show jobs in specific non-terminal state(s)\n");
     fprintf(out, "  -e <host>     only show jobs running on specific host\n");
+    fprintf(out, "  -j <id>       only show specific job (or its subjobs)\n");
     fprintf(out, "  -f            show finished jobs\n");
     fprintf(out, "  -F            only show failed jobs (implies -f)\n");
     fprintf(out, "  -H <hours>    history span for finished jobs [%d]\n",
         DEFAULT_HISTORY);
     fprintf(out, "  -S            include array subjobs\n");
     fprintf(out, "  -a            run in the aggregate (summary) mode (implies -S)\n");
-    fprintf(out, "  -R <secs>     refresh period [%d]\n", refresh_period);
+    fprintf(out, "  -R <secs>     refresh period, adapted to the server's load and the job\n");
+    fprintf(out, "                turnover within [R/2, 4R] [%d]\n", refresh_period);
+    fprintf(out, "  --fixed-refresh refresh exactly every -R seconds\n");
+    fprintf(out, "  --timeout=<secs> give up on a PBS request after secs, 0 for never [%d]\n",
+        DEFAULT_TIMEOUT);
+    fprintf(out, "  -w <file>     record the job tables to file\n");
+    fprintf(out, "  -t <file>     play back a recording made with -w\n");
+    fprintf(out, "  -J <file>     append job events (state changes etc.) to file\n");
+    fprintf(out, "  -A            read finished jobs from accounting logs (files or\n");
+    fprintf(out, "                directories) given as arguments\n");
+    fprintf(out, "  -b <format>   batch mode: print the job list (or, with -a, the summary)\n");
+    fprintf(out, "                as csv, json (lines) or columns to stdout\n");
+    fprintf(out, "  -n <count>    number of iterations in the batch mode, 0 for no limit [1]\n");
+    fprintf(out, "  -r <format>   print efficiency report of finished jobs (table or csv)\n");
+    fprintf(out, "                and exit\n");
+    fprintf(out, "  --watch=<cond> run headless, firing on the condition (state[=<states>],\n");
+    fprintf(out, "                bad, mem[=<%%>], or gone); may be repeated\n");
+    fprintf(out, "  --exec=<cmd>  with --watch, run cmd on each event (see QTOP_* variables)\n");
+    fprintf(out, "  --fifo=<file> with --watch, write each event to the FIFO\n");
+    fprintf(out, "  --pbs-record=<file> record all PBS calls and their results to file\n");
+    fprintf(out, "  --pbs-replay=<file> serve PBS calls from a recording, as timed originally\n");
+    fprintf(out, "  --pbs-synthetic=<njobs> serve PBS calls from a synthetic server of njobs\n");
+    fprintf(out, "  --profile=<file> append the timing of every refresh to file\n");
+    fprintf(out, "  --daemon[=<socket>] run as qtopd, refreshing all jobs for the qtop's\n");
+    fprintf(out, "                connecting to socket [$QTOPD_SOCKET or %s]\n",
+        QTOPD_SOCKET);
+    fprintf(out, "  --no-daemon   talk to the server even if qtopd is running\n");
+    fprintf(out, "  --serve=<addr> run headless, serving the metrics of every refresh to\n");
+    fprintf(out, "                Prometheus on [host]:port (127.0.0.1 by default) or\n");
+    fprintf(out, "                unix:<path>\n");
+    fprintf(out, "  --snapshot=<file> publish the job table of every refresh to file\n");
+    fprintf(out, "  --from-snapshot=<file> show the job table published to file instead\n");
     fprintf(out, "  -C            start in monochrome mode\n");
     fprintf(out, "  -V            print version info and exit\n");
     fprintf(out, "  -h            print this help\n");
@@ -1313,6 +5774,28 @@ static void about(void)
     fprintf(stdout, "Written by Evgeny Stambulchik.\n");
 }
 
+static void init_colors(void)
+{
+    start_color();
+    use_default_colors();
+    if (can_change_color()) {
+        init_color(COLOR_WHITE, 1000, 1000, 1000);
+        init_color(COLOR_RED,    800,  100,  100);
+        init_color(COLOR_BLUE,     0,  400, 1000);
+        init_color(COLOR_GREEN,    0,  800,  100);
+    }
+    init_pair(COLOR_PAIR_HEADER,    COLOR_BLUE,    -1);
+    init_pair(COLOR_PAIR_JHEADER,           -1,    -1);
+    init_pair(COLOR_PAIR_JOB_R,     COLOR_GREEN,   -1);
+    init_pair(COLOR_PAIR_JOB_Q,     COLOR_CYAN,    -1);
+    init_pair(COLOR_PAIR_JOB_W,     COLOR_YELLOW,  -1);
+    init_pair(COLOR_PAIR_JOB_H,     COLOR_MAGENTA, -1);
+    init_pair(COLOR_PAIR_JOB_S,     COLOR_YELLOW,  -1);
+    init_pair(COLOR_PAIR_JOB_OTHER, COLOR_BLACK,   -1);
+    init_pair(COLOR_PAIR_JOB_BAD,   COLOR_RED,     -1);
+}
+
+#ifndef QTOP_NO_MAIN
 int main(int argc, char * const argv[])
 {
     char *server_name = NULL;
@@ -1325,6 +5808,26 @@ int main(int argc, char * const argv[])
     bool subjobs = false;
     int history_span = DEFAULT_HISTORY;
     bool bw = false;
+    char *record_file = NULL;
+    char *playback_file = NULL;
+    char *snapshot_file = NULL, *snapshot_path = NULL;
+    char *journal_file = NULL;
+    bool acct = false;
+    unsigned int job_id = 0;
+    report_format_t report_format = REPORT_NONE;
+    batch_format_t batch_format = BATCH_NONE;
+    int batch_niter = 1;
+    char *serve_addr = NULL;
+    char *daemon_socket = getenv("QTOPD_SOCKET");
+    bool daemon_mode = false, no_daemon = false;
+    bool fixed_refresh = false;
+    int call_timeout = DEFAULT_TIMEOUT;
+    sched_t sched;
+    watch_t watch;
+    memset(&watch, 0, sizeof(watch_t));
+    watch.fifo_fd = -1;
+    profile_t profile;
+    memset(&profile, 0, sizeof(profile_t));
 
     qtop_mode_t mode = QTOP_MODE_JOBS;
 
@@ -1336,9 +5839,49 @@ int main(int argc, char * const argv[])
         }
     }
 
+    enum {
+        OPT_WATCH = 256,
+        OPT_EXEC,
+        OPT_FIFO,
+        OPT_PBS_RECORD,
+        OPT_PBS_REPLAY,
+        OPT_PBS_SYNTHETIC,
+        OPT_PROFILE,
+        OPT_SERVE,
+        OPT_DAEMON,
+        OPT_NO_DAEMON,
+        OPT_SNAPSHOT,
+        OPT_FROM_SNAPSHOT,
+        OPT_FIXED_REFRESH,
+        OPT_TIMEOUT
+    };
+    static const struct option long_options[] = {
+        {"watch", required_argument, NULL, OPT_WATCH},
+        {"exec",  required_argument, NULL, OPT_EXEC},
+        {"fifo",  required_argument, NULL, OPT_FIFO},
+        {"pbs-record", required_argument, NULL, OPT_PBS_RECORD},
+        {"pbs-replay", required_argument, NULL, OPT_PBS_REPLAY},
+        {"pbs-synthetic", required_argument, NULL, OPT_PBS_SYNTHETIC},
+        {"profile", required_argument, NULL, OPT_PROFILE},
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"daemon", optional_argument, NULL, OPT_DAEMON},
+        {"no-daemon", no_argument, NULL, OPT_NO_DAEMON},
+        {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+        {"from-snapshot", required_argument, NULL, OPT_FROM_SNAPSHOT},
+        {"fixed-refresh", no_argument, NULL, OPT_FIXED_REFRESH},
+        {"timeout", required_argument, NULL, OPT_TIMEOUT},
+        {NULL, 0, NULL, 0}
+    };
     int opt;
 
-    while ((opt = getopt(argc, argv, "u:q:s:e:fFH:R:SaCVh")) != -1) {
+    // installed as a link
+    const char *arg0 = strrchr(argv[0], '/');
+    if (!strcmp(arg0 ? arg0 + 1:argv[0], "qtopd")) {
+        daemon_mode = true;
+    }
+
+    while ((opt = getopt_long(argc, argv, "u:q:s:e:j:fFH:R:Sw:t:J:Ar:b:n:aCVh",
+                long_options, NULL)) != -1) {
         switch (opt) {
         case 'u':
             if (strcmp(optarg, "all")) {
@@ -1356,6 +5899,9 @@ int main(int argc, char * const argv[])
         case 'e':
             exec_host = optarg;
             break;
+        case 'j':
+            job_id = atoi(optarg);
+            break;
         case 'f':
             finished = true;
             break;
@@ -1376,6 +5922,113 @@ int main(int argc, char * const argv[])
         case 'S':
             subjobs = true;
             break;
+        case 'w':
+            record_file = optarg;
+            break;
+        case 't':
+            playback_file = optarg;
+            break;
+        case 'J':
+            journal_file = optarg;
+            break;
+        case 'A':
+            acct = true;
+            break;
+        case 'r':
+            if (!strcmp(optarg, "table")) {
+                report_format = REPORT_TABLE;
+            } else
+            if (!strcmp(optarg, "csv")) {
+                report_format = REPORT_CSV;
+            } else {
+                usage(argv[0], stderr);
+                exit(1);
+            }
+            break;
+        case 'b':
+            if (!strcmp(optarg, "csv")) {
+                batch_format = BATCH_CSV;
+            } else
+            if (!strcmp(optarg, "json")) {
+                batch_format = BATCH_JSON;
+            } else
+            if (!strcmp(optarg, "columns")) {
+                batch_format = BATCH_COLUMNS;
+            } else {
+                usage(argv[0], stderr);
+                exit(1);
+            }
+            break;
+        case 'n':
+            batch_niter = atoi(optarg);
+            break;
+        case OPT_WATCH:
+            if (!watch_add_rule(&watch, optarg)) {
+                fprintf(stderr, "Invalid watch condition %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_EXEC:
+            watch.command = optarg;
+            break;
+        case OPT_FIFO:
+            watch.fifo = optarg;
+            break;
+        case OPT_PBS_RECORD:
+            if (!backend_record(optarg)) {
+                fprintf(stderr, "Failed opening %s for recording\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_PBS_REPLAY:
+            if (!backend_replay(optarg)) {
+                fprintf(stderr, "Failed reading PBS recording %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_PBS_SYNTHETIC:
+            if (!backend_synthetic(atoi(optarg))) {
+                fprintf(stderr, "Invalid number of jobs %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_PROFILE:
+            profile.out = fopen(optarg, "a");
+            if (!profile.out) {
+                fprintf(stderr, "Failed opening %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SERVE:
+            serve_addr = optarg;
+            // the summary covers array subjobs, as with -a
+            subjobs = true;
+            break;
+        case OPT_DAEMON:
+            daemon_mode = true;
+            if (optarg) {
+                daemon_socket = optarg;
+            }
+            break;
+        case OPT_NO_DAEMON:
+            no_daemon = true;
+            break;
+        case OPT_SNAPSHOT:
+            snapshot_file = optarg;
+            break;
+        case OPT_FROM_SNAPSHOT:
+            snapshot_path = optarg;
+            break;
+        case OPT_FIXED_REFRESH:
+            fixed_refresh = true;
+            break;
+        case OPT_TIMEOUT:
+            call_timeout = atoi(optarg);
+            if (call_timeout < 0) {
+                usage(argv[0], stderr);
+                exit(1);
+            }
+            break;
         case 'C':
             bw = true;
             break;
@@ -1394,11 +6047,95 @@ int main(int argc, char * const argv[])
         }
     }
 
-    qtop_t *qtop = qtop_new(server_name);
-    if (!qtop) {
-        fprintf(stderr, "Failed connecting to server, errno = %d\n", pbs_errno);
+    if (acct && optind == argc) {
+        usage(argv[0], stderr);
         exit(1);
     }
+
+    if (!daemon_socket) {
+        daemon_socket = QTOPD_SOCKET;
+    }
+    // only the direct calls are taken over by qtopd, if it's running
+    if (!daemon_mode && !no_daemon && !acct && !playback_file &&
+        !snapshot_path &&
+        !strcmp(backend->name, "direct")) {
+        backend_daemon(daemon_socket);
+    }
+    // a hung server isn't waited for; the reconnection is in the background
+    if (call_timeout > 0 && !acct && !playback_file && !snapshot_path) {
+        int connect_timeout = call_timeout < CONNECT_TIMEOUT ?
+            call_timeout:CONNECT_TIMEOUT;
+        backend_guard(1000*connect_timeout, 1000*call_timeout);
+    }
+
+    qtop_t *qtop;
+    if (acct) {
+        // the server name is taken from the job IDs
+        qtop = qtop_new_offline("");
+        if (!qtop) {
+            exit(1);
+        }
+        qtop->username     = username;
+        qtop->queue        = queue;
+        qtop->exec_host    = exec_host;
+        qtop->failed       = failed;
+        qtop->history_span = history_span;
+        qtop->subjobs      = subjobs;
+        qtop->job_id       = job_id;
+        if (report_format != REPORT_NONE) {
+            qtop_acct_init(qtop, argv + optind, argc - optind);
+        } else
+        if (!qtop_acct_load(qtop, argv + optind, argc - optind)) {
+            fprintf(stderr, "Failed reading accounting logs\n");
+            exit(1);
+        }
+        finished = false;
+    } else
+    if (playback_file) {
+        qtop = qtop_new_offline(playback_file);
+        if (qtop) {
+            qtop->playback = histlog_open_read(playback_file);
+        }
+        if (!qtop || !qtop->playback || !histlog_nframes(qtop->playback)) {
+            fprintf(stderr, "Failed reading recording %s\n", playback_file);
+            exit(1);
+        }
+        // start with the most recent frame
+        qtop_playback_seek(qtop, histlog_nframes(qtop->playback) - 1);
+        // the recording is filtered already
+        username = NULL;
+        finished = false;
+    } else
+    if (snapshot_path) {
+        qtop = qtop_new_offline(snapshot_path);
+        if (qtop) {
+            qtop->snapshot_path = snapshot_path;
+            qtop->snapshot = snapshot_open(snapshot_path);
+        }
+        if (!qtop || !qtop->snapshot) {
+            fprintf(stderr, "Failed reading snapshot %s\n", snapshot_path);
+            exit(1);
+        }
+        // finished jobs are there if the publisher was asked for them
+        finished = false;
+    } else {
+        qtop = qtop_new(server_name);
+        if (!qtop) {
+            fprintf(stderr, "Failed connecting to server, errno = %d\n",
+                pbs_errno);
+            exit(1);
+        }
+    }
+    if (record_file && qtop->conn > 0) {
+        qtop->recorder = histlog_open_write(record_file);
+        if (!qtop->recorder) {
+            fprintf(stderr, "Failed opening %s for recording\n", record_file);
+            exit(1);
+        }
+    }
+    if (snapshot_file && qtop->conn > 0) {
+        qtop->snapshot_file = snapshot_file;
+    }
     qtop->username     = username;
     qtop->queue        = queue;
     qtop->state        = state;
@@ -1407,9 +6144,90 @@ int main(int argc, char * const argv[])
     qtop->failed       = failed;
     qtop->history_span = history_span;
     qtop->subjobs      = subjobs;
+    qtop->job_id       = job_id;
+    qtop->hist_kind    = -1;
+    if (profile.out) {
+        qtop->prof = &profile;
+    }
+    // the server's load and turnover are only known talking to it
+    sched_init(&sched, refresh_period,
+        !fixed_refresh && qtop->conn > 0, !fixed_refresh);
+    qtop->sched = &sched;
+
+    if (report_format != REPORT_NONE) {
+        // all finished jobs, whatever the state filter
+        qtop->state = NULL;
+        if (!qtop_report(qtop, report_format, stdout)) {
+            fprintf(stderr, "Failed collecting the report\n");
+            exit(1);
+        }
+        exit(0);
+    }
+
+    if (qtop->finished) {
+        qtop_history_load(qtop);
+        qtop->history_saved = time(NULL);
+        history_owner = qtop;
+        atexit(history_save_at_exit);
+    }
+
+    events_t *events = calloc(1, sizeof(events_t));
+    if (!events) {
+        exit(1);
+    }
+    events->mem_high = watch.mem_high ? watch.mem_high:EVENTS_MEM_HIGH;
+    if (journal_file && !(events->journal = fopen(journal_file, "a"))) {
+        fprintf(stderr, "Failed opening %s\n", journal_file);
+        exit(1);
+    }
 
     server_t *pbs = pbs_server_new();
 
+    if (daemon_mode) {
+        char addr[512];
+        serve_t *srv;
+        if (qtop->conn <= 0) {
+            fprintf(stderr, "The daemon mode needs a server\n");
+            exit(1);
+        }
+        snprintf(addr, sizeof(addr), "unix:%s", daemon_socket);
+        srv = serve_open(addr);
+        if (!srv) {
+            fprintf(stderr, "Failed listening on %s: %s\n", daemon_socket,
+                strerror(errno));
+            exit(1);
+        }
+        // for all users to connect; what they see is up to daemon_answer()
+        chmod(srv->path, 0666);
+        srv->handler = daemon_answer;
+        qtop_daemon(qtop, pbs, srv);
+    }
+
+    if (watch.nrules > 0 || serve_addr) {
+        serve_t *srv = NULL;
+        if (qtop->conn <= 0) {
+            fprintf(stderr, "The watch and serve modes need a server\n");
+            exit(1);
+        }
+        if (serve_addr && !(srv = serve_open(serve_addr))) {
+            fprintf(stderr, "Failed listening on %s: %s\n", serve_addr,
+                strerror(errno));
+            exit(1);
+        }
+        qtop_watch(qtop, pbs, events, &watch, srv);
+    }
+
+    if (batch_format != BATCH_NONE) {
+        bool ok = qtop_batch(qtop, pbs, events, batch_format,
+            mode == QTOP_MODE_SUMMARY, batch_niter);
+        if (!ok) {
+            fprintf(stderr, "Failed fetching the job list, errno = %d\n",
+                pbs_errno);
+            exit(1);
+        }
+        exit(0);
+    }
+
     initscr();
     cbreak();
     noecho();
@@ -1417,38 +6235,84 @@ int main(int argc, char * const argv[])
     set_escdelay(0);
     curs_set(0);
     timeout(1000);
+    // a kill or a closed terminal end the session as 'q' does
+    signal(SIGINT, catch_stop);
+    signal(SIGTERM, catch_stop);
+    signal(SIGHUP, catch_stop);
 
     if (!bw && has_colors()) {
-        start_color();
-        use_default_colors();
-        if (can_change_color()) {
-            init_color(COLOR_WHITE, 1000, 1000, 1000);
-            init_color(COLOR_RED,    800,  100,  100);
-            init_color(COLOR_BLUE,     0,  400, 1000);
-            init_color(COLOR_GREEN,    0,  800,  100);
-        }
-        init_pair(COLOR_PAIR_HEADER,    COLOR_BLUE,    -1);
-        init_pair(COLOR_PAIR_JHEADER,           -1,    -1);
-        init_pair(COLOR_PAIR_JOB_R,     COLOR_GREEN,   -1);
-        init_pair(COLOR_PAIR_JOB_Q,     COLOR_CYAN,    -1);
-        init_pair(COLOR_PAIR_JOB_W,     COLOR_YELLOW,  -1);
-        init_pair(COLOR_PAIR_JOB_H,     COLOR_MAGENTA, -1);
-        init_pair(COLOR_PAIR_JOB_S,     COLOR_YELLOW,  -1);
-        init_pair(COLOR_PAIR_JOB_OTHER, COLOR_BLACK,   -1);
-        init_pair(COLOR_PAIR_JOB_BAD,   COLOR_RED,     -1);
+        init_colors();
     }
 
     qtop->jwin = newwin(LINES - HEADER_NROWS, COLS, HEADER_NROWS, 0);
-
-    qtop_server_update(qtop, pbs);
+    // 'q' while waiting for the server gives up on it
+    backend_guard_cancel(wait_cancelled);
 
     int njobs;
-    job_t *jobs = qtop_server_jobs(qtop, &njobs, 0);
+    job_t *jobs;
+    double fetch_t0 = profile_now();
+    if (qtop->acct) {
+        jobs = qtop_acct_jobs(qtop, pbs, &njobs);
+    } else
+    if (qtop->playback) {
+        jobs = qtop_playback_jobs(qtop, pbs, &njobs);
+    } else
+    if (qtop->snapshot) {
+        jobs = qtop_snapshot_jobs(qtop, pbs, &njobs);
+    } else {
+        qtop_server_update(qtop, pbs);
+        jobs = qtop_server_jobs(qtop, &njobs, 0);
+        if (qtop->recorder) {
+            histlog_append(qtop->recorder, pbs, jobs, njobs);
+        }
+        qtop_snapshot_publish(qtop, pbs, jobs, njobs);
+        // an empty selection too, the last jobs being gone
+        if (jobs || pbs_errno == PBSE_NONE) {
+            double t0 = profile_start(qtop->prof);
+            events_update(events, jobs, njobs, qtop->subjobs);
+            profile_add(qtop->prof, PROF_OTHER, t0);
+        }
+    }
+    sched_update(&sched, jobs || pbs_errno == PBSE_NONE,
+        profile_now() - fetch_t0, -1, njobs);
+    wait_keys_restore();
+    if (!refresh_period) {
+        qtop->sched = NULL;
+    }
+    if (qtop->prof) {
+        profile.pending = true;
+    }
+
+    histogram_t hist;
+    leaderboard_t lboard;
+    memset(&lboard, 0, sizeof(leaderboard_t));
+    forecast_t forecast;
+    memset(&forecast, 0, sizeof(forecast_t));
+    waits_t waits;
+    memset(&waits, 0, sizeof(waits_t));
+    depindex_t depindex;
+    memset(&depindex, 0, sizeof(depindex_t));
+    timeseries_t tseries;
+    memset(&tseries, 0, sizeof(timeseries_t));
+    double t0 = profile_start(qtop->prof);
+    timeseries_update(&tseries, jobs, njobs);
+    jobs_histogram(jobs, njobs, &hist);
+    profile_add(qtop->prof, PROF_OTHER, t0);
+    t0 = profile_start(qtop->prof);
     qsort(jobs, njobs, sizeof(job_t), job_comp);
+    profile_add(qtop->prof, PROF_SORT, t0);
+    t0 = profile_start(qtop->prof);
+    jobs_leaderboard(jobs, njobs, &lboard);
+    depindex_build(&depindex, jobs, njobs);
+    profile_add(qtop->prof, PROF_OTHER, t0);
+
+    marks_t marks;
+    memset(&marks, 0, sizeof(marks_t));
+    bulk_t *bulk = NULL;
 
     signal(SIGALRM, catch_alarm);
     if (refresh_period) {
-        alarm(refresh_period);
+        sched_arm(&sched);
     }
 
     bool first_time = true;
@@ -1459,6 +6323,14 @@ int main(int argc, char * const argv[])
     unsigned int xshift = 0, yshift = 0;
     unsigned int joblist_xshift = 0;
     unsigned int ajob_id_expanded = 0;
+    int hist_selkind = 0, hist_selbin = 0;
+    waste_kind_t waste_kind = WASTE_CPU;
+    waste_horizon_t waste_horizon = WASTE_SO_FAR;
+    long fc_ncpus = 1, fc_mem = 0;
+    char *wait_queue = NULL;
+    long wait_ncpus = 0, wait_qtime = 0;
+    unsigned int dep_id = 0;
+    int ev_scroll = 0;
     do {
         int page_lines = LINES - HEADER_NROWS;
         int ij;
@@ -1471,6 +6343,16 @@ int main(int argc, char * const argv[])
                 if (yshift > 0) {
                     yshift--;
                 }
+            } else
+            if (mode == QTOP_MODE_HISTOGRAM) {
+                if (hist_selbin > 0) {
+                    hist_selbin--;
+                }
+            } else
+            if (mode == QTOP_MODE_EVENTS) {
+                if (ev_scroll > 0) {
+                    ev_scroll--;
+                }
             } else {
                 selpos--;
             }
@@ -1478,6 +6360,16 @@ int main(int argc, char * const argv[])
         case KEY_DOWN:
             if (mode == QTOP_MODE_DETAIL) {
                 yshift++;
+            } else
+            if (mode == QTOP_MODE_HISTOGRAM) {
+                if (hist_selbin < HIST_NBINS - 1) {
+                    hist_selbin++;
+                }
+            } else
+            if (mode == QTOP_MODE_EVENTS) {
+                if (ev_scroll < events->n - 1) {
+                    ev_scroll++;
+                }
             } else {
                 selpos++;
             }
@@ -1491,11 +6383,23 @@ int main(int argc, char * const argv[])
         case 'p':
             paused = !paused;
             break;
+        case 'T':
+            profile.shown = !profile.shown;
+            qtop->prof = profile.shown || profile.out ? &profile:NULL;
+            break;
         case KEY_LEFT:
             if (mode == QTOP_MODE_DETAIL) {
                 if (xshift > 0) {
                     xshift--;
                 }
+            } else
+            if (mode == QTOP_MODE_HISTOGRAM) {
+                if (hist_selkind > 0) {
+                    hist_selkind--;
+                }
+            } else
+            if (mode == QTOP_MODE_LEADERBOARD) {
+                waste_kind = WASTE_CPU;
             } else {
                 if (joblist_xshift > 0) {
                     joblist_xshift--;
@@ -1505,6 +6409,14 @@ int main(int argc, char * const argv[])
         case KEY_RIGHT:
             if (mode == QTOP_MODE_DETAIL) {
                 xshift++;
+            } else
+            if (mode == QTOP_MODE_HISTOGRAM) {
+                if (hist_selkind < HIST_NKINDS - 1) {
+                    hist_selkind++;
+                }
+            } else
+            if (mode == QTOP_MODE_LEADERBOARD) {
+                waste_kind = WASTE_MEM;
             } else {
                 joblist_xshift++;
             }
@@ -1526,11 +6438,136 @@ int main(int argc, char * const argv[])
         case 'r':
             need_update = true;
             break;
+        case '[':
+        case ']':
+        case '{':
+        case '}':
+            if (qtop->playback) {
+                time_t t = qtop->frame_time;
+                switch (ch) {
+                case '[':
+                    qtop_playback_seek(qtop, qtop->frame - 1);
+                    break;
+                case ']':
+                    qtop_playback_seek(qtop, qtop->frame + 1);
+                    break;
+                case '{':
+                    qtop_playback_seek(qtop,
+                        histlog_find(qtop->playback, t - 3600));
+                    break;
+                case '}':
+                    qtop_playback_seek(qtop,
+                        histlog_find(qtop->playback, t + 3600));
+                    break;
+                }
+                need_update = true;
+            }
+            break;
         case '\n':
         case '\r':
         case KEY_ENTER:
             if (mode == QTOP_MODE_JOBS) {
                 mode = QTOP_MODE_DETAIL;
+            } else
+            if (mode == QTOP_MODE_HISTOGRAM) {
+                // selecting the active filter again resets it
+                if (qtop->hist_kind == hist_selkind &&
+                    qtop->hist_bin == hist_selbin) {
+                    qtop->hist_kind = -1;
+                } else {
+                    qtop->hist_kind = hist_selkind;
+                    qtop->hist_bin  = hist_selbin;
+                }
+                mode = QTOP_MODE_JOBS;
+                jid_start = 0;
+                selpos = 0;
+                need_update = true;
+            }
+            break;
+        case 'H':
+            if (mode == QTOP_MODE_HISTOGRAM) {
+                mode = QTOP_MODE_JOBS;
+            } else
+            if (mode == QTOP_MODE_JOBS) {
+                mode = QTOP_MODE_HISTOGRAM;
+            }
+            break;
+        case 'L':
+            if (mode == QTOP_MODE_LEADERBOARD) {
+                mode = QTOP_MODE_JOBS;
+            } else
+            if (mode == QTOP_MODE_JOBS) {
+                mode = QTOP_MODE_LEADERBOARD;
+            }
+            break;
+        case 'F':
+            if (mode == QTOP_MODE_FORECAST) {
+                mode = QTOP_MODE_JOBS;
+            } else
+            if (mode == QTOP_MODE_JOBS && qtop->conn > 0) {
+                ajob = get_job(jobs, njobs, jid_start + selpos);
+                if (ajob && ajob->ncpus_r > 0) {
+                    fc_ncpus = ajob->ncpus_r;
+                    fc_mem   = ajob->mem_r;
+                }
+                mode = QTOP_MODE_FORECAST;
+                need_update = true;
+            }
+            break;
+        case 'W':
+            if (mode == QTOP_MODE_WAITS) {
+                mode = QTOP_MODE_JOBS;
+            } else
+            if (mode == QTOP_MODE_JOBS && (qtop->conn > 0 || qtop->acct)) {
+                ajob = get_job(jobs, njobs, jid_start + selpos);
+                xfree(wait_queue);
+                wait_queue = NULL;
+                if (ajob && ajob->queue && ajob->qtime > 0 &&
+                    (ajob->state == JOB_QUEUED || ajob->state == JOB_HELD ||
+                     ajob->state == JOB_WAITING)) {
+                    wait_queue = strdup(ajob->queue);
+                    wait_ncpus = ajob->ncpus_r;
+                    wait_qtime = ajob->qtime;
+                }
+                mode = QTOP_MODE_WAITS;
+                need_update = true;
+            }
+            break;
+        case 'E':
+            if (mode == QTOP_MODE_EVENTS) {
+                mode = QTOP_MODE_JOBS;
+            } else
+            if (mode == QTOP_MODE_JOBS) {
+                ev_scroll = 0;
+                mode = QTOP_MODE_EVENTS;
+            }
+            break;
+        case 'D':
+            if (mode == QTOP_MODE_DEPEND) {
+                mode = QTOP_MODE_JOBS;
+            } else
+            if (mode == QTOP_MODE_JOBS) {
+                ajob = get_job(jobs, njobs, jid_start + selpos);
+                if (ajob) {
+                    dep_id = ajob->id;
+                    mode = QTOP_MODE_DEPEND;
+                }
+            }
+            break;
+        case '+':
+            if (mode == QTOP_MODE_FORECAST) {
+                fc_ncpus *= 2;
+            }
+            break;
+        case '-':
+            if (mode == QTOP_MODE_FORECAST && fc_ncpus > 1) {
+                fc_ncpus /= 2;
+            }
+            break;
+        case 'w':
+            if (mode == QTOP_MODE_LEADERBOARD) {
+                waste_horizon = waste_horizon == WASTE_SO_FAR ?
+                    WASTE_PROJECTED:WASTE_SO_FAR;
             }
             break;
         case ' ':
@@ -1547,32 +6584,85 @@ int main(int argc, char * const argv[])
             }
             break;
         case 27:
-            if (mode == QTOP_MODE_DETAIL) {
+            if (mode == QTOP_MODE_DETAIL || mode == QTOP_MODE_HISTOGRAM ||
+                mode == QTOP_MODE_LEADERBOARD || mode == QTOP_MODE_FORECAST ||
+                mode == QTOP_MODE_DEPEND || mode == QTOP_MODE_WAITS ||
+                mode == QTOP_MODE_EVENTS) {
                 mode = QTOP_MODE_JOBS;
+            } else
+            if (mode == QTOP_MODE_JOBS && qtop->hist_kind >= 0) {
+                qtop->hist_kind = -1;
+                need_update = true;
+            }
+            break;
+        case 'm':
+            if (mode == QTOP_MODE_JOBS) {
+                ajob = get_job(jobs, njobs, jid_start + selpos);
+                if (ajob) {
+                    marks_toggle(&marks, ajob);
+                    qtop->nmarked = marks_apply(&marks, jobs, njobs);
+                    selpos++;
+                }
+            }
+            break;
+        case 'M':
+            if (mode == QTOP_MODE_JOBS) {
+                if (marks.n > 0) {
+                    marks_clear(&marks);
+                } else {
+                    marks_set_all(&marks, jobs, njobs);
+                }
+                qtop->nmarked = marks_apply(&marks, jobs, njobs);
             }
             break;
         case 'd':
         case KEY_DC:
-            if (mode == QTOP_MODE_JOBS) {
-                char idstr[32], buf[64];
+        case 'h':
+        case 'u':
+        case 'a':
+            if (mode == QTOP_MODE_JOBS && !bulk && njobs && qtop->conn > 0) {
+                char idstr[32], buf[128], spec[128] = "";
+                bulk_op_t op;
                 job_t *job = get_job(jobs, njobs, jid_start + selpos);
-                if (job->is_array) {
-                    sprintf(idstr, "%d[]", job->id);
-                } else
-                if (job->aid != 0) {
-                    sprintf(idstr, "%d[%d]", job->id, job->aid);
+
+                switch (ch) {
+                case 'h':
+                    op = BULK_HOLD;
+                    break;
+                case 'u':
+                    op = BULK_RELEASE;
+                    break;
+                case 'a':
+                    op = BULK_ALTER;
+                    break;
+                default:
+                    op = BULK_DELETE;
+                    break;
+                }
+
+                if (qtop->nmarked > 0) {
+                    sprintf(buf, "%s %d marked jobs", bulk_op_names[op],
+                        qtop->nmarked);
                 } else {
-                    sprintf(idstr, "%d", job->id);
+                    format_job_id(job, idstr);
+                    sprintf(buf, "%s job %s", bulk_op_names[op], idstr);
                 }
 
-                sprintf(buf, "Delete job %s?", idstr);
+                if (op == BULK_ALTER) {
+                    char pbuf[160];
+                    sprintf(pbuf, "%s: attribute=value", buf);
+                    if (!prompt(pbuf, spec, 64)) {
+                        break;
+                    }
+                    sprintf(buf + strlen(buf), " (%s)?", spec);
+                } else {
+                    strcat(buf, "?");
+                }
 
                 if (yes_no(buf)) {
-                    int err_no = pbs_deljob(qtop->conn, idstr, NULL);
-                    if (err_no == 0) {
-                        need_update = true;
-                    } else {
-                        alert(pbse_to_txt(err_no));
+                    bulk = bulk_start(qtop, op, spec, jobs, njobs, job);
+                    if (!bulk) {
+                        alert("Failed to start the operation");
                     }
                 }
             }
@@ -1591,25 +6681,115 @@ int main(int argc, char * const argv[])
             need_joblist_refresh = true;
         }
 
+        if (bulk && bulk_done(bulk)) {
+            if (bulk->nfailed > 0) {
+                bulk_report(bulk);
+            } else {
+                marks_clear(&marks);
+            }
+            bulk_free(bulk);
+            bulk = NULL;
+            timeout(1000);
+            need_update = true;
+        }
+
         if (need_update && mode != QTOP_MODE_DETAIL) {
             need_update = false;
             need_joblist_refresh = true;
-            
-            qtop_server_update(qtop, pbs);
 
-            for (ij = 0; ij < njobs; ij++) {
-                job_t *job = jobs + ij;
-                job_free_data(job);
-            }
-            xfree(jobs);
+            // freed once the new list is in
+            job_t *prev = jobs;
+            int nprev = njobs;
+            jobs = NULL;
 
-            jobs = qtop_server_jobs(qtop, &njobs, ajob_id_expanded);
-            if (!jobs && pbs_errno == PBSE_EXPIRED) {
-                qtop_reconnect(qtop);
+            fetch_t0 = profile_now();
+            if (qtop->acct) {
+                jobs = qtop_acct_jobs(qtop, pbs, &njobs);
+            } else
+            if (qtop->playback) {
+                jobs = qtop_playback_jobs(qtop, pbs, &njobs);
+            } else
+            if (qtop->snapshot) {
+                jobs = qtop_snapshot_jobs(qtop, pbs, &njobs);
+            } else {
                 qtop_server_update(qtop, pbs);
                 jobs = qtop_server_jobs(qtop, &njobs, ajob_id_expanded);
+                // not if given up on, which looks like a lost connection
+                if (!jobs && !wait_quit && conn_lost() &&
+                    qtop_reconnect(qtop)) {
+                    qtop_server_update(qtop, pbs);
+                    jobs = qtop_server_jobs(qtop, &njobs, ajob_id_expanded);
+                }
+                if (jobs && qtop->recorder) {
+                    histlog_append(qtop->recorder, pbs, jobs, njobs);
+                }
+                qtop_snapshot_publish(qtop, pbs, jobs, njobs);
+                // an empty selection too, the last jobs being gone
+                if (jobs || pbs_errno == PBSE_NONE) {
+                    t0 = profile_start(qtop->prof);
+                    events_update(events, jobs, njobs, qtop->subjobs);
+                    profile_add(qtop->prof, PROF_OTHER, t0);
+                }
+            }
+            bool live = !qtop->acct && !qtop->playback && !qtop->snapshot;
+            bool fetched = jobs || pbs_errno == PBSE_NONE;
+            sched_update(&sched, fetched, profile_now() - fetch_t0,
+                live && fetched ? events->nchanged:-1, njobs);
+            if (!fetched && live && prev) {
+                // the server is out of reach; the last list stays, as stale
+                jobs = prev;
+                njobs = nprev;
+            } else {
+                for (ij = 0; ij < nprev; ij++) {
+                    job_free_data(prev + ij);
+                }
+                xfree(prev);
+                prev = NULL;
+            }
+            if (refresh_period) {
+                sched_arm(&sched);
+            }
+            if (qtop->prof) {
+                profile.pending = true;
+            }
+            if (!prev) {
+                t0 = profile_start(qtop->prof);
+                timeseries_update(&tseries, jobs, njobs);
+                jobs_histogram(jobs, njobs, &hist);
+                jobs_filter_hist(qtop, jobs, &njobs);
+                profile_add(qtop->prof, PROF_OTHER, t0);
             }
+            t0 = profile_start(qtop->prof);
             qsort(jobs, njobs, sizeof(job_t), job_comp);
+            profile_add(qtop->prof, PROF_SORT, t0);
+            t0 = profile_start(qtop->prof);
+            jobs_leaderboard(jobs, njobs, &lboard);
+            depindex_build(&depindex, jobs, njobs);
+            qtop->nmarked = marks_apply(&marks, jobs, njobs);
+            profile_add(qtop->prof, PROF_OTHER, t0);
+
+            if (mode == QTOP_MODE_FORECAST) {
+                if (pbs->ncpus_avail == 0 || pbs->mem_avail == 0) {
+                    qtop_server_capacity(qtop, pbs);
+                }
+                if (qtop_selects_running(qtop) && !ajob_id_expanded) {
+                    // no need to ask the server again
+                    forecast_update(&forecast, pbs, jobs, njobs);
+                } else {
+                    int nrjobs;
+                    job_t *rjobs = qtop_running_jobs(qtop, &nrjobs);
+
+                    forecast_update(&forecast, pbs, rjobs, nrjobs);
+
+                    for (ij = 0; ij < nrjobs; ij++) {
+                        job_free_data(rjobs + ij);
+                    }
+                    xfree(rjobs);
+                }
+            }
+            if (mode == QTOP_MODE_WAITS) {
+                waits_update(qtop, &waits);
+            }
         }
 
         if (selpos < 0) {
@@ -1637,12 +6817,16 @@ int main(int argc, char * const argv[])
 
         // If there are no jobs selected, ignore the request to show details
         // of any
-        if (!njobs) {
+        if (!njobs && mode != QTOP_MODE_HISTOGRAM &&
+            mode != QTOP_MODE_LEADERBOARD && mode != QTOP_MODE_FORECAST &&
+            mode != QTOP_MODE_DEPEND && mode != QTOP_MODE_WAITS &&
+            mode != QTOP_MODE_EVENTS) {
             mode = QTOP_MODE_JOBS;
         }
 
+        t0 = profile_start(qtop->prof);
         if (!paused || need_joblist_refresh) {
-            print_server_stats(pbs, stdscr, paused);
+            print_server_stats(qtop, pbs, stdscr, paused);
         }
 
         switch (mode) {
@@ -1650,6 +6834,38 @@ int main(int argc, char * const argv[])
             print_job_details(qtop, get_job(jobs, njobs, jid_start + selpos),
                 xshift, yshift);
             break;
+        case QTOP_MODE_HISTOGRAM:
+            if (need_joblist_refresh) {
+                print_histogram(&hist, stdscr, hist_selkind, hist_selbin, qtop);
+            }
+            break;
+        case QTOP_MODE_LEADERBOARD:
+            if (need_joblist_refresh) {
+                print_leaderboard(&lboard, jobs, njobs, stdscr,
+                    waste_kind, waste_horizon);
+            }
+            break;
+        case QTOP_MODE_DEPEND:
+            if (need_joblist_refresh) {
+                print_depend(&depindex, jobs, njobs, stdscr, dep_id);
+            }
+            break;
+        case QTOP_MODE_FORECAST:
+            if (need_joblist_refresh) {
+                print_forecast(&forecast, stdscr, fc_ncpus, fc_mem);
+            }
+            break;
+        case QTOP_MODE_EVENTS:
+            if (need_joblist_refresh) {
+                print_events(events, stdscr, ev_scroll);
+            }
+            break;
+        case QTOP_MODE_WAITS:
+            if (need_joblist_refresh) {
+                print_waits(&waits, stdscr, wait_queue, wait_ncpus,
+                    wait_qtime);
+            }
+            break;
         case QTOP_MODE_SUMMARY:
             if (nsummaries > 0 && selpos >= nsummaries) {
                 selpos = nsummaries - 1;
@@ -1667,11 +6883,46 @@ int main(int argc, char * const argv[])
             }
             break;
         }
-    } while ((ch = getch()) != 'q');
+
+        if (qtop->prof && profile.pending) {
+            profile_add(qtop->prof, PROF_DRAW, t0);
+            profile_commit(qtop->prof);
+        }
+        if (profile.shown) {
+            if (mode == QTOP_MODE_DETAIL) {
+                print_profile(&profile, qtop->jwin, 0);
+            } else {
+                print_profile(&profile, stdscr, HEADER_NROWS);
+            }
+        }
+
+        if (bulk) {
+            // poll the progress more often
+            timeout(100);
+            print_progress(bulk);
+        }
+        wait_keys_restore();
+    } while ((ch = getch()) != 'q' && !watch_stopped);
 
     endwin();
 
+    bulk_free(bulk);
+    marks_free(&marks);
+    leaderboard_free(&lboard);
+    forecast_free(&forecast);
+    waits_free(&waits);
+    events_free(events);
+    xfree(events);
+    xfree(wait_queue);
+    depindex_free(&depindex);
+    timeseries_free(&tseries);
     pbs_server_free(pbs);
+    backend_close();
+    if (profile.out) {
+        fclose(profile.out);
+    }
 
     exit(0);
 }
+
+#endif /* QTOP_NO_MAIN */
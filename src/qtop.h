@@ -43,24 +43,16 @@
 
 #define DEFAULT_REFRESH     30
 #define DEFAULT_HISTORY     24
+/* how often (in s) the finished-job history is saved while running */
+#define HISTORY_SAVE_PERIOD 600
+/* how long (in s) the capacity summed over vnodes is reused */
+#define CAPACITY_TTL        600
+/* how long (in s) a call to the server may take, connecting at most */
+#define DEFAULT_TIMEOUT     60
+#define CONNECT_TIMEOUT     10
 
-typedef struct {
-    char *servername;
-
-    int conn;
-
-    /* filters */
-    char *username;
-    char *queue;
-    char *state;
-    char *exec_host;
-    bool finished;
-    int history_span;
-    bool failed;
-    bool subjobs;
-
-    WINDOW *jwin;
-} qtop_t;
+/* where qtopd listens, unless QTOPD_SOCKET is set */
+#define QTOPD_SOCKET        "/run/qtopd/qtopd.sock"
 
 typedef struct {
     struct batch_status *qstatus;
@@ -82,8 +74,20 @@ typedef struct {
     long vmem;
     unsigned int ncpus;
     unsigned int mpiprocs;
+
+    /* capacity; from the server or, if not set there, summed over vnodes */
+    long mem_avail;
+    unsigned int ncpus_avail;
+
+    /* the vnode sums, as of vnode_time */
+    long vnode_mem;
+    unsigned int vnode_ncpus;
+    time_t vnode_time;
 } server_t;
 
+#define TS_NSAMPLES         8
+#define TS_NLEVELS          8
+
 typedef enum {
     JOB_SUB_RUNNING   = 'B',
     JOB_EXITING       = 'E',
@@ -102,7 +106,13 @@ typedef enum {
 typedef enum {
     QTOP_MODE_JOBS,
     QTOP_MODE_DETAIL,
-    QTOP_MODE_SUMMARY
+    QTOP_MODE_SUMMARY,
+    QTOP_MODE_HISTOGRAM,
+    QTOP_MODE_LEADERBOARD,
+    QTOP_MODE_FORECAST,
+    QTOP_MODE_DEPEND,
+    QTOP_MODE_WAITS,
+    QTOP_MODE_EVENTS
 } qtop_mode_t;
 
 typedef struct {
@@ -112,6 +122,7 @@ typedef struct {
     char *user;
 
     char *exec_host;
+    char *depend;
 
     bool is_array;
     unsigned int aid;
@@ -138,6 +149,773 @@ typedef struct {
     double cpupercent;
 
     int exit_status;
+    long history_ts;
+
+    long qtime;                 /* queued since */
+    long stime;                 /* started at */
+
+    bool marked;
+
+    /* over the recent samples, see timeseries_t */
+    bool has_rates;
+    double cpu_rate;            /* CPU utilization */
+    double mem_rate;            /* memory growth, kB/s */
+    unsigned char trend[TS_NSAMPLES - 1];
+    int ntrend;
 } job_t;
 
+/* takes over a job read from accounting logs; false to stop reading */
+typedef bool (*acct_sink_t)(job_t *job, void *data);
+
+/* an accounting log, read up to offset */
+typedef struct {
+    char *fname;
+    long offset;
+    /* as last read, to tell a rotated or truncated file */
+    unsigned long ino;
+    long size;
+} acct_file_t;
+
+/* append-only log of job tables, see histlog.c */
+typedef struct histlog histlog_t;
+
+/* a mapped job table snapshot, see snapshot.c */
+typedef struct snapshot snapshot_t;
+
+/* stages of a refresh, timed when profiling */
+typedef enum {
+    PROF_SERVER,        /* PBS calls */
+    PROF_PARSE,
+    PROF_SORT,
+    PROF_OTHER,         /* events, histogram, leaderboard, etc. */
+    PROF_DRAW,
+    PROF_NSTAGES
+} prof_stage_t;
+
+typedef struct {
+    double ms[PROF_NSTAGES];
+    long njobs;
+    long nattribs;
+    long nbytes;
+} prof_record_t;
+
+typedef struct {
+    prof_record_t cur;          /* the refresh in progress */
+    bool pending;               /* ... and it's yet to be drawn */
+    double count_ms;            /* spent counting, not parsing */
+    prof_record_t last;
+    prof_record_t total;
+    int nrefreshes;
+
+    bool shown;                 /* the overlay */
+    FILE *out;                  /* a record per refresh (--profile) */
+} profile_t;
+
+/* the refresh period adapts within [-R/2, 4*-R], see sched_update() */
+#define SCHED_MIN_SCALE     0.5
+#define SCHED_MAX_SCALE     4
+/* fetching takes at most 1/SCHED_LOAD of the time */
+#define SCHED_LOAD          20
+/* the share of jobs changing state in a period that is rapid turnover */
+#define SCHED_TURNOVER      0.01
+/* +/- the period, randomly, not to poll in lockstep with other qtops */
+#define SCHED_JITTER        0.1
+/* the longest wait after failed refreshes, s */
+#define SCHED_MAX_BACKOFF   300
+
+typedef struct {
+    double base;                /* the period asked for (-R), s */
+    double period;              /* adapted to the server and the jobs */
+    double effective;           /* ... or backed off after errors */
+    double next;                /* ... with jitter, till the next refresh */
+    double fetch_ms;            /* smoothed over refreshes */
+    int nrefreshes;
+    int nerrors;                /* failed refreshes in a row */
+    bool adaptive;
+    bool jitter;
+    unsigned int seed;
+} sched_t;
+
+/* a quick reconnect (in ms), e.g., after the session expired, is waited for */
+#define RECONNECT_GRACE     1000
+/* the longest wait between attempts, s */
+#define RECONNECT_MAX_BACKOFF 300
+
+/* reconnecting in the background, see qtop_reconnect() */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *servers[2];           /* the server, and the failover one if any */
+    int current;                /* the one connected to last */
+
+    bool running;
+    bool done;                  /* ... with conn to be taken over */
+    int conn;
+    int nfailed;                /* attempts in a row */
+    time_t next_time;           /* of the next attempt */
+    bool orphaned;              /* the session is gone, the thread frees */
+} reconnect_t;
+
+typedef struct {
+    char *servername;
+
+    int conn;
+    reconnect_t *reconnect;
+    long data_time;             /* of the last successful refresh */
+    bool stale;                 /* ... and the ones since failed */
+
+    /* filters */
+    char *username;
+    char *queue;
+    char *state;
+    char *exec_host;
+    bool finished;
+    int history_span;
+    bool failed;
+    bool subjobs;
+    unsigned int job_id;
+
+    /* local filter by a histogram bin; hist_kind < 0 means none */
+    int hist_kind;
+    int hist_bin;
+
+    /* number of marked jobs in the list */
+    int nmarked;
+
+    /* finished jobs seen so far, sorted by history_ts */
+    job_t *history;
+    int nhistory;
+    int history_size;
+    long history_watermark;
+    /* the history is complete since then */
+    long history_since;
+    time_t history_saved;
+
+    /* finished jobs come from accounting logs (-A), kept in history */
+    bool acct;
+    char * const *acct_paths;
+    int nacct_paths;
+    acct_file_t *acct_files;
+    int nacct_files;
+
+    /* recording (-w) or playing back (-t) the job tables */
+    histlog_t *recorder;
+    histlog_t *playback;
+    char *snapshot_file;        /* published on every refresh */
+    uint64_t snapshot_gen;
+    snapshot_t *snapshot;       /* read instead of the server */
+    char *snapshot_path;
+    int frame;
+    bool frame_follow;
+    long frame_time;
+
+    /* per-stage timing of refreshes, if not NULL */
+    profile_t *prof;
+    /* the refresh period, if refreshing periodically */
+    sched_t *sched;
+
+    WINDOW *jwin;
+} qtop_t;
+
+/* keys (see job_key()) of marked jobs, sorted */
+typedef struct {
+    unsigned long long *keys;
+    int n;
+    int size;
+} marks_t;
+
+#define BULK_NWORKERS       4
+
+typedef enum {
+    BULK_DELETE,
+    BULK_HOLD,
+    BULK_RELEASE,
+    BULK_ALTER
+} bulk_op_t;
+
+typedef struct {
+    char id[32];
+    int err;
+} bulk_item_t;
+
+/* an operation on a set of jobs, run by workers with their own connections */
+typedef struct {
+    bulk_op_t op;
+    char *servername;
+
+    /* for BULK_ALTER */
+    struct attrl attr;
+
+    bulk_item_t *items;
+    int nitems;
+
+    pthread_mutex_t lock;
+    int next;
+    int ndone;
+    int nfailed;
+
+    pthread_t threads[BULK_NWORKERS];
+    int nthreads;
+} bulk_t;
+
+/* effective (used or requested, depending on the state) job values */
+typedef struct {
+    double mem;
+    double vmem;
+    long cput;
+    long walltime;
+    int ncpus;
+
+    double cpuutil;
+    double memutil;
+    double wallutil;
+
+    bool bad;
+} job_stats_t;
+
+typedef struct {
+    int64_t cput;               /* s, as cput_u; no wrap at 2^32 */
+    int64_t walltime;
+    uint64_t mem;               /* kB, as mem_u; no 4 TB limit */
+} ts_sample_t;
+
+/* ring buffer of the latest samples of a running job */
+typedef struct {
+    unsigned long long key;     /* 0 for an empty slot */
+    unsigned char head;         /* the newest sample */
+    unsigned char n;
+    ts_sample_t samples[TS_NSAMPLES];
+} ts_ring_t;
+
+/* rebuilt on each refresh, so only the running jobs are kept */
+typedef struct {
+    ts_ring_t *rings;
+    unsigned int size;
+} timeseries_t;
+
+/* totals of a run of jobs of the same user, state, and queue */
+typedef struct {
+    const char *user;
+    const char *queue;
+    job_state_t state;
+    int njobs;
+
+    double mem;
+    double mem_r;
+    double io;
+    long cput;
+    long walltime;
+    long nwalltime;     /* cores times walltime */
+    int ncpus;
+    int nbad;
+
+    /* of the jobs started, 0 otherwise */
+    double cpuutil;
+    double memutil;
+} summary_row_t;
+
+typedef enum {
+    EVENT_STATE,        /* changed state, or showed up */
+    EVENT_BAD,          /* became bad */
+    EVENT_MEM,          /* exceeded the %Mem threshold */
+    EVENT_DELETED       /* gone without being seen finished */
+} event_kind_t;
+
+typedef struct {
+    time_t stamp;
+    event_kind_t kind;
+    char jobid[32];
+    char user[16];
+    char queue[16];
+    char old_state;     /* 0 for a new job */
+    char new_state;
+    int memutil;        /* in % */
+} event_t;
+
+/* what is known of a job as of the last refresh it was seen */
+typedef struct {
+    unsigned long long key;     /* 0 for an empty slot */
+    char state;
+    bool bad;
+    bool mem_high;
+    unsigned char gen;          /* of the last refresh it was seen */
+    char jobid[32];
+    char user[16];
+    char queue[16];
+} job_trace_t;
+
+#define EVENTS_NKEEP        1024
+#define EVENTS_MEM_HIGH     90  /* %Mem, by default */
+
+typedef void (*event_sink_t)(const event_t *e, void *data);
+
+/* transitions between successive job tables; the latest ones are kept */
+typedef struct {
+    /* open-addressing hash of the jobs by key, kept across refreshes */
+    job_trace_t *traces;
+    unsigned int size;
+    int ntraces;
+    unsigned char gen;
+    bool primed;        /* the first table was taken as is */
+    int nchanged;       /* jobs new, gone or changing state, last time */
+    int mem_high;       /* %Mem threshold */
+
+    event_t ring[EVENTS_NKEEP];
+    int head;           /* the next slot */
+    int n;
+
+    FILE *journal;
+    /* called on each event, e.g., for the watch mode */
+    event_sink_t sink;
+    void *sink_data;
+} events_t;
+
+/* a condition of the watch mode (--watch) */
+typedef struct {
+    event_kind_t kind;
+    char states[16];    /* for EVENT_STATE, the states entered; any if empty */
+} watch_rule_t;
+
+typedef struct {
+    watch_rule_t *rules;
+    int nrules;
+    int mem_high;       /* %Mem threshold; 0 for the default */
+
+    /* where the fired events go; stdout if neither */
+    const char *command;
+    const char *fifo;
+    int fifo_fd;        /* kept open while there's a reader */
+} watch_t;
+
+#define HIST_NBINS          12
+#define HIST_BIN_WIDTH      10  /* in % */
+
+typedef enum {
+    HIST_CPU,
+    HIST_MEM,
+    HIST_WALL,
+    HIST_NKINDS
+} hist_kind_t;
+
+/* distribution of running jobs over utilization bins */
+typedef struct {
+    unsigned int counts[HIST_NKINDS][HIST_NBINS];
+    unsigned int nbad[HIST_NKINDS][HIST_NBINS];
+    unsigned int total[HIST_NKINDS];
+    unsigned int nrunning;
+} histogram_t;
+
+#define LEADERBOARD_K       64
+
+typedef enum {
+    WASTE_CPU,      /* core-hours */
+    WASTE_MEM,      /* GB-hours */
+    WASTE_NKINDS
+} waste_kind_t;
+
+typedef enum {
+    WASTE_SO_FAR,
+    WASTE_PROJECTED,
+    WASTE_NHORIZONS
+} waste_horizon_t;
+
+typedef struct {
+    double value;
+    int index;      /* in the job table or in the user table */
+} waste_entry_t;
+
+typedef struct {
+    const char *user;
+    unsigned int njobs;
+    double waste[WASTE_NHORIZONS][WASTE_NKINDS];
+} user_waste_t;
+
+/* top-K wasters, computed anew on each refresh */
+typedef struct {
+    waste_entry_t jobs[WASTE_NHORIZONS][WASTE_NKINDS][LEADERBOARD_K];
+    int njobs[WASTE_NHORIZONS][WASTE_NKINDS];
+    waste_entry_t users[WASTE_NHORIZONS][WASTE_NKINDS][LEADERBOARD_K];
+    int nusers[WASTE_NHORIZONS][WASTE_NKINDS];
+
+    /* open-addressing hash of per-user totals */
+    user_waste_t *utable;
+    unsigned int utable_size;
+    unsigned int utable_used;
+} leaderboard_t;
+
+/* totals of finished jobs of a user or a queue, for the report (-r) */
+typedef struct {
+    char *name;
+    unsigned int njobs;
+    unsigned int nbad;
+    double coreh_alloc;     /* allocated cores times walltime */
+    double coreh_used;      /* CPU time */
+    double gbh_req;         /* requested memory times walltime */
+    double gbh_used;
+    double wall_req;        /* hours */
+    double wall_used;
+} report_entry_t;
+
+/* open-addressing hash of report entries */
+typedef struct {
+    report_entry_t *table;
+    unsigned int size;
+    unsigned int used;
+} report_table_t;
+
+typedef enum {
+    REPORT_NONE,
+    REPORT_TABLE,
+    REPORT_CSV
+} report_format_t;
+
+typedef enum {
+    BATCH_NONE,
+    BATCH_CSV,
+    BATCH_JSON,
+    BATCH_COLUMNS
+} batch_format_t;
+
+/* buffered output of the batch mode, see format.c */
+#define OUTBUF_SIZE     65536
+
+typedef struct {
+    FILE *out;
+    size_t len;
+    char buf[OUTBUF_SIZE];
+} outbuf_t;
+
+typedef struct {
+    report_table_t users;
+    report_table_t queues;
+    report_entry_t total;
+} report_t;
+
+/*
+ * Log-bucketed histogram of waits: bin i counts values in
+ * (SKETCH_GAMMA^(i-1), SKETCH_GAMMA^i], so any quantile is within 2% of
+ * the true one. Sketches of the same kind merge by adding the counts.
+ */
+#define SKETCH_NBINS        512
+#define SKETCH_GAMMA        1.04
+
+typedef struct {
+    unsigned int counts[SKETCH_NBINS];
+    unsigned int nzero;         /* waits under a second */
+    unsigned int n;
+} sketch_t;
+
+/* job sizes by cores: 1, 2-4, 5-16, 17-64, 65-256, 257+ */
+#define WAIT_NSIZES         6
+
+typedef struct {
+    char *queue;
+    sketch_t sizes[WAIT_NSIZES];
+} queue_waits_t;
+
+/* queue wait distributions, fed once per job as it starts */
+typedef struct {
+    queue_waits_t *queues;
+    int nqueues;
+
+    /* the latest start time folded in */
+    long watermark;
+    /* ... and the jobs (keys) of that second folded in already */
+    unsigned long long *edge;
+    int nedge;
+    int edge_size;
+    /* accounting jobs folded in */
+    int nacct;
+
+    /* pbs_errno of the last update, if it failed */
+    int error;
+} waits_t;
+
+/* resources released by running jobs up to (and including) the moment */
+typedef struct {
+    long when;      /* seconds from now */
+    long ncpus;
+    long mem;
+} forecast_point_t;
+
+typedef struct {
+    time_t stamp;
+
+    long ncpus_total;
+    long mem_total;
+    long ncpus_free;
+    long mem_free;
+
+    /* cumulative, sorted by time */
+    forecast_point_t *points;
+    int npoints;
+    int size;
+} forecast_t;
+
+/* job dependencies, by job index in the (sorted) job table */
+typedef struct {
+    /* hash of job ids (of non-subjobs) to their index */
+    unsigned int *hids;
+    int *hidx;
+    unsigned int hsize;
+
+    /* compressed adjacency lists of job ids (the other ends may be unlisted) */
+    int *up_start;
+    unsigned int *up;
+    int *down_start;
+    unsigned int *down;
+
+    /* temporary edge list, kept for reuse */
+    unsigned int *edges;
+    int nedges;
+    int edges_size;
+
+    int njobs;
+} depindex_t;
+
+/* the PBS calls made, see backend.c */
+typedef struct {
+    const char *name;
+    char *(*default_server)(void);
+    int (*connect)(const char *server);
+    int (*disconnect)(int conn);
+    struct batch_status *(*statserver)(int conn, struct attrl *attribs,
+        char *extend);
+    struct batch_status *(*statvnode)(int conn, char *id,
+        struct attrl *attribs, char *extend);
+    struct batch_status *(*statjob)(int conn, char *id,
+        struct attrl *attribs, char *extend);
+    struct batch_status *(*selstat)(int conn, struct attropl *criteria,
+        struct attrl *attribs, char *extend);
+    void (*statfree)(struct batch_status *bs);
+    int (*deljob)(int conn, char *id, char *extend);
+    int (*holdjob)(int conn, char *id, char *type, char *extend);
+    int (*rlsjob)(int conn, char *id, char *type, char *extend);
+    int (*alterjob)(int conn, char *id, struct attrl *attribs, char *extend);
+} pbs_backend_t;
+
+/* fixed-layout part of a job, for storing on disk */
+typedef struct {
+    uint32_t id;
+    uint32_t aid;
+    uint8_t state;
+    uint8_t is_array;
+    uint8_t pad[2];
+    int32_t exit_status;
+
+    uint32_t ncpus_r;
+    uint32_t nodect_r;
+    uint32_t ncpus_u;
+    uint32_t pad2;
+
+    int64_t mem_r;
+    int64_t vmem_r;
+    int64_t cput_r;
+    int64_t walltime_r;
+    int64_t mem_u;
+    int64_t vmem_u;
+    int64_t cput_u;
+    int64_t walltime_u;
+    int64_t history_ts;
+    int64_t qtime;
+    int64_t stime;
+
+    double io_r;
+    double cpupercent;
+} job_record_t;
+
+/* the job table as a memory-mappable file, see snapshot.c */
+#define SNAPSHOT_MAGIC      "QTOPSNAP"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_NOSTRING   0xffffffff
+
+/* the columns, in the order of the directory */
+typedef enum {
+    SNAP_ID,            /* u32 */
+    SNAP_AID,           /* u32 */
+    SNAP_STATE,         /* u8, the state letter */
+    SNAP_IS_ARRAY,      /* u8 */
+    SNAP_EXIT_STATUS,   /* i32 */
+    SNAP_NCPUS_R,       /* u32 */
+    SNAP_NODECT_R,      /* u32 */
+    SNAP_NCPUS_U,       /* u32 */
+    SNAP_MEM_R,         /* i64, kB */
+    SNAP_VMEM_R,        /* i64, kB */
+    SNAP_CPUT_R,        /* i64, s */
+    SNAP_WALLTIME_R,    /* i64, s */
+    SNAP_MEM_U,         /* i64, kB */
+    SNAP_VMEM_U,        /* i64, kB */
+    SNAP_CPUT_U,        /* i64, s */
+    SNAP_WALLTIME_U,    /* i64, s */
+    SNAP_HISTORY_TS,    /* i64, time */
+    SNAP_QTIME,         /* i64, time */
+    SNAP_STIME,         /* i64, time */
+    SNAP_IO_R,          /* f64 */
+    SNAP_CPUPERCENT,    /* f64 */
+    SNAP_NAME,          /* u32, offset in the string table */
+    SNAP_USER,          /* u32, ditto */
+    SNAP_QUEUE,         /* u32, ditto */
+    SNAP_EXEC_HOST,     /* u32, ditto */
+    SNAP_NCOLUMNS
+} snapshot_column_t;
+
+typedef enum {
+    SNAP_TYPE_U8 = 1,
+    SNAP_TYPE_I32,
+    SNAP_TYPE_U32,
+    SNAP_TYPE_I64,
+    SNAP_TYPE_F64,
+    SNAP_TYPE_STRING    /* u32 offset */
+} snapshot_type_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t width;     /* bytes per job */
+    uint64_t offset;    /* from the start of the file, 8-byte aligned */
+} snapshot_coldesc_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t generation;
+    int64_t stamp;
+    uint64_t file_size;
+
+    uint32_t njobs;
+    uint32_t ncolumns;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+
+    /* the server */
+    uint32_t host;      /* string offsets */
+    uint32_t pbs_version;
+    uint32_t active;
+    uint32_t total_jobs;
+    uint32_t njobs_r;
+    uint32_t njobs_q;
+    uint32_t njobs_w;
+    uint32_t njobs_t;
+    uint32_t njobs_h;
+    uint32_t njobs_e;
+    uint32_t njobs_b;
+    uint32_t ncpus;
+    uint32_t mpiprocs;
+    uint32_t ncpus_avail;
+    int64_t mem;
+    int64_t vmem;
+    int64_t mem_avail;
+
+    snapshot_coldesc_t columns[SNAP_NCOLUMNS];
+} snapshot_header_t;
+
+/* the metrics endpoint */
+typedef struct {
+    int fd;             /* listening */
+    char *path;         /* of the unix socket, removed on close */
+
+    char *body;         /* the reply, as of the last refresh */
+    size_t len;
+
+    unsigned long nscrapes;
+
+    /* if set, serves the connections instead */
+    void (*handler)(int fd, void *data);
+    void *data;
+
+    /* shuts down a handled connection past its deadline, see serve_wait() */
+    pthread_t watchdog;
+    bool watchdog_running;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int client;         /* the connection being handled, or -1 */
+    struct timespec deadline;
+} serve_t;
+
+/* qtop.c */
+void job_free_data(job_t *job);
+void parse_job_status(job_t *job, struct batch_status *qtmp);
+bool job_filtered_out(const qtop_t *q, const job_t *job);
+unsigned int str_hash(const char *str);
+
+/* cache.c */
+bool qtop_cache_dir(char *buf, size_t bufsize);
+void job_to_record(const job_t *job, job_record_t *rec);
+void job_from_record(job_t *job, const job_record_t *rec);
+bool qtop_history_load(qtop_t *q);
+bool qtop_history_save(const qtop_t *q);
+
+/* backend.c */
+extern const pbs_backend_t *backend;
+bool backend_record(const char *fname);
+bool backend_replay(const char *fname);
+bool backend_daemon(const char *path);
+bool backend_guard(int connect_ms, int call_ms);
+void backend_guard_cancel(bool (*cancelled)(void));
+char *backend_secondary(void);
+void backend_close(void);
+bool daemon_refresh(int conn);
+void daemon_answer(int fd, void *data);
+const struct batch_status *daemon_cached(const struct batch_status **server);
+
+/* synth.c */
+struct batch_status *synth_jobs(int njobs, const struct attropl *criteria,
+    const struct attrl *attribs);
+void synth_statfree(struct batch_status *bs);
+bool backend_synthetic(int njobs);
+
+/* format.c */
+void outbuf_init(outbuf_t *ob, FILE *out);
+void outbuf_flush(outbuf_t *ob);
+void out_mem(outbuf_t *ob, const char *s, size_t len);
+void out_char(outbuf_t *ob, char c);
+void out_str(outbuf_t *ob, const char *s);
+void out_pad(outbuf_t *ob, int n);
+void out_field(outbuf_t *ob, const char *s, size_t len, int width);
+int fmt_long(char buf[24], long v);
+int fmt_fixed(char buf[32], double v, int decimals);
+int fmt_hms(char buf[32], long secs);
+void out_long(outbuf_t *ob, long v, int width);
+void out_fixed(outbuf_t *ob, double v, int decimals, int width);
+void out_hms(outbuf_t *ob, long secs, int width);
+void out_csv_str(outbuf_t *ob, const char *s);
+void out_json_str(outbuf_t *ob, const char *s);
+void out_prom_label(outbuf_t *ob, const char *s);
+
+/* snapshot.c */
+bool snapshot_publish(const char *fname, uint64_t generation,
+    const server_t *pbs, const job_t *jobs, int njobs);
+snapshot_t *snapshot_open(const char *fname);
+void snapshot_close(snapshot_t *snap);
+bool snapshot_changed(const snapshot_t *snap, const char *fname);
+const snapshot_header_t *snapshot_header(const snapshot_t *snap);
+const void *snapshot_column(const snapshot_t *snap, snapshot_column_t col);
+const char *snapshot_string(const snapshot_t *snap, uint32_t offset);
+job_t *snapshot_jobs(const snapshot_t *snap, server_t *pbs, int *njobs);
+
+/* serve.c */
+serve_t *serve_open(const char *addr);
+void serve_close(serve_t *s);
+void serve_set(serve_t *s, char *body, size_t len);
+void serve_wait(serve_t *s, double secs);
+
+/* histlog.c */
+histlog_t *histlog_open_write(const char *fname);
+histlog_t *histlog_open_read(const char *fname);
+void histlog_close(histlog_t *log);
+bool histlog_append(histlog_t *log, const server_t *pbs,
+    const job_t *jobs, int njobs);
+int histlog_nframes(histlog_t *log);
+int histlog_find(const histlog_t *log, time_t t);
+time_t histlog_stamp(const histlog_t *log, int frame);
+job_t *histlog_jobs(histlog_t *log, int frame, server_t *pbs, int *njobs);
+
+/* acct.c */
+bool qtop_acct_load(qtop_t *q, char * const *paths, int npaths);
+void qtop_acct_init(qtop_t *q, char * const *paths, int npaths);
+bool qtop_acct_foreach(qtop_t *q, acct_sink_t sink, void *data);
+bool qtop_acct_update(qtop_t *q);
+void qtop_acct_free(qtop_t *q);
+
 #endif /* QTOP_H_ */
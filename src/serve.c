@@ -0,0 +1,404 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A minimal HTTP endpoint for metrics scrapers, on a TCP port or a unix
+ * socket. It's served in between refreshes from the same thread, one
+ * connection at a time, always with the body set after the last refresh; so
+ * scrapers never cause PBS queries of their own. With a handler set, the
+ * connections are passed to it instead (that's how qtopd serves its clients),
+ * each shut down by a watchdog thread should it take too long.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <stdbool.h>
+
+#include <pbs_ifl.h>
+
+#include <ncurses.h>
+
+#include "qtop.h"
+
+#define SERVE_BACKLOG       16
+#define SERVE_REQUEST_MAX   4096
+/* a client gets this long (in ms) to send its request and read the reply */
+#define SERVE_CLIENT_TIMEOUT 2000
+/* ... or, with a handler, within the 10 s qtop waits for qtopd */
+#define SERVE_HANDLER_TIMEOUT 5000
+
+/* The time secs from now */
+static void serve_deadline(struct timespec *end, double secs)
+{
+    clock_gettime(CLOCK_MONOTONIC, end);
+    end->tv_sec += (time_t) secs;
+    end->tv_nsec += (long) (1.0e9*(secs - (time_t) secs));
+    if (end->tv_nsec >= 1000000000) {
+        end->tv_sec++;
+        end->tv_nsec -= 1000000000;
+    }
+}
+
+/* The ms left till a deadline, if any */
+static int serve_ms_left(const struct timespec *end)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (end->tv_sec - now.tv_sec)*1000 +
+        (end->tv_nsec - now.tv_nsec)/1000000;
+
+    return ms > 0 ? ms:0;
+}
+
+static int serve_listen_unix(const char *path)
+{
+    struct sockaddr_un sun;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // a stale socket of a previous run; anything else is left alone
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            close(fd);
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 ||
+        listen(fd, SERVE_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int serve_listen_tcp(const char *addr)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[256];
+    const char *port = strrchr(addr, ':');
+    int fd = -1, on = 1;
+
+    if (!port || port - addr >= (long) sizeof(host)) {
+        return -1;
+    }
+    if (port == addr) {
+        // only local scrapers, unless asked otherwise
+        strcpy(host, "127.0.0.1");
+    } else {
+        memcpy(host, addr, port - addr);
+        host[port - addr] = '\0';
+    }
+    port++;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+            ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SERVE_BACKLOG) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+/*
+ * Listen on addr: [host]:port (the host defaulting to 127.0.0.1), or a unix
+ * socket given as unix:path or by an absolute path
+ */
+serve_t *serve_open(const char *addr)
+{
+    serve_t *s = calloc(1, sizeof(serve_t));
+    bool local = addr[0] == '/';
+    if (!s) {
+        return NULL;
+    }
+
+    if (!strncmp(addr, "unix:", 5)) {
+        addr += 5;
+        local = true;
+    }
+    if (local) {
+        s->fd = serve_listen_unix(addr);
+        if (s->fd >= 0) {
+            s->path = strdup(addr);
+        }
+    } else {
+        s->fd = serve_listen_tcp(addr);
+    }
+
+    if (s->fd < 0) {
+        free(s);
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    // the deadlines are monotonic
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&s->lock, NULL);
+    s->client = -1;
+
+    return s;
+}
+
+void serve_close(serve_t *s)
+{
+    if (!s) {
+        return;
+    }
+    if (s->watchdog_running) {
+        pthread_mutex_lock(&s->lock);
+        s->closing = true;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->watchdog, NULL);
+    }
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    close(s->fd);
+    if (s->path) {
+        unlink(s->path);
+        free(s->path);
+    }
+    free(s->body);
+    free(s);
+}
+
+/* Take over body (malloc'ed) as the reply until the next one */
+void serve_set(serve_t *s, char *body, size_t len)
+{
+    free(s->body);
+    s->body = body;
+    s->len = len;
+}
+
+static bool serve_write(int fd, const char *buf, size_t len,
+    const struct timespec *end)
+{
+    while (len > 0) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        if (poll(&pfd, 1, serve_ms_left(end)) <= 0) {
+            return false;
+        }
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static void serve_client(serve_t *s, int fd)
+{
+    char req[SERVE_REQUEST_MAX + 1], head[256];
+    size_t len = 0;
+    const char *status;
+    struct timespec end;
+    bool found;
+
+    // for the whole request, however it trickles in
+    serve_deadline(&end, SERVE_CLIENT_TIMEOUT/1000.0);
+
+    // the request line and headers; a body, if any, is ignored
+    while (len < SERVE_REQUEST_MAX) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, serve_ms_left(&end)) <= 0) {
+            return;
+        }
+        ssize_t n = read(fd, req + len, SERVE_REQUEST_MAX - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+    req[len] = '\0';
+
+    found = !strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET / ", 6);
+    if (!found) {
+        status = "404 Not Found";
+    } else
+    if (!s->body) {
+        // no successful refresh yet
+        status = "503 Service Unavailable";
+        found = false;
+    } else {
+        status = "200 OK";
+    }
+
+    int hlen = snprintf(head, sizeof(head),
+        "HTTP/1.0 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n", status, found ? s->len:0);
+    if (serve_write(fd, head, hlen, &end) && found) {
+        serve_write(fd, s->body, s->len, &end);
+        s->nscrapes++;
+    }
+}
+
+/*
+ * Wait for the handled connection's deadline; a handler still at it then is
+ * cut off, its reads and writes failing at once
+ */
+static void *serve_watchdog(void *arg)
+{
+    serve_t *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->closing) {
+        if (s->client < 0) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        } else
+        if (serve_ms_left(&s->deadline) > 0) {
+            pthread_cond_timedwait(&s->cond, &s->lock, &s->deadline);
+        } else {
+            shutdown(s->client, SHUT_RDWR);
+            s->client = -1;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/* Pass a connection to the handler, for no longer than the deadline */
+static void serve_handle(serve_t *s, int fd)
+{
+    if (!s->watchdog_running) {
+        s->watchdog_running =
+            pthread_create(&s->watchdog, NULL, serve_watchdog, s) == 0;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->client = fd;
+    serve_deadline(&s->deadline, SERVE_HANDLER_TIMEOUT/1000.0);
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    s->handler(fd, s->data);
+
+    // before fd is closed, and maybe reused
+    pthread_mutex_lock(&s->lock);
+    s->client = -1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Answer scrapes for the given number of seconds, or until a signal */
+void serve_wait(serve_t *s, double secs)
+{
+    struct timespec end;
+
+    serve_deadline(&end, secs);
+
+    while (true) {
+        int ms = serve_ms_left(&end);
+        if (ms <= 0) {
+            break;
+        }
+
+        struct pollfd pfd = {s->fd, POLLIN, 0};
+        int rc = poll(&pfd, 1, ms);
+        if (rc < 0 && errno == EINTR) {
+            // a signal for the caller to check
+            break;
+        }
+        if (rc <= 0) {
+            continue;
+        }
+
+        int fd = accept4(s->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            struct timeval tv = {SERVE_CLIENT_TIMEOUT/1000, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            if (s->handler) {
+                serve_handle(s, fd);
+            } else {
+                serve_client(s, fd);
+            }
+            close(fd);
+        }
+    }
+}
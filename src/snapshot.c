@@ -0,0 +1,552 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The job table as a flat file to be mapped by readers, with nothing to
+ * parse: a header (snapshot_header_t) with the server stats and a directory
+ * of columns, then the columns, one fixed-width value per job each, and the
+ * string table of NUL-terminated strings, which the string columns point
+ * into (users and queues are stored once). Everything is native-endian and
+ * 8-byte aligned. Opening one is a map and a few checks of the header,
+ * whatever the number of jobs.
+ *
+ * Each generation is written to a temporary file next to the snapshot and
+ * renamed over it, so readers see either the old or the new one, complete;
+ * one that's open keeps its generation until reopened. Columns may be added
+ * at the end without a version change; readers check ncolumns.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdbool.h>
+
+#include <pbs_ifl.h>
+
+#include <ncurses.h>
+
+#include "qtop.h"
+
+#define SNAP_ALIGN(n)   (((n) + 7) & ~(uint64_t) 7)
+/* values converted at a time, when writing a column */
+#define SNAP_CHUNK      4096
+
+struct snapshot {
+    const snapshot_header_t *hdr;
+    size_t size;
+    ino_t ino;
+};
+
+static const snapshot_coldesc_t snap_columns[SNAP_NCOLUMNS] = {
+    [SNAP_ID]           = {SNAP_TYPE_U32, 4, 0},
+    [SNAP_AID]          = {SNAP_TYPE_U32, 4, 0},
+    [SNAP_STATE]        = {SNAP_TYPE_U8, 1, 0},
+    [SNAP_IS_ARRAY]     = {SNAP_TYPE_U8, 1, 0},
+    [SNAP_EXIT_STATUS]  = {SNAP_TYPE_I32, 4, 0},
+    [SNAP_NCPUS_R]      = {SNAP_TYPE_U32, 4, 0},
+    [SNAP_NODECT_R]     = {SNAP_TYPE_U32, 4, 0},
+    [SNAP_NCPUS_U]      = {SNAP_TYPE_U32, 4, 0},
+    [SNAP_MEM_R]        = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_VMEM_R]       = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_CPUT_R]       = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_WALLTIME_R]   = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_MEM_U]        = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_VMEM_U]       = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_CPUT_U]       = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_WALLTIME_U]   = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_HISTORY_TS]   = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_QTIME]        = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_STIME]        = {SNAP_TYPE_I64, 8, 0},
+    [SNAP_IO_R]         = {SNAP_TYPE_F64, 8, 0},
+    [SNAP_CPUPERCENT]   = {SNAP_TYPE_F64, 8, 0},
+    [SNAP_NAME]         = {SNAP_TYPE_STRING, 4, 0},
+    [SNAP_USER]         = {SNAP_TYPE_STRING, 4, 0},
+    [SNAP_QUEUE]        = {SNAP_TYPE_STRING, 4, 0},
+    [SNAP_EXEC_HOST]    = {SNAP_TYPE_STRING, 4, 0}
+};
+
+/* the string table being built, with a hash of offsets to intern them */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+
+    uint32_t *slots;    /* offset + 1, 0 if free */
+    uint32_t nslots;
+
+    bool failed;        /* a string didn't fit; buf stays as it was */
+} strtab_t;
+
+static uint32_t strtab_add(strtab_t *st, const char *s)
+{
+    uint32_t i;
+    size_t len;
+
+    if (!s || st->failed) {
+        return SNAPSHOT_NOSTRING;
+    }
+
+    i = str_hash(s) & (st->nslots - 1);
+    while (st->slots[i]) {
+        uint32_t offset = st->slots[i] - 1;
+        if (!strcmp(st->buf + offset, s)) {
+            return offset;
+        }
+        i = (i + 1) & (st->nslots - 1);
+    }
+
+    len = strlen(s) + 1;
+    if (st->len + len > st->size) {
+        size_t size = 2*st->size + len;
+        char *buf = size < SNAPSHOT_NOSTRING ? realloc(st->buf, size):NULL;
+        if (!buf) {
+            st->failed = true;
+            return SNAPSHOT_NOSTRING;
+        }
+        st->buf = buf;
+        st->size = size;
+    }
+    memcpy(st->buf + st->len, s, len);
+    st->slots[i] = st->len + 1;
+    st->len += len;
+
+    return st->slots[i] - 1;
+}
+
+#define SNAP_COPY(type, expr) \
+    for (k = 0; k < n; k++) { \
+        const job_t *job = jobs + i + k; \
+        ((type *) chunk)[k] = (expr); \
+    }
+
+static bool snap_write_column(FILE *fp, snapshot_column_t col,
+    const job_t *jobs, int njobs)
+{
+    static uint64_t chunk[SNAP_CHUNK];
+    size_t width = snap_columns[col].width;
+    int i, k;
+
+    for (i = 0; i < njobs; i += SNAP_CHUNK) {
+        int n = njobs - i < SNAP_CHUNK ? njobs - i:SNAP_CHUNK;
+
+        switch (col) {
+        case SNAP_ID:
+            SNAP_COPY(uint32_t, job->id);
+            break;
+        case SNAP_AID:
+            SNAP_COPY(uint32_t, job->aid);
+            break;
+        case SNAP_STATE:
+            SNAP_COPY(uint8_t, job->state);
+            break;
+        case SNAP_IS_ARRAY:
+            SNAP_COPY(uint8_t, job->is_array);
+            break;
+        case SNAP_EXIT_STATUS:
+            SNAP_COPY(int32_t, job->exit_status);
+            break;
+        case SNAP_NCPUS_R:
+            SNAP_COPY(uint32_t, job->ncpus_r);
+            break;
+        case SNAP_NODECT_R:
+            SNAP_COPY(uint32_t, job->nodect_r);
+            break;
+        case SNAP_NCPUS_U:
+            SNAP_COPY(uint32_t, job->ncpus_u);
+            break;
+        case SNAP_MEM_R:
+            SNAP_COPY(int64_t, job->mem_r);
+            break;
+        case SNAP_VMEM_R:
+            SNAP_COPY(int64_t, job->vmem_r);
+            break;
+        case SNAP_CPUT_R:
+            SNAP_COPY(int64_t, job->cput_r);
+            break;
+        case SNAP_WALLTIME_R:
+            SNAP_COPY(int64_t, job->walltime_r);
+            break;
+        case SNAP_MEM_U:
+            SNAP_COPY(int64_t, job->mem_u);
+            break;
+        case SNAP_VMEM_U:
+            SNAP_COPY(int64_t, job->vmem_u);
+            break;
+        case SNAP_CPUT_U:
+            SNAP_COPY(int64_t, job->cput_u);
+            break;
+        case SNAP_WALLTIME_U:
+            SNAP_COPY(int64_t, job->walltime_u);
+            break;
+        case SNAP_HISTORY_TS:
+            SNAP_COPY(int64_t, job->history_ts);
+            break;
+        case SNAP_QTIME:
+            SNAP_COPY(int64_t, job->qtime);
+            break;
+        case SNAP_STIME:
+            SNAP_COPY(int64_t, job->stime);
+            break;
+        case SNAP_IO_R:
+            SNAP_COPY(double, job->io_r);
+            break;
+        case SNAP_CPUPERCENT:
+            SNAP_COPY(double, job->cpupercent);
+            break;
+        default:
+            // the string columns are written whole
+            return false;
+        }
+
+        if (fwrite(chunk, width, n, fp) != (size_t) n) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool snap_write_pad(FILE *fp, uint64_t len)
+{
+    static const char zeros[8];
+    size_t npad = SNAP_ALIGN(len) - len;
+
+    return fwrite(zeros, 1, npad, fp) == npad;
+}
+
+/*
+ * Write the job table and the server stats as the given generation of the
+ * snapshot fname, replacing the previous one at once
+ */
+bool snapshot_publish(const char *fname, uint64_t generation,
+    const server_t *pbs, const job_t *jobs, int njobs)
+{
+    snapshot_header_t hdr;
+    uint32_t *strcols[4] = {NULL, NULL, NULL, NULL};
+    strtab_t st;
+    char *tmpname;
+    uint64_t offset;
+    bool ok = false;
+    int i, col;
+
+    memset(&st, 0, sizeof(st));
+    st.nslots = 1024;
+    while (st.nslots < 8*(uint64_t) njobs) {
+        st.nslots *= 2;
+    }
+    st.slots = calloc(st.nslots, sizeof(uint32_t));
+    for (i = 0; i < 4; i++) {
+        strcols[i] = malloc((njobs + 1)*sizeof(uint32_t));
+    }
+    tmpname = malloc(strlen(fname) + 8);
+    if (!st.slots || !strcols[0] || !strcols[1] || !strcols[2] ||
+        !strcols[3] || !tmpname) {
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, 8);
+    hdr.version     = SNAPSHOT_VERSION;
+    hdr.header_size = sizeof(snapshot_header_t);
+    hdr.generation  = generation;
+    hdr.stamp       = time(NULL);
+    hdr.njobs       = njobs;
+    hdr.ncolumns    = SNAP_NCOLUMNS;
+
+    hdr.host        = strtab_add(&st, pbs->host);
+    hdr.pbs_version = strtab_add(&st, pbs->version);
+    hdr.active      = pbs->active;
+    hdr.total_jobs  = pbs->total_jobs;
+    hdr.njobs_r     = pbs->njobs_r;
+    hdr.njobs_q     = pbs->njobs_q;
+    hdr.njobs_w     = pbs->njobs_w;
+    hdr.njobs_t     = pbs->njobs_t;
+    hdr.njobs_h     = pbs->njobs_h;
+    hdr.njobs_e     = pbs->njobs_e;
+    hdr.njobs_b     = pbs->njobs_b;
+    hdr.ncpus       = pbs->ncpus;
+    hdr.mpiprocs    = pbs->mpiprocs;
+    hdr.ncpus_avail = pbs->ncpus_avail;
+    hdr.mem         = pbs->mem;
+    hdr.vmem        = pbs->vmem;
+    hdr.mem_avail   = pbs->mem_avail;
+
+    for (i = 0; i < njobs; i++) {
+        const job_t *job = jobs + i;
+        strcols[0][i] = strtab_add(&st, job->name);
+        strcols[1][i] = strtab_add(&st, job->user);
+        strcols[2][i] = strtab_add(&st, job->queue);
+        strcols[3][i] = strtab_add(&st, job->exec_host);
+    }
+    if (st.failed) {
+        goto out;
+    }
+
+    offset = SNAP_ALIGN(sizeof(snapshot_header_t));
+    for (col = 0; col < SNAP_NCOLUMNS; col++) {
+        hdr.columns[col] = snap_columns[col];
+        hdr.columns[col].offset = offset;
+        offset += SNAP_ALIGN((uint64_t) snap_columns[col].width*njobs);
+    }
+    hdr.strings_offset = offset;
+    hdr.strings_size   = st.len;
+    hdr.file_size      = offset + SNAP_ALIGN(st.len);
+
+    // next to the snapshot, for rename() to replace it
+    sprintf(tmpname, "%s.XXXXXX", fname);
+    int fd = mkstemp(tmpname);
+    if (fd < 0) {
+        goto out;
+    }
+    fchmod(fd, 0644);
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(tmpname);
+        goto out;
+    }
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+        snap_write_pad(fp, sizeof(hdr));
+    for (col = 0; ok && col < SNAP_NCOLUMNS; col++) {
+        uint64_t len = (uint64_t) snap_columns[col].width*njobs;
+        if (snap_columns[col].type == SNAP_TYPE_STRING) {
+            ok = fwrite(strcols[col - SNAP_NAME], 4, njobs, fp) ==
+                (size_t) njobs;
+        } else {
+            ok = snap_write_column(fp, col, jobs, njobs);
+        }
+        ok = ok && snap_write_pad(fp, len);
+    }
+    ok = ok && fwrite(st.buf, 1, st.len, fp) == st.len &&
+        snap_write_pad(fp, st.len);
+    ok = fclose(fp) == 0 && ok;
+
+    if (ok) {
+        ok = rename(tmpname, fname) == 0;
+    }
+    if (!ok) {
+        unlink(tmpname);
+    }
+
+out:
+    free(tmpname);
+    for (i = 0; i < 4; i++) {
+        free(strcols[i]);
+    }
+    free(st.slots);
+    free(st.buf);
+
+    return ok;
+}
+
+/* Map the snapshot, checking its layout; NULL if it's not a valid one */
+snapshot_t *snapshot_open(const char *fname)
+{
+    const snapshot_header_t *hdr;
+    struct stat sb;
+    int col;
+
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &sb) < 0 || (size_t) sb.st_size < sizeof(*hdr)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    hdr = map;
+    bool ok = !memcmp(hdr->magic, SNAPSHOT_MAGIC, 8) &&
+        hdr->version == SNAPSHOT_VERSION &&
+        hdr->header_size >= sizeof(*hdr) &&
+        hdr->file_size == (uint64_t) sb.st_size &&
+        hdr->ncolumns >= SNAP_NCOLUMNS &&
+        hdr->strings_offset + hdr->strings_size <= hdr->file_size &&
+        (hdr->strings_size == 0 ||
+         ((const char *) map)[hdr->strings_offset + hdr->strings_size - 1] ==
+         '\0');
+    for (col = 0; ok && col < SNAP_NCOLUMNS; col++) {
+        const snapshot_coldesc_t *cd = hdr->columns + col;
+        ok = cd->type == snap_columns[col].type &&
+            cd->width == snap_columns[col].width && cd->offset % 8 == 0 &&
+            cd->offset + (uint64_t) cd->width*hdr->njobs <= hdr->file_size;
+    }
+
+    snapshot_t *snap = ok ? malloc(sizeof(snapshot_t)):NULL;
+    if (!snap) {
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+    snap->hdr  = hdr;
+    snap->size = sb.st_size;
+    snap->ino  = sb.st_ino;
+
+    return snap;
+}
+
+void snapshot_close(snapshot_t *snap)
+{
+    if (snap) {
+        munmap((void *) snap->hdr, snap->size);
+        free(snap);
+    }
+}
+
+/* Whether a newer generation has been published since snap was opened */
+bool snapshot_changed(const snapshot_t *snap, const char *fname)
+{
+    struct stat sb;
+
+    return stat(fname, &sb) == 0 && sb.st_ino != snap->ino;
+}
+
+const snapshot_header_t *snapshot_header(const snapshot_t *snap)
+{
+    return snap->hdr;
+}
+
+/* The values of a column, hdr->njobs of them */
+const void *snapshot_column(const snapshot_t *snap, snapshot_column_t col)
+{
+    return (const char *) snap->hdr + snap->hdr->columns[col].offset;
+}
+
+const char *snapshot_string(const snapshot_t *snap, uint32_t offset)
+{
+    if (offset >= snap->hdr->strings_size) {
+        return NULL;
+    }
+
+    return (const char *) snap->hdr + snap->hdr->strings_offset + offset;
+}
+
+static char *snap_strdup(const snapshot_t *snap, uint32_t offset)
+{
+    const char *s = snapshot_string(snap, offset);
+
+    return s ? strdup(s):NULL;
+}
+
+/*
+ * The job table of the snapshot as jobs, for qtop to show; the server's
+ * host and version point into the snapshot
+ */
+job_t *snapshot_jobs(const snapshot_t *snap, server_t *pbs, int *njobs)
+{
+    const snapshot_header_t *hdr = snap->hdr;
+    int i, n = hdr->njobs;
+
+    job_t *jobs = calloc(n + 1, sizeof(job_t));
+    if (!jobs) {
+        *njobs = 0;
+        return NULL;
+    }
+
+    const uint32_t *id          = snapshot_column(snap, SNAP_ID);
+    const uint32_t *aid         = snapshot_column(snap, SNAP_AID);
+    const uint8_t *state        = snapshot_column(snap, SNAP_STATE);
+    const uint8_t *is_array     = snapshot_column(snap, SNAP_IS_ARRAY);
+    const int32_t *exit_status  = snapshot_column(snap, SNAP_EXIT_STATUS);
+    const uint32_t *ncpus_r     = snapshot_column(snap, SNAP_NCPUS_R);
+    const uint32_t *nodect_r    = snapshot_column(snap, SNAP_NODECT_R);
+    const uint32_t *ncpus_u     = snapshot_column(snap, SNAP_NCPUS_U);
+    const int64_t *mem_r        = snapshot_column(snap, SNAP_MEM_R);
+    const int64_t *vmem_r       = snapshot_column(snap, SNAP_VMEM_R);
+    const int64_t *cput_r       = snapshot_column(snap, SNAP_CPUT_R);
+    const int64_t *walltime_r   = snapshot_column(snap, SNAP_WALLTIME_R);
+    const int64_t *mem_u        = snapshot_column(snap, SNAP_MEM_U);
+    const int64_t *vmem_u       = snapshot_column(snap, SNAP_VMEM_U);
+    const int64_t *cput_u       = snapshot_column(snap, SNAP_CPUT_U);
+    const int64_t *walltime_u   = snapshot_column(snap, SNAP_WALLTIME_U);
+    const int64_t *history_ts   = snapshot_column(snap, SNAP_HISTORY_TS);
+    const int64_t *qtime        = snapshot_column(snap, SNAP_QTIME);
+    const int64_t *stime        = snapshot_column(snap, SNAP_STIME);
+    const double *io_r          = snapshot_column(snap, SNAP_IO_R);
+    const double *cpupercent    = snapshot_column(snap, SNAP_CPUPERCENT);
+    const uint32_t *name        = snapshot_column(snap, SNAP_NAME);
+    const uint32_t *user        = snapshot_column(snap, SNAP_USER);
+    const uint32_t *queue       = snapshot_column(snap, SNAP_QUEUE);
+    const uint32_t *exec_host   = snapshot_column(snap, SNAP_EXEC_HOST);
+
+    for (i = 0; i < n; i++) {
+        job_t *job = jobs + i;
+        job->id          = id[i];
+        job->aid         = aid[i];
+        job->state       = state[i];
+        job->is_array    = is_array[i];
+        job->exit_status = exit_status[i];
+        job->ncpus_r     = ncpus_r[i];
+        job->nodect_r    = nodect_r[i];
+        job->ncpus_u     = ncpus_u[i];
+        job->mem_r       = mem_r[i];
+        job->vmem_r      = vmem_r[i];
+        job->cput_r      = cput_r[i];
+        job->walltime_r  = walltime_r[i];
+        job->mem_u       = mem_u[i];
+        job->vmem_u      = vmem_u[i];
+        job->cput_u      = cput_u[i];
+        job->walltime_u  = walltime_u[i];
+        job->history_ts  = history_ts[i];
+        job->qtime       = qtime[i];
+        job->stime       = stime[i];
+        job->io_r        = io_r[i];
+        job->cpupercent  = cpupercent[i];
+        job->name        = snap_strdup(snap, name[i]);
+        job->user        = snap_strdup(snap, user[i]);
+        job->queue       = snap_strdup(snap, queue[i]);
+        job->exec_host   = snap_strdup(snap, exec_host[i]);
+    }
+    *njobs = n;
+
+    pbs->host        = (char *) snapshot_string(snap, hdr->host);
+    pbs->version     = (char *) snapshot_string(snap, hdr->pbs_version);
+    pbs->active      = hdr->active;
+    pbs->total_jobs  = hdr->total_jobs;
+    pbs->njobs_r     = hdr->njobs_r;
+    pbs->njobs_q     = hdr->njobs_q;
+    pbs->njobs_w     = hdr->njobs_w;
+    pbs->njobs_t     = hdr->njobs_t;
+    pbs->njobs_h     = hdr->njobs_h;
+    pbs->njobs_e     = hdr->njobs_e;
+    pbs->njobs_b     = hdr->njobs_b;
+    pbs->ncpus       = hdr->ncpus;
+    pbs->mpiprocs    = hdr->mpiprocs;
+    pbs->ncpus_avail = hdr->ncpus_avail;
+    pbs->mem         = hdr->mem;
+    pbs->vmem        = hdr->vmem;
+    pbs->mem_avail   = hdr->mem_avail;
+
+    return jobs;
+}
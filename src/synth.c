@@ -0,0 +1,648 @@
+/**
+ *
+ * This file is part of qtop.
+ *
+ * Copyright 2021-2026 Evgeny Stambulchik
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A synthetic PBS server, for trying qtop out and for benchmarking it on
+ * large queues without one. The jobs are generated from their index alone,
+ * so every call returns the same population, aged by the time passed: a mix
+ * of states, skewed users and queues, job arrays, and the attributes a real
+ * server returns (long Variable_Lists included), restricted to the ones
+ * asked for. Of the selection criteria, only those on the state, user and
+ * queue are honored.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <stdbool.h>
+
+#include <pbs_error.h>
+#include <pbs_ifl.h>
+
+#include <ncurses.h>
+
+#include "qtop.h"
+
+#define SYNTH_SERVER    "synth"
+#define SYNTH_BASE_ID   4200000
+#define SYNTH_NUSERS    200
+#define SYNTH_ARRAY     50      /* every that many jobs is an array */
+#define SYNTH_NCPUS     64      /* per node */
+
+static int synth_njobs;
+static long synth_t0;
+
+typedef struct {
+    struct attrl *head;
+    struct attrl **tail;
+    const struct attrl *want;
+} synth_attrs_t;
+
+/* a job, as drawn from its index */
+typedef struct {
+    unsigned int id;
+    int index;
+    int user;
+    int queue;
+    char state;
+    bool is_array;
+    int nsubjobs;
+    int ncpus;
+    int nodect;
+    int mem_gb;
+    long walltime;
+    long elapsed;
+    double efficiency;
+    long qtime;
+} synth_job_t;
+
+static const char *synth_queues[] = {
+    "workq", "short", "long", "gpu", "bigmem", "debug"
+};
+
+/* splitmix64 */
+static uint64_t synth_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double synth_uniform(uint64_t *state)
+{
+    return (synth_rand(state) >> 11)*(1.0/9007199254740992.0);
+}
+
+static void synth_draw(int index, synth_job_t *sj)
+{
+    static const int ncpus_choices[] = {1, 1, 2, 4, 8, 8, 16, 32, 64, 128, 256};
+    uint64_t rs = index;
+    double u;
+
+    memset(sj, 0, sizeof(synth_job_t));
+    sj->index = index;
+    sj->id = SYNTH_BASE_ID + index;
+
+    // a few users own most of the jobs
+    u = synth_uniform(&rs);
+    sj->user = (int) (SYNTH_NUSERS*u*u*u);
+
+    u = synth_uniform(&rs);
+    sj->queue = u < 0.5 ? 0:(u < 0.7 ? 1:(u < 0.8 ? 2:(u < 0.9 ? 3:
+        (u < 0.97 ? 4:5))));
+
+    u = synth_uniform(&rs);
+    if (index % SYNTH_ARRAY == SYNTH_ARRAY - 1) {
+        sj->is_array = true;
+        sj->nsubjobs = 4 + synth_rand(&rs) % 61;
+        sj->state = 'B';
+    } else {
+        sj->state = u < 0.45 ? 'R':(u < 0.80 ? 'Q':(u < 0.88 ? 'H':
+            (u < 0.93 ? 'W':(u < 0.96 ? 'E':(u < 0.97 ? 'S':'R')))));
+    }
+
+    sj->ncpus = ncpus_choices[synth_rand(&rs) %
+        (sizeof(ncpus_choices)/sizeof(int))];
+    sj->nodect = (sj->ncpus + SYNTH_NCPUS - 1)/SYNTH_NCPUS;
+    sj->mem_gb = sj->ncpus*(1 << (synth_rand(&rs) % 4));
+    sj->walltime = 3600*(1 + synth_rand(&rs) % 72);
+    sj->elapsed = (long) (synth_uniform(&rs)*sj->walltime);
+    sj->efficiency = 0.3 + 0.7*synth_uniform(&rs);
+    sj->qtime = synth_t0 - sj->elapsed - (long) (86400*synth_uniform(&rs));
+}
+
+static bool synth_wanted(const struct attrl *want, const char *name)
+{
+    if (!want) {
+        return true;
+    }
+    for (; want; want = want->next) {
+        if (!strcmp(want->name, name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void synth_add(synth_attrs_t *sa, const char *name,
+    const char *resource, const char *value)
+{
+    struct attrl *a;
+
+    if (!synth_wanted(sa->want, name) || !(a = calloc(1, sizeof(struct attrl)))) {
+        return;
+    }
+    a->name = strdup(name);
+    if (resource) {
+        a->resource = strdup(resource);
+    }
+    a->value = strdup(value);
+    a->op = SET;
+
+    *sa->tail = a;
+    sa->tail = &a->next;
+}
+
+static void synth_add_long(synth_attrs_t *sa, const char *name,
+    const char *resource, long value)
+{
+    char buf[32];
+    sprintf(buf, "%ld", value);
+    synth_add(sa, name, resource, buf);
+}
+
+static void synth_add_time(synth_attrs_t *sa, const char *name,
+    const char *resource, long secs)
+{
+    char buf[32];
+    sprintf(buf, "%02ld:%02ld:%02ld", secs/3600, (secs/60) % 60, secs % 60);
+    synth_add(sa, name, resource, buf);
+}
+
+static struct batch_status *synth_status(const char *name)
+{
+    struct batch_status *bs = calloc(1, sizeof(struct batch_status));
+
+    if (bs) {
+        bs->name = strdup(name);
+    }
+
+    return bs;
+}
+
+/* The status of a job, or of a subjob of an array if aid > 0 */
+static struct batch_status *synth_job_status(const synth_job_t *sj, int aid,
+    const struct attrl *want)
+{
+    char name[64], buf[2048], user[16];
+    synth_attrs_t sa;
+    char state = sj->state;
+    long elapsed = sj->elapsed + (time(NULL) - synth_t0);
+    int len, i;
+
+    if (sj->is_array && aid > 0) {
+        // the first subjobs are done, then some run, and the rest wait
+        state = aid <= sj->nsubjobs/4 ? 'X':(aid <= sj->nsubjobs/2 ? 'R':'Q');
+        sprintf(name, "%u[%d]." SYNTH_SERVER, sj->id, aid);
+    } else
+    if (sj->is_array) {
+        sprintf(name, "%u[]." SYNTH_SERVER, sj->id);
+    } else {
+        sprintf(name, "%u." SYNTH_SERVER, sj->id);
+    }
+    bool started = state == 'R' || state == 'E' || state == 'S';
+    if (elapsed > sj->walltime) {
+        elapsed = sj->walltime;
+    }
+
+    struct batch_status *bs = synth_status(name);
+    if (!bs) {
+        return NULL;
+    }
+    sa.head = NULL;
+    sa.tail = &sa.head;
+    sa.want = want;
+
+    sprintf(user, "user%03d", sj->user);
+
+    sprintf(buf, "run_%s_%d", synth_queues[sj->queue], sj->index % 1000);
+    synth_add(&sa, ATTR_name, NULL, buf);
+    sprintf(buf, "%s@login%d." SYNTH_SERVER, user, sj->index % 4);
+    synth_add(&sa, ATTR_owner, NULL, buf);
+    sprintf(buf, "%c", state);
+    synth_add(&sa, ATTR_state, NULL, buf);
+    synth_add(&sa, ATTR_queue, NULL, synth_queues[sj->queue]);
+    synth_add(&sa, "server", NULL, SYNTH_SERVER);
+    synth_add(&sa, "Checkpoint", NULL, "u");
+    synth_add_long(&sa, ATTR_ctime, NULL, sj->qtime);
+    sprintf(buf, "login%d." SYNTH_SERVER ":/scratch/%s/%s.e%u",
+        sj->index % 4, user, user, sj->id);
+    synth_add(&sa, "Error_Path", NULL, buf);
+    synth_add(&sa, ATTR_h, NULL, state == 'H' ? "u":"n");
+    synth_add(&sa, "Join_Path", NULL, "n");
+    synth_add(&sa, "Keep_Files", NULL, "n");
+    synth_add(&sa, "Mail_Points", NULL, "a");
+    synth_add_long(&sa, ATTR_mtime, NULL, synth_t0 - elapsed);
+    sprintf(buf, "login%d." SYNTH_SERVER ":/scratch/%s/%s.o%u",
+        sj->index % 4, user, user, sj->id);
+    synth_add(&sa, "Output_Path", NULL, buf);
+    synth_add(&sa, "Priority", NULL, "0");
+    synth_add_long(&sa, ATTR_qtime, NULL, sj->qtime);
+    synth_add(&sa, "Rerunable", NULL, "True");
+
+    synth_add_long(&sa, ATTR_l, "ncpus", sj->ncpus);
+    synth_add_long(&sa, ATTR_l, "nodect", sj->nodect);
+    sprintf(buf, "%dgb", sj->mem_gb);
+    synth_add(&sa, ATTR_l, "mem", buf);
+    sprintf(buf, "%dgb", 2*sj->mem_gb);
+    synth_add(&sa, ATTR_l, "vmem", buf);
+    synth_add_long(&sa, ATTR_l, "mpiprocs", sj->ncpus);
+    synth_add(&sa, ATTR_l, "ompthreads", "1");
+    synth_add(&sa, ATTR_l, "place", sj->nodect > 1 ? "scatter":"free");
+    sprintf(buf, "%d:ncpus=%d:mem=%dgb:mpiprocs=%d", sj->nodect,
+        sj->ncpus/sj->nodect, sj->mem_gb/sj->nodect, sj->ncpus/sj->nodect);
+    synth_add(&sa, ATTR_l, "select", buf);
+    synth_add_time(&sa, ATTR_l, "walltime", sj->walltime);
+
+    if (started) {
+        long cput = (long) (sj->efficiency*sj->ncpus*elapsed);
+        synth_add_time(&sa, ATTR_used, "cput", cput);
+        synth_add_long(&sa, ATTR_used, "cpupercent",
+            (long) (100*sj->efficiency*sj->ncpus));
+        sprintf(buf, "%ldkb", (long) (sj->efficiency*sj->mem_gb*1048576));
+        synth_add(&sa, ATTR_used, "mem", buf);
+        synth_add_long(&sa, ATTR_used, "ncpus", sj->ncpus);
+        sprintf(buf, "%ldkb", (long) (1.5*sj->efficiency*sj->mem_gb*1048576));
+        synth_add(&sa, ATTR_used, "vmem", buf);
+        synth_add_time(&sa, ATTR_used, "walltime", elapsed);
+
+        int node = (sj->index*7) % 10000;
+        for (len = 0, i = 0; i < sj->nodect && len < 1024; i++) {
+            len += sprintf(buf + len, "%snode%04d/0*%d", i ? "+":"",
+                (node + i) % 10000, sj->ncpus/sj->nodect);
+        }
+        synth_add(&sa, ATTR_exechost, NULL, buf);
+        for (len = 0, i = 0; i < sj->nodect && len < 1024; i++) {
+            len += sprintf(buf + len, "%s(node%04d:ncpus=%d:mem=%dgb)",
+                i ? "+":"", (node + i) % 10000, sj->ncpus/sj->nodect,
+                sj->mem_gb/sj->nodect);
+        }
+        synth_add(&sa, "exec_vnode", NULL, buf);
+        synth_add_long(&sa, ATTR_stime, NULL, synth_t0 - sj->elapsed);
+        synth_add_long(&sa, "session_id", NULL, 10000 + sj->index % 50000);
+        synth_add(&sa, "substate", NULL, "42");
+        sprintf(buf, "Job run at %ld on (node%04d)", synth_t0 - sj->elapsed,
+            node);
+        synth_add(&sa, "comment", NULL, buf);
+    } else
+    if (state == 'Q') {
+        synth_add(&sa, "comment", NULL,
+            "Not Running: Insufficient amount of resource: ncpus");
+    }
+
+    if (sj->is_array && aid == 0) {
+        sprintf(buf, "1-%d", sj->nsubjobs);
+        synth_add(&sa, "array_indices_submitted", NULL, buf);
+        synth_add(&sa, "array", NULL, "True");
+    }
+    if (state == 'H' && sj->index > 0) {
+        sprintf(buf, "afterok:%u." SYNTH_SERVER, sj->id - 1);
+        synth_add(&sa, ATTR_depend, NULL, buf);
+    }
+
+    len = sprintf(buf, "PBS_O_HOME=/home/%s,PBS_O_LANG=en_US.UTF-8,"
+        "PBS_O_LOGNAME=%s,PBS_O_PATH=/home/%s/.local/bin:/home/%s/bin:"
+        "/opt/pbs/bin:/usr/local/bin:/usr/bin:/usr/local/sbin:/usr/sbin:"
+        "/opt/intel/oneapi/compiler/latest/bin:/opt/intel/oneapi/mpi/latest"
+        "/bin,PBS_O_MAIL=/var/spool/mail/%s,PBS_O_SHELL=/bin/bash,"
+        "PBS_O_WORKDIR=/scratch/%s/run%04d,PBS_O_SYSTEM=Linux,"
+        "PBS_O_QUEUE=%s,PBS_O_HOST=login%d." SYNTH_SERVER ",",
+        user, user, user, user, user, user, sj->index % 10000,
+        synth_queues[sj->queue], sj->index % 4);
+    sprintf(buf + len, "MODULEPATH=/etc/modulefiles:/usr/share/modulefiles:"
+        "/opt/modulefiles/compilers:/opt/modulefiles/libraries:"
+        "/opt/modulefiles/applications,LOADEDMODULES=gcc/13.2.0:"
+        "openmpi/4.1.6:hdf5/1.14.3:netcdf/4.9.2:fftw/3.3.10,"
+        "OMP_NUM_THREADS=1,LD_LIBRARY_PATH=/opt/openmpi/4.1.6/lib:"
+        "/opt/hdf5/1.14.3/lib:/opt/netcdf/4.9.2/lib:/opt/fftw/3.3.10/lib");
+    synth_add(&sa, ATTR_v, NULL, buf);
+
+    synth_add(&sa, "project", NULL, "_pbs_project_default");
+    sprintf(buf, "-l select=%d:ncpus=%d:mem=%dgb -l walltime=%ld:00:00 "
+        "job.sh", sj->nodect, sj->ncpus/sj->nodect, sj->mem_gb/sj->nodect,
+        sj->walltime/3600);
+    synth_add(&sa, ATTR_submit_arguments, NULL, buf);
+    sprintf(buf, "login%d." SYNTH_SERVER, sj->index % 4);
+    synth_add(&sa, "Submit_Host", NULL, buf);
+
+    bs->attribs = sa.head;
+
+    return bs;
+}
+
+static bool synth_match(const struct attropl *criteria, const char *name,
+    const char *value)
+{
+    const struct attropl *c;
+
+    for (c = criteria; c; c = c->next) {
+        if (!strcmp(c->name, name) && c->op == EQ) {
+            if (!strcmp(name, ATTR_state)) {
+                if (!strchr(c->value, value[0])) {
+                    return false;
+                }
+            } else
+            if (strcmp(c->value, value)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * The batch status list of njobs synthetic jobs, as pbs_selstat() would
+ * return it for the attributes asked for (all if NULL) and criteria.
+ */
+struct batch_status *synth_jobs(int njobs, const struct attropl *criteria,
+    const struct attrl *attribs)
+{
+    struct batch_status *head = NULL, **tail = &head;
+    char user[16], state[2];
+    int i;
+
+    if (!synth_t0) {
+        synth_t0 = time(NULL);
+    }
+
+    for (i = 0; i < njobs; i++) {
+        synth_job_t sj;
+
+        synth_draw(i, &sj);
+        sprintf(user, "user%03d", sj.user);
+        state[0] = sj.state;
+        state[1] = '\0';
+        if (!synth_match(criteria, ATTR_state, state) ||
+            !synth_match(criteria, ATTR_u, user) ||
+            !synth_match(criteria, ATTR_q, synth_queues[sj.queue])) {
+            continue;
+        }
+
+        struct batch_status *bs = synth_job_status(&sj, 0, attribs);
+        if (!bs) {
+            break;
+        }
+        *tail = bs;
+        tail = &bs->next;
+    }
+
+    return head;
+}
+
+void synth_statfree(struct batch_status *bs)
+{
+    while (bs) {
+        struct batch_status *next = bs->next;
+        struct attrl *a = bs->attribs;
+        while (a) {
+            struct attrl *anext = a->next;
+            free(a->name);
+            free(a->resource);
+            free(a->value);
+            free(a);
+            a = anext;
+        }
+        free(bs->name);
+        free(bs->text);
+        free(bs);
+        bs = next;
+    }
+}
+
+static char *synth_default(void)
+{
+    return SYNTH_SERVER;
+}
+
+static int synth_connect(const char *server)
+{
+    (void) server;
+    return 1;
+}
+
+static int synth_disconnect(int conn)
+{
+    (void) conn;
+    return 0;
+}
+
+static struct batch_status *synth_statserver(int conn, struct attrl *attribs,
+    char *extend)
+{
+    int i, counts[7] = {0, 0, 0, 0, 0, 0, 0};
+    long ncpus = 0, mem = 0;
+    char buf[256];
+    synth_attrs_t sa;
+
+    (void) conn; (void) extend;
+
+    for (i = 0; i < synth_njobs; i++) {
+        synth_job_t sj;
+        synth_draw(i, &sj);
+        switch (sj.state) {
+        case 'Q':
+            counts[1]++;
+            break;
+        case 'H':
+            counts[2]++;
+            break;
+        case 'W':
+            counts[3]++;
+            break;
+        case 'R':
+        case 'S':
+            counts[4]++;
+            ncpus += sj.ncpus;
+            mem += sj.mem_gb;
+            break;
+        case 'E':
+            counts[5]++;
+            break;
+        case 'B':
+            counts[6]++;
+            break;
+        }
+    }
+
+    struct batch_status *bs = synth_status(SYNTH_SERVER);
+    if (!bs) {
+        return NULL;
+    }
+    sa.head = NULL;
+    sa.tail = &sa.head;
+    sa.want = attribs;
+
+    synth_add(&sa, ATTR_SvrHost, NULL, SYNTH_SERVER);
+    synth_add(&sa, ATTR_version, NULL, "synthetic");
+    synth_add(&sa, ATTR_status, NULL, "Active");
+    synth_add_long(&sa, ATTR_total, NULL, synth_njobs);
+    sprintf(buf, "Transit:%d Queued:%d Held:%d Waiting:%d Running:%d "
+        "Exiting:%d Begun:%d", counts[0], counts[1], counts[2], counts[3],
+        counts[4], counts[5], counts[6]);
+    synth_add(&sa, ATTR_count, NULL, buf);
+    synth_add_long(&sa, ATTR_rescassn, "ncpus", ncpus);
+    synth_add_long(&sa, ATTR_rescassn, "mpiprocs", ncpus);
+    sprintf(buf, "%ldgb", mem);
+    synth_add(&sa, ATTR_rescassn, "mem", buf);
+    sprintf(buf, "%ldgb", 2*mem);
+    synth_add(&sa, ATTR_rescassn, "vmem", buf);
+
+    bs->attribs = sa.head;
+
+    return bs;
+}
+
+/* Enough nodes to run all of the running jobs, and then some */
+static struct batch_status *synth_statvnode(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    struct batch_status *head = NULL, **tail = &head;
+    int i, nnodes = synth_njobs/4;
+    char name[32];
+
+    (void) conn; (void) id; (void) extend;
+
+    if (nnodes < 16) {
+        nnodes = 16;
+    } else
+    if (nnodes > 10000) {
+        nnodes = 10000;
+    }
+
+    for (i = 0; i < nnodes; i++) {
+        synth_attrs_t sa;
+
+        sprintf(name, "node%04d", i);
+        struct batch_status *bs = synth_status(name);
+        if (!bs) {
+            break;
+        }
+        sa.head = NULL;
+        sa.tail = &sa.head;
+        sa.want = attribs;
+
+        synth_add(&sa, ATTR_NODE_state, NULL,
+            i % 97 == 13 ? "down":(i % 3 ? "job-busy":"free"));
+        synth_add_long(&sa, ATTR_rescavail, "ncpus", SYNTH_NCPUS);
+        synth_add(&sa, ATTR_rescavail, "mem", "512gb");
+
+        bs->attribs = sa.head;
+        *tail = bs;
+        tail = &bs->next;
+    }
+
+    return head;
+}
+
+/* A job, or an array with all its subjobs for "NNN[]" */
+static struct batch_status *synth_statjob(int conn, char *id,
+    struct attrl *attribs, char *extend)
+{
+    unsigned int jid;
+    synth_job_t sj;
+    int i;
+
+    (void) conn; (void) extend;
+
+    if (!id || sscanf(id, "%u", &jid) != 1 || jid < SYNTH_BASE_ID ||
+        jid >= SYNTH_BASE_ID + (unsigned int) synth_njobs) {
+        pbs_errno = PBSE_UNKJOBID;
+        return NULL;
+    }
+    synth_draw(jid - SYNTH_BASE_ID, &sj);
+
+    struct batch_status *head = synth_job_status(&sj, 0, attribs);
+    struct batch_status **tail = head ? &head->next:&head;
+    if (head && sj.is_array && strstr(id, "[]")) {
+        for (i = 1; i <= sj.nsubjobs; i++) {
+            struct batch_status *bs = synth_job_status(&sj, i, attribs);
+            if (!bs) {
+                break;
+            }
+            *tail = bs;
+            tail = &bs->next;
+        }
+    }
+
+    return head;
+}
+
+static struct batch_status *synth_selstat(int conn,
+    struct attropl *criteria, struct attrl *attribs, char *extend)
+{
+    (void) conn; (void) extend;
+
+    pbs_errno = PBSE_NONE;
+
+    return synth_jobs(synth_njobs, criteria, attribs);
+}
+
+/* Job operations are accepted, but don't change anything */
+static int synth_deljob(int conn, char *id, char *extend)
+{
+    (void) conn; (void) id; (void) extend;
+    return 0;
+}
+
+static int synth_holdjob(int conn, char *id, char *type, char *extend)
+{
+    (void) conn; (void) id; (void) type; (void) extend;
+    return 0;
+}
+
+static int synth_rlsjob(int conn, char *id, char *type, char *extend)
+{
+    (void) conn; (void) id; (void) type; (void) extend;
+    return 0;
+}
+
+static int synth_alterjob(int conn, char *id, struct attrl *attribs,
+    char *extend)
+{
+    (void) conn; (void) id; (void) attribs; (void) extend;
+    return 0;
+}
+
+static const pbs_backend_t synth_backend = {
+    "synthetic",
+    synth_default,
+    synth_connect,
+    synth_disconnect,
+    synth_statserver,
+    synth_statvnode,
+    synth_statjob,
+    synth_selstat,
+    synth_statfree,
+    synth_deljob,
+    synth_holdjob,
+    synth_rlsjob,
+    synth_alterjob
+};
+
+/* Serve all PBS calls from a synthetic server of njobs jobs */
+bool backend_synthetic(int njobs)
+{
+    if (njobs < 0) {
+        return false;
+    }
+
+    synth_njobs = njobs;
+    synth_t0 = time(NULL);
+    backend = &synth_backend;
+
+    return true;
+}